@@ -0,0 +1,658 @@
+#pragma once
+
+/**
+ * XORVM ahead-of-time compiler.
+ * Author: 0xb4db01
+ *
+ * transpile_code() writes a program as a C function keeping R0-R7, D0-D7
+ * and the flags in local variables, with one label per instruction and
+ * jumps turned into goto, so a C compiler can do the register allocation
+ * and loop optimizations the JIT does not. Every instruction is written
+ * with the same expression as its handler in handlers.h, so it behaves
+ * the same (conversions, flags, PC when halting).
+ *
+ * compile_aot() runs the C compiler (XORVM_CC or cc) on it to get a shared
+ * library, caches the library by the hash of the code (in XORVM_AOT_CACHE,
+ * or xorvm-aot in $XDG_CACHE_HOME or ~/.cache) and loads it with dlopen(),
+ * so a program that does not change is only compiled once per user. Needs
+ * -ldl with older C libraries.
+ *
+ * dlopen() runs the constructors of a library before anything can be
+ * checked, and the name of a library follows from the code, so nothing is
+ * loaded from a cache that is not a directory of the user only (no
+ * symlink, no permission for group or others), nor a library somebody
+ * else owns.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <math.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "cpu.h"
+
+// bumped whenever the generated code changes, so cached libraries built
+// by an older transpile_code() are not loaded
+#define AOT_VERSION 1
+
+// the cache in $XDG_CACHE_HOME, or in ~/.cache without it
+#define AOT_CACHE "xorvm-aot"
+
+extern char **environ;
+
+/*
+ * The generated function: runs from the entry-th decoded instruction and
+ * returns the slot of the HLT it stopped on, or -1 - slot for an
+ * instruction left to interpret_code().
+ */
+typedef long (*AotFunction)(long *, double *, short *, unsigned char *,
+        long);
+
+typedef struct aot_program_t
+{
+    void *library;
+    AotFunction function;
+    DecodedProgram *program;
+    char name[32];
+} AotProgram;
+
+/*
+ * AOT functions prototypes
+ */
+
+unsigned long aot_hash(Memory *);
+int transpile_code(Memory *, const char *, FILE *);
+void transpile_instruction(DecodedProgram *, size_t, FILE *);
+void aot_long(FILE *, long);
+void aot_double(FILE *, double);
+int transpile_integer_add(DecodedInstruction *, FILE *);
+AotProgram *compile_aot(Memory *, const char *);
+AotProgram *open_aot(Memory *, const char *, const char *);
+int aot_cache_path(char *, size_t);
+int private_aot_path(const char *, int);
+int run_compiler(const char *, const char *);
+void run_aot(CPU *, AotProgram *);
+void free_aot_program(AotProgram *);
+
+/*
+ * FNV-1a of the code, salted with AOT_VERSION.
+ */
+unsigned long aot_hash(Memory *memory)
+{
+    const unsigned char *bytes = (const unsigned char *)memory->code;
+    unsigned long hash = 14695981039346656037UL ^ AOT_VERSION;
+
+    for(size_t i = 0; i < memory->code_size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211UL;
+    }
+
+    return hash;
+}
+
+// LONG_MIN has no literal of its own
+void aot_long(FILE *out, long value)
+{
+    if(value == -9223372036854775807L - 1)
+        fprintf(out, "(-9223372036854775807L - 1)");
+    else
+        fprintf(out, "%ldL", value);
+}
+
+// hexadecimal literals are exact, NaN and infinities go through their bits
+void aot_double(FILE *out, double value)
+{
+    unsigned long bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+
+    if(isfinite(value))
+        fprintf(out, "%a", value);
+    else
+        fprintf(out, "from_bits(0x%lxUL)", bits);
+}
+
+/*
+ * ADDI/SUBI R<n> of an integer k is r + k as long as r is far enough from
+ * 2^53 for (double)r + k to be exact, which the generated code checks
+ * before taking the slow way (the same fast path as the JIT's). Returns 0
+ * for the other instructions.
+ */
+int transpile_integer_add(DecodedInstruction *instruction, FILE *out)
+{
+    double k = instruction->imm.d;
+
+    if(instruction->opcode == SUBI_R)
+        k = -k;
+
+    if(!(instruction->opcode == ADDI_R || instruction->opcode == SUBI_R) ||
+            !(k >= -2147483648.0 && k <= 2147483648.0) || k != (long)k)
+        return 0;
+
+    fprintf(out, "    r%d = INTEGER_ADD(r%d, %ldL);\n", instruction->dst,
+            instruction->dst, (long)k);
+
+    return 1;
+}
+
+#define AOT_FLAGS_R(reg)\
+    fprintf(out, "    negative = r%d < 0; zero = r%d == 0;\n", reg, reg)
+
+#define AOT_FLAGS_D(reg)\
+    fprintf(out, "    negative = bits_of(d%d) < 0; zero = bits_of(d%d) == 0;\n",\
+            reg, reg)
+
+#define AOT_COMPARE(a, b)\
+    fprintf(out, "    zero = " a " == " b "; negative = 0;"\
+            " overflow = !zero && " a " > " b ";\n", dst, src, dst, src)
+
+#define AOT_OPERATION(name, operator)\
+    case name##_RR:\
+        fprintf(out, "    r%d " operator "= r%d;\n", dst, src);\
+        AOT_FLAGS_R(dst);\
+        break;\
+    case name##_RD:\
+        fprintf(out, "    r%d " operator "= d%d;\n", dst, src);\
+        AOT_FLAGS_R(dst);\
+        break;\
+    case name##_DR:\
+        fprintf(out, "    d%d " operator "= r%d;\n", dst, src);\
+        AOT_FLAGS_D(dst);\
+        break;\
+    case name##_DD:\
+        fprintf(out, "    d%d " operator "= d%d;\n", dst, src);\
+        AOT_FLAGS_D(dst);\
+        break;\
+
+#define AOT_OPERATIONI(name, operator)\
+    case name##_R:\
+        if(!transpile_integer_add(instruction, out))\
+        {\
+            fprintf(out, "    r%d " operator "= ", dst);\
+            aot_double(out, instruction->imm.d);\
+            fprintf(out, ";\n");\
+        }\
+        AOT_FLAGS_R(dst);\
+        break;\
+    case name##_D:\
+        fprintf(out, "    d%d " operator "= ", dst);\
+        aot_double(out, instruction->imm.d);\
+        fprintf(out, ";\n");\
+        AOT_FLAGS_D(dst);\
+        break;\
+
+#define AOT_JUMP(name, condition)\
+    case name:\
+        fprintf(out, "    if(" condition ") goto L%ld;\n",\
+                instruction->imm.i);\
+        break;\
+
+/*
+ * Writes the index-th decoded instruction of program.
+ */
+void transpile_instruction(DecodedProgram *program, size_t index, FILE *out)
+{
+    DecodedInstruction *instruction = &program->instructions[index];
+    int dst = instruction->dst;
+    int src = instruction->src;
+
+    fprintf(out, "L%zu:\n", index);
+
+    switch(instruction->opcode)
+    {
+        AOT_OPERATION(MOV, )
+        AOT_OPERATION(ADD, "+")
+        AOT_OPERATION(SUB, "-")
+        AOT_OPERATION(MUL, "*")
+        AOT_OPERATION(DIV, "/")
+
+        AOT_OPERATIONI(ADDI, "+")
+        AOT_OPERATIONI(SUBI, "-")
+        AOT_OPERATIONI(MULI, "*")
+        AOT_OPERATIONI(DIVI, "/")
+
+        case MOVI_R:
+            fprintf(out, "    r%d = ", dst);
+            aot_long(out, instruction->imm.i);
+            fprintf(out, ";\n");
+            AOT_FLAGS_R(dst);
+
+            break;
+
+        case MOVI_D:
+            fprintf(out, "    d%d = ", dst);
+            aot_double(out, instruction->imm.d);
+            fprintf(out, ";\n");
+            AOT_FLAGS_D(dst);
+
+            break;
+
+        case CMP_RR: AOT_COMPARE("r%d", "r%d"); break;
+        case CMP_RD: AOT_COMPARE("r%d", "d%d"); break;
+        case CMP_DR: AOT_COMPARE("d%d", "r%d"); break;
+        case CMP_DD: AOT_COMPARE("d%d", "d%d"); break;
+
+        AOT_JUMP(JMP, "1")
+        AOT_JUMP(JE, "zero == 1")
+        AOT_JUMP(JNE, "zero == 0")
+        AOT_JUMP(JLT, "zero == 0 && overflow == 0")
+        AOT_JUMP(JGT, "zero == 0 && overflow == 1")
+
+        case LD_RR:
+            fprintf(out, "    r%d = rwmem[r%d];\n", dst, src);
+            AOT_FLAGS_R(dst);
+
+            break;
+
+        case LD_RD:
+            fprintf(out, "    r%d = rwmem[(int)d%d];\n", dst, src);
+            AOT_FLAGS_R(dst);
+
+            break;
+
+        case LD_DR:
+            fprintf(out, "    d%d = rwmem[r%d];\n", dst, src);
+            AOT_FLAGS_D(dst);
+
+            break;
+
+        case LD_DD:
+            fprintf(out, "    d%d = rwmem[(int)d%d];\n", dst, src);
+            AOT_FLAGS_D(dst);
+
+            break;
+
+        case STR_RR:
+            fprintf(out, "    rwmem[r%d] = r%d;\n", dst, src);
+            AOT_FLAGS_R(dst);
+
+            break;
+
+        case STR_RD:
+            fprintf(out, "    rwmem[(int)r%d] = d%d;\n", dst, src);
+            AOT_FLAGS_R(dst);
+
+            break;
+
+        case STR_DR:
+            fprintf(out, "    rwmem[(int)d%d] = r%d;\n", dst, src);
+            AOT_FLAGS_D(dst);
+
+            break;
+
+        case STR_DD:
+            fprintf(out, "    rwmem[(int)d%d] = d%d;\n", dst, src);
+            AOT_FLAGS_D(dst);
+
+            break;
+
+        case XOR: fprintf(out, "    r%d ^= r%d;\n", dst, src); break;
+        case SHL: fprintf(out, "    r%d <<= r%d;\n", dst, src); break;
+        case SHR: fprintf(out, "    r%d >>= r%d;\n", dst, src); break;
+
+        case XORI: case SHLI: case SHRI:
+            fprintf(out, "    r%d %s= ", dst,
+                    instruction->opcode == XORI ? "^" :
+                    instruction->opcode == SHLI ? "<<" : ">>");
+            aot_long(out, instruction->imm.i);
+            fprintf(out, ";\n");
+
+            break;
+
+        case HLT:
+            fprintf(out, "    EXIT(%d);\n", instruction->slot);
+
+            break;
+
+        // superinstructions never get here, the program is not fused
+        default:
+            fprintf(out, "    EXIT(-1 - %dL);\n", instruction->slot);
+
+            break;
+    }
+}
+
+#undef AOT_FLAGS_R
+#undef AOT_FLAGS_D
+#undef AOT_COMPARE
+#undef AOT_OPERATION
+#undef AOT_OPERATIONI
+#undef AOT_JUMP
+
+/*
+ * Writes memory->code as a C file defining the AotFunction name, plus
+ * name_code and name_code_size holding a copy of the code (so a cached
+ * library can be checked against the program it was built from). Returns
+ * 0, or -1 if the code can not be decoded.
+ */
+int transpile_code(Memory *memory, const char *name, FILE *out)
+{
+    DecodedProgram *program = decode_program(memory);
+
+    if(program == NULL)
+        return -1;
+
+    size_t length = memory->code_size / sizeof(double);
+    const unsigned long *bits = (const unsigned long *)memory->code;
+
+    fprintf(out, "/* XORVM program transpiled by transpile_code() */\n\n");
+    fprintf(out, "#include <string.h>\n\n");
+
+    fprintf(out, "static long bits_of(double value)\n{\n"
+            "    long bits;\n"
+            "    memcpy(&bits, &value, sizeof(bits));\n\n"
+            "    return bits;\n}\n\n");
+
+    fprintf(out, "static double from_bits(unsigned long bits)\n{\n"
+            "    double value;\n"
+            "    memcpy(&value, &bits, sizeof(value));\n\n"
+            "    return value;\n}\n\n");
+
+    fprintf(out, "const unsigned long %s_code_size = %zuUL;\n", name,
+            memory->code_size);
+    fprintf(out, "const unsigned long %s_code[] = {", name);
+
+    for(size_t i = 0; i < length; ++i)
+        fprintf(out, "%s0x%lxUL", i == 0 ? "\n    " : i % 4 ? ", " : ",\n    ",
+                bits[i]);
+
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "#define INTEGER_ADD(r, k) ((r) >= -(1L << 53) + (1L << 31)"
+            " && (r) <= (1L << 53) - (1L << 31) ?"
+            " (r) + (k) : (long)((double)(r) + (double)(k)))\n\n");
+
+    fprintf(out, "#define EXIT(value) do {");
+
+    for(int i = 0; i < 8; ++i)
+        fprintf(out, " registers[%d] = r%d; dregisters[%d] = d%d;", i, i, i, i);
+
+    fprintf(out, " flags[0] = zero; flags[1] = negative; flags[2] = overflow;"
+            " return (value); } while(0)\n\n");
+
+    fprintf(out, "long %s(long *registers, double *dregisters, short *flags,"
+            " unsigned char *rwmem, long entry)\n{\n", name);
+
+    for(int i = 0; i < 8; ++i)
+        fprintf(out, "    long r%d = registers[%d];\n", i, i);
+
+    for(int i = 0; i < 8; ++i)
+        fprintf(out, "    double d%d = dregisters[%d];\n", i, i);
+
+    fprintf(out, "    short zero = flags[0], negative = flags[1],"
+            " overflow = flags[2];\n\n");
+
+    fprintf(out, "    (void)from_bits;\n    (void)bits_of;\n\n");
+    fprintf(out, "    switch(entry)\n    {\n");
+
+    for(size_t i = 0; i < program->entries; ++i)
+        fprintf(out, "        case %zu: goto L%zu;\n", i, i);
+
+    fprintf(out, "    }\n\n    EXIT(-1 - 0L);\n\n");
+
+    for(size_t i = 0; i < program->entries; ++i)
+        transpile_instruction(program, i, out);
+
+    fprintf(out, "}\n");
+
+    free_decoded_program(program);
+
+    return ferror(out) ? -1 : 0;
+}
+
+/*
+ * Runs the compiler on source, writing the shared library library. Returns
+ * 0 if it succeeded.
+ */
+int run_compiler(const char *source, const char *library)
+{
+    const char *compiler = getenv("XORVM_CC");
+    pid_t pid;
+    int status;
+
+    if(compiler == NULL)
+        compiler = "cc";
+
+    char *argv[] = {
+        (char *)compiler, "-O2", "-shared", "-fPIC", "-w",
+        "-o", (char *)library, (char *)source, NULL
+    };
+
+    if(posix_spawnp(&pid, compiler, NULL, NULL, argv, environ) != 0)
+        return -1;
+
+    while(waitpid(pid, &status, 0) == -1)
+    {
+        if(errno != EINTR)
+            return -1;
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/*
+ * Writes the default cache directory to path, making ~/.cache if there is
+ * no $XDG_CACHE_HOME. Returns 0 if there is no home to put it in.
+ */
+int aot_cache_path(char *path, size_t size)
+{
+    const char *base = getenv("XDG_CACHE_HOME");
+    int length;
+
+    if(base != NULL && base[0] == '/')
+    {
+        length = snprintf(path, size, "%s/%s", base, AOT_CACHE);
+
+        return length > 0 && (size_t)length < size;
+    }
+
+    base = getenv("HOME");
+
+    if(base == NULL || base[0] != '/')
+        return 0;
+
+    length = snprintf(path, size, "%s/.cache", base);
+
+    if(length <= 0 || (size_t)length >= size ||
+            (mkdir(path, 0700) != 0 && errno != EEXIST))
+        return 0;
+
+    length = snprintf(path, size, "%s/.cache/%s", base, AOT_CACHE);
+
+    return length > 0 && (size_t)length < size;
+}
+
+/*
+ * Returns 1 if path is the user's own directory (directory) with no
+ * permissions for anybody else, or the user's own regular file.
+ */
+int private_aot_path(const char *path, int directory)
+{
+    struct stat status;
+
+    // lstat() so that a symlink is never followed
+    if(lstat(path, &status) != 0 || status.st_uid != getuid())
+        return 0;
+
+    if(directory)
+        return S_ISDIR(status.st_mode) && (status.st_mode & 077) == 0;
+
+    return S_ISREG(status.st_mode);
+}
+
+/*
+ * Loads the library at path and checks it was built from memory->code,
+ * NULL if it can not be used or is not the user's own.
+ */
+AotProgram *open_aot(Memory *memory, const char *name, const char *path)
+{
+    char symbol[64];
+
+    if(!private_aot_path(path, 0))
+        return NULL;
+
+    void *library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+
+    if(library == NULL)
+        return NULL;
+
+    AotFunction function = (AotFunction)dlsym(library, name);
+
+    snprintf(symbol, sizeof(symbol), "%s_code_size", name);
+    const unsigned long *code_size = (const unsigned long *)dlsym(library,
+            symbol);
+
+    snprintf(symbol, sizeof(symbol), "%s_code", name);
+    const void *code = dlsym(library, symbol);
+
+    if(function == NULL || code_size == NULL || code == NULL ||
+            *code_size != memory->code_size ||
+            memcmp(code, memory->code, memory->code_size) != 0)
+    {
+        dlclose(library);
+
+        return NULL;
+    }
+
+    AotProgram *aot = (AotProgram *)malloc(sizeof(AotProgram));
+    DecodedProgram *program = decode_program(memory);
+
+    if(aot == NULL || program == NULL)
+    {
+        free(aot);
+        free_decoded_program(program);
+        dlclose(library);
+
+        return NULL;
+    }
+
+    aot->library = library;
+    aot->function = function;
+    aot->program = program;
+    snprintf(aot->name, sizeof(aot->name), "%s", name);
+
+    return aot;
+}
+
+/*
+ * Returns the compiled version of memory->code, loading it from cache
+ * (XORVM_AOT_CACHE or the default one, see aot_cache_path(), if NULL) or
+ * compiling it there first. Returns NULL if the code could not be compiled
+ * or loaded, or cache is not private to the user.
+ */
+AotProgram *compile_aot(Memory *memory, const char *cache)
+{
+    char name[32];
+    char directory[4096];
+    char path[4096];
+    char source[4096];
+    char library[4096];
+
+    if(cache == NULL)
+        cache = getenv("XORVM_AOT_CACHE");
+
+    if(cache == NULL)
+    {
+        if(!aot_cache_path(directory, sizeof(directory)))
+            return NULL;
+
+        cache = directory;
+    }
+
+    snprintf(name, sizeof(name), "xorvm_%016lx", aot_hash(memory));
+
+    if(snprintf(path, sizeof(path), "%s/%s.so", cache, name) >=
+            (int)sizeof(path))
+        return NULL;
+
+    if(mkdir(cache, 0700) != 0 && errno != EEXIST)
+        return NULL;
+
+    // made by somebody else first, it is not to be loaded from
+    if(!private_aot_path(cache, 1))
+        return NULL;
+
+    AotProgram *aot = open_aot(memory, name, path);
+
+    if(aot != NULL)
+        return aot;
+
+    // other processes may be compiling the same program: everything is
+    // built under a name of its own, then renamed
+    if(snprintf(source, sizeof(source), "%s/%s.%d.c", cache, name,
+                (int)getpid()) >= (int)sizeof(source) ||
+            snprintf(library, sizeof(library), "%s/%s.%d.so", cache, name,
+                (int)getpid()) >= (int)sizeof(library))
+        return NULL;
+
+    FILE *out = fopen(source, "w");
+
+    if(out == NULL)
+        return NULL;
+
+    int transpiled = transpile_code(memory, name, out) == 0;
+
+    if(fclose(out) != 0 || !transpiled ||
+            run_compiler(source, library) != 0 ||
+            rename(library, path) != 0)
+    {
+        unlink(source);
+        unlink(library);
+
+        return NULL;
+    }
+
+    unlink(source);
+
+    return open_aot(memory, name, path);
+}
+
+/*
+ * Runs the compiled program on cpu, which starts (or resumes) like with
+ * run_cpu(). Instructions the program could not compile are left to
+ * interpret_code().
+ */
+void run_aot(CPU *cpu, AotProgram *aot)
+{
+    DecodedProgram *attached = cpu->program;
+    long entry;
+
+    // decoded_entry() looks for PC in cpu->program
+    cpu->program = aot->program;
+    entry = decoded_entry(cpu);
+    cpu->program = attached;
+
+    if(entry == -1)
+        return;
+
+    long stop = aot->function(cpu->registers, cpu->dregisters,
+            (short *)&cpu->flags, cpu->memory->rwmem, entry);
+
+    if(stop >= 0)
+    {
+        cpu->PC = stop;
+        cpu->instruction.bytecode = HLT;
+
+        return;
+    }
+
+    // like the DECODED_FALLBACK handler, PC is the slot before it
+    cpu->PC = -1 - stop - 1;
+    cpu->instruction.bytecode = DECODED_FALLBACK;
+
+    interpret_code(cpu);
+}
+
+void free_aot_program(AotProgram *aot)
+{
+    if(aot == NULL)
+        return;
+
+    dlclose(aot->library);
+    free_decoded_program(aot->program);
+    free(aot);
+}
@@ -0,0 +1,542 @@
+#pragma once
+
+/**
+ * XORVM lock-step batch execution.
+ * Author: 0xb4db01
+ *
+ * run_lanes() runs the same DecodedProgram on many CPUs, each with its own
+ * Memory, BATCH_LANES of them at a time. The registers of a group of CPUs
+ * are kept in structure of arrays layout (R0 of every lane, then R1...) as
+ * GCC vectors, so every instruction is executed once for all the lanes
+ * with AVX-512, AVX2 or SSE2 (whichever the host has, picked at load time).
+ *
+ * Lanes do not have to follow the same path: every step runs the
+ * instruction with the lowest index among the lanes still running, with a
+ * mask of the lanes standing there, so lanes leaving a loop early wait for
+ * the others at the exit and go on together from there.
+ *
+ * LD/STR and DIV on R<n> registers are done lane by lane, with the same C
+ * expressions as handlers.h, and a lane reaching a DECODED_FALLBACK
+ * instruction goes on alone in interpret_code(): the CPUs end up exactly as
+ * if run_cpu() had run them one at a time.
+ */
+
+#include "cpu.h"
+
+// 4, 8 or 16
+#ifndef BATCH_LANES
+#define BATCH_LANES 8
+#endif
+
+/*
+ * Batch functions prototypes
+ */
+
+void run_lanes(DecodedProgram *, CPU **, size_t);
+
+#ifdef __GNUC__
+
+#if defined(__x86_64__) && defined(__linux__)
+#define BATCH_TARGETS\
+    __attribute__((target_clones("arch=x86-64-v4", "avx2", "default")))
+#else
+#define BATCH_TARGETS
+#endif
+
+typedef long LaneLong __attribute__((vector_size(sizeof(long) * BATCH_LANES)));
+typedef double LaneDouble
+    __attribute__((vector_size(sizeof(double) * BATCH_LANES)));
+
+// a lane not running anymore
+#define LANE_DONE -1
+
+#define LANES_BLEND(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+#define LANES_BLEND_D(mask, a, b)\
+    (LaneDouble)LANES_BLEND(mask, (LaneLong)(a), (LaneLong)(b))
+
+#define LANES_TO_D(v) __builtin_convertvector(v, LaneDouble)
+#define LANES_TO_R(v) __builtin_convertvector(v, LaneLong)
+
+// vector comparisons give -1 for true
+#define LANES_FLAGS(bits)\
+    flags_zero = LANES_BLEND(mask, ((bits) == 0) & 1, flags_zero);\
+    flags_negative = LANES_BLEND(mask, ((bits) < 0) & 1, flags_negative);\
+
+#define LANES_FLAGS_R(reg) LANES_FLAGS(r[reg])
+#define LANES_FLAGS_D(reg) LANES_FLAGS((LaneLong)d[reg])
+
+#define LANES_SET_R(reg, value)\
+    r[reg] = LANES_BLEND(mask, value, r[reg]);\
+    LANES_FLAGS_R(reg)
+
+#define LANES_SET_D(reg, value)\
+    d[reg] = LANES_BLEND_D(mask, value, d[reg]);\
+    LANES_FLAGS_D(reg)
+
+#define LANES_OPERATION(name, operator)\
+    case name##_RR:\
+        LANES_SET_R(ip->dst, r[ip->dst] operator r[ip->src])\
+        break;\
+    case name##_RD:\
+        LANES_SET_R(ip->dst, LANES_TO_R(LANES_TO_D(r[ip->dst]) operator\
+                    d[ip->src]))\
+        break;\
+    case name##_DR:\
+        LANES_SET_D(ip->dst, d[ip->dst] operator LANES_TO_D(r[ip->src]))\
+        break;\
+    case name##_DD:\
+        LANES_SET_D(ip->dst, d[ip->dst] operator d[ip->src])\
+        break;\
+    case name##I_R:\
+        LANES_SET_R(ip->dst, LANES_TO_R(LANES_TO_D(r[ip->dst]) operator\
+                    ip->imm.d))\
+        break;\
+    case name##I_D:\
+        LANES_SET_D(ip->dst, d[ip->dst] operator ip->imm.d)\
+        break;\
+
+#define LANES_COMPARE(a, b)\
+    {\
+        LaneLong equal = ((a) == (b)) & 1;\
+        LaneLong greater = ((a) > (b)) & 1;\
+        flags_zero = LANES_BLEND(mask, equal, flags_zero);\
+        flags_negative = LANES_BLEND(mask, (LaneLong){0}, flags_negative);\
+        flags_overflow = LANES_BLEND(mask, greater, flags_overflow);\
+    }\
+
+#define FOR_LANES(lane)\
+    for(int lane = 0; lane < lanes; ++lane)\
+        if(active & (1 << lane))
+
+// gives the registers and flags of lane back to its CPU
+#define LANE_STORE(lane)\
+    for(int i = 0; i < 8; ++i)\
+    {\
+        cpus[lane]->registers[i] = r[i][lane];\
+        cpus[lane]->dregisters[i] = d[i][lane];\
+    }\
+    cpus[lane]->flags.zero = flags_zero[lane];\
+    cpus[lane]->flags.negative = flags_negative[lane];\
+    cpus[lane]->flags.overflow = flags_overflow[lane];\
+
+/*
+ * Runs up to BATCH_LANES CPUs in lock-step, see run_lanes().
+ */
+BATCH_TARGETS
+void run_lane_group(DecodedProgram *program, CPU **cpus, int lanes)
+{
+    DecodedInstruction *code = program->instructions;
+    unsigned char *rwmem[BATCH_LANES];
+    long pc[BATCH_LANES];
+    LaneLong r[8];
+    LaneDouble d[8];
+    LaneLong flags_zero = {0};
+    LaneLong flags_negative = {0};
+    LaneLong flags_overflow = {0};
+    LaneLong mask = {0};
+
+    // bit masks of the lanes still running and of the ones at entry
+    int running = 0;
+    int active = 0;
+    long entry = 0;
+
+    memset(r, 0, sizeof(r));
+    memset(d, 0, sizeof(d));
+
+    for(int lane = 0; lane < BATCH_LANES; ++lane)
+    {
+        pc[lane] = LANE_DONE;
+
+        if(lane >= lanes)
+            continue;
+
+        CPU *cpu = cpus[lane];
+
+        // the same as decoded_entry(), for the program given here
+        if(cpu->instruction.bytecode == HLT)
+            continue;
+
+        pc[lane] = cpu->PC == -1 ? 0 :
+            find_decoded_instruction(program, cpu->PC + 1);
+
+        if(pc[lane] == LANE_DONE)
+        {
+            interpret_code(cpu);
+
+            continue;
+        }
+
+        rwmem[lane] = cpu->memory->rwmem;
+
+        for(int i = 0; i < 8; ++i)
+        {
+            r[i][lane] = cpu->registers[i];
+            d[i][lane] = cpu->dregisters[i];
+        }
+
+        flags_zero[lane] = cpu->flags.zero;
+        flags_negative[lane] = cpu->flags.negative;
+        flags_overflow[lane] = cpu->flags.overflow;
+
+        running |= 1 << lane;
+    }
+
+    for(;;)
+    {
+        // pc is only up to date for lanes not in active, which is empty
+        // after the lanes took different ways
+        if(active == 0)
+        {
+            if(running == 0)
+                return;
+
+            entry = LANE_DONE;
+
+            for(int lane = 0; lane < lanes; ++lane)
+            {
+                if((running & (1 << lane)) && (entry == LANE_DONE ||
+                            pc[lane] < entry))
+                    entry = pc[lane];
+            }
+
+            for(int lane = 0; lane < BATCH_LANES; ++lane)
+            {
+                int here = (running & (1 << lane)) && pc[lane] == entry;
+
+                active |= here << lane;
+                mask[lane] = here ? -1 : 0;
+            }
+        }
+
+        DecodedInstruction *ip = &code[entry];
+        int opcode = ip->opcode;
+
+        // number of instructions to skip, more than one for superinstructions
+        int next = 1;
+
+        switch(opcode)
+        {
+            case MOV_RR:
+                LANES_SET_R(ip->dst, r[ip->src])
+
+                break;
+
+            case MOV_RD:
+                LANES_SET_R(ip->dst, LANES_TO_R(d[ip->src]))
+
+                break;
+
+            case MOV_DR:
+                LANES_SET_D(ip->dst, LANES_TO_D(r[ip->src]))
+
+                break;
+
+            case MOV_DD:
+                LANES_SET_D(ip->dst, d[ip->src])
+
+                break;
+
+            case MOVI_R:
+                LANES_SET_R(ip->dst, (LaneLong){0} + ip->imm.i)
+
+                break;
+
+            case MOVI_D:
+                LANES_SET_D(ip->dst, (LaneDouble){0} + ip->imm.d)
+
+                break;
+
+            LANES_OPERATION(ADD, +)
+            LANES_OPERATION(SUB, -)
+            LANES_OPERATION(MUL, *)
+
+            case DIV_RR:
+                // lane by lane: a lane not standing here may divide by 0
+                FOR_LANES(lane)
+                    r[ip->dst][lane] /= r[ip->src][lane];
+
+                LANES_FLAGS_R(ip->dst)
+
+                break;
+
+            case DIV_RD:
+                LANES_SET_R(ip->dst, LANES_TO_R(LANES_TO_D(r[ip->dst]) /
+                            d[ip->src]))
+
+                break;
+
+            case DIV_DR:
+                LANES_SET_D(ip->dst, d[ip->dst] / LANES_TO_D(r[ip->src]))
+
+                break;
+
+            case DIV_DD:
+                LANES_SET_D(ip->dst, d[ip->dst] / d[ip->src])
+
+                break;
+
+            case DIVI_R:
+                LANES_SET_R(ip->dst, LANES_TO_R(LANES_TO_D(r[ip->dst]) /
+                            ip->imm.d))
+
+                break;
+
+            case DIVI_D:
+                LANES_SET_D(ip->dst, d[ip->dst] / ip->imm.d)
+
+                break;
+
+            case CMP_RR:
+                LANES_COMPARE(r[ip->dst], r[ip->src])
+
+                break;
+
+            case CMP_RD:
+                LANES_COMPARE(LANES_TO_D(r[ip->dst]), d[ip->src])
+
+                break;
+
+            case CMP_DR:
+                LANES_COMPARE(d[ip->dst], LANES_TO_D(r[ip->src]))
+
+                break;
+
+            case CMP_DD:
+                LANES_COMPARE(d[ip->dst], d[ip->src])
+
+                break;
+
+            // lanes run the loop of a MAP_LOOP one round at a time
+            case LD_RR: case MAP_LOOP:
+                FOR_LANES(lane)
+                    r[ip->dst][lane] = rwmem[lane][r[ip->src][lane]];
+
+                LANES_FLAGS_R(ip->dst)
+
+                break;
+
+            case LD_RD:
+                FOR_LANES(lane)
+                    r[ip->dst][lane] = rwmem[lane][(int)d[ip->src][lane]];
+
+                LANES_FLAGS_R(ip->dst)
+
+                break;
+
+            case LD_DR:
+                FOR_LANES(lane)
+                    d[ip->dst][lane] = rwmem[lane][r[ip->src][lane]];
+
+                LANES_FLAGS_D(ip->dst)
+
+                break;
+
+            case LD_DD:
+                FOR_LANES(lane)
+                    d[ip->dst][lane] = rwmem[lane][(int)d[ip->src][lane]];
+
+                LANES_FLAGS_D(ip->dst)
+
+                break;
+
+            case STR_RR:
+                FOR_LANES(lane)
+                    rwmem[lane][r[ip->dst][lane]] = r[ip->src][lane];
+
+                LANES_FLAGS_R(ip->dst)
+
+                break;
+
+            case STR_RD:
+                FOR_LANES(lane)
+                    rwmem[lane][(int)r[ip->dst][lane]] = d[ip->src][lane];
+
+                LANES_FLAGS_R(ip->dst)
+
+                break;
+
+            case STR_DR:
+                FOR_LANES(lane)
+                    rwmem[lane][(int)d[ip->dst][lane]] = r[ip->src][lane];
+
+                LANES_FLAGS_D(ip->dst)
+
+                break;
+
+            case STR_DD:
+                FOR_LANES(lane)
+                    rwmem[lane][(int)d[ip->dst][lane]] = d[ip->src][lane];
+
+                LANES_FLAGS_D(ip->dst)
+
+                break;
+
+            // no flags for XOR and the shifts, whose count is masked the
+            // way x86 does for the scalar ones
+            case XOR:
+                r[ip->dst] = LANES_BLEND(mask, r[ip->dst] ^ r[ip->src],
+                        r[ip->dst]);
+
+                break;
+
+            case XORI:
+                r[ip->dst] = LANES_BLEND(mask, r[ip->dst] ^ ip->imm.i,
+                        r[ip->dst]);
+
+                break;
+
+            case SHL:
+                r[ip->dst] = LANES_BLEND(mask,
+                        r[ip->dst] << (r[ip->src] & 63), r[ip->dst]);
+
+                break;
+
+            case SHLI:
+                r[ip->dst] = LANES_BLEND(mask,
+                        r[ip->dst] << (ip->imm.i & 63), r[ip->dst]);
+
+                break;
+
+            case SHR:
+                r[ip->dst] = LANES_BLEND(mask,
+                        r[ip->dst] >> (r[ip->src] & 63), r[ip->dst]);
+
+                break;
+
+            case SHRI:
+                r[ip->dst] = LANES_BLEND(mask,
+                        r[ip->dst] >> (ip->imm.i & 63), r[ip->dst]);
+
+                break;
+
+            case LD_XOR_STR_INC:
+                FOR_LANES(lane)
+                {
+                    r[ip->dst][lane] = rwmem[lane][r[ip->src][lane]];
+                    r[ip->dst][lane] ^= r[ip->src2][lane];
+                    rwmem[lane][r[ip->src][lane]] = r[ip->dst][lane];
+                }
+
+                LANES_SET_R(ip->src, LANES_TO_R(LANES_TO_D(r[ip->src]) +
+                            ip->imm.d))
+
+                next = 4;
+
+                break;
+
+            case CMP_JE_RR: case CMP_JNE_RR: case CMP_JLT_RR: case CMP_JGT_RR:
+                LANES_COMPARE(r[ip->dst], r[ip->src])
+
+                opcode = JE + opcode - CMP_JE_RR;
+                next = 2;
+
+                // fall through
+            case JMP: case JE: case JNE: case JLT: case JGT:
+            {
+                LaneLong not_zero = flags_zero != 0;
+                LaneLong taken = (LaneLong){0} - 1;
+                int taken_lanes = 0;
+
+                if(opcode == JE)
+                    taken = flags_zero == 1;
+                else if(opcode == JNE)
+                    taken = flags_zero == 0;
+                else if(opcode == JLT)
+                    taken = ~not_zero & (flags_overflow == 0);
+                else if(opcode == JGT)
+                    taken = ~not_zero & (flags_overflow == 1);
+
+                for(int lane = 0; lane < BATCH_LANES; ++lane)
+                    taken_lanes |= (taken[lane] & 1) << lane;
+
+                taken_lanes &= active;
+
+                // the lanes only split if some of them jump and some do not
+                if(active == running && (taken_lanes == 0 ||
+                            taken_lanes == active))
+                {
+                    entry = taken_lanes ? ip->imm.i : entry + next;
+
+                    continue;
+                }
+
+                FOR_LANES(lane)
+                    pc[lane] = (taken_lanes & (1 << lane)) ? ip->imm.i :
+                        entry + next;
+
+                active = 0;
+
+                continue;
+            }
+
+            case HLT:
+                FOR_LANES(lane)
+                {
+                    LANE_STORE(lane)
+
+                    cpus[lane]->PC = ip->slot;
+                    cpus[lane]->instruction.bytecode = HLT;
+                }
+
+                running &= ~active;
+                active = 0;
+
+                continue;
+
+            default:
+                FOR_LANES(lane)
+                {
+                    LANE_STORE(lane)
+
+                    // like the DECODED_FALLBACK handler
+                    cpus[lane]->PC = ip->slot - 1;
+                    cpus[lane]->instruction.bytecode = DECODED_FALLBACK;
+
+                    interpret_code(cpus[lane]);
+                }
+
+                running &= ~active;
+                active = 0;
+
+                continue;
+        }
+
+        if(active == running)
+        {
+            entry += next;
+        } else
+        {
+            FOR_LANES(lane)
+                pc[lane] = entry + next;
+
+            active = 0;
+        }
+    }
+}
+
+/*
+ * Runs program on count CPUs, which must all have their own rwmem and the
+ * code program was decoded from.
+ */
+void run_lanes(DecodedProgram *program, CPU **cpus, size_t count)
+{
+    for(size_t i = 0; i < count; i += BATCH_LANES)
+    {
+        size_t lanes = count - i < BATCH_LANES ? count - i : BATCH_LANES;
+
+        run_lane_group(program, cpus + i, lanes);
+    }
+}
+
+#else
+
+void run_lanes(DecodedProgram *program, CPU **cpus, size_t count)
+{
+    for(size_t i = 0; i < count; ++i)
+    {
+        attach_program(cpus[i], program);
+        run_cpu(cpus[i]);
+    }
+}
+
+#endif
@@ -0,0 +1,1595 @@
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include "cpu.h"
+#include "batch.h"
+#include "pool.h"
+#include "stream.h"
+#include "bytecode.h"
+#include "aot.h"
+#include "profile.h"
+#include "perf.h"
+#include "context.h"
+#include "scheduler.h"
+#include "loop.h"
+
+#define XORFUN_SIZE (1 << 20)
+#define XORFUN_RUNS 5
+
+// run_sampled() takes a sample every PROFILE_PERIOD instructions
+#define PROFILE_PERIOD 1000
+
+// run_lanes() over LANES_BUFFERS payloads of LANES_SIZE bytes
+#define LANES_BUFFERS 1024
+#define LANES_SIZE 1024
+
+// run_stream() over a file of STREAM_SIZE bytes
+#define STREAM_SIZE (64 << 20)
+
+// run_batch() over BATCH_JOBS payloads of 64 bytes to BATCH_MAX_SIZE
+#define BATCH_JOBS 4096
+#define BATCH_MAX_SIZE 0xffff
+
+// CONTEXT_RUNS runs of a 10-instruction program, one CPU each
+#define CONTEXT_RUNS (1 << 18)
+
+// TIER_RUNS runs of xorfun over TIER_SHORT bytes, a new CPU each
+#define TIER_RUNS (1 << 16)
+#define TIER_SHORT 16
+
+// a loop of SCHEDULER_LONG rounds queued before SCHEDULER_SHORT xorfun
+// loops over 40 bytes
+#define SCHEDULER_LONG 10000000
+#define SCHEDULER_SHORT 1000
+
+double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The loop of xorfun() in tests.c over a payload of size bytes: 2 MOVI,
+ * then 6 instructions per byte, then HLT.
+ */
+void xorfun_code(double *code, size_t size)
+{
+    double loop[] = {
+        MOVI, R2, size,
+        MOVI, R3, 0x12,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 5,
+
+        HLT
+    };
+
+    memcpy(code, loop, sizeof(loop));
+}
+
+/*
+ * Runs code_size bytes of code over payload with the given engine (-1 is
+ * interpret_code(), -2 run_sampled()) and superinstructions, and returns
+ * the best time in seconds.
+ */
+double bench_code(int engine, int fusions, double *code, size_t code_size,
+        unsigned char *payload, size_t size)
+{
+    double best = 0;
+
+    Memory memory;
+    memory.code_size = code_size;
+    memory.code = code;
+    memory.rwmem_size = size;
+    memory.rwmem = payload;
+
+    DecodedProgram *program = decode_program(&memory);
+    Profile *profile = new_profile(&memory, PROFILE_PERIOD, 0);
+
+    fuse_program(program, fusions);
+
+    for(int run = 0; run < XORFUN_RUNS; ++run)
+    {
+        CPU *cpu = new_cpu(&memory);
+
+        attach_program(cpu, program);
+
+        double start = now();
+
+        if(engine == -1)
+        {
+            interpret_code(cpu);
+        } else if(engine == -2)
+        {
+            run_sampled(cpu, profile);
+        } else
+        {
+            set_engine(cpu, engine);
+            run_cpu(cpu);
+        }
+
+        double elapsed = now() - start;
+
+        if(run == 0 || elapsed < best)
+            best = elapsed;
+
+        free_cpu(cpu);
+    }
+
+    free_decoded_program(program);
+    free_profile(profile);
+
+    return best;
+}
+
+/*
+ * The xorfun loop with bench_code().
+ */
+double bench_xorfun(int engine, int fusions, unsigned char *payload,
+        size_t size)
+{
+    double code[25];
+
+    xorfun_code(code, size);
+
+    return bench_code(engine, fusions, code, sizeof(code), payload, size);
+}
+
+/*
+ * The xorfun loop with bench_code(), unrolled factor times by
+ * optimize_loops() (not unrolled below 2). Returns 0 if it can not be
+ * optimized.
+ */
+double bench_unrolled(int engine, int fusions, int factor,
+        unsigned char *payload, size_t size)
+{
+    double code[25];
+    size_t optimized_size;
+
+    xorfun_code(code, size);
+
+    // xorfun_code() writes 24 doubles, R1 starts zeroed like every CPU
+    // from new_cpu()
+    double *optimized = optimize_loops(code, 24 * sizeof(double), factor, 1,
+            &optimized_size, NULL);
+
+    if(optimized == NULL)
+        return 0;
+
+    double elapsed = bench_code(engine, fusions, optimized, optimized_size,
+            payload, size);
+
+    free(optimized);
+
+    return elapsed;
+}
+
+/*
+ * xorfun with a 32-byte key, 32 bytes per round with VLD/VXOR/VST: the
+ * key is the first 32 bytes of the payload, the rest gets xored with it.
+ * Returns the best time in seconds with engine.
+ */
+double bench_vector(int engine, unsigned char *payload, size_t size)
+{
+    double code[] = {
+        MOVI, R2, size,
+        VLD, V1, R1,
+        MOVI, R1, VECTOR_SIZE,
+
+        VLD, V0, R1,
+        VXOR, V0, V1,
+        VST, R1, V0,
+        ADDI, R1, VECTOR_SIZE,
+        CMP, R1, R2,
+        JLT, 8,
+
+        HLT
+    };
+    double best = 0;
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = size;
+    memory.rwmem = payload;
+
+    for(int run = 0; run < XORFUN_RUNS; ++run)
+    {
+        CPU *cpu = new_cpu(&memory);
+
+        set_engine(cpu, engine);
+
+        double start = now();
+
+        run_cpu(cpu);
+
+        double elapsed = now() - start;
+
+        if(run == 0 || elapsed < best)
+            best = elapsed;
+
+        free_cpu(cpu);
+    }
+
+    return best;
+}
+
+/*
+ * xorfun with a key of key_length bytes in a single MEMXORK: the key is the
+ * first key_length bytes of the payload. Returns the best time in seconds.
+ */
+double bench_block(unsigned char *payload, size_t size, size_t key_length)
+{
+    double code[] = {
+        MOVI, R1, key_length,
+        MOVI, R2, size - key_length,
+        MOVI, R3, key_length,
+        MEMXORK, R1, R0, R2, R3,
+
+        HLT
+    };
+    double best = 0;
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = size;
+    memory.rwmem = payload;
+
+    for(int run = 0; run < XORFUN_RUNS; ++run)
+    {
+        CPU *cpu = new_cpu(&memory);
+
+        double start = now();
+
+        run_cpu(cpu);
+
+        double elapsed = now() - start;
+
+        if(run == 0 || elapsed < best)
+            best = elapsed;
+
+        free_cpu(cpu);
+    }
+
+    return best;
+}
+
+/*
+ * Runs the xorfun loop converted to bytecode with run_bytecode() and
+ * returns the best time in seconds, and the size of the bytecode in
+ * code_size.
+ */
+double bench_bytecode(unsigned char *payload, size_t size, size_t *code_size)
+{
+    double code[25];
+    double best = 0;
+
+    xorfun_code(code, size);
+
+    // the loop takes 24 of the doubles in code[], the last one is garbage
+    Bytecode *bytecode = convert_code(code, 24 * sizeof(double));
+
+    Memory memory;
+    memory.code_size = 0;
+    memory.code = NULL;
+    memory.rwmem_size = size;
+    memory.rwmem = payload;
+
+    for(int run = 0; run < XORFUN_RUNS; ++run)
+    {
+        CPU *cpu = new_cpu(&memory);
+
+        double start = now();
+
+        run_bytecode(cpu, bytecode);
+
+        double elapsed = now() - start;
+
+        if(run == 0 || elapsed < best)
+            best = elapsed;
+
+        free_cpu(cpu);
+    }
+
+    *code_size = bytecode->header->header_size + bytecode->code_size;
+
+    free_bytecode(bytecode);
+
+    return best;
+}
+
+/*
+ * Runs the xorfun loop compiled with compile_aot() and returns the best
+ * time in seconds, and the time compile_aot() took in compile_time.
+ */
+double bench_aot(unsigned char *payload, size_t size, double *compile_time)
+{
+    double code[25];
+    double best = 0;
+
+    xorfun_code(code, size);
+
+    Memory memory;
+    memory.code_size = 24 * sizeof(double);
+    memory.code = code;
+    memory.rwmem_size = size;
+    memory.rwmem = payload;
+
+    double start = now();
+    AotProgram *aot = compile_aot(&memory, NULL);
+
+    *compile_time = now() - start;
+
+    if(aot == NULL)
+        return 0;
+
+    for(int run = 0; run < XORFUN_RUNS; ++run)
+    {
+        CPU *cpu = new_cpu(&memory);
+
+        start = now();
+
+        run_aot(cpu, aot);
+
+        double elapsed = now() - start;
+
+        if(run == 0 || elapsed < best)
+            best = elapsed;
+
+        free_cpu(cpu);
+    }
+
+    free_aot_program(aot);
+
+    return best;
+}
+
+/*
+ * Counts the dispatches of a run of the xorfun loop over size bytes with
+ * the given superinstructions, or with the ones choose_fusions() picks
+ * from a profile of an unfused run when fusions is -1.
+ */
+unsigned long count_xorfun_dispatches(int fusions, unsigned char *payload,
+        size_t size, int *chosen)
+{
+    double code[25];
+    unsigned long counts[16] = {0};
+    unsigned long total = 0;
+
+    xorfun_code(code, size);
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = size;
+    memory.rwmem = payload;
+
+    DecodedProgram *program = decode_program(&memory);
+
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        CPU *cpu = new_cpu(&memory);
+
+        memset(counts, 0, sizeof(counts));
+
+        attach_program(cpu, program);
+        run_profiled(cpu, counts);
+
+        free_cpu(cpu);
+
+        if(pass == 0)
+        {
+            *chosen = fusions == -1 ? choose_fusions(program, counts) :
+                fusions;
+
+            fuse_program(program, *chosen);
+        }
+    }
+
+    for(size_t i = 0; i < program->entries; ++i)
+        total += counts[i];
+
+    free_decoded_program(program);
+
+    return total;
+}
+
+/*
+ * Runs the xorfun loop over LANES_BUFFERS payloads, one CPU at a time with
+ * run_cpu() or in lock-step with run_lanes(), and returns the best time.
+ */
+double bench_lanes(int lanes, unsigned char *payloads)
+{
+    double code[25];
+    double best = 0;
+    static Memory memories[LANES_BUFFERS];
+    static CPU *cpus[LANES_BUFFERS];
+
+    xorfun_code(code, LANES_SIZE);
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = LANES_SIZE;
+    memory.rwmem = NULL;
+
+    DecodedProgram *program = decode_program(&memory);
+
+    fuse_program(program, FUSE_ALL);
+
+    for(int run = 0; run < XORFUN_RUNS; ++run)
+    {
+        for(size_t i = 0; i < LANES_BUFFERS; ++i)
+        {
+            memories[i] = memory;
+            memories[i].rwmem = payloads + i * LANES_SIZE;
+
+            cpus[i] = new_cpu(&memories[i]);
+
+            attach_program(cpus[i], program);
+        }
+
+        double start = now();
+
+        if(lanes)
+        {
+            run_lanes(program, cpus, LANES_BUFFERS);
+        } else
+        {
+            for(size_t i = 0; i < LANES_BUFFERS; ++i)
+                run_cpu(cpus[i]);
+        }
+
+        double elapsed = now() - start;
+
+        if(run == 0 || elapsed < best)
+            best = elapsed;
+
+        for(size_t i = 0; i < LANES_BUFFERS; ++i)
+            free_cpu(cpus[i]);
+    }
+
+    free_decoded_program(program);
+
+    return best;
+}
+
+/*
+ * Runs the xorfun loop over BATCH_JOBS payloads of very different sizes
+ * with run_batch() and threads workers, returns the best time and the
+ * number of bytes in total. The first two bytes of a payload are its size.
+ */
+double bench_batch(int threads, unsigned char *payloads, double *bytes)
+{
+    double code[] = {
+        LD, R2, R1,
+        SHLI, R2, 8,
+        MOVI, R1, 1,
+        LD, R4, R1,
+        ADD, R2, R4,
+        MOVI, R1, 2,
+        MOVI, R3, 0x12,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JLT, 20,
+
+        HLT
+    };
+
+    static Memory jobs[BATCH_JOBS];
+    size_t offset = 0;
+    double best = 0;
+
+    for(size_t i = 0; i < BATCH_JOBS; ++i)
+    {
+        // mostly small payloads, a few up to BATCH_MAX_SIZE
+        size_t size = i % 64 == 0 ? BATCH_MAX_SIZE : 64 << (i % 5);
+
+        jobs[i].code_size = sizeof(code);
+        jobs[i].code = code;
+        jobs[i].rwmem_size = size;
+        jobs[i].rwmem = payloads + offset;
+        jobs[i].rwmem[0] = size >> 8;
+        jobs[i].rwmem[1] = size & 0xff;
+
+        offset += size;
+    }
+
+    *bytes = offset;
+
+    DecodedProgram *program = decode_program(&jobs[0]);
+
+    fuse_program(program, FUSE_ALL);
+
+    for(int run = 0; run < XORFUN_RUNS; ++run)
+    {
+        double start = now();
+
+        run_batch(program, jobs, BATCH_JOBS, threads);
+
+        double elapsed = now() - start;
+
+        if(run == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    free_decoded_program(program);
+
+    return best;
+}
+
+/*
+ * Streams a STREAM_SIZE bytes temporary file through the xorfun loop to
+ * /dev/null, window bytes at a time, and returns the time it took.
+ */
+double bench_stream(size_t window)
+{
+    double code[] = {
+        MOVI, R3, 0x12,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JLT, 2,
+
+        HLT
+    };
+
+    FILE *in = tmpfile();
+    int out = open("/dev/null", O_WRONLY);
+    static unsigned char chunk[1 << 16];
+
+    if(in == NULL || out < 0)
+        return 0;
+
+    for(size_t i = 0; i < STREAM_SIZE / sizeof(chunk); ++i)
+        fwrite(chunk, 1, sizeof(chunk), in);
+
+    fflush(in);
+    rewind(in);
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = 0;
+    memory.rwmem = NULL;
+
+    CPU *cpu = new_cpu(&memory);
+
+    StreamConfig config;
+    config.window = window;
+    config.length_register = 2;
+    config.carry = 0;
+
+    double start = now();
+
+    run_stream(cpu, fileno(in), out, &config);
+
+    double elapsed = now() - start;
+
+    free_cpu(cpu);
+    fclose(in);
+    close(out);
+
+    return elapsed;
+}
+
+/*
+ * Runs a 10-instruction program CONTEXT_RUNS times over 8 bytes of rwmem
+ * and returns the best time in seconds. The CPU of every run comes from:
+ *
+ * 0: new_cpu(), which decodes the program again, and free_cpu()
+ * 1: new_cpu() with a program decoded once, and free_cpu()
+ * 2: acquire_cpu() and release_cpu() on the pool of the thread
+ * 3: reset_cpu() on a single CPU
+ */
+double bench_contexts(int mode)
+{
+    unsigned char payload[8] = {0};
+    double code[] = {
+        MOVI, R3, 0x12,
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+
+        HLT
+    };
+    double best = 0;
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = sizeof(payload);
+    memory.rwmem = payload;
+
+    DecodedProgram *program = decode_program(&memory);
+    ContextPool *pool = thread_context_pool();
+    CPU *reused = new_cpu(&memory);
+
+    fuse_program(program, FUSE_ALL);
+    attach_program(reused, program);
+
+    for(int run = 0; run < XORFUN_RUNS; ++run)
+    {
+        double start = now();
+
+        for(long i = 0; i < CONTEXT_RUNS; ++i)
+        {
+            CPU *cpu;
+
+            switch(mode)
+            {
+                case 0:
+                    cpu = new_cpu(&memory);
+                    run_cpu(cpu);
+                    free_cpu(cpu);
+
+                    break;
+
+                case 1:
+                    cpu = new_cpu(&memory);
+                    attach_program(cpu, program);
+                    run_cpu(cpu);
+                    free_cpu(cpu);
+
+                    break;
+
+                case 2:
+                    cpu = acquire_cpu(pool, &memory, program);
+                    run_cpu(cpu);
+                    release_cpu(pool, cpu);
+
+                    break;
+
+                default:
+                    reset_cpu(reused, &memory);
+                    run_cpu(reused);
+
+                    break;
+            }
+        }
+
+        double elapsed = now() - start;
+
+        if(run == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    free_cpu(reused);
+    free_decoded_program(program);
+
+    return best;
+}
+
+/*
+ * Runs xorfun over size bytes runs times, with a new CPU every time (so
+ * nothing decoded is reused) and engine (-1 is interpret_code()). Returns
+ * the best time in seconds for all the runs.
+ */
+double bench_tiered(int engine, size_t size, long runs)
+{
+    unsigned char *payload = (unsigned char *)calloc(size, 1);
+    double code[25];
+    double best = 0;
+
+    xorfun_code(code, size);
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = size;
+    memory.rwmem = payload;
+
+    for(int run = 0; run < XORFUN_RUNS; ++run)
+    {
+        double start = now();
+
+        for(long i = 0; i < runs; ++i)
+        {
+            CPU *cpu = new_cpu(&memory);
+
+            if(engine == -1)
+            {
+                interpret_code(cpu);
+            } else
+            {
+                set_engine(cpu, engine);
+                run_cpu(cpu);
+            }
+
+            free_cpu(cpu);
+        }
+
+        double elapsed = now() - start;
+
+        if(run == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    free(payload);
+
+    return best;
+}
+
+/*
+ * Suite: every case runs BENCH_WARMUP times untimed, then up to BENCH_REPS
+ * timed runs (at least BENCH_MIN_REPS, fewer than BENCH_REPS once they
+ * have taken BENCH_BUDGET seconds). A run shorter than BENCH_MIN_TIME is
+ * repeated within a single timing, divided by the number of repetitions.
+ */
+#define BENCH_WARMUP 1
+#define BENCH_REPS 21
+#define BENCH_MIN_REPS 3
+#define BENCH_BUDGET 2.0
+#define BENCH_MIN_TIME 1e-3
+#define BENCH_CASES 256
+
+// opcode cases run BENCH_UNROLL copies of the opcode BENCH_ROUNDS times
+#define BENCH_UNROLL 16
+#define BENCH_ROUNDS 2000
+
+/*
+ * instructions and bytes are the VM instructions and the bytes of payload
+ * of a single run (bytes is 0 when the payload does not matter), seconds
+ * the time of every timed run, sorted. perf holds the hardware counters of
+ * the timed runs per VM instruction, -1 for those not available.
+ */
+typedef struct bench_case_t
+{
+    const char *group;
+    char name[32];
+    int engine;
+
+    double instructions;
+    double bytes;
+
+    int runs;
+    double seconds[BENCH_REPS];
+
+    double perf[TOTAL_PERF_EVENTS];
+} BenchCase;
+
+BenchCase bench_cases[BENCH_CASES];
+size_t bench_count = 0;
+
+// opened by main(), timing only without hardware counters
+PerfCounters bench_perf;
+
+const char *engine_names[] = {"ENGINE_SWITCH", "ENGINE_THREADED",
+    "ENGINE_JIT"};
+
+int compare_seconds(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+// nearest rank
+double percentile(BenchCase *c, int p)
+{
+    int rank = (p * c->runs + 99) / 100;
+
+    return c->seconds[rank > 0 ? rank - 1 : 0];
+}
+
+/*
+ * Counts the VM instructions of a run of memory->code: the dispatches of
+ * an unfused run, which has no superinstructions.
+ */
+double count_instructions(Memory *memory)
+{
+    DecodedProgram *program = decode_program(memory);
+    unsigned long *counts = (unsigned long *)calloc(program->entries,
+            sizeof(unsigned long));
+    double total = 0;
+
+    CPU *cpu = new_cpu(memory);
+
+    attach_program(cpu, program);
+    run_profiled(cpu, counts);
+
+    for(size_t i = 0; i < program->entries; ++i)
+        total += counts[i];
+
+    free_cpu(cpu);
+    free(counts);
+    free_decoded_program(program);
+
+    return total;
+}
+
+/*
+ * Times memory->code with engine and every superinstruction and adds it to
+ * bench_cases. instructions is the number of VM instructions of a run, 0
+ * to count them with count_instructions().
+ */
+BenchCase *bench_case(const char *group, const char *name, int engine,
+        Memory *memory, double instructions, double bytes)
+{
+    if(bench_count == BENCH_CASES)
+    {
+        fprintf(stderr, "more than %d cases\n", BENCH_CASES);
+
+        exit(1);
+    }
+
+    BenchCase *c = &bench_cases[bench_count++];
+
+    c->group = group;
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    c->engine = engine;
+    c->instructions = instructions ? instructions :
+        count_instructions(memory);
+    c->bytes = bytes;
+    c->runs = 0;
+
+    DecodedProgram *program = decode_program(memory);
+    CPU *cpu = new_cpu(memory);
+    long repeat = 1;
+    double spent = 0;
+
+    fuse_program(program, FUSE_ALL);
+    attach_program(cpu, program);
+    set_engine(cpu, engine);
+
+    for(int run = -BENCH_WARMUP; run < BENCH_REPS; ++run)
+    {
+        if(run == 0)
+            start_perf(&bench_perf);
+
+        double start = now();
+
+        for(long i = 0; i < repeat; ++i)
+        {
+            reset_cpu(cpu, memory);
+            run_cpu(cpu);
+        }
+
+        double elapsed = now() - start;
+
+        if(run < 0)
+        {
+            // the last warm-up run finds how many runs make a timing
+            while(run == -1 && elapsed * repeat < BENCH_MIN_TIME &&
+                    repeat < (1L << 30))
+                repeat *= 2;
+
+            continue;
+        }
+
+        c->seconds[c->runs++] = elapsed / repeat;
+        spent += elapsed;
+
+        if(spent > BENCH_BUDGET && c->runs >= BENCH_MIN_REPS)
+            break;
+    }
+
+    stop_perf(&bench_perf);
+
+    for(int i = 0; i < TOTAL_PERF_EVENTS; ++i)
+    {
+        c->perf[i] = -1;
+
+        if(perf_available(&bench_perf, i))
+            c->perf[i] = bench_perf.values[i] /
+                (c->instructions * repeat * c->runs);
+    }
+
+    qsort(c->seconds, c->runs, sizeof(double), compare_seconds);
+
+    free_cpu(cpu);
+    free_decoded_program(program);
+
+    return c;
+}
+
+void print_case(BenchCase *c)
+{
+    double median = percentile(c, 50);
+
+    printf("%-24s%-16s: %8.2f ns/instruction (p10 %8.2f, p90 %8.2f), "
+            "%9.2f M instructions/s", c->name, engine_names[c->engine],
+            median * 1e9 / c->instructions,
+            percentile(c, 10) * 1e9 / c->instructions,
+            percentile(c, 90) * 1e9 / c->instructions,
+            c->instructions / median / 1e6);
+
+    if(c->bytes > 0)
+        printf(", %9.2f MB/s", c->bytes / median / 1e6);
+
+    printf("\n");
+
+    if(c->perf[PERF_CYCLES] < 0)
+        return;
+
+    printf("%40s", "per VM instruction:");
+
+    for(int i = 0; i < TOTAL_PERF_EVENTS; ++i)
+    {
+        if(c->perf[i] >= 0)
+            printf(" %.3f %s,", c->perf[i], perf_event_name(i));
+    }
+
+    if(c->perf[PERF_INSTRUCTIONS] >= 0 && c->perf[PERF_CYCLES] > 0)
+        printf(" IPC %.2f", c->perf[PERF_INSTRUCTIONS] / c->perf[PERF_CYCLES]);
+
+    printf("\n");
+}
+
+/*
+ * Writes every case of bench_cases to path as JSON, returns -1 if the file
+ * can not be written.
+ */
+int write_json(const char *path)
+{
+    FILE *out = fopen(path, "w");
+
+    if(out == NULL)
+        return -1;
+
+    fprintf(out, "{\n  \"warmup\": %d,\n  \"cases\": [\n", BENCH_WARMUP);
+
+    for(size_t i = 0; i < bench_count; ++i)
+    {
+        BenchCase *c = &bench_cases[i];
+        double median = percentile(c, 50);
+
+        fprintf(out, "    {\"group\": \"%s\", \"name\": \"%s\", "
+                "\"engine\": \"%s\", \"runs\": %d, "
+                "\"instructions\": %.0f, \"bytes\": %.0f,\n",
+                c->group, c->name, engine_names[c->engine], c->runs,
+                c->instructions, c->bytes);
+        fprintf(out, "     \"seconds\": {\"min\": %.9g, \"p10\": %.9g, "
+                "\"p50\": %.9g, \"p90\": %.9g, \"max\": %.9g},\n",
+                c->seconds[0], percentile(c, 10), median, percentile(c, 90),
+                c->seconds[c->runs - 1]);
+        fprintf(out, "     \"ns_per_instruction\": %.4f, "
+                "\"instructions_per_second\": %.0f, \"mb_per_second\": %.2f,"
+                "\n", median * 1e9 / c->instructions,
+                c->instructions / median, c->bytes / median / 1e6);
+
+        // counters per VM instruction, null when not available
+        const char *keys[] = {
+            [PERF_CYCLES] = "cycles",
+            [PERF_INSTRUCTIONS] = "instructions",
+            [PERF_BRANCH_MISSES] = "branch_misses",
+            [PERF_L1D_MISSES] = "l1d_misses",
+            [PERF_L1I_MISSES] = "l1i_misses"
+        };
+
+        fprintf(out, "     \"perf\": {");
+
+        for(int event = 0; event < TOTAL_PERF_EVENTS; ++event)
+        {
+            if(c->perf[event] >= 0)
+                fprintf(out, "\"%s\": %.6f, ", keys[event], c->perf[event]);
+            else
+                fprintf(out, "\"%s\": null, ", keys[event]);
+        }
+
+        if(c->perf[PERF_INSTRUCTIONS] >= 0 && c->perf[PERF_CYCLES] > 0)
+            fprintf(out, "\"ipc\": %.4f}}", c->perf[PERF_INSTRUCTIONS] /
+                    c->perf[PERF_CYCLES]);
+        else
+            fprintf(out, "\"ipc\": null}}");
+
+        fprintf(out, "%s\n", i + 1 < bench_count ? "," : "");
+    }
+
+    fprintf(out, "  ]\n}\n");
+    fclose(out);
+
+    return 0;
+}
+
+/*
+ * A loop running instruction (its slots doubles) BENCH_UNROLL times a
+ * round, BENCH_ROUNDS rounds, or no instruction with slots 0. Jumps go to
+ * the next instruction. The operands can count on R1 = 1, R2 = 0, R3 = 32,
+ * R4 = 16 and R5 = 3, with 64 bytes of rwmem. Returns the slots of code.
+ */
+size_t opcode_code(double *code, double *instruction, size_t slots)
+{
+    double prologue[] = {
+        MOVI, R1, 1,
+        MOVI, R2, 0,
+        MOVI, R3, 32,
+        MOVI, R4, 16,
+        MOVI, R5, 3,
+        MOVI, R7, BENCH_ROUNDS
+    };
+    size_t length = sizeof(prologue) / sizeof(double);
+    size_t loop = length;
+
+    memcpy(code, prologue, sizeof(prologue));
+
+    for(int i = 0; slots && i < BENCH_UNROLL; ++i)
+    {
+        memcpy(code + length, instruction, slots * sizeof(double));
+
+        if(instruction[0] >= JMP && instruction[0] <= JGT)
+            code[length + 1] = length + 1;
+
+        length += slots;
+    }
+
+    double epilogue[] = {
+        ADDI, R6, 1,
+        CMP, R6, R7,
+        JNE, loop - 1,
+
+        HLT
+    };
+
+    memcpy(code + length, epilogue, sizeof(epilogue));
+
+    return length + sizeof(epilogue) / sizeof(double);
+}
+
+/*
+ * One case per opcode of enum Instructions but HLT on each engine, printed
+ * as ns per opcode once the time of the loop alone is taken away.
+ */
+void bench_opcodes()
+{
+    double instructions[][5] = {
+        {MOV, R0, R1}, {MOVI, R0, 5},
+        {ADD, R0, R1}, {ADDI, R0, 1}, {SUB, R0, R1}, {SUBI, R0, 1},
+        {MUL, R0, R1}, {MULI, R0, 1}, {DIV, R0, R1}, {DIVI, R0, 1},
+        {CMP, R0, R1},
+        {JMP, 0}, {JE, 0}, {JNE, 0}, {JLT, 0}, {JGT, 0},
+        {LD, R0, R2}, {STR, R2, R0},
+        {XOR, R0, R1}, {XORI, R0, 1}, {SHL, R0, R1}, {SHR, R0, R1},
+        {SHLI, R0, 1}, {SHRI, R0, 1},
+        {LD16, R0, R2}, {LD32, R0, R2}, {LD64, R0, R2},
+        {STR16, R2, R0}, {STR32, R2, R0}, {STR64, R2, R0},
+        {VLD, V0, R2}, {VST, R2, V0}, {VXOR, V0, V1}, {VADD, V0, V1},
+        {VSHL, V0, 1}, {VSHR, V0, 1},
+        {MEMCPY, R3, R2, R4}, {MEMSET, R3, R1, R4}, {MEMXOR, R3, R2, R4},
+        {MEMXORK, R3, R2, R4, R5}
+    };
+    double code[32 + BENCH_UNROLL * 5];
+    unsigned char rwmem[64] = {0};
+    BenchCase *loops[3];
+
+    Memory memory;
+    memory.code = code;
+    memory.rwmem_size = sizeof(rwmem);
+    memory.rwmem = rwmem;
+
+    memory.code_size = opcode_code(code, NULL, 0) * sizeof(double);
+
+    for(int engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine)
+        loops[engine] = bench_case("opcode", "loop", engine, &memory, 0, 0);
+
+    printf("%-10s%18s%18s%18s\n", "ns/opcode", engine_names[0],
+            engine_names[1], engine_names[2]);
+
+    for(size_t i = 0; i < sizeof(instructions) / sizeof(instructions[0]);
+            ++i)
+    {
+        int opcode = instructions[i][0];
+        size_t slots = opcode >= JMP && opcode <= JGT ? 2 :
+            opcode == MEMXORK ? 5 : opcode >= MEMCPY ? 4 : 3;
+
+        memory.code_size = opcode_code(code, instructions[i], slots) *
+            sizeof(double);
+
+        printf("%-10s", instruction_name(opcode));
+
+        for(int engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine)
+        {
+            BenchCase *c = bench_case("opcode", instruction_name(opcode),
+                    engine, &memory, 0, 0);
+
+            printf("%18.2f", (percentile(c, 50) -
+                        percentile(loops[engine], 50)) * 1e9 /
+                    (BENCH_UNROLL * BENCH_ROUNDS));
+        }
+
+        printf("\n");
+    }
+}
+
+/*
+ * Loops and branches: two nested loops, a branch going one way then the
+ * other, and arithmetic on D<n> registers.
+ */
+void bench_programs()
+{
+    double nested[] = {
+        MOVI, R3, 100,
+        MOVI, R7, 1000,
+
+        MOVI, R1, 0,
+        ADDI, R1, 1,
+        CMP, R1, R3,
+        JNE, 8,
+        ADDI, R6, 1,
+        CMP, R6, R7,
+        JNE, 5,
+
+        HLT
+    };
+
+    double branches[] = {
+        MOVI, R7, 100000,
+
+        // R0 is 0 for even rounds
+        MOV, R0, R6,
+        SHLI, R0, 63,
+        CMP, R0, R2,
+        JE, 18,
+        ADDI, R5, 3,
+        JMP, 21,
+        SUBI, R5, 1,
+        ADDI, R6, 1,
+        CMP, R6, R7,
+        JNE, 2,
+
+        HLT
+    };
+
+    double doubles[] = {
+        MOVI, R7, 100000,
+        MOVI, D0, 1,
+        MOVI, D1, 1.0000001,
+        MOVI, D2, 0.5,
+
+        MUL, D0, D1,
+        ADD, D3, D2,
+        DIV, D3, D1,
+        ADDI, R6, 1,
+        CMP, R6, R7,
+        JNE, 11,
+
+        HLT
+    };
+
+    double *programs[] = {nested, branches, doubles};
+    size_t sizes[] = {sizeof(nested), sizeof(branches), sizeof(doubles)};
+    const char *names[] = {"nested loops", "branches", "doubles"};
+
+    for(size_t i = 0; i < 3; ++i)
+    {
+        Memory memory;
+        memory.code_size = sizes[i];
+        memory.code = programs[i];
+        memory.rwmem_size = 0;
+        memory.rwmem = NULL;
+
+        for(int engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine)
+            print_case(bench_case("program", names[i], engine, &memory, 0,
+                        0));
+    }
+}
+
+/*
+ * The xorfun loop over 64 bytes to 1 GB (up to 1 MB without large) with
+ * every engine.
+ */
+void bench_xorfun_sizes(int large)
+{
+    size_t sizes[] = {64, 4 << 10, 1 << 20, 1 << 30};
+    const char *names[] = {"xorfun 64 B", "xorfun 4 KB", "xorfun 1 MB",
+        "xorfun 1 GB"};
+    double code[25];
+
+    for(size_t i = 0; i < (large ? 4 : 3); ++i)
+    {
+        unsigned char *payload = (unsigned char *)calloc(sizes[i], 1);
+
+        if(payload == NULL)
+        {
+            printf("%-24s: not enough memory\n", names[i]);
+
+            continue;
+        }
+
+        xorfun_code(code, sizes[i]);
+
+        Memory memory;
+        memory.code_size = 24 * sizeof(double);
+        memory.code = code;
+        memory.rwmem_size = sizes[i];
+        memory.rwmem = payload;
+
+        for(int engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine)
+            print_case(bench_case("xorfun", names[i], engine, &memory,
+                        6.0 * sizes[i] + 3, sizes[i]));
+
+        free(payload);
+    }
+}
+
+void task_finished(SchedulerTask *task)
+{
+    *(double *)task->data = now();
+}
+
+/*
+ * Runs a long loop then SCHEDULER_SHORT short programs, one after the
+ * other with run_cpu() (scheduled is 0) or with a single worker of the
+ * scheduler. Returns the time until all are done, and in p50 and p99 the
+ * percentiles of the time until a short program is done.
+ */
+double bench_scheduler(int scheduled, double *p50, double *p99)
+{
+    static unsigned char payloads[SCHEDULER_SHORT][40];
+    static Memory memories[SCHEDULER_SHORT + 1];
+    static CPU cpus[SCHEDULER_SHORT + 1];
+    static SchedulerTask tasks[SCHEDULER_SHORT + 1];
+    static double finished[SCHEDULER_SHORT + 1];
+
+    double code[] = {
+        MOVI, R2, 40,
+        MOVI, R3, 0x12,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 5,
+
+        HLT
+    };
+
+    double loop[] = {
+        MOVI, R2, SCHEDULER_LONG,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 2,
+        HLT
+    };
+
+    static unsigned char nothing[1];
+
+    for(int i = 0; i <= SCHEDULER_SHORT; ++i)
+    {
+        memories[i].code_size = i == 0 ? sizeof(loop) : sizeof(code);
+        memories[i].code = i == 0 ? loop : code;
+        memories[i].rwmem_size = i == 0 ? sizeof(nothing) : 40;
+        memories[i].rwmem = i == 0 ? nothing : payloads[i - 1];
+
+        init_cpu(&cpus[i], &memories[i]);
+
+        tasks[i].limit = 0;
+        tasks[i].done = task_finished;
+        tasks[i].data = &finished[i];
+    }
+
+    Scheduler *scheduler = scheduled ? new_scheduler(1, SCHEDULER_SLICE) :
+        NULL;
+    double start = now();
+
+    for(int i = 0; i <= SCHEDULER_SHORT; ++i)
+    {
+        if(scheduler != NULL)
+        {
+            schedule(scheduler, &tasks[i], &cpus[i]);
+        } else
+        {
+            run_cpu(&cpus[i]);
+            finished[i] = now();
+        }
+    }
+
+    if(scheduler != NULL)
+    {
+        wait_scheduler(scheduler);
+        free_scheduler(scheduler);
+    }
+
+    double elapsed = 0;
+
+    for(int i = 0; i <= SCHEDULER_SHORT; ++i)
+    {
+        finished[i] -= start;
+
+        if(finished[i] > elapsed)
+            elapsed = finished[i];
+
+        deinit_cpu(&cpus[i]);
+    }
+
+    qsort(finished + 1, SCHEDULER_SHORT, sizeof(double), compare_seconds);
+
+    *p50 = finished[1 + SCHEDULER_SHORT / 2];
+    *p99 = finished[1 + SCHEDULER_SHORT * 99 / 100];
+
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    static unsigned char payload[XORFUN_SIZE];
+    double instructions = 6.0 * XORFUN_SIZE + 3;
+
+    const char *names[] = {"interpret_code", "ENGINE_SWITCH", "ENGINE_THREADED",
+        "ENGINE_JIT"};
+    int engines[] = {-1, ENGINE_SWITCH, ENGINE_THREADED, ENGINE_JIT};
+
+    const char *json = NULL;
+    int large = 1;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+        {
+            json = argv[++i];
+        } else if(strcmp(argv[i], "--small") == 0)
+        {
+            large = 0;
+        } else
+        {
+            fprintf(stderr, "usage: %s [--json FILE] [--small]\n", argv[0]);
+
+            return 1;
+        }
+    }
+
+    int counters = open_perf(&bench_perf);
+
+    if(counters > 0)
+        printf("[+] %d OF %d HARDWARE COUNTERS\n\n", counters,
+                TOTAL_PERF_EVENTS);
+    else
+        printf("[+] NO HARDWARE COUNTERS, TIMING ONLY\n\n");
+
+    printf("[+] OPCODES, %d x %d PER RUN, MEDIAN OF UP TO %d RUNS\n\n",
+            BENCH_UNROLL, BENCH_ROUNDS, BENCH_REPS);
+
+    bench_opcodes();
+
+    printf("\n[+] PROGRAMS\n\n");
+
+    bench_programs();
+
+    printf("\n[+] XORFUN\n\n");
+
+    bench_xorfun_sizes(large);
+
+    close_perf(&bench_perf);
+
+    printf("\n[+] XORFUN LOOP, %d BYTES, BEST OF %d\n\n", XORFUN_SIZE,
+            XORFUN_RUNS);
+
+    // the JIT takes superinstructions apart, MAP_LOOP included
+    const char *levels[] = {"", " FUSED", " MAP"};
+    int fusions_of[] = {FUSE_NONE, FUSE_CMP_JUMP | FUSE_LD_XOR_STR_INC,
+        FUSE_ALL};
+
+    for(size_t i = 0; i < sizeof(engines) / sizeof(int); ++i)
+    {
+        for(int level = 0; level < 3; ++level)
+        {
+            // interpret_code() does not run decoded programs at all
+            if((level && engines[i] == -1) ||
+                    (level == 2 && engines[i] == ENGINE_JIT))
+                continue;
+
+            double elapsed = bench_xorfun(engines[i], fusions_of[level],
+                    payload, XORFUN_SIZE);
+
+            printf("%-16s%-6s: %6.2f ns/instruction, %8.2f MB/s\n",
+                    names[i], levels[level], elapsed * 1e9 / instructions,
+                    XORFUN_SIZE / elapsed / 1e6);
+        }
+    }
+
+    double sampled = bench_xorfun(-2, FUSE_NONE, payload, XORFUN_SIZE);
+
+    printf("%-22s: %6.2f ns/instruction, %8.2f MB/s (every %d)\n",
+            "run_sampled", sampled * 1e9 / instructions,
+            XORFUN_SIZE / sampled / 1e6, PROFILE_PERIOD);
+
+    // 6 instructions for every 32 bytes
+    for(int engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine)
+    {
+        double elapsed = bench_vector(engine, payload, XORFUN_SIZE);
+
+        printf("%-16s%-6s: %6.2f ns/instruction, %8.2f MB/s\n",
+                names[engine + 1], " VXOR", elapsed * 1e9 /
+                (6.0 * XORFUN_SIZE / VECTOR_SIZE), XORFUN_SIZE / elapsed / 1e6);
+    }
+
+    for(size_t key_length = 1; key_length <= 1000; key_length *= 10)
+    {
+        double elapsed = bench_block(payload, XORFUN_SIZE, key_length);
+
+        printf("MEMXORK %4zu bytes   : %8.2f MB/s\n", key_length,
+                XORFUN_SIZE / elapsed / 1e6);
+    }
+
+    size_t bytecode_size;
+    double elapsed = bench_bytecode(payload, XORFUN_SIZE, &bytecode_size);
+
+    printf("%-22s: %6.2f ns/instruction, %8.2f MB/s\n", "run_bytecode",
+            elapsed * 1e9 / instructions, XORFUN_SIZE / elapsed / 1e6);
+    double compile_time;
+
+    elapsed = bench_aot(payload, XORFUN_SIZE, &compile_time);
+
+    if(elapsed > 0)
+        printf("%-22s: %6.2f ns/instruction, %8.2f MB/s (%.0f ms to load)\n",
+                "run_aot", elapsed * 1e9 / instructions,
+                XORFUN_SIZE / elapsed / 1e6, compile_time * 1e3);
+    else
+        printf("%-22s: no C compiler\n", "run_aot");
+
+    printf("\ncode[]: %zu bytes, bytecode: %zu bytes with the header\n",
+            24 * sizeof(double), bytecode_size);
+
+    const char *fusion_names[] = {"FUSE_NONE", "FUSE_CMP_JUMP",
+        "FUSE_LD_XOR_STR_INC", "FUSE_MAP_LOOP", "FUSE_ALL", "PROFILE"};
+    int fusions[] = {FUSE_NONE, FUSE_CMP_JUMP, FUSE_LD_XOR_STR_INC,
+        FUSE_MAP_LOOP, FUSE_ALL, -1};
+
+    printf("\n[+] XORFUN LOOP DISPATCHES\n\n");
+
+    for(size_t i = 0; i < sizeof(fusions) / sizeof(int); ++i)
+    {
+        int chosen;
+        unsigned long dispatches = count_xorfun_dispatches(fusions[i],
+                payload, XORFUN_SIZE, &chosen);
+
+        printf("%-20s: %9lu dispatches, %.2f per byte (fusions 0x%x)\n",
+                fusion_names[i], dispatches,
+                (double)dispatches / XORFUN_SIZE, chosen);
+    }
+
+    int factors[] = {1, 4, 8};
+
+    printf("\n[+] XORFUN LOOP THROUGH optimize_loops(), %d BYTES, BEST OF %d"
+            "\n\n", XORFUN_SIZE, XORFUN_RUNS);
+
+    for(size_t i = 0; i < sizeof(engines) / sizeof(int); ++i)
+    {
+        for(int level = 0; level < 3; ++level)
+        {
+            if((level && engines[i] == -1) ||
+                    (level == 2 && engines[i] == ENGINE_JIT))
+                continue;
+
+            printf("%-16s%-6s:", names[i], levels[level]);
+
+            for(size_t f = 0; f < sizeof(factors) / sizeof(int); ++f)
+            {
+                double elapsed = bench_unrolled(engines[i], fusions_of[level],
+                        factors[f], payload, XORFUN_SIZE);
+
+                printf(" x%d %8.2f MB/s", factors[f],
+                        XORFUN_SIZE / elapsed / 1e6);
+            }
+
+            printf("\n");
+        }
+    }
+
+    static unsigned char payloads[LANES_BUFFERS * LANES_SIZE];
+    double bytes = (double)LANES_BUFFERS * LANES_SIZE;
+
+    printf("\n[+] XORFUN LOOP, %d PAYLOADS OF %d BYTES, %d LANES\n\n",
+            LANES_BUFFERS, LANES_SIZE, BATCH_LANES);
+
+    for(int lanes = 0; lanes < 2; ++lanes)
+    {
+        double elapsed = bench_lanes(lanes, payloads);
+
+        printf("%-16s: %8.2f MB/s\n", lanes ? "run_lanes" : "run_cpu",
+                bytes / elapsed / 1e6);
+    }
+
+    printf("\n[+] XORFUN LOOP, %d MB FILE, run_stream()\n\n",
+            STREAM_SIZE >> 20);
+
+    for(size_t window = 4 << 10; window <= 4 << 20; window *= 16)
+    {
+        double elapsed = bench_stream(window);
+
+        printf("%5zu KB windows  : %8.2f MB/s, %zu KB of buffers\n",
+                window >> 10, STREAM_SIZE / elapsed / 1e6, 2 * window >> 10);
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned char *batch_payloads = (unsigned char *)calloc(BATCH_JOBS,
+            BATCH_MAX_SIZE);
+
+    printf("\n[+] XORFUN LOOP, %d PAYLOADS OF 64 BYTES TO %d KB, run_batch()"
+            "\n\n", BATCH_JOBS, BATCH_MAX_SIZE >> 10);
+
+    for(long threads = 1; batch_payloads != NULL && threads <= cores;
+            threads *= 2)
+    {
+        double bytes;
+        double elapsed = bench_batch(threads, batch_payloads, &bytes);
+
+        printf("%3ld threads      : %8.2f MB/s\n", threads,
+                bytes / elapsed / 1e6);
+
+        // the last step is always all the cores
+        if(threads < cores && threads * 2 > cores)
+            threads = cores / 2;
+    }
+
+    free(batch_payloads);
+
+    const char *context_names[] = {"new_cpu", "new_cpu + program",
+        "acquire_cpu", "reset_cpu"};
+
+    printf("\n[+] %d RUNS OF A 10-INSTRUCTION PROGRAM, A CPU EACH\n\n",
+            CONTEXT_RUNS);
+
+    for(int mode = 0; mode < 4; ++mode)
+    {
+        double elapsed = bench_contexts(mode);
+
+        printf("%-18s: %8.2f ns/run\n", context_names[mode],
+                elapsed * 1e9 / CONTEXT_RUNS);
+    }
+
+    const char *tier_names[] = {"interpret_code", "ENGINE_THREADED",
+        "ENGINE_JIT", "ENGINE_TIERED"};
+    int tier_engines[] = {-1, ENGINE_THREADED, ENGINE_JIT, ENGINE_TIERED};
+
+    printf("\n[+] XORFUN WITH A NEW CPU EVERY RUN: %d x %d BYTES, 1 x %d "
+            "BYTES\n\n", TIER_RUNS, TIER_SHORT, XORFUN_SIZE);
+
+    for(int i = 0; i < 4; ++i)
+    {
+        double short_runs = bench_tiered(tier_engines[i], TIER_SHORT,
+                TIER_RUNS);
+        double long_run = bench_tiered(tier_engines[i], XORFUN_SIZE, 1);
+
+        printf("%-18s: %8.2f ns/short run, %8.2f MB/s long run\n",
+                tier_names[i], short_runs * 1e9 / TIER_RUNS,
+                XORFUN_SIZE / long_run / 1e6);
+    }
+
+    printf("\n[+] A LOOP OF %d ROUNDS, THEN %d SHORT PROGRAMS, 1 THREAD\n\n",
+            SCHEDULER_LONG, SCHEDULER_SHORT);
+
+    for(int scheduled = 0; scheduled < 2; ++scheduled)
+    {
+        double p50;
+        double p99;
+        double elapsed = bench_scheduler(scheduled, &p50, &p99);
+
+        printf("%-18s: short programs done in %8.3f ms (p50), %8.3f ms "
+                "(p99), all in %8.3f ms\n", scheduled ? "scheduler" :
+                "run_cpu in order", p50 * 1e3, p99 * 1e3, elapsed * 1e3);
+    }
+
+    if(json != NULL)
+    {
+        if(write_json(json) == 0)
+            printf("\n[+] %zu CASES WRITTEN TO %s\n", bench_count, json);
+        else
+            printf("\n[+] CAN NOT WRITE %s\n", json);
+    }
+
+    return 0;
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+/**
+ * XORVM block instructions.
+ * Author: 0xb4db01
+ *
+ * MEMCPY, MEMSET, MEMXOR and MEMXORK work on a whole range of rwmem in a
+ * single instruction, all their operands being R<n> registers:
+ *
+ *     MEMCPY Rd, Rs, Rn       copies rwmem[Rs...] to rwmem[Rd...]
+ *     MEMSET Rd, Rv, Rn       fills rwmem[Rd...] with the low byte of Rv
+ *     MEMXOR Rd, Rs, Rn       rwmem[Rd + i] ^= rwmem[Rs + i]
+ *     MEMXORK Rd, Rk, Rn, Rl  rwmem[Rd + i] ^= rwmem[Rk + i % Rl]
+ *
+ * for Rn bytes, i going from 0 to Rn - 1. Ranges may overlap: the source
+ * (or the key) is read as it was before the instruction, like memmove()
+ * does. Nothing happens when Rn (or the key length Rl) is 0 or less, and
+ * neither the registers nor the flags change.
+ *
+ * The ranges are not checked, like the address of LD and STR (see
+ * run_safe() in verify.h for programs that may be broken).
+ */
+
+#include "cpu.h"
+
+// MEMXORK keys up to this size are expanded on the stack
+#define BLOCK_KEY_STACK 256
+
+#ifdef __GNUC__
+
+#if defined(__x86_64__) && defined(__linux__)
+#define BLOCK_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define BLOCK_TARGETS
+#endif
+
+typedef unsigned char BlockBytes __attribute__((vector_size(32)));
+
+#endif
+
+/*
+ * Block functions prototypes
+ */
+
+void block_operation(unsigned char *, int, long, long, long, long);
+void xor_bytes(unsigned char *, unsigned char *, size_t);
+void xor_bytes_backwards(unsigned char *, unsigned char *, size_t);
+void xor_key(unsigned char *, size_t, unsigned char *, size_t);
+
+/*
+ * dst[i] ^= src[i] from the first byte to the last one.
+ */
+#ifdef __GNUC__
+BLOCK_TARGETS
+#endif
+void xor_bytes(unsigned char *dst, unsigned char *src, size_t length)
+{
+    size_t done = 0;
+
+#ifdef __GNUC__
+    for(; done + sizeof(BlockBytes) <= length; done += sizeof(BlockBytes))
+    {
+        BlockBytes a;
+        BlockBytes b;
+
+        memcpy(&a, dst + done, sizeof(a));
+        memcpy(&b, src + done, sizeof(b));
+
+        a ^= b;
+
+        memcpy(dst + done, &a, sizeof(a));
+    }
+#endif
+
+    for(; done < length; ++done)
+        dst[done] ^= src[done];
+}
+
+/*
+ * Same from the last byte to the first one, for a dst overlapping the end
+ * of src: every byte of src is read before it gets written.
+ */
+#ifdef __GNUC__
+BLOCK_TARGETS
+#endif
+void xor_bytes_backwards(unsigned char *dst, unsigned char *src,
+        size_t length)
+{
+#ifdef __GNUC__
+    for(; length >= sizeof(BlockBytes); length -= sizeof(BlockBytes))
+    {
+        size_t at = length - sizeof(BlockBytes);
+        BlockBytes a;
+        BlockBytes b;
+
+        memcpy(&a, dst + at, sizeof(a));
+        memcpy(&b, src + at, sizeof(b));
+
+        a ^= b;
+
+        memcpy(dst + at, &a, sizeof(a));
+    }
+#endif
+
+    while(length > 0)
+    {
+        length--;
+        dst[length] ^= src[length];
+    }
+}
+
+/*
+ * dst[i] ^= key[i % key_length]. pattern holds the key repeated over
+ * key_length + 32 bytes, so the 32 bytes of key for any position are
+ * contiguous in it and the block at i starts at pattern + i % key_length.
+ */
+#ifdef __GNUC__
+BLOCK_TARGETS
+#endif
+void xor_key(unsigned char *dst, size_t length, unsigned char *pattern,
+        size_t key_length)
+{
+    size_t done = 0;
+    size_t phase = 0;
+
+#ifdef __GNUC__
+    // how far the key moves every block, without a division per block
+    size_t step = sizeof(BlockBytes) % key_length;
+
+    for(; done + sizeof(BlockBytes) <= length; done += sizeof(BlockBytes))
+    {
+        BlockBytes a;
+        BlockBytes b;
+
+        memcpy(&a, dst + done, sizeof(a));
+        memcpy(&b, pattern + phase, sizeof(b));
+
+        a ^= b;
+
+        memcpy(dst + done, &a, sizeof(a));
+
+        phase += step;
+
+        if(phase >= key_length)
+            phase -= key_length;
+    }
+#endif
+
+    for(; done < length; ++done)
+    {
+        dst[done] ^= pattern[phase];
+        phase = phase + 1 == key_length ? 0 : phase + 1;
+    }
+}
+
+/*
+ * Runs the block instruction opcode on rwmem, with the values of its
+ * registers: dst, src (the value of MEMSET, the key of MEMXORK), length
+ * and key_length (MEMXORK only).
+ */
+void block_operation(unsigned char *rwmem, int opcode, long dst, long src,
+        long length, long key_length)
+{
+    if(length <= 0)
+        return;
+
+    switch(opcode)
+    {
+        case MEMCPY:
+            memmove(rwmem + dst, rwmem + src, length);
+
+            break;
+
+        case MEMSET:
+            memset(rwmem + dst, src & 0xff, length);
+
+            break;
+
+        case MEMXOR:
+            if(dst > src && dst < src + length)
+                xor_bytes_backwards(rwmem + dst, rwmem + src, length);
+            else
+                xor_bytes(rwmem + dst, rwmem + src, length);
+
+            break;
+
+        case MEMXORK:
+        {
+            unsigned char stack[BLOCK_KEY_STACK + 32];
+            unsigned char *pattern = stack;
+            size_t size = key_length + 32;
+
+            if(key_length <= 0)
+                break;
+
+            if(key_length > BLOCK_KEY_STACK)
+                pattern = (unsigned char *)malloc(size);
+
+            // without memory for the pattern the key is read in place,
+            // which is only different when it overlaps dst
+            if(pattern == NULL)
+            {
+                for(long i = 0; i < length; ++i)
+                    rwmem[dst + i] ^= rwmem[src + i % key_length];
+
+                break;
+            }
+
+            // the key, then what is already there again: every copy starts
+            // at a multiple of key_length
+            memcpy(pattern, rwmem + src, key_length);
+
+            for(size_t done = key_length; done < size; done *= 2)
+                memcpy(pattern + done, pattern,
+                        done < size - done ? done : size - done);
+
+            xor_key(rwmem + dst, length, pattern, key_length);
+
+            if(pattern != stack)
+                free(pattern);
+
+            break;
+        }
+    }
+}
@@ -0,0 +1,967 @@
+#pragma once
+
+/**
+ * XORVM binary bytecode.
+ * Author: 0xb4db01
+ *
+ * A compact format for programs, meant to be stored in files and run
+ * straight from memory (see load_bytecode(), which maps the file) instead
+ * of being parsed into a double code[] first.
+ *
+ * A file is a 32 bytes BytecodeHeader followed by code_size bytes of
+ * instructions, padded with zeros to a multiple of 8 bytes. Everything is
+ * little-endian. Instructions take 1 to 10 bytes:
+ *
+ * HLT                      : opcode
+ * MOV, ADD, CMP, LD, XOR...: opcode, dst | src << 4
+ * MOVI, ADDI, XORI...      : opcode, dst | kind << 4, immediate
+ * JMP, JE, JNE, JLT, JGT   : opcode, 0, target (int32)
+ *
+ * The opcode byte is the enum Instructions value with BYTECODE_D_DST and
+ * BYTECODE_D_SRC telling whether dst and src are D<n> registers, so
+ * registers take 3 bits and the engine never has to look at their class.
+ * Immediates are stored in the smallest enum BytecodeImmediates kind
+ * holding them exactly and converted by the instruction like the ones of
+ * code[] (to long for MOVI on R<n>, XORI, SHLI and SHRI, to double for the
+ * others), so MOVI R0, 1 takes 3 bytes and 64-bit integers are exact.
+ * Jump targets are the offset in bytes of an instruction from the
+ * beginning of the code.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cpu.h"
+
+#define BYTECODE_MAGIC "XVMB"
+#define BYTECODE_VERSION 1
+
+// bits of the opcode byte
+#define BYTECODE_D_DST 0x80
+#define BYTECODE_D_SRC 0x40
+#define BYTECODE_OPCODE(op, dst, src)\
+    ((op) | ((dst) ? BYTECODE_D_DST : 0) | ((src) ? BYTECODE_D_SRC : 0))
+
+enum BytecodeImmediates
+{
+    BYTECODE_I8,
+    BYTECODE_I16,
+    BYTECODE_I32,
+    BYTECODE_I64,
+    BYTECODE_F32,
+    BYTECODE_F64
+};
+
+const int bytecode_immediate_size[] = {
+    [BYTECODE_I8] = 1, [BYTECODE_I16] = 2, [BYTECODE_I32] = 4,
+    [BYTECODE_I64] = 8, [BYTECODE_F32] = 4, [BYTECODE_F64] = 8
+};
+
+/*
+ * checksum is the 32 bits FNV-1a hash of the code_size bytes of code,
+ * count the number of instructions in there.
+ */
+typedef struct bytecode_header_t
+{
+    char magic[4];
+    unsigned short version;
+    unsigned short flags;
+    unsigned int header_size;
+    unsigned int code_size;
+    unsigned int count;
+    unsigned int checksum;
+    unsigned char reserved[8];
+} BytecodeHeader;
+
+_Static_assert(sizeof(BytecodeHeader) == 32, "BytecodeHeader is 32 bytes");
+
+/*
+ * A checked program, pointing into memory it may own: the file mapped by
+ * load_bytecode() (mapping) or the buffer filled by convert_code() (owned).
+ */
+typedef struct bytecode_t
+{
+    const BytecodeHeader *header;
+    const unsigned char *code;
+    size_t code_size;
+
+    void *mapping;
+    size_t mapping_size;
+    void *owned;
+} Bytecode;
+
+/*
+ * Bytecode functions prototypes
+ */
+
+Bytecode *convert_code(double *, size_t);
+Bytecode *open_bytecode(const void *, size_t);
+Bytecode *load_bytecode(const char *);
+int save_bytecode(Bytecode *, const char *);
+void free_bytecode(Bytecode *);
+void run_bytecode(CPU *, Bytecode *);
+int verify_bytecode(const unsigned char *, size_t, size_t);
+size_t bytecode_length(const unsigned char *);
+long bytecode_long(const unsigned char *);
+double bytecode_double(const unsigned char *);
+int bytecode_kind_long(long);
+int bytecode_kind_double(double);
+size_t encode_bytecode(DecodedInstruction *, unsigned char *);
+void put_immediate(unsigned char *, int, long, double);
+unsigned int bytecode_checksum(const unsigned char *, size_t);
+
+#define BYTECODE_DST(ip) ((ip)[1] & 0x0f)
+#define BYTECODE_SRC(ip) ((ip)[1] >> 4)
+#define BYTECODE_KIND(ip) ((ip)[1] >> 4)
+
+unsigned int bytecode_checksum(const unsigned char *bytes, size_t size)
+{
+    unsigned int hash = 2166136261u;
+
+    for(size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Size in bytes of the instruction at ip, 0 if its opcode is unknown.
+ */
+size_t bytecode_length(const unsigned char *ip)
+{
+    switch(ip[0] & 0x1f)
+    {
+        case MOV: case ADD: case SUB: case MUL: case DIV:
+        case CMP: case LD: case STR:
+        case XOR: case SHL: case SHR:
+            return 2;
+
+        case MOVI: case ADDI: case SUBI: case MULI: case DIVI:
+        case XORI: case SHLI: case SHRI:
+            if(BYTECODE_KIND(ip) > BYTECODE_F64)
+                return 0;
+
+            return 2 + bytecode_immediate_size[BYTECODE_KIND(ip)];
+
+        case JMP: case JE: case JNE: case JLT: case JGT:
+            return 6;
+
+        case HLT:
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * The immediate of the instruction at ip, as a long and as a double.
+ */
+long bytecode_long(const unsigned char *ip)
+{
+    switch(BYTECODE_KIND(ip))
+    {
+        case BYTECODE_I8:
+            return (signed char)ip[2];
+
+        case BYTECODE_I16:
+        {
+            short value;
+            memcpy(&value, ip + 2, sizeof(value));
+
+            return value;
+        }
+
+        case BYTECODE_I32:
+        {
+            int value;
+            memcpy(&value, ip + 2, sizeof(value));
+
+            return value;
+        }
+
+        case BYTECODE_I64:
+        {
+            long value;
+            memcpy(&value, ip + 2, sizeof(value));
+
+            return value;
+        }
+    }
+
+    return bytecode_double(ip);
+}
+
+double bytecode_double(const unsigned char *ip)
+{
+    switch(BYTECODE_KIND(ip))
+    {
+        case BYTECODE_F32:
+        {
+            float value;
+            memcpy(&value, ip + 2, sizeof(value));
+
+            return value;
+        }
+
+        case BYTECODE_F64:
+        {
+            double value;
+            memcpy(&value, ip + 2, sizeof(value));
+
+            return value;
+        }
+    }
+
+    return bytecode_long(ip);
+}
+
+/*
+ * Writes an immediate of the given kind, from i for the integer kinds and
+ * from d for the others.
+ */
+void put_immediate(unsigned char *bytes, int kind, long i, double d)
+{
+    signed char i8 = i;
+    short i16 = i;
+    int i32 = i;
+    float f32 = d;
+
+    switch(kind)
+    {
+        case BYTECODE_I8: memcpy(bytes, &i8, sizeof(i8)); break;
+        case BYTECODE_I16: memcpy(bytes, &i16, sizeof(i16)); break;
+        case BYTECODE_I32: memcpy(bytes, &i32, sizeof(i32)); break;
+        case BYTECODE_I64: memcpy(bytes, &i, sizeof(i)); break;
+        case BYTECODE_F32: memcpy(bytes, &f32, sizeof(f32)); break;
+        case BYTECODE_F64: memcpy(bytes, &d, sizeof(d)); break;
+    }
+}
+
+int bytecode_kind_long(long value)
+{
+    if(value >= -128 && value <= 127)
+        return BYTECODE_I8;
+
+    if(value >= -32768 && value <= 32767)
+        return BYTECODE_I16;
+
+    if(value >= -2147483648L && value <= 2147483647L)
+        return BYTECODE_I32;
+
+    return BYTECODE_I64;
+}
+
+/*
+ * Integers up to 32 bits are exact doubles, -0.0 is not an integer and NaN
+ * payloads only survive as a F64.
+ */
+int bytecode_kind_double(double value)
+{
+    if(value >= -2147483648.0 && value <= 2147483647.0 &&
+            value == (int)value && !(value == 0 && signbit(value)))
+        return bytecode_kind_long((int)value);
+
+    if((double)(float)value == value)
+        return BYTECODE_F32;
+
+    return BYTECODE_F64;
+}
+
+/*
+ * Writes the bytecode of a decoded (not specialized) instruction to out,
+ * or only measures it if out is NULL, and returns its size. Jumps get
+ * imm.i as their target.
+ */
+size_t encode_bytecode(DecodedInstruction *instruction, unsigned char *out)
+{
+    unsigned char bytes[10];
+    int op = instruction->opcode;
+    int dst = instruction->dst;
+    int src = instruction->src;
+    size_t size = 2;
+    int kind;
+
+    bytes[0] = op;
+    bytes[1] = 0;
+
+    switch(op)
+    {
+        case MOV: case ADD: case SUB: case MUL: case DIV:
+        case CMP: case LD: case STR:
+        case XOR: case SHL: case SHR:
+            bytes[0] = BYTECODE_OPCODE(op, dst > 7, src > 7);
+            bytes[1] = (dst & 7) | (src & 7) << 4;
+
+            break;
+
+        case MOVI: case ADDI: case SUBI: case MULI: case DIVI:
+        case XORI: case SHLI: case SHRI:
+            // the decoder keeps a long for these, a double for the others
+            if((op == MOVI && dst <= 7) || op == XORI || op == SHLI ||
+                    op == SHRI)
+            {
+                kind = bytecode_kind_long(instruction->imm.i);
+                put_immediate(bytes + 2, kind, instruction->imm.i, 0);
+            } else
+            {
+                kind = bytecode_kind_double(instruction->imm.d);
+                put_immediate(bytes + 2, kind, instruction->imm.d,
+                        instruction->imm.d);
+            }
+
+            bytes[0] = BYTECODE_OPCODE(op, dst > 7, 0);
+            bytes[1] = (dst & 7) | kind << 4;
+            size += bytecode_immediate_size[kind];
+
+            break;
+
+        case JMP: case JE: case JNE: case JLT: case JGT:
+        {
+            int target = instruction->imm.i;
+
+            memcpy(bytes + 2, &target, 4);
+            size = 6;
+
+            break;
+        }
+
+        case HLT:
+            size = 1;
+
+            break;
+    }
+
+    if(out != NULL)
+        memcpy(out, bytes, size);
+
+    return size;
+}
+
+/*
+ * Checks that the size bytes of code are count well formed instructions,
+ * that jumps land on the beginning of one and that the last one is a HLT
+ * or a JMP, so run_bytecode() never has to check where it is. Returns 1 if
+ * the code is fine.
+ */
+int verify_bytecode(const unsigned char *code, size_t size, size_t count)
+{
+    if(size == 0)
+        return 0;
+
+    unsigned char *starts = (unsigned char *)calloc(size, 1);
+    size_t found = 0;
+    size_t last = 0;
+    int valid = 1;
+
+    if(starts == NULL)
+        return 0;
+
+    for(size_t offset = 0; valid && offset < size;)
+    {
+        const unsigned char *ip = code + offset;
+        int op = ip[0] & 0x1f;
+        size_t length = bytecode_length(ip);
+
+        // the bits left are BYTECODE_D_DST and BYTECODE_D_SRC
+        int classes = ip[0] & ~0x1f;
+
+        if(length == 0 || offset + length > size || (ip[0] & 0x20))
+        {
+            valid = 0;
+
+            break;
+        }
+
+        switch(op)
+        {
+            case MOV: case ADD: case SUB: case MUL: case DIV:
+            case CMP: case LD: case STR:
+                valid = (ip[1] & 0x88) == 0;
+
+                break;
+
+            case MOVI: case ADDI: case SUBI: case MULI: case DIVI:
+                valid = !(classes & BYTECODE_D_SRC) && (ip[1] & 0x08) == 0;
+
+                break;
+
+            case XOR: case SHL: case SHR:
+                valid = classes == 0 && (ip[1] & 0x88) == 0;
+
+                break;
+
+            case XORI: case SHLI: case SHRI:
+                valid = classes == 0 && (ip[1] & 0x08) == 0;
+
+                break;
+
+            case JMP: case JE: case JNE: case JLT: case JGT:
+            case HLT:
+                valid = classes == 0 && (op == HLT || ip[1] == 0);
+
+                break;
+        }
+
+        starts[offset] = 1;
+        last = offset;
+        found++;
+        offset += length;
+    }
+
+    valid = valid && found == count &&
+        ((code[last] & 0x1f) == HLT || (code[last] & 0x1f) == JMP);
+
+    for(size_t offset = 0; valid && offset < size;
+            offset += bytecode_length(code + offset))
+    {
+        int op = code[offset] & 0x1f;
+        int target;
+
+        if(op < JMP || op > JGT)
+            continue;
+
+        memcpy(&target, code + offset + 2, 4);
+
+        valid = target >= 0 && (size_t)target < size && starts[target];
+    }
+
+    free(starts);
+
+    return valid;
+}
+
+/*
+ * Makes a Bytecode out of size bytes holding a header and its code,
+ * without copying them: they must stay there until free_bytecode().
+ * Returns NULL with errno set to EINVAL if they are not valid bytecode.
+ */
+Bytecode *open_bytecode(const void *bytes, size_t size)
+{
+    const BytecodeHeader *header = (const BytecodeHeader *)bytes;
+    unsigned short endianness = 1;
+
+    if(size < sizeof(BytecodeHeader) ||
+            memcmp(header->magic, BYTECODE_MAGIC, 4) != 0 ||
+            header->version != BYTECODE_VERSION ||
+            *(unsigned char *)&endianness != 1 ||
+            header->header_size < sizeof(BytecodeHeader) ||
+            header->header_size % 8 != 0 ||
+            header->header_size > size ||
+            header->code_size > size - header->header_size)
+    {
+        errno = EINVAL;
+
+        return NULL;
+    }
+
+    const unsigned char *code = (const unsigned char *)bytes +
+        header->header_size;
+
+    if(bytecode_checksum(code, header->code_size) != header->checksum ||
+            !verify_bytecode(code, header->code_size, header->count))
+    {
+        errno = EINVAL;
+
+        return NULL;
+    }
+
+    Bytecode *bytecode = (Bytecode *)malloc(sizeof(Bytecode));
+
+    if(bytecode == NULL)
+        return NULL;
+
+    bytecode->header = header;
+    bytecode->code = code;
+    bytecode->code_size = header->code_size;
+    bytecode->mapping = NULL;
+    bytecode->mapping_size = 0;
+    bytecode->owned = NULL;
+
+    return bytecode;
+}
+
+/*
+ * Converts code_size bytes of double code[] to bytecode. The instructions
+ * must be all decodable and jumps must land on the beginning of one, as
+ * there is no interpret_code() to fall back to. Returns NULL if the code
+ * can not be converted.
+ */
+Bytecode *convert_code(double *code, size_t code_size)
+{
+    size_t length = code_size / sizeof(double);
+    size_t size = 0;
+    size_t count = 0;
+    int last = -1;
+
+    if(length == 0 || length >= 0x7fffffff)
+        return NULL;
+
+    long *offsets = (long *)malloc(sizeof(long) * length);
+
+    if(offsets == NULL)
+        return NULL;
+
+    for(size_t slot = 0; slot < length; ++slot)
+        offsets[slot] = -1;
+
+    // first pass: check every instruction and find where it goes
+    for(size_t slot = 0; slot < length;)
+    {
+        DecodedInstruction instruction;
+        int opcode = code[slot];
+
+        // version 1 has no wide or vector instructions
+        if(!(opcode >= MOV && opcode <= HLT) ||
+                slot + instruction_slots[opcode] > length)
+        {
+            free(offsets);
+
+            return NULL;
+        }
+
+        memset(&instruction, 0, sizeof(instruction));
+        instruction.opcode = opcode;
+
+        if(!(opcode >= JMP && opcode <= JGT) &&
+                !decode_instruction(code, slot, &instruction))
+        {
+            free(offsets);
+
+            return NULL;
+        }
+
+        offsets[slot] = size;
+        size += encode_bytecode(&instruction, NULL);
+        count++;
+        last = opcode;
+        slot += instruction_slots[opcode];
+    }
+
+    size_t padded = (size + 7) & ~(size_t)7;
+    unsigned char *bytes = (unsigned char *)calloc(
+            sizeof(BytecodeHeader) + padded, 1);
+
+    if(bytes == NULL || size > 0x7fffffff || (last != HLT && last != JMP))
+    {
+        free(offsets);
+        free(bytes);
+
+        return NULL;
+    }
+
+    unsigned char *out = bytes + sizeof(BytecodeHeader);
+
+    // second pass: encode, with jump targets turned into offsets
+    for(size_t slot = 0; slot < length;)
+    {
+        DecodedInstruction instruction;
+        int opcode = code[slot];
+
+        memset(&instruction, 0, sizeof(instruction));
+        instruction.opcode = opcode;
+
+        if(opcode >= JMP && opcode <= JGT)
+        {
+            // jumps set PC to the slot *before* the next instruction
+            double target = code[slot + 1] + 1;
+
+            if(!(target >= 0 && target < length) || target != (long)target ||
+                    offsets[(long)target] == -1)
+            {
+                free(offsets);
+                free(bytes);
+
+                return NULL;
+            }
+
+            instruction.imm.i = offsets[(long)target];
+        } else
+        {
+            decode_instruction(code, slot, &instruction);
+        }
+
+        out += encode_bytecode(&instruction, out);
+        slot += instruction_slots[opcode];
+    }
+
+    free(offsets);
+
+    BytecodeHeader *header = (BytecodeHeader *)bytes;
+
+    memcpy(header->magic, BYTECODE_MAGIC, 4);
+    header->version = BYTECODE_VERSION;
+    header->flags = 0;
+    header->header_size = sizeof(BytecodeHeader);
+    header->code_size = size;
+    header->count = count;
+    header->checksum = bytecode_checksum(bytes + sizeof(BytecodeHeader), size);
+
+    Bytecode *bytecode = open_bytecode(bytes, sizeof(BytecodeHeader) + padded);
+
+    if(bytecode == NULL)
+    {
+        free(bytes);
+
+        return NULL;
+    }
+
+    bytecode->owned = bytes;
+
+    return bytecode;
+}
+
+/*
+ * Maps the bytecode file at path and checks it, its code is then run
+ * straight from the mapping. Returns NULL with errno set on errors (EINVAL
+ * if the file is not valid bytecode).
+ */
+Bytecode *load_bytecode(const char *path)
+{
+    struct stat info;
+    int fd = open(path, O_RDONLY);
+
+    if(fd < 0)
+        return NULL;
+
+    if(fstat(fd, &info) != 0)
+    {
+        close(fd);
+
+        return NULL;
+    }
+
+    if(info.st_size < (off_t)sizeof(BytecodeHeader))
+    {
+        close(fd);
+        errno = EINVAL;
+
+        return NULL;
+    }
+
+    void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if(mapping == MAP_FAILED)
+        return NULL;
+
+    Bytecode *bytecode = open_bytecode(mapping, info.st_size);
+
+    if(bytecode == NULL)
+    {
+        int error = errno;
+
+        munmap(mapping, info.st_size);
+        errno = error;
+
+        return NULL;
+    }
+
+    bytecode->mapping = mapping;
+    bytecode->mapping_size = info.st_size;
+
+    return bytecode;
+}
+
+/*
+ * Writes bytecode to the file at path, returns 0 or -1 with errno set.
+ */
+int save_bytecode(Bytecode *bytecode, const char *path)
+{
+    size_t size = bytecode->header->header_size +
+        ((bytecode->code_size + 7) & ~(size_t)7);
+    FILE *file = fopen(path, "wb");
+
+    if(file == NULL)
+        return -1;
+
+    size_t written = fwrite(bytecode->header, 1, bytecode->header->header_size,
+            file);
+
+    written += fwrite(bytecode->code, 1, bytecode->code_size, file);
+
+    // the code of a mapped file may not be followed by its padding
+    for(; written < size; ++written)
+    {
+        if(fputc(0, file) == EOF)
+            break;
+    }
+
+    if(fclose(file) != 0 || written != size)
+        return -1;
+
+    return 0;
+}
+
+void free_bytecode(Bytecode *bytecode)
+{
+    if(bytecode == NULL)
+        return;
+
+    if(bytecode->mapping != NULL)
+        munmap(bytecode->mapping, bytecode->mapping_size);
+
+    free(bytecode->owned);
+    free(bytecode);
+}
+
+/*
+ * The bytecode counterparts of DECODED_OPERATION and friends in cpu.h,
+ * one case for each combination of R<n>/D<n> operands.
+ *
+ * Small integers being the most common immediates, BYTECODE_LONG() and
+ * BYTECODE_DOUBLE() read a BYTECODE_I8 without calling anything.
+ */
+#define BYTECODE_LONG(ip)\
+    (BYTECODE_KIND(ip) == BYTECODE_I8 ? (signed char)(ip)[2] :\
+     bytecode_long(ip))
+
+#define BYTECODE_DOUBLE(ip)\
+    (BYTECODE_KIND(ip) == BYTECODE_I8 ? (double)(signed char)(ip)[2] :\
+     bytecode_double(ip))
+
+#define BYTECODE_NEXTI(ip)\
+    ip += 2 + bytecode_immediate_size[BYTECODE_KIND(ip)]
+
+#define BYTECODE_OPERATION(name, operator)\
+    case BYTECODE_OPCODE(name, 0, 0):\
+        r[BYTECODE_DST(ip)] operator##= r[BYTECODE_SRC(ip)];\
+        DECODED_FLAGS_R(BYTECODE_DST(ip))\
+        ip += 2;\
+        break;\
+    case BYTECODE_OPCODE(name, 0, 1):\
+        r[BYTECODE_DST(ip)] operator##= d[BYTECODE_SRC(ip)];\
+        DECODED_FLAGS_R(BYTECODE_DST(ip))\
+        ip += 2;\
+        break;\
+    case BYTECODE_OPCODE(name, 1, 0):\
+        d[BYTECODE_DST(ip)] operator##= r[BYTECODE_SRC(ip)];\
+        DECODED_FLAGS_D(BYTECODE_DST(ip))\
+        ip += 2;\
+        break;\
+    case BYTECODE_OPCODE(name, 1, 1):\
+        d[BYTECODE_DST(ip)] operator##= d[BYTECODE_SRC(ip)];\
+        DECODED_FLAGS_D(BYTECODE_DST(ip))\
+        ip += 2;\
+        break;\
+
+#define BYTECODE_OPERATIONI(name, operator)\
+    case BYTECODE_OPCODE(name, 0, 0):\
+        r[BYTECODE_DST(ip)] operator##= BYTECODE_DOUBLE(ip);\
+        DECODED_FLAGS_R(BYTECODE_DST(ip))\
+        BYTECODE_NEXTI(ip);\
+        break;\
+    case BYTECODE_OPCODE(name, 1, 0):\
+        d[BYTECODE_DST(ip)] operator##= BYTECODE_DOUBLE(ip);\
+        DECODED_FLAGS_D(BYTECODE_DST(ip))\
+        BYTECODE_NEXTI(ip);\
+        break;\
+
+#define BYTECODE_JUMP(name, condition)\
+    case name:\
+        if(condition)\
+        {\
+            int target;\
+            memcpy(&target, ip + 2, 4);\
+            ip = code + target;\
+        } else\
+        {\
+            ip += 6;\
+        }\
+        break;\
+
+/*
+ * Runs bytecode on cpu (its registers and cpu->memory->rwmem, code[] is
+ * not used) from the first instruction until HLT. cpu->PC is then the
+ * offset of the HLT in the code.
+ */
+void run_bytecode(CPU *cpu, Bytecode *bytecode)
+{
+    const unsigned char *code = bytecode->code;
+    const unsigned char *ip = code;
+    unsigned char *rwmem = cpu->memory->rwmem;
+    long r[8];
+    double d[8];
+    Flags flags;
+
+    memcpy(r, cpu->registers, sizeof(r));
+    memcpy(d, cpu->dregisters, sizeof(d));
+    flags = cpu->flags;
+
+    for(;;)
+    {
+        switch(ip[0])
+        {
+            BYTECODE_OPERATION(MOV, )
+            BYTECODE_OPERATION(ADD, +)
+            BYTECODE_OPERATION(SUB, -)
+            BYTECODE_OPERATION(MUL, *)
+            BYTECODE_OPERATION(DIV, /)
+
+            BYTECODE_OPERATIONI(ADDI, +)
+            BYTECODE_OPERATIONI(SUBI, -)
+            BYTECODE_OPERATIONI(MULI, *)
+            BYTECODE_OPERATIONI(DIVI, /)
+
+            case BYTECODE_OPCODE(MOVI, 0, 0):
+                r[BYTECODE_DST(ip)] = BYTECODE_LONG(ip);
+                DECODED_FLAGS_R(BYTECODE_DST(ip))
+                BYTECODE_NEXTI(ip);
+
+                break;
+
+            case BYTECODE_OPCODE(MOVI, 1, 0):
+                d[BYTECODE_DST(ip)] = BYTECODE_DOUBLE(ip);
+                DECODED_FLAGS_D(BYTECODE_DST(ip))
+                BYTECODE_NEXTI(ip);
+
+                break;
+
+            case BYTECODE_OPCODE(CMP, 0, 0):
+                DECODED_COMPARE(r[BYTECODE_DST(ip)], r[BYTECODE_SRC(ip)])
+                ip += 2;
+
+                break;
+
+            case BYTECODE_OPCODE(CMP, 0, 1):
+                DECODED_COMPARE(r[BYTECODE_DST(ip)], d[BYTECODE_SRC(ip)])
+                ip += 2;
+
+                break;
+
+            case BYTECODE_OPCODE(CMP, 1, 0):
+                DECODED_COMPARE(d[BYTECODE_DST(ip)], r[BYTECODE_SRC(ip)])
+                ip += 2;
+
+                break;
+
+            case BYTECODE_OPCODE(CMP, 1, 1):
+                DECODED_COMPARE(d[BYTECODE_DST(ip)], d[BYTECODE_SRC(ip)])
+                ip += 2;
+
+                break;
+
+            BYTECODE_JUMP(JMP, 1)
+            BYTECODE_JUMP(JE, flags.zero == 1)
+            BYTECODE_JUMP(JNE, flags.zero == 0)
+            BYTECODE_JUMP(JLT, flags.zero == 0 && flags.overflow == 0)
+            BYTECODE_JUMP(JGT, flags.zero == 0 && flags.overflow == 1)
+
+            case BYTECODE_OPCODE(LD, 0, 0):
+                r[BYTECODE_DST(ip)] = rwmem[r[BYTECODE_SRC(ip)]];
+                DECODED_FLAGS_R(BYTECODE_DST(ip))
+                ip += 2;
+
+                break;
+
+            case BYTECODE_OPCODE(LD, 0, 1):
+                r[BYTECODE_DST(ip)] = rwmem[(int)d[BYTECODE_SRC(ip)]];
+                DECODED_FLAGS_R(BYTECODE_DST(ip))
+                ip += 2;
+
+                break;
+
+            case BYTECODE_OPCODE(LD, 1, 0):
+                d[BYTECODE_DST(ip)] = rwmem[r[BYTECODE_SRC(ip)]];
+                DECODED_FLAGS_D(BYTECODE_DST(ip))
+                ip += 2;
+
+                break;
+
+            case BYTECODE_OPCODE(LD, 1, 1):
+                d[BYTECODE_DST(ip)] = rwmem[(int)d[BYTECODE_SRC(ip)]];
+                DECODED_FLAGS_D(BYTECODE_DST(ip))
+                ip += 2;
+
+                break;
+
+            case BYTECODE_OPCODE(STR, 0, 0):
+                rwmem[r[BYTECODE_DST(ip)]] = r[BYTECODE_SRC(ip)];
+                DECODED_FLAGS_R(BYTECODE_DST(ip))
+                ip += 2;
+
+                break;
+
+            case BYTECODE_OPCODE(STR, 0, 1):
+                rwmem[(int)r[BYTECODE_DST(ip)]] = d[BYTECODE_SRC(ip)];
+                DECODED_FLAGS_R(BYTECODE_DST(ip))
+                ip += 2;
+
+                break;
+
+            case BYTECODE_OPCODE(STR, 1, 0):
+                rwmem[(int)d[BYTECODE_DST(ip)]] = r[BYTECODE_SRC(ip)];
+                DECODED_FLAGS_D(BYTECODE_DST(ip))
+                ip += 2;
+
+                break;
+
+            case BYTECODE_OPCODE(STR, 1, 1):
+                rwmem[(int)d[BYTECODE_DST(ip)]] = d[BYTECODE_SRC(ip)];
+                DECODED_FLAGS_D(BYTECODE_DST(ip))
+                ip += 2;
+
+                break;
+
+            case XOR:
+                r[BYTECODE_DST(ip)] ^= r[BYTECODE_SRC(ip)];
+                ip += 2;
+
+                break;
+
+            case XORI:
+                r[BYTECODE_DST(ip)] ^= BYTECODE_LONG(ip);
+                BYTECODE_NEXTI(ip);
+
+                break;
+
+            case SHL:
+                r[BYTECODE_DST(ip)] <<= r[BYTECODE_SRC(ip)];
+                ip += 2;
+
+                break;
+
+            case SHLI:
+                r[BYTECODE_DST(ip)] <<= BYTECODE_LONG(ip);
+                BYTECODE_NEXTI(ip);
+
+                break;
+
+            case SHR:
+                r[BYTECODE_DST(ip)] >>= r[BYTECODE_SRC(ip)];
+                ip += 2;
+
+                break;
+
+            case SHRI:
+                r[BYTECODE_DST(ip)] >>= BYTECODE_LONG(ip);
+                BYTECODE_NEXTI(ip);
+
+                break;
+
+            case HLT:
+                memcpy(cpu->registers, r, sizeof(r));
+                memcpy(cpu->dregisters, d, sizeof(d));
+                cpu->flags = flags;
+
+                cpu->PC = ip - code;
+                cpu->instruction.bytecode = HLT;
+
+                return;
+        }
+    }
+}
+
+#undef BYTECODE_OPERATION
+#undef BYTECODE_OPERATIONI
+#undef BYTECODE_JUMP
+#undef BYTECODE_LONG
+#undef BYTECODE_DOUBLE
+#undef BYTECODE_NEXTI
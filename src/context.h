@@ -0,0 +1,197 @@
+#pragma once
+
+/**
+ * XORVM CPU context pools.
+ * Author: 0xb4db01
+ *
+ * A ContextPool keeps CPUs in one block of memory, each on cache lines of
+ * its own, to be taken and given back over and over without malloc() and
+ * free(): running millions of tiny programs, those cost more than the
+ * programs themselves.
+ *
+ *     CPU *cpu = acquire_cpu(thread_context_pool(), &memory, program);
+ *
+ *     run_cpu(cpu);
+ *     release_cpu(thread_context_pool(), cpu);
+ *
+ * A pool is not locked, so it belongs to a single thread, and
+ * thread_context_pool() gives every thread one of its own, made the first
+ * time it is asked for and freed when the thread exits. A CPU must go back
+ * to the pool it came from. When a pool has no free CPU left acquire_cpu()
+ * falls back to new_cpu(), and release_cpu() knows those from its own.
+ *
+ * Decoding is the other cost of a new CPU: pass acquire_cpu() a program
+ * decoded once with decode_program() (it is only read) to skip it.
+ */
+
+#include <pthread.h>
+
+#include "cpu.h"
+
+#define CONTEXT_CACHE_LINE 64
+
+// CPUs of the pool of a thread, see thread_context_pool()
+#define CONTEXT_POOL_SIZE 64
+
+typedef struct context_t
+{
+    _Alignas(CONTEXT_CACHE_LINE) CPU cpu;
+} Context;
+
+/*
+ * free holds the indexes in contexts of the available CPUs, the last one
+ * being the next one taken (and the one given back last, so still in
+ * cache).
+ */
+typedef struct context_pool_t
+{
+    Context *contexts;
+    size_t *free;
+    size_t size;
+    size_t available;
+} ContextPool;
+
+/*
+ * Context functions prototypes
+ */
+
+ContextPool *new_context_pool(size_t);
+void free_context_pool(ContextPool *);
+CPU *acquire_cpu(ContextPool *, Memory *, DecodedProgram *);
+void release_cpu(ContextPool *, CPU *);
+void free_thread_context_pool(void *);
+void make_context_key();
+ContextPool *thread_context_pool();
+
+pthread_key_t context_key;
+pthread_once_t context_once = PTHREAD_ONCE_INIT;
+
+/*
+ * A pool of size CPUs, NULL if there is not enough memory.
+ */
+ContextPool *new_context_pool(size_t size)
+{
+    ContextPool *pool = (ContextPool *)malloc(sizeof(ContextPool));
+
+    if(pool == NULL)
+        return NULL;
+
+    pool->contexts = (Context *)aligned_alloc(CONTEXT_CACHE_LINE,
+            sizeof(Context) * (size > 0 ? size : 1));
+    pool->free = (size_t *)malloc(sizeof(size_t) * (size > 0 ? size : 1));
+
+    if(pool->contexts == NULL || pool->free == NULL)
+    {
+        free(pool->contexts);
+        free(pool->free);
+        free(pool);
+
+        return NULL;
+    }
+
+    pool->size = size;
+    pool->available = size;
+
+    // the first CPU taken is the first one in memory
+    for(size_t i = 0; i < size; ++i)
+        pool->free[i] = size - 1 - i;
+
+    return pool;
+}
+
+/*
+ * Frees pool, with the CPUs that were not given back.
+ */
+void free_context_pool(ContextPool *pool)
+{
+    if(pool == NULL)
+        return;
+
+    // the free CPUs own nothing (some were never even made), then all
+    // those still out get deinit_cpu()ed
+    for(size_t i = 0; i < pool->available; ++i)
+        pool->contexts[pool->free[i]].cpu.owns_program = 0;
+
+    for(size_t i = 0; i < pool->size; ++i)
+        deinit_cpu(&pool->contexts[i].cpu);
+
+    free(pool->contexts);
+    free(pool->free);
+    free(pool);
+}
+
+/*
+ * Takes a CPU of pool ready to run memory, as init_cpu() makes it, with
+ * program attached if it is not NULL. Returns NULL if the pool is empty
+ * and new_cpu() fails too.
+ */
+CPU *acquire_cpu(ContextPool *pool, Memory *memory, DecodedProgram *program)
+{
+    CPU *cpu;
+
+    if(pool != NULL && pool->available > 0)
+    {
+        cpu = &pool->contexts[pool->free[--pool->available]].cpu;
+
+        init_cpu(cpu, memory);
+    } else
+    {
+        cpu = new_cpu(memory);
+    }
+
+    if(cpu != NULL && program != NULL)
+        attach_program(cpu, program);
+
+    return cpu;
+}
+
+/*
+ * Gives cpu back to the pool it was taken from, freeing the program
+ * run_cpu() decoded for it if any.
+ */
+void release_cpu(ContextPool *pool, CPU *cpu)
+{
+    if(pool == NULL || (Context *)cpu < pool->contexts ||
+            (Context *)cpu >= pool->contexts + pool->size)
+    {
+        free_cpu(cpu);
+
+        return;
+    }
+
+    deinit_cpu(cpu);
+
+    pool->free[pool->available++] = (Context *)cpu - pool->contexts;
+}
+
+void free_thread_context_pool(void *pool)
+{
+    free_context_pool((ContextPool *)pool);
+}
+
+void make_context_key()
+{
+    pthread_key_create(&context_key, free_thread_context_pool);
+}
+
+/*
+ * The pool of the calling thread, with CONTEXT_POOL_SIZE CPUs. Returns
+ * NULL if it can not be made, which acquire_cpu() and release_cpu() take
+ * as a pool always empty.
+ */
+ContextPool *thread_context_pool()
+{
+    pthread_once(&context_once, make_context_key);
+
+    ContextPool *pool = (ContextPool *)pthread_getspecific(context_key);
+
+    if(pool != NULL)
+        return pool;
+
+    pool = new_context_pool(CONTEXT_POOL_SIZE);
+
+    if(pool != NULL)
+        pthread_setspecific(context_key, pool);
+
+    return pool;
+}
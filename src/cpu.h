@@ -5,7 +5,9 @@
  * Author: 0xb4db01
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "instructions.h"
 
@@ -20,14 +22,33 @@ typedef struct memory_t
 /*
  * R<n>: common registers (long)
  * D<n>: bigint/float registers (double)
+ * V<n>: vector registers (VectorRegister), only for the V* instructions
  */
 enum Registers
 {
     R0, R1, R2, R3, R4, R5, R6, R7,
     D0, D1, D2, D3, D4, D5, D6, D7,
+    V0, V1, V2, V3, V4, V5, V6, V7,
     TOTAL_REGISTERS
 };
 
+/*
+ * A vector register holds VECTOR_SIZE bytes of rwmem, which VADD, VSHL and
+ * VSHR see as 64-bit lanes (the byte at the lowest address being the least
+ * significant one of the first lane, like for LD64).
+ */
+#define VECTOR_SIZE 32
+#define VECTOR_LANES (VECTOR_SIZE / 8)
+
+typedef struct vector_register_t
+{
+    unsigned long lanes[VECTOR_LANES];
+} VectorRegister;
+
+#ifdef __GNUC__
+typedef unsigned long VectorLanes __attribute__((vector_size(VECTOR_SIZE)));
+#endif
+
 /*
  * Instructions are defined in instructions.h...
  */
@@ -43,6 +64,215 @@ typedef struct flags_t
     short overflow;
 } Flags;
 
+/*
+ * Decoded instructions.
+ *
+ * decode_program() walks memory->code once and turns every instruction into
+ * a DecodedInstruction, so the interpreter never has to convert doubles to
+ * ints while running. Register operands are stored as their index in
+ * cpu->registers, cpu->dregisters or cpu->vregisters (the opcode tells
+ * which, see below), immediates are stored already converted to what the
+ * instruction needs (long for XORI/SHLI/SHRI, VSHL/VSHR and MOVI on R<n>,
+ * double for the others) and jump targets are stored as an index in the
+ * decoded array.
+ *
+ * slot is the position of the opcode in memory->code, needed to give
+ * cpu->PC back its usual meaning when the program stops, and src2 is only
+ * used by superinstructions needing a third register (see fuse_program()).
+ */
+typedef struct decoded_instruction_t
+{
+    unsigned char opcode;
+    unsigned char dst;
+    unsigned char src;
+    unsigned char src2;
+
+    int slot;
+
+    union
+    {
+        long i;
+        double d;
+    } imm;
+} DecodedInstruction;
+
+/*
+ * Anything the decoder can not prove to behave exactly like the code[]
+ * interpreter (unknown registers, jumps in the middle of an instruction,
+ * XOR on D<n> registers...) is decoded as DECODED_FALLBACK, which hands the
+ * CPU back to interpret_code() starting at that slot.
+ */
+#define DECODED_FALLBACK 0xff
+
+/*
+ * Opcodes of decoded instructions whose behaviour depends on the class of
+ * their operands: decode_program() picks the right one once, so handlers
+ * never have to check whether an operand is a R<n> or a D<n> register.
+ * Instructions that only work on R<n> registers keep their own opcode.
+ */
+enum DecodedOpcodes
+{
+    MOV_RR = TOTAL_INSTRUCTIONS, MOV_RD, MOV_DR, MOV_DD,
+    MOVI_R, MOVI_D,
+    ADD_RR, ADD_RD, ADD_DR, ADD_DD,
+    ADDI_R, ADDI_D,
+    SUB_RR, SUB_RD, SUB_DR, SUB_DD,
+    SUBI_R, SUBI_D,
+    MUL_RR, MUL_RD, MUL_DR, MUL_DD,
+    MULI_R, MULI_D,
+    DIV_RR, DIV_RD, DIV_DR, DIV_DD,
+    DIVI_R, DIVI_D,
+    CMP_RR, CMP_RD, CMP_DR, CMP_DD,
+    LD_RR, LD_RD, LD_DR, LD_DD,
+    STR_RR, STR_RD, STR_DR, STR_DD,
+
+    // superinstructions, see fuse_program()
+    CMP_JE_RR, CMP_JNE_RR, CMP_JLT_RR, CMP_JGT_RR,
+    LD_XOR_STR_INC,
+    MAP_LOOP
+};
+
+/*
+ * Sequences fuse_program() can turn into a single superinstruction:
+ *
+ * FUSE_CMP_JUMP      : CMP Rx, Ry followed by JE/JNE/JLT/JGT
+ * FUSE_LD_XOR_STR_INC: LD Ra, Ri; XOR Ra, Rk; STR Ri, Ra; ADDI Ri, imm
+ * FUSE_MAP_LOOP      : a whole loop mapping bytes of rwmem, see idiom.h
+ */
+enum Fusions
+{
+    FUSE_NONE = 0,
+    FUSE_CMP_JUMP = 1,
+    FUSE_LD_XOR_STR_INC = 2,
+    FUSE_MAP_LOOP = 4,
+    FUSE_ALL = FUSE_CMP_JUMP | FUSE_LD_XOR_STR_INC | FUSE_MAP_LOOP
+};
+
+// choose_fusions() enables a pattern saving at least this share of the
+// dispatches of a profiled run
+#define FUSION_THRESHOLD 0.01
+
+/*
+ * length is the number of instructions decoded from memory->code, entries
+ * also counts the DECODED_FALLBACK instructions appended after them.
+ *
+ * threaded holds the handler address of every entry for run_threaded() and
+ * jit the native code compiled by run_jit() (a JitProgram, see jit.h).
+ * fusions is the set of enum Fusions currently applied to instructions.
+ * verified is what verify_program() proved for a rwmem of verified_size
+ * bytes (see verify.h), -1 until it runs.
+ *
+ * A frozen program (the one of a Program, see program.h) is never changed
+ * again: run_jit() does not compile it and verify_program() does not keep
+ * what it found, so any number of threads can run it at once.
+ */
+typedef struct decoded_program_t
+{
+    size_t length;
+    size_t entries;
+    DecodedInstruction *instructions;
+    void **threaded;
+    struct jit_program_t *jit;
+    int fusions;
+    int verified;
+    size_t verified_size;
+    int frozen;
+} DecodedProgram;
+
+/*
+ * Engines able to run a DecodedProgram, see set_engine().
+ *
+ * ENGINE_SWITCH  : a loop around a switch on the opcode
+ * ENGINE_THREADED: direct threaded code, each handler jumps to the next one
+ * ENGINE_JIT     : native x86-64 code, ENGINE_THREADED on other hosts
+ * ENGINE_TIERED  : interpreted until a loop gets hot, then compiled, see
+ *                  tier.h
+ */
+enum Engines
+{
+    ENGINE_SWITCH,
+    ENGINE_THREADED,
+    ENGINE_JIT,
+    ENGINE_TIERED
+};
+
+/*
+ * Classes of instructions stats->cycles is split in, see stats_class().
+ */
+enum InstructionClasses
+{
+    CLASS_MOVE,
+    CLASS_ARITHMETIC,
+    CLASS_COMPARE,
+    CLASS_JUMP,
+    CLASS_MEMORY,
+    CLASS_BITWISE,
+    CLASS_VECTOR,
+    CLASS_BLOCK,
+    CLASS_FUSED,
+    CLASS_OTHER,
+    TOTAL_CLASSES
+};
+
+/*
+ * What a CPU ran, kept in cpu->stats when XORVM is compiled with
+ * XORVM_STATS (see stats.h and get_stats()).
+ *
+ * instructions counts the VM instructions run for every opcode, retired is
+ * their total and dispatches the number of handlers run for them (a
+ * superinstruction runs several instructions in one dispatch). taken and
+ * not_taken count the jumps of JMP to JGT (index opcode - JMP), loaded and
+ * stored the bytes of rwmem read and written. cycles is the time stamp
+ * counter spent in every enum InstructionClasses, only counted with
+ * XORVM_STATS_CYCLES.
+ */
+typedef struct stats_t
+{
+    unsigned long instructions[TOTAL_INSTRUCTIONS];
+    unsigned long retired;
+    unsigned long dispatches;
+    unsigned long taken[JGT - JMP + 1];
+    unsigned long not_taken[JGT - JMP + 1];
+    unsigned long loaded;
+    unsigned long stored;
+    unsigned long long cycles[TOTAL_CLASSES];
+
+    // where the cycles since last_tsc go
+    unsigned long long last_tsc;
+    int last_class;
+} Stats;
+
+#if defined(XORVM_STATS_CYCLES) && !defined(XORVM_STATS)
+#define XORVM_STATS
+#endif
+
+/*
+ * Hooks of the engines, compiled to nothing without XORVM_STATS. They are
+ * used without a trailing semicolon.
+ */
+#ifdef XORVM_STATS
+
+#define STATS_DISPATCH(cpu, opcode) stats_dispatch(&(cpu)->stats, opcode);
+#define STATS_JUMP(cpu, opcode, condition)\
+    stats_jump(&(cpu)->stats, opcode, condition);
+#define STATS_BLOCK(cpu, opcode, length, key_length)\
+    stats_block(&(cpu)->stats, opcode, length, key_length);
+#define STATS_MAP_LOOP(cpu, ip, rounds)\
+    stats_map_loop(&(cpu)->stats, ip, rounds);
+#define STATS_START(cpu) stats_start(&(cpu)->stats);
+#define STATS_STOP(cpu) stats_stop(&(cpu)->stats);
+
+#else
+
+#define STATS_DISPATCH(cpu, opcode)
+#define STATS_JUMP(cpu, opcode, condition)
+#define STATS_BLOCK(cpu, opcode, length, key_length)
+// rounds is worked out by the engine anyway, only the hook is dropped
+#define STATS_MAP_LOOP(cpu, ip, rounds) (void)(rounds);
+#define STATS_START(cpu)
+#define STATS_STOP(cpu)
+
+#endif
 
 typedef struct cpu_t
 {
@@ -52,10 +282,28 @@ typedef struct cpu_t
     
     long registers[8];
     double dregisters[8];
+    VectorRegister vregisters[8];
 
     Instruction instruction;
 
     Flags flags;
+
+    DecodedProgram *program;
+    int owns_program;
+
+    int engine;
+    int fusions;
+
+    // run_cpu_for() found the program verified when this run started
+    int verified;
+
+    // the channels of IN and OUT, and what the CPU waits for (see io.h)
+    struct io_t *io;
+    int io_wait;
+
+#ifdef XORVM_STATS
+    Stats stats;
+#endif
 } CPU;
 
 /*
@@ -64,11 +312,96 @@ typedef struct cpu_t
 
 CPU *new_cpu(Memory *);
 void free_cpu(CPU *);
+void init_cpu(CPU *, Memory *);
+void reset_cpu(CPU *, Memory *);
+void deinit_cpu(CPU *);
 void fetch_instruction(CPU *);
 void set_flags(CPU *, int);
 void execute_instruction(CPU *);
+void interpret_code(CPU *);
 void run_cpu(CPU *);
 
+/*
+ * Decoder functions prototypes
+ */
+
+int decode_register(double, unsigned char *);
+int decode_vector_register(double, unsigned char *);
+int decode_instruction(double *, size_t, DecodedInstruction *);
+void specialize_instruction(DecodedInstruction *);
+DecodedProgram *decode_program(Memory *);
+void free_decoded_program(DecodedProgram *);
+void attach_program(CPU *, DecodedProgram *);
+long find_decoded_instruction(DecodedProgram *, long);
+long decoded_entry(CPU *);
+void run_decoded(CPU *);
+#ifdef __GNUC__
+void threaded_engine(CPU *, DecodedProgram *);
+#endif
+void thread_program(DecodedProgram *);
+void run_threaded(CPU *);
+void set_engine(CPU *, int);
+void run_profiled(CPU *, unsigned long *);
+
+/*
+ * Superinstruction functions prototypes
+ */
+
+int unfused_opcode(int);
+size_t match_fusion(DecodedProgram *, size_t, int, DecodedInstruction *);
+void fuse_program(DecodedProgram *, int);
+int choose_fusions(DecodedProgram *, unsigned long *);
+void set_fusions(CPU *, int);
+
+/*
+ * JIT functions prototypes, see jit.h
+ */
+
+void free_jit_program(struct jit_program_t *);
+void run_jit(CPU *);
+
+/*
+ * Tier functions prototypes, see tier.h
+ */
+
+void run_tiered(CPU *);
+
+/*
+ * Idiom functions prototypes, see idiom.h
+ */
+
+int match_map_loop(DecodedProgram *, size_t);
+size_t map_loop(DecodedInstruction *, long *, unsigned char *, size_t);
+
+/*
+ * Block functions prototypes, see block.h
+ */
+
+void block_operation(unsigned char *, int, long, long, long, long);
+
+/*
+ * I/O functions prototypes, see io.h
+ */
+
+int io_operation(CPU *, int, long *, long *);
+
+/*
+ * Stats functions prototypes, see stats.h
+ */
+
+int stats_instruction(int);
+int stats_opcode(int);
+int stats_class(int);
+void stats_dispatch(Stats *, int);
+void stats_jump(Stats *, int, int);
+void stats_block(Stats *, int, long, long);
+void stats_map_loop(Stats *, DecodedInstruction *, size_t);
+void stats_start(Stats *);
+void stats_stop(Stats *);
+Stats *get_stats(CPU *);
+void reset_stats(CPU *);
+void print_stats(Stats *);
+
 /*
  * Instruction functions prototypes
  */
@@ -97,6 +430,24 @@ void shl(CPU *);
 void shli(CPU *);
 void shr(CPU *);
 void shri(CPU *);
+void wide_load(CPU *);
+void wide_store(CPU *);
+void vector_load(CPU *);
+void vector_store(CPU *);
+void vector(CPU *);
+void block(CPU *);
+void io(CPU *);
+
+/*
+ * Wide and vector memory functions prototypes
+ */
+
+int wide_size(int);
+unsigned long load_wide(unsigned char *, int);
+void store_wide(unsigned char *, unsigned long, int);
+void load_vector(VectorRegister *, unsigned char *);
+void store_vector(unsigned char *, VectorRegister *);
+void vector_operation(VectorRegister *, VectorRegister *, long, int);
 
 /*
  * CPU utility functions prototypes
@@ -108,20 +459,83 @@ void print_cpu_flags(CPU *);
  * CPU Functions implementation
  */
 
+/*
+ * A CPU on the heap, see init_cpu(). Returns NULL if there is not enough
+ * memory.
+ */
 CPU *new_cpu(Memory *memory)
 {
     CPU *cpu = (CPU *)malloc(sizeof(CPU));
-    
-    cpu->memory = memory;
 
-    cpu->PC = -1;
+    if(cpu == NULL)
+        return NULL;
 
-    cpu->instruction.bytecode = 0;
+    init_cpu(cpu, memory);
 
     return cpu;
 }
 
 void free_cpu(CPU *cpu)
+{
+    deinit_cpu(cpu);
+
+    free(cpu);
+}
+
+/*
+ * Makes a CPU of the storage at cpu (on the stack, in an array, in a
+ * ContextPool...) without allocating anything: registers, flags and stats
+ * zeroed, no program, the default engine and superinstructions. A CPU made
+ * this way is given back with deinit_cpu() instead of free_cpu().
+ */
+void init_cpu(CPU *cpu, Memory *memory)
+{
+    reset_cpu(cpu, memory);
+
+    cpu->program = NULL;
+    cpu->owns_program = 0;
+    cpu->io = NULL;
+
+#ifdef __GNUC__
+    cpu->engine = ENGINE_THREADED;
+#else
+    cpu->engine = ENGINE_SWITCH;
+#endif
+
+    cpu->fusions = FUSE_ALL;
+
+#ifdef XORVM_STATS
+    memset(&cpu->stats, 0, sizeof(cpu->stats));
+#endif
+}
+
+/*
+ * Gets cpu ready to run again over memory, which must have the same code
+ * as before: registers and flags are zeroed and PC goes back to the start,
+ * while the program (decoded by the last run_cpu() or attached), the
+ * engine, the superinstructions and the stats are kept. This is all it
+ * takes to run a small program many times over different rwmem.
+ */
+void reset_cpu(CPU *cpu, Memory *memory)
+{
+    cpu->memory = memory;
+
+    cpu->PC = -1;
+
+    memset(cpu->registers, 0, sizeof(cpu->registers));
+    memset(cpu->dregisters, 0, sizeof(cpu->dregisters));
+    memset(cpu->vregisters, 0, sizeof(cpu->vregisters));
+    memset(&cpu->flags, 0, sizeof(cpu->flags));
+
+    cpu->instruction.bytecode = 0;
+    cpu->verified = 0;
+    cpu->io_wait = 0;
+}
+
+/*
+ * Frees what cpu owns (the program decoded by run_cpu()) but not cpu.
+ */
+void deinit_cpu(CPU *cpu)
 {
     for(size_t i = 0; i <= 7; ++i)
     {
@@ -129,7 +543,11 @@ void free_cpu(CPU *cpu)
         cpu->dregisters[i] = 0;
     }
 
-    free(cpu);
+    if(cpu->owns_program)
+        free_decoded_program(cpu->program);
+
+    cpu->program = NULL;
+    cpu->owns_program = 0;
 }
 
 void fetch_instruction(CPU *cpu)
@@ -152,6 +570,8 @@ void set_flags(CPU *cpu, int dst)
  */
 void execute_instruction(CPU *cpu)
 {
+    STATS_DISPATCH(cpu, stats_instruction(cpu->instruction.bytecode))
+
     switch(cpu->instruction.bytecode)
     {
         case MOV:
@@ -277,6 +697,41 @@ void execute_instruction(CPU *cpu)
         case HLT:
             break;
 
+        case LD16: case LD32: case LD64:
+            wide_load(cpu);
+
+            break;
+
+        case STR16: case STR32: case STR64:
+            wide_store(cpu);
+
+            break;
+
+        case VLD:
+            vector_load(cpu);
+
+            break;
+
+        case VST:
+            vector_store(cpu);
+
+            break;
+
+        case VXOR: case VADD: case VSHL: case VSHR:
+            vector(cpu);
+
+            break;
+
+        case MEMCPY: case MEMSET: case MEMXOR: case MEMXORK:
+            block(cpu);
+
+            break;
+
+        case IN: case OUT: case YIELD:
+            io(cpu);
+
+            break;
+
         default:
             printf("Unsupported instruction... %d\n",
                     cpu->instruction.bytecode);
@@ -286,10 +741,10 @@ void execute_instruction(CPU *cpu)
 }
 
 /*
- * This is the main function to be called when a new CPU is created.
- * It fetches the instruction in cpu->memory->code and executes it.
+ * Fetches and executes the instructions straight from cpu->memory->code,
+ * one double at a time.
  */
-void run_cpu(CPU *cpu)
+void interpret_code(CPU *cpu)
 {
     while(cpu->instruction.bytecode != HLT)
     {
@@ -298,6 +753,40 @@ void run_cpu(CPU *cpu)
     }
 }
 
+/*
+ * This is the main function to be called when a new CPU is created.
+ * The program is decoded the first time the CPU runs (unless one was
+ * attached with attach_program(), or ENGINE_TIERED decides it does not
+ * have to be) and executed from the decoded array by the engine chosen
+ * with set_engine().
+ */
+void run_cpu(CPU *cpu)
+{
+    STATS_START(cpu)
+
+    if(cpu->program == NULL && cpu->engine != ENGINE_TIERED)
+    {
+        cpu->program = decode_program(cpu->memory);
+        cpu->owns_program = 1;
+
+        if(cpu->program != NULL)
+            fuse_program(cpu->program, cpu->fusions);
+    }
+
+    if(cpu->engine == ENGINE_TIERED)
+        run_tiered(cpu);
+    else if(cpu->program == NULL)
+        interpret_code(cpu);
+    else if(cpu->engine == ENGINE_JIT)
+        run_jit(cpu);
+    else if(cpu->engine == ENGINE_THREADED)
+        run_threaded(cpu);
+    else
+        run_decoded(cpu);
+
+    STATS_STOP(cpu)
+}
+
 void move(CPU *cpu)
 {
     double dst = cpu->memory->code[cpu->PC+1];
@@ -528,6 +1017,8 @@ void cmp(CPU *cpu)
 
 void jmp(CPU *cpu)
 {
+    STATS_JUMP(cpu, JMP, 1)
+
     cpu->PC = cpu->memory->code[cpu->PC+1];
 }
 
@@ -535,6 +1026,8 @@ void je(CPU *cpu)
 {
     long dst = cpu->memory->code[cpu->PC+1];
 
+    STATS_JUMP(cpu, JE, cpu->flags.zero == 1)
+
     if(cpu->flags.zero == 1)
     {
         cpu->PC = dst;
@@ -549,6 +1042,8 @@ void jne(CPU *cpu)
 {
     long dst = cpu->memory->code[cpu->PC+1];
 
+    STATS_JUMP(cpu, JNE, cpu->flags.zero == 0)
+
     // since not equal can be both < or > there is no need to check
     // the overflow flag...
     if(cpu->flags.zero == 0)
@@ -565,6 +1060,8 @@ void jlt(CPU *cpu)
 {
     long dst = cpu->memory->code[cpu->PC+1];
 
+    STATS_JUMP(cpu, JLT, cpu->flags.zero == 0 && cpu->flags.overflow == 0)
+
     if(cpu->flags.zero == 0 && cpu->flags.overflow == 0)
     {
         cpu->PC = dst;
@@ -579,6 +1076,8 @@ void jgt(CPU *cpu)
 {
     long dst = cpu->memory->code[cpu->PC+1];
 
+    STATS_JUMP(cpu, JGT, cpu->flags.zero == 0 && cpu->flags.overflow == 1)
+
     if(cpu->flags.zero == 0 && cpu->flags.overflow == 1)
     {
         cpu->PC = dst;
@@ -761,33 +1260,1172 @@ void shri(CPU *cpu)
 }
 
 /*
- * CPU utility functions implementation
+ * LD16/LD32/LD64 load 2, 4 or 8 bytes from the rwmem address in src,
+ * STR16/STR32/STR64 store the low 2, 4 or 8 bytes of src at the address in
+ * dst, both in little-endian order. Only R<n> registers are allowed, and
+ * like LD and STR they set the flags on dst.
  */
+void wide_load(CPU *cpu)
+{
+    long dst = cpu->memory->code[cpu->PC+1];
+    long src = cpu->memory->code[cpu->PC+2];
 
-void print_cpu_registers(CPU *cpu)
+    if(dst > 7 || src > 7)
+    {
+        printf("[XORVM]::ERROR: can operate only on R<n> registers!\n");
+
+        exit(-1);
+    }
+
+    cpu->registers[dst] = load_wide(cpu->memory->rwmem +
+            cpu->registers[src], wide_size(cpu->instruction.bytecode));
+
+    set_flags(cpu, dst);
+
+    cpu->PC += 2;
+}
+
+void wide_store(CPU *cpu)
 {
-    printf("[REGISTERS]\n");
+    long dst = cpu->memory->code[cpu->PC+1];
+    long src = cpu->memory->code[cpu->PC+2];
 
-    for(size_t i = 0; i < 8; ++i)
+    if(dst > 7 || src > 7)
     {
-        printf("R%ld: %ld\n", i, cpu->registers[i]);
+        printf("[XORVM]::ERROR: can operate only on R<n> registers!\n");
+
+        exit(-1);
     }
 
-    for(size_t i = 0; i < 8; ++i)
+    store_wide(cpu->memory->rwmem + cpu->registers[dst],
+            cpu->registers[src], wide_size(cpu->instruction.bytecode));
+
+    set_flags(cpu, dst);
+
+    cpu->PC += 2;
+}
+
+/*
+ * VLD V<n>, R<n> loads VECTOR_SIZE bytes from the rwmem address in the R<n>
+ * register, VST R<n>, V<n> stores them back. Vector instructions never
+ * touch the flags.
+ */
+void vector_load(CPU *cpu)
+{
+    long dst = cpu->memory->code[cpu->PC+1];
+    long src = cpu->memory->code[cpu->PC+2];
+
+    if(dst < V0 || dst > V7 || src > 7)
     {
-        printf("D%ld: %.15f\n", i, cpu->dregisters[i]);
+        printf("[XORVM]::ERROR: VLD needs a V<n> and a R<n> register!\n");
+
+        exit(-1);
     }
 
-    printf("\n");
+    load_vector(&cpu->vregisters[dst - V0], cpu->memory->rwmem +
+            cpu->registers[src]);
+
+    cpu->PC += 2;
 }
 
-void print_cpu_flags(CPU *cpu)
+void vector_store(CPU *cpu)
 {
-    printf("[FLAGS]\n");
-    
-    printf("ZERO        : %d\n", cpu->flags.zero);
-    printf("NEGATIVE    : %d\n", cpu->flags.negative);
-    printf("OVERFLOW    : %d\n", cpu->flags.overflow);
+    long dst = cpu->memory->code[cpu->PC+1];
+    long src = cpu->memory->code[cpu->PC+2];
 
-    printf("\n");
+    if(dst > 7 || src < V0 || src > V7)
+    {
+        printf("[XORVM]::ERROR: VST needs a R<n> and a V<n> register!\n");
+
+        exit(-1);
+    }
+
+    store_vector(cpu->memory->rwmem + cpu->registers[dst],
+            &cpu->vregisters[src - V0]);
+
+    cpu->PC += 2;
+}
+
+/*
+ * VXOR and VADD V<n>, V<n>, VSHL and VSHR V<n>, count.
+ */
+void vector(CPU *cpu)
+{
+    int opcode = cpu->instruction.bytecode;
+    long dst = cpu->memory->code[cpu->PC+1];
+    double src = cpu->memory->code[cpu->PC+2];
+    int shift = opcode == VSHL || opcode == VSHR;
+
+    if(dst < V0 || dst > V7 || (!shift && !(src >= V0 && src <= V7)))
+    {
+        printf("[XORVM]::ERROR: can operate only on V<n> registers!\n");
+
+        exit(-1);
+    }
+
+    // a count that is not even a long clears the lanes too
+    if(shift)
+        vector_operation(&cpu->vregisters[dst - V0], NULL,
+                src >= 0 && src <= 63 ? (long)src : -1, opcode);
+    else
+        vector_operation(&cpu->vregisters[dst - V0],
+                &cpu->vregisters[(int)src - V0], 0, opcode);
+
+    cpu->PC += 2;
 }
+
+/*
+ * MEMCPY, MEMSET and MEMXOR Rd, Rs, Rn and MEMXORK Rd, Rk, Rn, Rl, see
+ * block.h. All the operands are R<n> registers.
+ */
+void block(CPU *cpu)
+{
+    int opcode = cpu->instruction.bytecode;
+    int operands = opcode == MEMXORK ? 4 : 3;
+    long reg[4] = {0, 0, 0, 0};
+    long value[4] = {0, 0, 0, 0};
+
+    for(int i = 0; i < operands; ++i)
+    {
+        reg[i] = cpu->memory->code[cpu->PC + 1 + i];
+
+        if(reg[i] < 0 || reg[i] > 7)
+        {
+            printf("[XORVM]::ERROR: can operate only on R<n> registers!\n");
+
+            exit(-1);
+        }
+
+        value[i] = cpu->registers[reg[i]];
+    }
+
+    STATS_BLOCK(cpu, opcode, value[2], value[3])
+
+    block_operation(cpu->memory->rwmem, opcode, value[0], value[1],
+            value[2], value[3]);
+
+    cpu->PC += operands;
+}
+
+/*
+ * IN Rd, Rn, OUT Rs, Rn (R<n> registers only) and YIELD, see io.h. A CPU
+ * that has to wait stops as if it had run a HLT.
+ */
+void io(CPU *cpu)
+{
+    int opcode = cpu->instruction.bytecode;
+    int operands = opcode == YIELD ? 0 : 2;
+    long reg[2] = {0, 0};
+
+    for(int i = 0; i < operands; ++i)
+    {
+        reg[i] = cpu->memory->code[cpu->PC + 1 + i];
+
+        if(reg[i] < 0 || reg[i] > 7)
+        {
+            printf("[XORVM]::ERROR: can operate only on R<n> registers!\n");
+
+            exit(-1);
+        }
+    }
+
+    if(!io_operation(cpu, opcode, &cpu->registers[reg[0]],
+                &cpu->registers[reg[1]]))
+    {
+        // IN and OUT run again once resumed, YIELD does not
+        if(opcode != YIELD)
+            cpu->PC--;
+
+        cpu->instruction.bytecode = HLT;
+
+        return;
+    }
+
+    if(opcode == IN)
+        set_flags(cpu, reg[1]);
+
+    cpu->PC += operands;
+}
+
+/*
+ * Wide and vector memory functions implementation
+ */
+
+// 2, 4 or 8 bytes for LD16/STR16, LD32/STR32 and LD64/STR64
+int wide_size(int opcode)
+{
+    return 2 << (opcode - LD16) % 3;
+}
+
+/*
+ * Little-endian whatever the host is, on little-endian hosts that is a
+ * plain copy.
+ */
+unsigned long load_wide(unsigned char *bytes, int size)
+{
+    unsigned long value = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&value, bytes, size);
+#else
+    for(int i = size - 1; i >= 0; --i)
+        value = value << 8 | bytes[i];
+#endif
+
+    return value;
+}
+
+void store_wide(unsigned char *bytes, unsigned long value, int size)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(bytes, &value, size);
+#else
+    for(int i = 0; i < size; ++i)
+        bytes[i] = value >> (8 * i);
+#endif
+}
+
+void load_vector(VectorRegister *vector, unsigned char *bytes)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(vector->lanes, bytes, VECTOR_SIZE);
+#else
+    for(int i = 0; i < VECTOR_LANES; ++i)
+        vector->lanes[i] = load_wide(bytes + 8 * i, 8);
+#endif
+}
+
+void store_vector(unsigned char *bytes, VectorRegister *vector)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(bytes, vector->lanes, VECTOR_SIZE);
+#else
+    for(int i = 0; i < VECTOR_LANES; ++i)
+        store_wide(bytes + 8 * i, vector->lanes[i], 8);
+#endif
+}
+
+/*
+ * dst = dst op src for VXOR and VADD, dst = dst op count for VSHL and VSHR.
+ * Shifts are logical, and counts outside 0-63 clear the lanes. With GCC
+ * the lanes go through a vector type, that is SSE2 or AVX2 instructions.
+ */
+void vector_operation(VectorRegister *dst, VectorRegister *src, long count,
+        int opcode)
+{
+    if((opcode == VSHL || opcode == VSHR) && (count < 0 || count > 63))
+    {
+        memset(dst, 0, sizeof(VectorRegister));
+
+        return;
+    }
+
+#ifdef __GNUC__
+    VectorLanes a;
+    VectorLanes b = {0};
+
+    memcpy(&a, dst->lanes, sizeof(a));
+
+    if(src != NULL)
+        memcpy(&b, src->lanes, sizeof(b));
+
+    if(opcode == VXOR)
+        a ^= b;
+    else if(opcode == VADD)
+        a += b;
+    else if(opcode == VSHL)
+        a <<= count;
+    else
+        a >>= count;
+
+    memcpy(dst->lanes, &a, sizeof(a));
+#else
+    for(int i = 0; i < VECTOR_LANES; ++i)
+    {
+        if(opcode == VXOR)
+            dst->lanes[i] ^= src->lanes[i];
+        else if(opcode == VADD)
+            dst->lanes[i] += src->lanes[i];
+        else if(opcode == VSHL)
+            dst->lanes[i] <<= count;
+        else
+            dst->lanes[i] >>= count;
+    }
+#endif
+}
+
+/*
+ * Decoder implementation.
+ *
+ * Number of doubles taken by each instruction in memory->code, opcode
+ * included.
+ */
+const int instruction_slots[] = {
+    [MOV] = 3, [MOVI] = 3,
+    [ADD] = 3, [ADDI] = 3, [SUB] = 3, [SUBI] = 3,
+    [MUL] = 3, [MULI] = 3, [DIV] = 3, [DIVI] = 3,
+    [CMP] = 3,
+    [JMP] = 2, [JE] = 2, [JNE] = 2, [JLT] = 2, [JGT] = 2,
+    [LD] = 3, [STR] = 3,
+    [XOR] = 3, [XORI] = 3, [SHL] = 3, [SHR] = 3, [SHLI] = 3, [SHRI] = 3,
+    [HLT] = 1,
+    [LD16] = 3, [LD32] = 3, [LD64] = 3, [STR16] = 3, [STR32] = 3, [STR64] = 3,
+    [VLD] = 3, [VST] = 3, [VXOR] = 3, [VADD] = 3, [VSHL] = 3, [VSHR] = 3,
+    [MEMCPY] = 4, [MEMSET] = 4, [MEMXOR] = 4, [MEMXORK] = 5,
+    [IN] = 3, [OUT] = 3, [YIELD] = 1
+};
+
+/*
+ * Returns 1 and stores the register index in reg if value is one of the
+ * Registers, 0 otherwise.
+ */
+int decode_register(double value, unsigned char *reg)
+{
+    if(!(value >= R0 && value <= D7) || value != (int)value)
+        return 0;
+
+    *reg = (int)value;
+
+    return 1;
+}
+
+/*
+ * Same for V<n> registers, reg gets the index in cpu->vregisters.
+ */
+int decode_vector_register(double value, unsigned char *reg)
+{
+    if(!(value >= V0 && value <= V7) || value != (int)value)
+        return 0;
+
+    *reg = (int)value - V0;
+
+    return 1;
+}
+
+/*
+ * Decodes a single instruction starting at memory->code[slot]. Returns 0 if
+ * the instruction must be left to interpret_code().
+ */
+int decode_instruction(double *code, size_t slot, DecodedInstruction *out)
+{
+    // HLT has no operands, it may well be the last double in code[]
+    if(out->opcode == HLT || out->opcode == YIELD)
+        return 1;
+
+    double dst = code[slot + 1];
+    double src = code[slot + 2];
+
+    switch(out->opcode)
+    {
+        case MOV: case ADD: case SUB: case MUL: case DIV:
+        case CMP: case LD: case STR:
+            return decode_register(dst, &out->dst) &&
+                decode_register(src, &out->src);
+
+        case MOVI:
+            if(!decode_register(dst, &out->dst))
+                return 0;
+
+            if(out->dst <= 7)
+                out->imm.i = src;
+            else
+                out->imm.d = src;
+
+            return 1;
+
+        case ADDI: case SUBI: case MULI: case DIVI:
+            out->imm.d = src;
+
+            return decode_register(dst, &out->dst);
+
+        // the code[] interpreter exits on XOR/SHIFT to D<n> registers, so
+        // the decoder leaves those to it.
+        case XOR: case SHL: case SHR:
+            return decode_register(dst, &out->dst) && out->dst <= 7 &&
+                decode_register(src, &out->src) && out->src <= 7;
+
+        case XORI: case SHLI: case SHRI:
+            out->imm.i = src;
+
+            return decode_register(dst, &out->dst) && out->dst <= 7;
+
+        case LD16: case LD32: case LD64: case STR16: case STR32: case STR64:
+            return decode_register(dst, &out->dst) && out->dst <= 7 &&
+                decode_register(src, &out->src) && out->src <= 7;
+
+        case VLD:
+            return decode_vector_register(dst, &out->dst) &&
+                decode_register(src, &out->src) && out->src <= 7;
+
+        case VST:
+            return decode_register(dst, &out->dst) && out->dst <= 7 &&
+                decode_vector_register(src, &out->src);
+
+        case VXOR: case VADD:
+            return decode_vector_register(dst, &out->dst) &&
+                decode_vector_register(src, &out->src);
+
+        // like vector(), counts outside 0-63 clear the lanes
+        case VSHL: case VSHR:
+            out->imm.i = src >= 0 && src <= 63 ? (long)src : -1;
+
+            return decode_vector_register(dst, &out->dst);
+
+        // the length goes in src2, the key length of MEMXORK in imm.i
+        case MEMCPY: case MEMSET: case MEMXOR: case MEMXORK:
+        {
+            unsigned char key_length = 0;
+
+            if(out->opcode == MEMXORK &&
+                    !(decode_register(code[slot + 4], &key_length) &&
+                        key_length <= 7))
+                return 0;
+
+            out->imm.i = key_length;
+
+            return decode_register(dst, &out->dst) && out->dst <= 7 &&
+                decode_register(src, &out->src) && out->src <= 7 &&
+                decode_register(code[slot + 3], &out->src2) &&
+                out->src2 <= 7;
+        }
+
+        // the address goes in dst, the length in src
+        case IN: case OUT:
+            return decode_register(dst, &out->dst) && out->dst <= 7 &&
+                decode_register(src, &out->src) && out->src <= 7;
+    }
+
+    return 0;
+}
+
+/*
+ * Turns a decoded MOV, ADD, CMP, LD... into the DecodedOpcodes variant
+ * matching the class of its operands, and makes D<n> operands an index in
+ * cpu->dregisters.
+ */
+void specialize_instruction(DecodedInstruction *instruction)
+{
+    int dst = instruction->dst > 7;
+    int src = instruction->src > 7;
+    int immediate = 1;
+    int opcode;
+
+    switch(instruction->opcode)
+    {
+        case MOV: opcode = MOV_RR; immediate = 0; break;
+        case ADD: opcode = ADD_RR; immediate = 0; break;
+        case SUB: opcode = SUB_RR; immediate = 0; break;
+        case MUL: opcode = MUL_RR; immediate = 0; break;
+        case DIV: opcode = DIV_RR; immediate = 0; break;
+        case CMP: opcode = CMP_RR; immediate = 0; break;
+        case LD: opcode = LD_RR; immediate = 0; break;
+        case STR: opcode = STR_RR; immediate = 0; break;
+
+        case MOVI: opcode = MOVI_R; break;
+        case ADDI: opcode = ADDI_R; break;
+        case SUBI: opcode = SUBI_R; break;
+        case MULI: opcode = MULI_R; break;
+        case DIVI: opcode = DIVI_R; break;
+
+        default:
+            return;
+    }
+
+    // the _RR, _RD, _DR, _DD (or _R, _D) variants follow each other
+    if(immediate)
+        instruction->opcode = opcode + dst;
+    else
+        instruction->opcode = opcode + dst * 2 + src;
+
+    if(dst)
+        instruction->dst -= 8;
+
+    if(src)
+        instruction->src -= 8;
+}
+
+/*
+ * Decodes memory->code once, returns NULL if there is no memory left for
+ * the decoded program.
+ *
+ * The decoded array holds the instructions in the same order they have in
+ * memory->code, followed by a DECODED_FALLBACK for running off the end of
+ * the code and one for every jump that does not land at the beginning of an
+ * instruction.
+ */
+DecodedProgram *decode_program(Memory *memory)
+{
+    double *code = memory->code;
+    size_t length = memory->code_size / sizeof(double);
+    size_t count = 0;
+    size_t jumps = 0;
+
+    if(length == 0 || length >= 0x7fffffff)
+        return NULL;
+
+    long *index = (long *)malloc(sizeof(long) * length);
+
+    if(index == NULL)
+        return NULL;
+
+    for(size_t slot = 0; slot < length; ++slot)
+        index[slot] = -1;
+
+    // first pass: find where every instruction begins
+    for(size_t slot = 0; slot < length;)
+    {
+        int opcode = code[slot];
+
+        index[slot] = count++;
+
+        if(opcode >= JMP && opcode <= JGT)
+            jumps++;
+
+        slot += (opcode >= MOV && opcode < TOTAL_INSTRUCTIONS) ?
+            instruction_slots[opcode] : 1;
+    }
+
+    DecodedProgram *program = (DecodedProgram *)malloc(sizeof(DecodedProgram));
+    DecodedInstruction *instructions = (DecodedInstruction *)malloc(
+            sizeof(DecodedInstruction) * (count + 1 + jumps));
+
+    if(program == NULL || instructions == NULL)
+    {
+        free(index);
+        free(program);
+        free(instructions);
+
+        return NULL;
+    }
+
+    size_t extra = count + 1;
+
+    // second pass: decode operands and resolve jump targets
+    for(size_t slot = 0; slot < length;)
+    {
+        DecodedInstruction *instruction = &instructions[index[slot]];
+        int opcode = code[slot];
+        size_t slots = (opcode >= MOV && opcode < TOTAL_INSTRUCTIONS) ?
+            instruction_slots[opcode] : 1;
+
+        instruction->opcode = opcode;
+        instruction->dst = 0;
+        instruction->src = 0;
+        instruction->src2 = 0;
+        instruction->slot = slot;
+        instruction->imm.i = 0;
+
+        if(!(opcode >= MOV && opcode < TOTAL_INSTRUCTIONS) ||
+                slot + slots > length)
+        {
+            instruction->opcode = DECODED_FALLBACK;
+        } else if(opcode >= JMP && opcode <= JGT)
+        {
+            // jumps set PC to the slot *before* the next instruction
+            long target = (long)code[slot + 1] + 1;
+
+            if(target >= 0 && target < (long)length && index[target] >= 0)
+            {
+                instruction->imm.i = index[target];
+            } else if(target >= 0 && target < 0x7fffffff)
+            {
+                instructions[extra].opcode = DECODED_FALLBACK;
+                instructions[extra].slot = target;
+                instruction->imm.i = extra++;
+            } else
+            {
+                instruction->opcode = DECODED_FALLBACK;
+            }
+        } else if(!decode_instruction(code, slot, instruction))
+        {
+            instruction->opcode = DECODED_FALLBACK;
+        } else
+        {
+            specialize_instruction(instruction);
+        }
+
+        slot += slots;
+    }
+
+    instructions[count].opcode = DECODED_FALLBACK;
+    instructions[count].slot = length;
+
+    free(index);
+
+    program->length = count;
+    program->entries = extra;
+    program->instructions = instructions;
+    program->jit = NULL;
+    program->fusions = FUSE_NONE;
+    program->verified = -1;
+    program->verified_size = 0;
+    program->frozen = 0;
+
+    thread_program(program);
+
+    return program;
+}
+
+void free_decoded_program(DecodedProgram *program)
+{
+    if(program == NULL)
+        return;
+
+    free(program->instructions);
+    free(program->threaded);
+    free_jit_program(program->jit);
+    free(program);
+}
+
+/*
+ * Makes cpu run a program decoded once with decode_program(), so the same
+ * memory->code does not have to be decoded again for every new CPU.
+ * The program is not freed by free_cpu().
+ */
+void attach_program(CPU *cpu, DecodedProgram *program)
+{
+    if(cpu->owns_program)
+        free_decoded_program(cpu->program);
+
+    cpu->program = program;
+    cpu->owns_program = 0;
+}
+
+/*
+ * The following macros are the decoded counterparts of the OPERATION
+ * macros above, working on the local copies of the registers kept by the
+ * engines running a DecodedProgram (see handlers.h).
+ *
+ * The class of every operand is known once the program is decoded, so
+ * instead of checking it each time they expand to one handler for each
+ * combination of R<n>/D<n> operands: ADD_RR, ADD_RD, ADD_DR, ADD_DD and
+ * ADDI_R, ADDI_D for example.
+ */
+
+#define DECODED_FLAGS_R(reg)\
+    flags.negative = (r[reg] < 0) ? 1: 0;\
+    flags.zero = (r[reg] == 0) ? 1: 0;\
+
+// set_flags() on a D<n> register looks at the bits of the double
+#define DECODED_FLAGS_D(reg)\
+    {\
+        long bits;\
+        memcpy(&bits, &d[reg], sizeof(long));\
+        flags.negative = (bits < 0) ? 1: 0;\
+        flags.zero = (bits == 0) ? 1: 0;\
+    }\
+
+#define DECODED_OPERATION(name, operator)\
+    TARGET(name##_RR)\
+        r[ip->dst] operator##= r[ip->src];\
+        DECODED_FLAGS_R(ip->dst)\
+        DISPATCH();\
+    TARGET(name##_RD)\
+        r[ip->dst] operator##= d[ip->src];\
+        DECODED_FLAGS_R(ip->dst)\
+        DISPATCH();\
+    TARGET(name##_DR)\
+        d[ip->dst] operator##= r[ip->src];\
+        DECODED_FLAGS_D(ip->dst)\
+        DISPATCH();\
+    TARGET(name##_DD)\
+        d[ip->dst] operator##= d[ip->src];\
+        DECODED_FLAGS_D(ip->dst)\
+        DISPATCH();\
+
+#define DECODED_OPERATIONI(name, operator)\
+    TARGET(name##_R)\
+        r[ip->dst] operator##= ip->imm.d;\
+        DECODED_FLAGS_R(ip->dst)\
+        DISPATCH();\
+    TARGET(name##_D)\
+        d[ip->dst] operator##= ip->imm.d;\
+        DECODED_FLAGS_D(ip->dst)\
+        DISPATCH();\
+
+#define DECODED_COMPARE(a, b)\
+    flags.zero = 0;\
+    flags.negative = 0;\
+    flags.overflow = 0;\
+    if((a) == (b))\
+        flags.zero = 1;\
+    else if((a) > (b))\
+        flags.overflow = 1;\
+
+/*
+ * Returns the index of the decoded instruction starting at slot, -1 if no
+ * instruction starts there.
+ */
+long find_decoded_instruction(DecodedProgram *program, long slot)
+{
+    DecodedInstruction *code = program->instructions;
+    size_t low = 0;
+    size_t high = program->length;
+
+    while(low < high)
+    {
+        size_t middle = (low + high) / 2;
+
+        if(code[middle].slot < slot)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    if(low == program->length || code[low].slot != slot)
+        return -1;
+
+    return low;
+}
+
+/*
+ * Returns the index of the decoded instruction the CPU has to start from,
+ * or -1 if there is nothing left for the decoded program to run: either the
+ * CPU already halted, or it was stepped with fetch/execute_instruction to
+ * the middle of an instruction, in which case interpret_code() takes over.
+ */
+long decoded_entry(CPU *cpu)
+{
+    if(cpu->instruction.bytecode == HLT)
+        return -1;
+
+    if(cpu->PC == -1)
+        return 0;
+
+    long entry = find_decoded_instruction(cpu->program, cpu->PC + 1);
+
+    if(entry == -1)
+        interpret_code(cpu);
+
+    return entry;
+}
+
+/*
+ * Runs cpu->program with a switch, keeping the registers in local variables
+ * until the program halts (or falls back to interpret_code()).
+ */
+void run_decoded(CPU *cpu)
+{
+    long entry = decoded_entry(cpu);
+
+    if(entry == -1)
+        return;
+
+    DecodedInstruction *code = cpu->program->instructions;
+    DecodedInstruction *ip = code + entry;
+    unsigned char *rwmem = cpu->memory->rwmem;
+    long r[8];
+    double d[8];
+    Flags flags;
+
+    memcpy(r, cpu->registers, sizeof(r));
+    memcpy(d, cpu->dregisters, sizeof(d));
+    flags = cpu->flags;
+
+#define TARGET(op) case op: STATS_DISPATCH(cpu, op)
+#define DISPATCH() ip++; break
+#define SKIP(n) ip += (n); break
+#define JUMP(condition) ip = (condition) ? code + ip->imm.i : ip + 1; break
+
+    for(;;)
+    {
+        switch(ip->opcode)
+        {
+#include "handlers.h"
+        }
+    }
+
+#undef TARGET
+#undef DISPATCH
+#undef SKIP
+#undef JUMP
+}
+
+#ifdef __GNUC__
+
+/*
+ * Direct threaded engine (needs GCC's labels as values).
+ *
+ * program->threaded holds, for every decoded instruction, the address of
+ * its handler, and every handler ends jumping straight to the handler of
+ * the next instruction instead of going back to a shared switch.
+ *
+ * Called with a NULL cpu it only fills program->threaded, which is how
+ * decode_program() gets the addresses of the labels in here.
+ */
+#define DECODED_LABELS(name)\
+    [name##_RR] = &&target_##name##_RR, [name##_RD] = &&target_##name##_RD,\
+    [name##_DR] = &&target_##name##_DR, [name##_DD] = &&target_##name##_DD\
+
+#define DECODED_LABELSI(name)\
+    [name##_R] = &&target_##name##_R, [name##_D] = &&target_##name##_D\
+
+void threaded_engine(CPU *cpu, DecodedProgram *program)
+{
+    static void *labels[] = {
+        DECODED_LABELS(MOV), DECODED_LABELSI(MOVI),
+        DECODED_LABELS(ADD), DECODED_LABELSI(ADDI),
+        DECODED_LABELS(SUB), DECODED_LABELSI(SUBI),
+        DECODED_LABELS(MUL), DECODED_LABELSI(MULI),
+        DECODED_LABELS(DIV), DECODED_LABELSI(DIVI),
+        DECODED_LABELS(CMP),
+        [JMP] = &&target_JMP, [JE] = &&target_JE, [JNE] = &&target_JNE,
+        [JLT] = &&target_JLT, [JGT] = &&target_JGT,
+        DECODED_LABELS(LD), DECODED_LABELS(STR),
+        [XOR] = &&target_XOR, [XORI] = &&target_XORI,
+        [SHL] = &&target_SHL, [SHR] = &&target_SHR,
+        [SHLI] = &&target_SHLI, [SHRI] = &&target_SHRI,
+        [HLT] = &&target_HLT,
+        [LD16] = &&target_LD16, [LD32] = &&target_LD32,
+        [LD64] = &&target_LD64, [STR16] = &&target_STR16,
+        [STR32] = &&target_STR32, [STR64] = &&target_STR64,
+        [VLD] = &&target_VLD, [VST] = &&target_VST,
+        [VXOR] = &&target_VXOR, [VADD] = &&target_VADD,
+        [VSHL] = &&target_VSHL, [VSHR] = &&target_VSHR,
+        [MEMCPY] = &&target_MEMCPY, [MEMSET] = &&target_MEMSET,
+        [MEMXOR] = &&target_MEMXOR, [MEMXORK] = &&target_MEMXORK,
+        [IN] = &&target_IN, [OUT] = &&target_OUT, [YIELD] = &&target_YIELD,
+        [CMP_JE_RR] = &&target_CMP_JE_RR, [CMP_JNE_RR] = &&target_CMP_JNE_RR,
+        [CMP_JLT_RR] = &&target_CMP_JLT_RR, [CMP_JGT_RR] = &&target_CMP_JGT_RR,
+        [LD_XOR_STR_INC] = &&target_LD_XOR_STR_INC,
+        [MAP_LOOP] = &&target_MAP_LOOP,
+        [DECODED_FALLBACK] = &&target_DECODED_FALLBACK
+    };
+
+    if(cpu == NULL)
+    {
+        for(size_t i = 0; i < program->entries; ++i)
+            program->threaded[i] = labels[program->instructions[i].opcode];
+
+        return;
+    }
+
+    long entry = decoded_entry(cpu);
+
+    if(entry == -1)
+        return;
+
+    DecodedInstruction *code = cpu->program->instructions;
+    DecodedInstruction *ip = code + entry;
+    void **threaded = cpu->program->threaded;
+    void **tp = threaded + entry;
+    unsigned char *rwmem = cpu->memory->rwmem;
+    long r[8];
+    double d[8];
+    Flags flags;
+
+    memcpy(r, cpu->registers, sizeof(r));
+    memcpy(d, cpu->dregisters, sizeof(d));
+    flags = cpu->flags;
+
+#define TARGET(op) target_##op: STATS_DISPATCH(cpu, op)
+#define DISPATCH() ip++; tp++; goto **tp
+#define SKIP(n) ip += (n); tp += (n); goto **tp
+#define JUMP(condition)\
+    if(condition)\
+    {\
+        tp = threaded + ip->imm.i;\
+        ip = code + ip->imm.i;\
+    } else\
+    {\
+        ip++;\
+        tp++;\
+    }\
+    goto **tp
+
+    goto **tp;
+
+#include "handlers.h"
+
+#undef TARGET
+#undef DISPATCH
+#undef SKIP
+#undef JUMP
+}
+
+#endif
+
+/*
+ * Fills program->threaded for run_threaded(), leaving it NULL when the
+ * compiler does not support threaded code.
+ */
+void thread_program(DecodedProgram *program)
+{
+    program->threaded = NULL;
+
+#ifdef __GNUC__
+    program->threaded = (void **)malloc(sizeof(void *) * program->entries);
+
+    if(program->threaded != NULL)
+        threaded_engine(NULL, program);
+#endif
+}
+
+void run_threaded(CPU *cpu)
+{
+#ifdef __GNUC__
+    if(cpu->program->threaded != NULL)
+    {
+        threaded_engine(cpu, NULL);
+
+        return;
+    }
+#endif
+
+    run_decoded(cpu);
+}
+
+/*
+ * Chooses which engine runs the decoded program, see enum Engines.
+ */
+void set_engine(CPU *cpu, int engine)
+{
+    cpu->engine = engine;
+}
+
+/*
+ * Runs cpu->program like run_decoded(), adding one to counts[entry] every
+ * time the instruction at entry is dispatched. counts must have
+ * cpu->program->entries elements.
+ */
+void run_profiled(CPU *cpu, unsigned long *counts)
+{
+    long entry = decoded_entry(cpu);
+
+    if(entry == -1)
+        return;
+
+    DecodedInstruction *code = cpu->program->instructions;
+    DecodedInstruction *ip = code + entry;
+    unsigned char *rwmem = cpu->memory->rwmem;
+    long r[8];
+    double d[8];
+    Flags flags;
+
+    memcpy(r, cpu->registers, sizeof(r));
+    memcpy(d, cpu->dregisters, sizeof(d));
+    flags = cpu->flags;
+
+#define TARGET(op) case op: STATS_DISPATCH(cpu, op)
+#define DISPATCH() ip++; break
+#define SKIP(n) ip += (n); break
+#define JUMP(condition) ip = (condition) ? code + ip->imm.i : ip + 1; break
+
+    for(;;)
+    {
+        counts[ip - code]++;
+
+        switch(ip->opcode)
+        {
+#include "handlers.h"
+        }
+    }
+
+#undef TARGET
+#undef DISPATCH
+#undef SKIP
+#undef JUMP
+}
+
+/*
+ * Superinstruction functions implementation
+ */
+
+/*
+ * Returns the opcode of the first instruction a superinstruction was made
+ * of (a superinstruction keeps its dst and src), opcode itself otherwise.
+ */
+int unfused_opcode(int opcode)
+{
+    if(opcode >= CMP_JE_RR && opcode <= CMP_JGT_RR)
+        return CMP_RR;
+
+    if(opcode == LD_XOR_STR_INC || opcode == MAP_LOOP)
+        return LD_RR;
+
+    return opcode;
+}
+
+/*
+ * Returns the number of instructions starting at index that the patterns
+ * in fusions can fuse, 1 if none, and fills fused with the superinstruction.
+ */
+size_t match_fusion(DecodedProgram *program, size_t index, int fusions,
+        DecodedInstruction *fused)
+{
+    DecodedInstruction *ip = &program->instructions[index];
+    size_t left = program->length - index;
+
+    // the whole loop runs at once, the instructions after the LD are only
+    // run for its last round
+    if((fusions & FUSE_MAP_LOOP) && match_map_loop(program, index))
+    {
+        *fused = ip[0];
+        fused->opcode = MAP_LOOP;
+
+        return 6;
+    }
+
+    if((fusions & FUSE_CMP_JUMP) && left >= 2 && ip[0].opcode == CMP_RR &&
+            ip[1].opcode >= JE && ip[1].opcode <= JGT)
+    {
+        *fused = ip[0];
+        fused->opcode = CMP_JE_RR + ip[1].opcode - JE;
+        fused->imm.i = ip[1].imm.i;
+
+        return 2;
+    }
+
+    if((fusions & FUSE_LD_XOR_STR_INC) && left >= 4 &&
+            ip[0].opcode == LD_RR &&
+            ip[1].opcode == XOR && ip[1].dst == ip[0].dst &&
+            ip[2].opcode == STR_RR && ip[2].dst == ip[0].src &&
+            ip[2].src == ip[0].dst &&
+            ip[3].opcode == ADDI_R && ip[3].dst == ip[0].src)
+    {
+        *fused = ip[0];
+        fused->opcode = LD_XOR_STR_INC;
+        fused->src2 = ip[1].src;
+        fused->imm.d = ip[3].imm.d;
+
+        return 4;
+    }
+
+    return 1;
+}
+
+/*
+ * Replaces the sequences matching the patterns in fusions (see enum
+ * Fusions) with superinstructions, undoing any previous fusion first.
+ *
+ * A superinstruction only replaces the first instruction of its sequence:
+ * the others stay where they are, so a jump into the middle of a sequence
+ * still runs the original instructions from there on. Call it before any
+ * CPU runs the program: frozen programs are left as they are.
+ */
+void fuse_program(DecodedProgram *program, int fusions)
+{
+    DecodedInstruction *code = program->instructions;
+
+    if(program->frozen)
+        return;
+
+    for(size_t i = 0; i < program->length; ++i)
+    {
+        if(unfused_opcode(code[i].opcode) == code[i].opcode)
+            continue;
+
+        code[i].opcode = unfused_opcode(code[i].opcode);
+        code[i].src2 = 0;
+        code[i].imm.i = 0;
+    }
+
+    // every match looks at the instructions after it, so the sequences are
+    // matched first and the superinstructions written afterwards
+    DecodedInstruction *fused = (DecodedInstruction *)malloc(
+            sizeof(DecodedInstruction) * program->length);
+
+    program->fusions = FUSE_NONE;
+
+    if(fused == NULL)
+        return;
+
+    for(size_t i = 0; i < program->length; ++i)
+    {
+        if(match_fusion(program, i, fusions, &fused[i]) == 1)
+            fused[i] = code[i];
+    }
+
+    memcpy(code, fused, sizeof(DecodedInstruction) * program->length);
+    free(fused);
+
+    program->fusions = fusions;
+
+    free(program->threaded);
+    thread_program(program);
+}
+
+/*
+ * Picks the patterns worth fusing from a profile of an unfused run of
+ * program (counts filled by run_profiled()): a pattern is chosen if
+ * fusing it saves at least FUSION_THRESHOLD of all the dispatches.
+ */
+int choose_fusions(DecodedProgram *program, unsigned long *counts)
+{
+    int patterns[] = {FUSE_CMP_JUMP, FUSE_LD_XOR_STR_INC, FUSE_MAP_LOOP};
+    double total = 0;
+    int fusions = FUSE_NONE;
+
+    for(size_t i = 0; i < program->entries; ++i)
+        total += counts[i];
+
+    if(total == 0)
+        return FUSE_NONE;
+
+    for(size_t p = 0; p < sizeof(patterns) / sizeof(int); ++p)
+    {
+        double saved = 0;
+        DecodedInstruction fused;
+
+        for(size_t i = 0; i < program->length; ++i)
+        {
+            size_t length = match_fusion(program, i, patterns[p], &fused);
+
+            saved += (double)counts[i] * (length - 1);
+        }
+
+        if(saved / total >= FUSION_THRESHOLD)
+            fusions |= patterns[p];
+    }
+
+    return fusions;
+}
+
+/*
+ * Chooses the patterns fused in the program run_cpu() decodes for cpu,
+ * see enum Fusions. Programs given with attach_program() are fused with
+ * fuse_program() instead.
+ */
+void set_fusions(CPU *cpu, int fusions)
+{
+    cpu->fusions = fusions;
+}
+
+/*
+ * CPU utility functions implementation
+ */
+
+void print_cpu_registers(CPU *cpu)
+{
+    printf("[REGISTERS]\n");
+
+    for(size_t i = 0; i < 8; ++i)
+    {
+        printf("R%ld: %ld\n", i, cpu->registers[i]);
+    }
+
+    for(size_t i = 0; i < 8; ++i)
+    {
+        printf("D%ld: %.15f\n", i, cpu->dregisters[i]);
+    }
+
+    printf("\n");
+}
+
+void print_cpu_flags(CPU *cpu)
+{
+    printf("[FLAGS]\n");
+    
+    printf("ZERO        : %d\n", cpu->flags.zero);
+    printf("NEGATIVE    : %d\n", cpu->flags.negative);
+    printf("OVERFLOW    : %d\n", cpu->flags.overflow);
+
+    printf("\n");
+}
+
+#include "jit.h"
+#include "tier.h"
+#include "idiom.h"
+#include "block.h"
+#include "io.h"
+#include "stats.h"
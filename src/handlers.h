@@ -0,0 +1,345 @@
+/**
+ * XORVM decoded instruction handlers.
+ * Author: 0xb4db01
+ *
+ * This file is included in the body of every engine running a
+ * DecodedProgram (see run_decoded() and run_threaded() in cpu.h), which is
+ * why there is no #pragma once. Before including it an engine defines:
+ *
+ * TARGET(op)          : the beginning of the handler of op, followed by
+ *                       STATS_DISPATCH(cpu, op) (see stats.h)
+ * DISPATCH()          : go on with the next instruction
+ * SKIP(n)             : go on with the instruction n entries after this one
+ * JUMP(condition)     : go to ip->imm.i if condition holds, else go on
+ *
+ * and has cpu, ip, code, rwmem, r, d and flags in scope.
+ */
+
+// an empty operator turns DECODED_OPERATION into a plain move
+DECODED_OPERATION(MOV, )
+
+TARGET(MOVI_R)
+    r[ip->dst] = ip->imm.i;
+
+    DECODED_FLAGS_R(ip->dst)
+
+    DISPATCH();
+
+TARGET(MOVI_D)
+    d[ip->dst] = ip->imm.d;
+
+    DECODED_FLAGS_D(ip->dst)
+
+    DISPATCH();
+
+DECODED_OPERATION(ADD, +)
+DECODED_OPERATIONI(ADDI, +)
+DECODED_OPERATION(SUB, -)
+DECODED_OPERATIONI(SUBI, -)
+DECODED_OPERATION(MUL, *)
+DECODED_OPERATIONI(MULI, *)
+DECODED_OPERATION(DIV, /)
+DECODED_OPERATIONI(DIVI, /)
+
+TARGET(CMP_RR)
+    DECODED_COMPARE(r[ip->dst], r[ip->src])
+
+    DISPATCH();
+
+TARGET(CMP_RD)
+    DECODED_COMPARE(r[ip->dst], d[ip->src])
+
+    DISPATCH();
+
+TARGET(CMP_DR)
+    DECODED_COMPARE(d[ip->dst], r[ip->src])
+
+    DISPATCH();
+
+TARGET(CMP_DD)
+    DECODED_COMPARE(d[ip->dst], d[ip->src])
+
+    DISPATCH();
+
+TARGET(JMP)
+    STATS_JUMP(cpu, JMP, 1)
+
+    JUMP(1);
+
+TARGET(JE)
+    STATS_JUMP(cpu, JE, flags.zero == 1)
+
+    JUMP(flags.zero == 1);
+
+TARGET(JNE)
+    STATS_JUMP(cpu, JNE, flags.zero == 0)
+
+    JUMP(flags.zero == 0);
+
+TARGET(JLT)
+    STATS_JUMP(cpu, JLT, flags.zero == 0 && flags.overflow == 0)
+
+    JUMP(flags.zero == 0 && flags.overflow == 0);
+
+TARGET(JGT)
+    STATS_JUMP(cpu, JGT, flags.zero == 0 && flags.overflow == 1)
+
+    JUMP(flags.zero == 0 && flags.overflow == 1);
+
+TARGET(LD_RR)
+    r[ip->dst] = rwmem[r[ip->src]];
+
+    DECODED_FLAGS_R(ip->dst)
+
+    DISPATCH();
+
+TARGET(LD_RD)
+    r[ip->dst] = rwmem[(int)d[ip->src]];
+
+    DECODED_FLAGS_R(ip->dst)
+
+    DISPATCH();
+
+TARGET(LD_DR)
+    d[ip->dst] = rwmem[r[ip->src]];
+
+    DECODED_FLAGS_D(ip->dst)
+
+    DISPATCH();
+
+TARGET(LD_DD)
+    d[ip->dst] = rwmem[(int)d[ip->src]];
+
+    DECODED_FLAGS_D(ip->dst)
+
+    DISPATCH();
+
+TARGET(STR_RR)
+    rwmem[r[ip->dst]] = r[ip->src];
+
+    DECODED_FLAGS_R(ip->dst)
+
+    DISPATCH();
+
+TARGET(STR_RD)
+    rwmem[(int)r[ip->dst]] = d[ip->src];
+
+    DECODED_FLAGS_R(ip->dst)
+
+    DISPATCH();
+
+TARGET(STR_DR)
+    rwmem[(int)d[ip->dst]] = r[ip->src];
+
+    DECODED_FLAGS_D(ip->dst)
+
+    DISPATCH();
+
+TARGET(STR_DD)
+    rwmem[(int)d[ip->dst]] = d[ip->src];
+
+    DECODED_FLAGS_D(ip->dst)
+
+    DISPATCH();
+
+TARGET(XOR)
+    r[ip->dst] ^= r[ip->src];
+
+    DISPATCH();
+
+TARGET(XORI)
+    r[ip->dst] ^= ip->imm.i;
+
+    DISPATCH();
+
+TARGET(SHL)
+    r[ip->dst] <<= r[ip->src];
+
+    DISPATCH();
+
+TARGET(SHLI)
+    r[ip->dst] <<= ip->imm.i;
+
+    DISPATCH();
+
+TARGET(SHR)
+    r[ip->dst] >>= r[ip->src];
+
+    DISPATCH();
+
+TARGET(SHRI)
+    r[ip->dst] >>= ip->imm.i;
+
+    DISPATCH();
+
+// little-endian, see wide_load() and wide_store()
+#define DECODED_WIDE(bits)\
+    TARGET(LD##bits)\
+        r[ip->dst] = load_wide(rwmem + r[ip->src], bits / 8);\
+        DECODED_FLAGS_R(ip->dst)\
+        DISPATCH();\
+    TARGET(STR##bits)\
+        store_wide(rwmem + r[ip->dst], r[ip->src], bits / 8);\
+        DECODED_FLAGS_R(ip->dst)\
+        DISPATCH();\
+
+DECODED_WIDE(16)
+DECODED_WIDE(32)
+DECODED_WIDE(64)
+
+#undef DECODED_WIDE
+
+// V<n> registers stay in cpu, no engine keeps a copy of them
+TARGET(VLD)
+    load_vector(&cpu->vregisters[ip->dst], rwmem + r[ip->src]);
+
+    DISPATCH();
+
+TARGET(VST)
+    store_vector(rwmem + r[ip->dst], &cpu->vregisters[ip->src]);
+
+    DISPATCH();
+
+TARGET(VXOR)
+    vector_operation(&cpu->vregisters[ip->dst], &cpu->vregisters[ip->src], 0,
+            VXOR);
+
+    DISPATCH();
+
+TARGET(VADD)
+    vector_operation(&cpu->vregisters[ip->dst], &cpu->vregisters[ip->src], 0,
+            VADD);
+
+    DISPATCH();
+
+TARGET(VSHL)
+    vector_operation(&cpu->vregisters[ip->dst], NULL, ip->imm.i, VSHL);
+
+    DISPATCH();
+
+TARGET(VSHR)
+    vector_operation(&cpu->vregisters[ip->dst], NULL, ip->imm.i, VSHR);
+
+    DISPATCH();
+
+// see block.h, src2 is the length register
+#define DECODED_BLOCK(name, key_length)\
+    TARGET(name)\
+        STATS_BLOCK(cpu, name, r[ip->src2], key_length)\
+        block_operation(rwmem, name, r[ip->dst], r[ip->src], r[ip->src2],\
+                key_length);\
+        DISPATCH();\
+
+DECODED_BLOCK(MEMCPY, 0)
+DECODED_BLOCK(MEMSET, 0)
+DECODED_BLOCK(MEMXOR, 0)
+DECODED_BLOCK(MEMXORK, r[ip->imm.i])
+
+#undef DECODED_BLOCK
+
+// see io.h: a CPU that has to wait stops like on HLT, with PC on the slot
+// before the instruction it goes on from once resumed
+#define DECODED_WAIT(resume)\
+    {\
+        memcpy(cpu->registers, r, sizeof(r));\
+        memcpy(cpu->dregisters, d, sizeof(d));\
+        cpu->flags = flags;\
+\
+        cpu->PC = resume;\
+        cpu->instruction.bytecode = HLT;\
+\
+        return;\
+    }\
+
+TARGET(IN)
+    if(!io_operation(cpu, IN, &r[ip->dst], &r[ip->src]))
+        DECODED_WAIT(ip->slot - 1)
+
+    DECODED_FLAGS_R(ip->src)
+
+    DISPATCH();
+
+TARGET(OUT)
+    if(!io_operation(cpu, OUT, &r[ip->dst], &r[ip->src]))
+        DECODED_WAIT(ip->slot - 1)
+
+    DISPATCH();
+
+TARGET(YIELD)
+    if(!io_operation(cpu, YIELD, NULL, NULL))
+        DECODED_WAIT(ip->slot)
+
+    DISPATCH();
+
+#undef DECODED_WAIT
+
+/*
+ * Superinstructions skip the instructions they were fused with, which are
+ * still there for jumps landing in the middle of the sequence.
+ */
+#define DECODED_COMPARE_JUMP(name, condition)\
+    TARGET(name)\
+        DECODED_COMPARE(r[ip->dst], r[ip->src])\
+        STATS_JUMP(cpu, name - CMP_JE_RR + JE, condition)\
+        if(condition)\
+        {\
+            JUMP(1);\
+        }\
+        SKIP(2);\
+
+DECODED_COMPARE_JUMP(CMP_JE_RR, flags.zero == 1)
+DECODED_COMPARE_JUMP(CMP_JNE_RR, flags.zero == 0)
+DECODED_COMPARE_JUMP(CMP_JLT_RR, flags.zero == 0 && flags.overflow == 0)
+DECODED_COMPARE_JUMP(CMP_JGT_RR, flags.zero == 0 && flags.overflow == 1)
+
+#undef DECODED_COMPARE_JUMP
+
+// LD Ra, Ri; XOR Ra, Rk; STR Ri, Ra; ADDI Ri, imm (only the flags of ADDI
+// are left)
+TARGET(LD_XOR_STR_INC)
+    r[ip->dst] = rwmem[r[ip->src]];
+    r[ip->dst] ^= r[ip->src2];
+    rwmem[r[ip->src]] = r[ip->dst];
+    r[ip->src] += ip->imm.d;
+
+    DECODED_FLAGS_R(ip->src)
+
+    SKIP(4);
+
+// maps the bytes of all the rounds of the loop but the last one, then runs
+// the LD of the last round (see idiom.h)
+TARGET(MAP_LOOP)
+    {
+        size_t rounds = map_loop(ip, r, rwmem, cpu->memory->rwmem_size);
+
+        STATS_MAP_LOOP(cpu, ip, rounds)
+    }
+
+    r[ip->dst] = rwmem[r[ip->src]];
+
+    DECODED_FLAGS_R(ip->dst)
+
+    DISPATCH();
+
+TARGET(HLT)
+    memcpy(cpu->registers, r, sizeof(r));
+    memcpy(cpu->dregisters, d, sizeof(d));
+    cpu->flags = flags;
+
+    cpu->PC = ip->slot;
+    cpu->instruction.bytecode = HLT;
+
+    return;
+
+TARGET(DECODED_FALLBACK)
+    memcpy(cpu->registers, r, sizeof(r));
+    memcpy(cpu->dregisters, d, sizeof(d));
+    cpu->flags = flags;
+
+    // interpret_code() fetches PC + 1
+    cpu->PC = ip->slot - 1;
+    cpu->instruction.bytecode = DECODED_FALLBACK;
+
+    interpret_code(cpu);
+
+    return;
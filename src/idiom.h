@@ -0,0 +1,254 @@
+#pragma once
+
+/**
+ * XORVM map loop idiom.
+ * Author: 0xb4db01
+ *
+ * Most programs for this VM are a loop like the one of xorfun() in
+ * tests.c, changing every byte of rwmem on its own:
+ *
+ *     LD Ra, Ri
+ *     <op> Ra, Rk|imm     XOR, ADD, SUB, SHL, SHR or their immediate form
+ *     STR Ri, Ra
+ *     ADDI Ri, 1
+ *     CMP Ri, Rn          (or CMP Rn, Ri)
+ *     JNE/JLT the LD      (JNE/JGT after CMP Rn, Ri)
+ *
+ * which costs 6 dispatches a byte. FUSE_MAP_LOOP turns the LD into a
+ * MAP_LOOP superinstruction: when the loop is entered it works out how many
+ * times it is going to run, maps all the bytes but the last one at once
+ * with map_bytes() (AVX2 or SSE2 on x86-64) and moves Ri to the last byte.
+ * The last round then runs instruction by instruction, which leaves the
+ * registers, the flags and PC exactly as the whole loop would have.
+ *
+ * If the loop would not stop within rwmem (Ri past Rn for a JNE loop, a
+ * bound larger than rwmem...) or the shift count is not one of 0-63,
+ * MAP_LOOP is just the LD it replaces.
+ */
+
+#include "cpu.h"
+
+// the byte operations map_bytes() knows
+enum MapOperations
+{
+    MAP_XOR,
+    MAP_ADD,
+    MAP_SHL,
+    MAP_SHR
+};
+
+#ifdef __GNUC__
+
+#if defined(__x86_64__) && defined(__linux__)
+#define MAP_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define MAP_TARGETS
+#endif
+
+typedef unsigned char MapBytes __attribute__((vector_size(32)));
+
+#endif
+
+/*
+ * Idiom functions prototypes
+ */
+
+int map_operation(DecodedInstruction *, long *, unsigned char *);
+int match_map_loop(DecodedProgram *, size_t);
+void map_bytes(unsigned char *, size_t, int, unsigned char);
+size_t map_loop(DecodedInstruction *, long *, unsigned char *, size_t);
+
+/*
+ * Returns the enum MapOperations done by the <op> instruction of a map loop
+ * and puts the byte it works with in key (a shift count for shifts), -1 if
+ * it can not be done on the bytes alone with the registers in r.
+ *
+ * Ra is a byte when <op> runs, so only the low 8 bits of Rk or imm matter
+ * for XOR, ADD and SUB. ADDI and SUBI add a double: their immediate has to
+ * be an integer for the result to be a plain byte addition.
+ */
+int map_operation(DecodedInstruction *ip, long *r, unsigned char *key)
+{
+    long value;
+
+    switch(ip->opcode)
+    {
+        case XOR: case ADD_RR: case SHL: case SHR:
+            value = r[ip->src];
+
+            break;
+
+        case SUB_RR:
+            value = -(unsigned long)r[ip->src];
+
+            break;
+
+        case XORI: case SHLI: case SHRI:
+            value = ip->imm.i;
+
+            break;
+
+        case ADDI_R: case SUBI_R:
+            if(!(ip->imm.d >= -4503599627370496.0 &&
+                        ip->imm.d <= 4503599627370496.0) ||
+                    ip->imm.d != (long)ip->imm.d)
+                return -1;
+
+            value = (long)ip->imm.d;
+
+            if(ip->opcode == SUBI_R)
+                value = -value;
+
+            break;
+
+        default:
+            return -1;
+    }
+
+    *key = value;
+
+    switch(ip->opcode)
+    {
+        case XOR: case XORI:
+            return MAP_XOR;
+
+        case ADD_RR: case SUB_RR: case ADDI_R: case SUBI_R:
+            return MAP_ADD;
+    }
+
+    // larger counts would be undefined in the handlers too
+    if(value < 0 || value > 63)
+        return -1;
+
+    // every bit of a byte is shifted out
+    if(value > 7)
+        *key = 8;
+
+    return ip->opcode == SHL || ip->opcode == SHLI ? MAP_SHL : MAP_SHR;
+}
+
+/*
+ * Returns 1 if the instructions at index of program are a map loop (see
+ * the top of this file), checking everything but the values of the
+ * registers, which map_loop() checks every time the loop is entered.
+ */
+int match_map_loop(DecodedProgram *program, size_t index)
+{
+    DecodedInstruction *ip = &program->instructions[index];
+    int a = ip[0].dst;
+    int i = ip[0].src;
+
+    if(program->length - index < 6 || ip[0].opcode != LD_RR || a == i)
+        return 0;
+
+    switch(ip[1].opcode)
+    {
+        case XOR: case ADD_RR: case SUB_RR: case SHL: case SHR:
+            if(ip[1].src == a || ip[1].src == i)
+                return 0;
+
+            break;
+
+        case XORI: case SHLI: case SHRI: case ADDI_R: case SUBI_R:
+            break;
+
+        default:
+            return 0;
+    }
+
+    if(ip[1].dst != a || ip[2].opcode != STR_RR || ip[2].dst != i ||
+            ip[2].src != a || ip[3].opcode != ADDI_R || ip[3].dst != i ||
+            ip[3].imm.d != 1 || ip[4].opcode != CMP_RR ||
+            (size_t)ip[5].imm.i != index)
+        return 0;
+
+    // Ri below Rn is the only way out of the loop, either way around
+    int n = ip[4].dst == i ? ip[4].src : ip[4].dst;
+
+    if(n == a || n == i || (ip[4].dst != i && ip[4].src != i))
+        return 0;
+
+    if(ip[5].opcode == JNE)
+        return 1;
+
+    return ip[5].opcode == (ip[4].dst == i ? JLT : JGT);
+}
+
+/*
+ * Applies operation with key to length bytes.
+ */
+#ifdef __GNUC__
+MAP_TARGETS
+#endif
+void map_bytes(unsigned char *bytes, size_t length, int operation,
+        unsigned char key)
+{
+    size_t done = 0;
+
+#ifdef __GNUC__
+    for(; done + sizeof(MapBytes) <= length; done += sizeof(MapBytes))
+    {
+        MapBytes block;
+
+        memcpy(&block, bytes + done, sizeof(block));
+
+        if(operation == MAP_XOR)
+            block ^= key;
+        else if(operation == MAP_ADD)
+            block += key;
+        else if(key > 7)
+            block = (MapBytes){0};
+        else if(operation == MAP_SHL)
+            block <<= key;
+        else
+            block >>= key;
+
+        memcpy(bytes + done, &block, sizeof(block));
+    }
+#endif
+
+    for(; done < length; ++done)
+    {
+        unsigned char byte = bytes[done];
+
+        if(operation == MAP_XOR)
+            byte ^= key;
+        else if(operation == MAP_ADD)
+            byte += key;
+        else if(key > 7)
+            byte = 0;
+        else if(operation == MAP_SHL)
+            byte <<= key;
+        else
+            byte >>= key;
+
+        bytes[done] = byte;
+    }
+}
+
+/*
+ * Called by MAP_LOOP (ip) when the loop is about to run with the registers
+ * in r: maps every byte but the last one the loop is going to go through
+ * and moves Ri to it. Returns the number of bytes mapped, 0 if the loop
+ * has to run the slow way.
+ */
+size_t map_loop(DecodedInstruction *ip, long *r, unsigned char *rwmem,
+        size_t size)
+{
+    long index = r[ip->src];
+    long end = r[ip[4].dst == ip->src ? ip[4].src : ip[4].dst];
+    unsigned char key;
+
+    if(rwmem == NULL || index < 0 || end <= index + 1 || (size_t)end > size)
+        return 0;
+
+    int operation = map_operation(&ip[1], r, &key);
+
+    if(operation == -1)
+        return 0;
+
+    map_bytes(rwmem + index, end - index - 1, operation, key);
+    r[ip->src] = end - 1;
+
+    return end - index - 1;
+}
@@ -6,5 +6,10 @@ enum Instructions
     JMP, JE, JNE, JLT, JGT,
     LD, STR,
     XOR, XORI, SHL, SHR, SHLI, SHRI,
-    HLT
+    HLT,
+    LD16, LD32, LD64, STR16, STR32, STR64,
+    VLD, VST, VXOR, VADD, VSHL, VSHR,
+    MEMCPY, MEMSET, MEMXOR, MEMXORK,
+    IN, OUT, YIELD,
+    TOTAL_INSTRUCTIONS
 };
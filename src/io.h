@@ -0,0 +1,871 @@
+#pragma once
+
+/**
+ * XORVM I/O channels.
+ * Author: 0xb4db01
+ *
+ * IN and OUT move bytes between rwmem and the channels of a CPU, so a
+ * program can take its input a chunk at a time and give its output as it
+ * goes instead of finding all of it in rwmem. Their operands are R<n>
+ * registers:
+ *
+ *     IN Rd, Rn       reads up to Rn bytes to rwmem[Rd...], Rn = bytes read
+ *     OUT Rs, Rn      writes the Rn bytes of rwmem[Rs...]
+ *     YIELD           lets the host run something else
+ *
+ * IN reads what the input has, up to Rn bytes, and sets the flags on Rn: 0
+ * is the end of the input. Nothing happens when Rn is 0 or less (IN sets it
+ * to 0). Like LD and STR the ranges are not checked (see run_safe() in
+ * verify.h).
+ *
+ * When IN finds the input empty but not closed, or OUT finds no room for
+ * its bytes in the output, the CPU waits: it stops as if it had run a HLT,
+ * with cpu->io_wait telling why, and run_io() goes on from that very
+ * instruction once the host filled or drained the channel. YIELD stops the
+ * same way and goes on after itself. The engines have nothing to do with
+ * it beyond running IN, OUT and YIELD.
+ *
+ *     Io io;
+ *
+ *     init_io(&io, IO_BUFFER, IO_BUFFER);
+ *     attach_io(cpu, &io);
+ *
+ *     for(int wait; (wait = run_io(cpu)) != IO_NONE;)
+ *     {
+ *         if(wait == IO_WAIT_IN)
+ *             ... push_io(&io.in, ...) or io.in.closed = 1
+ *         else if(wait == IO_WAIT_OUT)
+ *             ... pull_io(&io.out, ...)
+ *     }
+ *
+ *     deinit_io(&io);
+ *
+ * An IoLoop does that for any number of CPUs in a single thread, reading
+ * their input from file descriptors (pipes, sockets...) watched with epoll
+ * or from bytes other threads give with post_io(), and writing their output
+ * to file descriptors: while some CPUs wait for their I/O the others run.
+ *
+ * A CPU without channels never waits: IN finds the end of the input, OUT
+ * throws its bytes away and YIELD does nothing. run_batch() and the AOT
+ * code run CPUs this way. The JIT leaves IN, OUT and YIELD to
+ * interpret_code() with the rest of the run, so programs doing a lot of I/O
+ * are better off with ENGINE_THREADED.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "cpu.h"
+
+// bytes of the input and of the output of a stream of an IoLoop
+#define IO_BUFFER 65536
+
+// epoll events taken at a time by run_io_loop()
+#define IO_EVENTS 64
+
+enum IoWaits
+{
+    IO_NONE,
+    IO_WAIT_IN,
+    IO_WAIT_OUT,
+    IO_YIELDED
+};
+
+/*
+ * The bytes of a channel are data[start...end]. closed is set on an input
+ * that has nothing more to give (IN then reads 0 bytes) and on an output
+ * nobody takes anymore (OUT then throws its bytes away).
+ */
+typedef struct io_channel_t
+{
+    unsigned char *data;
+    size_t size;
+    size_t start;
+    size_t end;
+    int closed;
+} IoChannel;
+
+typedef struct io_t
+{
+    IoChannel in;
+    IoChannel out;
+} Io;
+
+/*
+ * A CPU run by an IoLoop, reading its input from in_fd and writing its
+ * output to out_fd (the same socket may be both). in_fd -1 is an input
+ * given with post_io(), out_fd -1 an output thrown away. done, if not NULL,
+ * is called once the CPU halted and all its output is written.
+ *
+ * posted holds the bytes post_io() gave and run_io_stream() did not take yet,
+ * under the lock of the loop.
+ */
+typedef struct io_stream_t
+{
+    CPU *cpu;
+    Io io;
+    int in_fd;
+    int out_fd;
+
+    void (*done)(struct io_stream_t *);
+    void *data;
+
+    unsigned char *posted;
+    size_t posted_length;
+    size_t posted_size;
+    int posted_closed;
+    int posted_queued;
+
+    int halted;
+    int queued;
+    int watched_in;
+    int watched_out;
+
+    struct io_stream_t *next;
+    struct io_stream_t *next_posted;
+} IoStream;
+
+/*
+ * head to tail is the queue of the streams to run, streams the number of
+ * streams added and not done yet. wake is the eventfd post_io()
+ * writes to, posted the streams it gave bytes to.
+ */
+typedef struct io_loop_t
+{
+    int epoll;
+    int wake;
+
+    pthread_mutex_t lock;
+    IoStream *posted;
+
+    IoStream *head;
+    IoStream *tail;
+    size_t streams;
+} IoLoop;
+
+/*
+ * I/O functions prototypes
+ */
+
+int init_io(Io *, size_t, size_t);
+void deinit_io(Io *);
+void attach_io(CPU *, Io *);
+size_t push_io(IoChannel *, const unsigned char *, size_t);
+size_t pull_io(IoChannel *, unsigned char *, size_t);
+void compact_io(IoChannel *);
+int io_operation(CPU *, int, long *, long *);
+void resume_io(CPU *);
+int run_io(CPU *);
+
+/*
+ * I/O loop functions prototypes
+ */
+
+IoLoop *new_io_loop();
+void free_io_loop(IoLoop *);
+int add_io_stream(IoLoop *, IoStream *, CPU *, int, int);
+int post_io(IoLoop *, IoStream *, const unsigned char *, size_t, int);
+int run_io_loop(IoLoop *);
+void queue_io_stream(IoLoop *, IoStream *);
+int watch_io_stream(IoLoop *, IoStream *, int, int);
+void fill_io_stream(IoLoop *, IoStream *);
+int flush_io_stream(IoStream *);
+void finish_io_stream(IoLoop *, IoStream *);
+void run_io_stream(IoLoop *, IoStream *);
+
+/*
+ * Makes io with an input of in_size bytes and an output of out_size bytes.
+ * Returns 0 if there is not enough memory.
+ */
+int init_io(Io *io, size_t in_size, size_t out_size)
+{
+    memset(io, 0, sizeof(Io));
+
+    io->in.data = (unsigned char *)malloc(in_size > 0 ? in_size : 1);
+    io->out.data = (unsigned char *)malloc(out_size > 0 ? out_size : 1);
+
+    if(io->in.data == NULL || io->out.data == NULL)
+    {
+        deinit_io(io);
+
+        return 0;
+    }
+
+    io->in.size = in_size;
+    io->out.size = out_size;
+
+    return 1;
+}
+
+void deinit_io(Io *io)
+{
+    free(io->in.data);
+    free(io->out.data);
+
+    memset(io, 0, sizeof(Io));
+}
+
+/*
+ * Gives cpu the channels of io, NULL for none (see above).
+ */
+void attach_io(CPU *cpu, Io *io)
+{
+    cpu->io = io;
+}
+
+/*
+ * Moves the bytes of channel to the start of its data.
+ */
+void compact_io(IoChannel *channel)
+{
+    if(channel->start == 0)
+        return;
+
+    memmove(channel->data, channel->data + channel->start,
+            channel->end - channel->start);
+
+    channel->end -= channel->start;
+    channel->start = 0;
+}
+
+/*
+ * Adds up to length bytes to channel, returns how many there was room for.
+ */
+size_t push_io(IoChannel *channel, const unsigned char *bytes, size_t length)
+{
+    if(channel->end + length > channel->size)
+        compact_io(channel);
+
+    if(length > channel->size - channel->end)
+        length = channel->size - channel->end;
+
+    memcpy(channel->data + channel->end, bytes, length);
+    channel->end += length;
+
+    return length;
+}
+
+/*
+ * Takes up to size bytes out of channel, returns how many it had.
+ */
+size_t pull_io(IoChannel *channel, unsigned char *bytes, size_t size)
+{
+    size_t length = channel->end - channel->start;
+
+    if(length > size)
+        length = size;
+
+    memcpy(bytes, channel->data + channel->start, length);
+    channel->start += length;
+
+    if(channel->start == channel->end)
+        channel->start = channel->end = 0;
+
+    return length;
+}
+
+/*
+ * Runs IN, OUT or YIELD on cpu, address and length pointing to the
+ * registers of its operands (NULL for YIELD). Returns 0 if the CPU has to
+ * wait, cpu->io_wait telling why, without having changed anything.
+ */
+int io_operation(CPU *cpu, int opcode, long *address, long *length)
+{
+    Io *io = cpu->io;
+
+    switch(opcode)
+    {
+        case IN:
+        {
+            if(*length <= 0 || io == NULL)
+            {
+                *length = 0;
+
+                return 1;
+            }
+
+            IoChannel *in = &io->in;
+            size_t available = in->end - in->start;
+
+            if(available == 0 && !in->closed)
+            {
+                cpu->io_wait = IO_WAIT_IN;
+
+                return 0;
+            }
+
+            *length = pull_io(in, cpu->memory->rwmem + *address, *length);
+
+            return 1;
+        }
+
+        case OUT:
+        {
+            if(*length <= 0 || io == NULL || io->out.closed)
+                return 1;
+
+            IoChannel *out = &io->out;
+            size_t length_bytes = *length;
+            size_t pending = out->end - out->start;
+
+            if(out->size - pending < length_bytes)
+            {
+                if(pending > 0)
+                {
+                    cpu->io_wait = IO_WAIT_OUT;
+
+                    return 0;
+                }
+
+                // more than the channel ever holds: it grows, or closes
+                // when it can not
+                unsigned char *data = (unsigned char *)realloc(out->data,
+                        length_bytes);
+
+                if(data == NULL)
+                {
+                    out->closed = 1;
+
+                    return 1;
+                }
+
+                out->data = data;
+                out->size = length_bytes;
+            }
+
+            push_io(out, cpu->memory->rwmem + *address, length_bytes);
+
+            return 1;
+        }
+
+        case YIELD:
+            if(io == NULL)
+                return 1;
+
+            cpu->io_wait = IO_YIELDED;
+
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Gets a waiting cpu ready to go on, see run_io().
+ */
+void resume_io(CPU *cpu)
+{
+    if(cpu->io_wait == IO_NONE)
+        return;
+
+    cpu->io_wait = IO_NONE;
+
+    // PC is the slot before the instruction to go on from, which
+    // decoded_entry() finds like after a DECODED_FALLBACK
+    cpu->instruction.bytecode = DECODED_FALLBACK;
+}
+
+/*
+ * run_cpu() going on from where cpu waited, if it did. Returns what it
+ * waits for now, IO_NONE once it halted.
+ */
+int run_io(CPU *cpu)
+{
+    resume_io(cpu);
+    run_cpu(cpu);
+
+    return cpu->io_wait;
+}
+
+#ifdef __linux__
+
+/*
+ * I/O loop functions implementation
+ */
+
+/*
+ * An IoLoop with no stream, NULL if epoll or the eventfd can not be made.
+ */
+IoLoop *new_io_loop()
+{
+    IoLoop *loop = (IoLoop *)malloc(sizeof(IoLoop));
+
+    if(loop == NULL)
+        return NULL;
+
+    loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+
+    if(loop->epoll < 0 || loop->wake < 0 ||
+            epoll_ctl(loop->epoll, EPOLL_CTL_ADD, loop->wake, &event) != 0)
+    {
+        if(loop->epoll >= 0)
+            close(loop->epoll);
+
+        if(loop->wake >= 0)
+            close(loop->wake);
+
+        free(loop);
+
+        return NULL;
+    }
+
+    pthread_mutex_init(&loop->lock, NULL);
+
+    loop->posted = NULL;
+    loop->head = NULL;
+    loop->tail = NULL;
+    loop->streams = 0;
+
+    return loop;
+}
+
+/*
+ * Frees loop, which should have no stream left (see run_io_loop()).
+ */
+void free_io_loop(IoLoop *loop)
+{
+    if(loop == NULL)
+        return;
+
+    close(loop->epoll);
+    close(loop->wake);
+
+    pthread_mutex_destroy(&loop->lock);
+
+    free(loop);
+}
+
+/*
+ * Adds stream to loop, to run cpu with in_fd and out_fd (see IoStream),
+ * which are made non-blocking. done and data are left as the caller set
+ * them. Streams are added before run_io_loop() or from the done callbacks,
+ * in the thread of the loop. Returns 0 if there is not enough memory.
+ */
+int add_io_stream(IoLoop *loop, IoStream *stream, CPU *cpu, int in_fd,
+        int out_fd)
+{
+    if(!init_io(&stream->io, IO_BUFFER, IO_BUFFER))
+        return 0;
+
+    stream->cpu = cpu;
+    stream->in_fd = in_fd;
+    stream->out_fd = out_fd;
+
+    stream->posted = NULL;
+    stream->posted_length = 0;
+    stream->posted_size = 0;
+    stream->posted_closed = 0;
+    stream->posted_queued = 0;
+
+    stream->halted = 0;
+    stream->queued = 0;
+    stream->watched_in = 0;
+    stream->watched_out = 0;
+
+    stream->next = NULL;
+    stream->next_posted = NULL;
+
+    attach_io(cpu, &stream->io);
+
+    if(in_fd >= 0)
+        fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL) | O_NONBLOCK);
+
+    if(out_fd >= 0 && out_fd != in_fd)
+        fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_NONBLOCK);
+
+    loop->streams++;
+    queue_io_stream(loop, stream);
+
+    return 1;
+}
+
+/*
+ * Gives the input of stream length more bytes, then closes it if close is
+ * not 0. This is the one function of an IoLoop any thread may call, while
+ * the loop runs. Returns 0 if there is not enough memory or the loop could
+ * not be woken up (the bytes are given to the stream anyway).
+ */
+int post_io(IoLoop *loop, IoStream *stream, const unsigned char *bytes,
+        size_t length, int close)
+{
+    pthread_mutex_lock(&loop->lock);
+
+    if(stream->posted_length + length > stream->posted_size)
+    {
+        size_t size = (stream->posted_length + length) * 2;
+        unsigned char *posted = (unsigned char *)realloc(stream->posted,
+                size);
+
+        if(posted == NULL)
+        {
+            pthread_mutex_unlock(&loop->lock);
+
+            return 0;
+        }
+
+        stream->posted = posted;
+        stream->posted_size = size;
+    }
+
+    if(length > 0)
+        memcpy(stream->posted + stream->posted_length, bytes, length);
+
+    stream->posted_length += length;
+    stream->posted_closed = stream->posted_closed || close;
+
+    if(!stream->posted_queued)
+    {
+        stream->posted_queued = 1;
+        stream->next_posted = loop->posted;
+        loop->posted = stream;
+    }
+
+    pthread_mutex_unlock(&loop->lock);
+
+    unsigned long long one = 1;
+
+    // EAGAIN means the counter is full, so the loop is awake already
+    if(write(loop->wake, &one, sizeof(one)) != sizeof(one) &&
+            errno != EAGAIN)
+        return 0;
+
+    return 1;
+}
+
+void queue_io_stream(IoLoop *loop, IoStream *stream)
+{
+    if(stream->queued)
+        return;
+
+    stream->queued = 1;
+    stream->next = NULL;
+
+    if(loop->tail == NULL)
+        loop->head = stream;
+    else
+        loop->tail->next = stream;
+
+    loop->tail = stream;
+}
+
+/*
+ * Has epoll tell once fd (in_fd or out_fd of stream) is ready for events.
+ * Returns 0 if fd can not be watched: a regular file, which is always
+ * ready.
+ */
+int watch_io_stream(IoLoop *loop, IoStream *stream, int fd, int events)
+{
+    struct epoll_event event;
+    int *watched = fd == stream->in_fd ? &stream->watched_in :
+        &stream->watched_out;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = stream;
+
+    // the same socket for in_fd and out_fd is added once
+    if(stream->in_fd == stream->out_fd)
+        watched = &stream->watched_in;
+
+    if(epoll_ctl(loop->epoll, *watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd,
+                &event) != 0)
+        return 0;
+
+    *watched = 1;
+
+    return 1;
+}
+
+/*
+ * Reads what in_fd (or post_io()) has for the input of stream. A read
+ * error is the end of the input like the end of the file.
+ */
+void fill_io_stream(IoLoop *loop, IoStream *stream)
+{
+    IoChannel *in = &stream->io.in;
+
+    compact_io(in);
+
+    if(stream->in_fd < 0)
+    {
+        pthread_mutex_lock(&loop->lock);
+
+        if(stream->posted_length > 0)
+        {
+            size_t length = push_io(in, stream->posted,
+                    stream->posted_length);
+
+            memmove(stream->posted, stream->posted + length,
+                    stream->posted_length - length);
+            stream->posted_length -= length;
+        }
+
+        if(stream->posted_length == 0 && stream->posted_closed)
+            in->closed = 1;
+
+        pthread_mutex_unlock(&loop->lock);
+
+        return;
+    }
+
+    if(in->closed || in->end == in->size)
+        return;
+
+    ssize_t length = read(stream->in_fd, in->data + in->end,
+            in->size - in->end);
+
+    if(length > 0)
+        in->end += length;
+    else if(length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR))
+        in->closed = 1;
+}
+
+/*
+ * Writes what it can of the output of stream to out_fd, or throws it away
+ * without one. A write error closes the output. Returns 1 if anything
+ * left the channel.
+ */
+int flush_io_stream(IoStream *stream)
+{
+    IoChannel *out = &stream->io.out;
+    size_t pending = out->end - out->start;
+
+    if(pending == 0)
+        return 0;
+
+    if(stream->out_fd < 0 || out->closed)
+    {
+        out->start = out->end = 0;
+
+        return 1;
+    }
+
+    ssize_t length = write(stream->out_fd, out->data + out->start, pending);
+
+    if(length < 0)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+
+        out->closed = 1;
+        out->start = out->end = 0;
+
+        return 1;
+    }
+
+    out->start += length;
+
+    if(out->start == out->end)
+        out->start = out->end = 0;
+
+    return length > 0;
+}
+
+/*
+ * Takes stream out of loop once its CPU halted and its output is written.
+ */
+void finish_io_stream(IoLoop *loop, IoStream *stream)
+{
+    if(stream->watched_in)
+        epoll_ctl(loop->epoll, EPOLL_CTL_DEL, stream->in_fd, NULL);
+
+    if(stream->watched_out)
+        epoll_ctl(loop->epoll, EPOLL_CTL_DEL, stream->out_fd, NULL);
+
+    // post_io() must not find it anymore
+    pthread_mutex_lock(&loop->lock);
+
+    for(IoStream **posted = &loop->posted; *posted != NULL;
+            posted = &(*posted)->next_posted)
+    {
+        if(*posted == stream)
+        {
+            *posted = stream->next_posted;
+
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&loop->lock);
+
+    free(stream->posted);
+    stream->posted = NULL;
+
+    attach_io(stream->cpu, NULL);
+    deinit_io(&stream->io);
+
+    loop->streams--;
+
+    if(stream->done != NULL)
+        stream->done(stream);
+}
+
+/*
+ * Gives stream what its CPU waits for, runs it until it waits again and
+ * works out what wakes it up next: the queue, epoll, or post_io().
+ */
+void run_io_stream(IoLoop *loop, IoStream *stream)
+{
+    CPU *cpu = stream->cpu;
+    IoChannel *in = &stream->io.in;
+    IoChannel *out = &stream->io.out;
+
+    stream->queued = 0;
+
+    if(stream->halted)
+        flush_io_stream(stream);
+    else if(cpu->io_wait == IO_WAIT_IN && in->start == in->end)
+        fill_io_stream(loop, stream);
+
+    if(!stream->halted && (cpu->io_wait != IO_WAIT_OUT ||
+                flush_io_stream(stream)))
+    {
+        stream->halted = run_io(cpu) == IO_NONE;
+
+        // the output goes as soon as there is some, the input is read
+        // ahead while the CPU runs
+        flush_io_stream(stream);
+
+        if(cpu->io_wait == IO_WAIT_IN)
+            fill_io_stream(loop, stream);
+    }
+
+    // a regular file can not be watched, but is always ready
+    if(stream->halted)
+    {
+        if(out->start == out->end || out->closed)
+            finish_io_stream(loop, stream);
+        else if(!watch_io_stream(loop, stream, stream->out_fd, EPOLLOUT))
+            queue_io_stream(loop, stream);
+
+        return;
+    }
+
+    switch(cpu->io_wait)
+    {
+        case IO_YIELDED:
+            queue_io_stream(loop, stream);
+
+            break;
+
+        // without in_fd post_io() wakes it up
+        case IO_WAIT_IN:
+            if(in->start != in->end || in->closed ||
+                    (stream->in_fd >= 0 &&
+                     !watch_io_stream(loop, stream, stream->in_fd, EPOLLIN)))
+                queue_io_stream(loop, stream);
+
+            break;
+
+        case IO_WAIT_OUT:
+            if(out->start == out->end ||
+                    !watch_io_stream(loop, stream, stream->out_fd, EPOLLOUT))
+                queue_io_stream(loop, stream);
+
+            break;
+    }
+}
+
+/*
+ * Runs the streams of loop until every one of them is done. The streams
+ * ready at the start of a round run once, then epoll is polled, without
+ * waiting if some streams are ready again: one stream yielding over and
+ * over does not keep the others from their I/O. Returns 0, or -1 if epoll
+ * fails.
+ */
+int run_io_loop(IoLoop *loop)
+{
+    struct epoll_event events[IO_EVENTS];
+
+    while(loop->streams > 0)
+    {
+        IoStream *round = loop->head;
+
+        loop->head = loop->tail = NULL;
+
+        while(round != NULL)
+        {
+            IoStream *stream = round;
+
+            round = stream->next;
+            run_io_stream(loop, stream);
+        }
+
+        if(loop->streams == 0)
+            break;
+
+        int count = epoll_wait(loop->epoll, events, IO_EVENTS,
+                loop->head != NULL ? 0 : -1);
+
+        if(count < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        for(int i = 0; i < count; ++i)
+        {
+            IoStream *stream = (IoStream *)events[i].data.ptr;
+
+            if(stream != NULL)
+            {
+                queue_io_stream(loop, stream);
+
+                continue;
+            }
+
+            unsigned long long posts;
+
+            if(read(loop->wake, &posts, sizeof(posts)) != sizeof(posts))
+                continue;
+
+            // every stream post_io() gave bytes to runs again, those
+            // not waiting for them just wait again
+            pthread_mutex_lock(&loop->lock);
+
+            for(IoStream *posted = loop->posted; posted != NULL;
+                    posted = posted->next_posted)
+            {
+                posted->posted_queued = 0;
+                queue_io_stream(loop, posted);
+            }
+
+            loop->posted = NULL;
+
+            pthread_mutex_unlock(&loop->lock);
+        }
+    }
+
+    return 0;
+}
+
+#else
+
+IoLoop *new_io_loop()
+{
+    return NULL;
+}
+
+void free_io_loop(IoLoop *loop)
+{
+    (void)loop;
+}
+
+#endif
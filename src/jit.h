@@ -0,0 +1,1181 @@
+#pragma once
+
+/**
+ * XORVM x86-64 JIT.
+ * Author: 0xb4db01
+ *
+ * Translates a DecodedProgram to native code in a mmap'd buffer. R0-R7 live
+ * in r8-r15 and D0-D7 in xmm8-xmm15 for the whole run, CMP on R<n>
+ * registers followed by a conditional jump becomes a native cmp/jcc, and
+ * everything else keeps the semantics of the handlers in handlers.h (the
+ * same double conversions, the same flags, the same PC when halting).
+ *
+ * On hosts other than x86-64 Linux jit_compile() returns NULL and
+ * ENGINE_JIT runs the threaded engine instead. So it does with
+ * XORVM_STATS, native code not counting what it runs (see stats.h).
+ */
+
+#include <stddef.h>
+
+#include "cpu.h"
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(XORVM_STATS)
+#define XORVM_JIT
+
+#include <sys/mman.h>
+#endif
+
+/*
+ * offsets holds the position in code of every entry of program, so a CPU
+ * can start (or resume) at any instruction.
+ */
+typedef struct jit_program_t
+{
+    unsigned char *code;
+    size_t size;
+    size_t *offsets;
+} JitProgram;
+
+/*
+ * JIT functions prototypes
+ */
+
+JitProgram *jit_compile(DecodedProgram *);
+void free_jit_program(JitProgram *);
+void run_jit(CPU *);
+
+#ifdef XORVM_JIT
+
+/*
+ * x86-64 encoding.
+ *
+ * Registers are numbered as in the ModRM/REX encoding: 0-7 are rax, rcx,
+ * rdx, rbx, rsp, rbp, rsi, rdi and 8-15 are r8-r15 (or xmm0-xmm15 for SSE
+ * instructions).
+ */
+
+enum JitRegisters
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// condition codes, as in jcc/setcc
+enum JitConditions
+{
+    CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_S = 0x8, CC_NP = 0xb,
+    CC_L = 0xc, CC_G = 0xf
+};
+
+#define JIT_R(reg) (R8 + (reg))
+#define JIT_D(reg) (8 + (reg))
+
+// generated code is called as code(rwmem, cpu, entry), so rdi is rwmem and
+// rsi is the CPU
+#define JIT_RWMEM RDI
+#define JIT_CPU RSI
+
+// rbx holds 2^52 for the fast path of ADDI/SUBI, see jit_addi()
+#define JIT_BIAS RBX
+
+#define JIT_FLAG(flag) (int)offsetof(CPU, flags.flag)
+
+// V<n> registers stay in the CPU, half is one of their two 16-byte halves
+#define JIT_V(reg, half) (int)(offsetof(CPU, vregisters) +\
+        (reg) * sizeof(VectorRegister) + (half) * 16)
+
+typedef struct jit_buffer_t
+{
+    unsigned char *bytes;
+    size_t size;
+    size_t capacity;
+    int failed;
+} JitBuffer;
+
+/*
+ * A rel32 waiting for its target: an entry of the program (target >= 0)
+ * or a position in the buffer (target < 0 means -position - 1).
+ */
+typedef struct jit_fixup_t
+{
+    size_t at;
+    long target;
+} JitFixup;
+
+/*
+ * An ADDI/SUBI whose fast path bailed out, compiled after the program.
+ */
+typedef struct jit_slow_path_t
+{
+    size_t jump;
+    size_t back;
+    DecodedInstruction *instruction;
+} JitSlowPath;
+
+/*
+ * instructions is a copy of the instructions of program with the
+ * superinstructions taken apart again (see unfused_opcode()): the JIT
+ * does its own fusion of CMP and conditional jumps.
+ */
+typedef struct jit_compiler_t
+{
+    JitBuffer buffer;
+    DecodedProgram *program;
+    DecodedInstruction *instructions;
+
+    JitFixup *fixups;
+    size_t fixups_count;
+
+    JitSlowPath *slow_paths;
+    size_t slow_paths_count;
+
+    size_t *offsets;
+    unsigned char *targets;
+
+    size_t epilogue;
+} JitCompiler;
+
+void jit_byte(JitBuffer *buffer, int byte)
+{
+    if(buffer->size == buffer->capacity)
+    {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        unsigned char *bytes = (unsigned char *)realloc(buffer->bytes,
+                capacity);
+
+        if(bytes == NULL)
+        {
+            buffer->failed = 1;
+
+            return;
+        }
+
+        buffer->bytes = bytes;
+        buffer->capacity = capacity;
+    }
+
+    buffer->bytes[buffer->size++] = byte;
+}
+
+void jit_int32(JitBuffer *buffer, int value)
+{
+    for(int i = 0; i < 4; ++i)
+        jit_byte(buffer, (value >> (i * 8)) & 0xff);
+}
+
+void jit_int64(JitBuffer *buffer, long value)
+{
+    for(int i = 0; i < 8; ++i)
+        jit_byte(buffer, (value >> (i * 8)) & 0xff);
+}
+
+void jit_patch32(JitBuffer *buffer, size_t at, int value)
+{
+    if(buffer->failed)
+        return;
+
+    for(int i = 0; i < 4; ++i)
+        buffer->bytes[at + i] = (value >> (i * 8)) & 0xff;
+}
+
+/*
+ * [prefix] [REX] opcode, where opcode may be a single byte or 0x0fXX.
+ */
+void jit_opcode(JitBuffer *buffer, int prefix, int w, int reg, int index,
+        int base, int opcode)
+{
+    int rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) |
+        ((base & 8) >> 3);
+
+    if(prefix)
+        jit_byte(buffer, prefix);
+
+    if(rex != 0x40)
+        jit_byte(buffer, rex);
+
+    if(opcode > 0xff)
+        jit_byte(buffer, opcode >> 8);
+
+    jit_byte(buffer, opcode & 0xff);
+}
+
+/*
+ * opcode reg, rm with both operands in registers.
+ */
+void jit_rr(JitBuffer *buffer, int prefix, int w, int opcode, int reg, int rm)
+{
+    jit_opcode(buffer, prefix, w, reg, 0, rm, opcode);
+    jit_byte(buffer, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/*
+ * opcode reg, [base + disp32]
+ */
+void jit_mem(JitBuffer *buffer, int prefix, int w, int opcode, int reg,
+        int base, int disp)
+{
+    jit_opcode(buffer, prefix, w, reg, 0, base, opcode);
+    jit_byte(buffer, 0x80 | ((reg & 7) << 3) | (base & 7));
+
+    if((base & 7) == RSP)
+        jit_byte(buffer, 0x24);
+
+    jit_int32(buffer, disp);
+}
+
+/*
+ * opcode reg, [base + index]
+ */
+void jit_sib(JitBuffer *buffer, int prefix, int w, int opcode, int reg,
+        int base, int index)
+{
+    jit_opcode(buffer, prefix, w, reg, index, base, opcode);
+
+    // rbp/r13 as base need an explicit displacement
+    if((base & 7) == RBP)
+    {
+        jit_byte(buffer, 0x44 | ((reg & 7) << 3));
+        jit_byte(buffer, ((index & 7) << 3) | (base & 7));
+        jit_byte(buffer, 0);
+    } else
+    {
+        jit_byte(buffer, 0x04 | ((reg & 7) << 3));
+        jit_byte(buffer, ((index & 7) << 3) | (base & 7));
+    }
+}
+
+/*
+ * opcode /digit rm, imm32 (0x81) or imm8 (0xc1, 0x83)
+ */
+void jit_ri(JitBuffer *buffer, int w, int opcode, int digit, int rm,
+        long imm)
+{
+    jit_rr(buffer, 0, w, opcode, digit, rm);
+
+    if(opcode == 0x81)
+        jit_int32(buffer, imm);
+    else
+        jit_byte(buffer, imm & 0xff);
+}
+
+void jit_mov_imm(JitBuffer *buffer, int reg, long imm)
+{
+    if(imm >= -0x80000000L && imm <= 0x7fffffffL)
+    {
+        // mov r/m64, imm32 (sign extended)
+        jit_rr(buffer, 0, 1, 0xc7, 0, reg);
+        jit_int32(buffer, imm);
+    } else
+    {
+        jit_opcode(buffer, 0, 1, 0, 0, reg, 0xb8 + (reg & 7));
+        jit_int64(buffer, imm);
+    }
+}
+
+void jit_movq_imm(JitBuffer *buffer, int xmm, double value)
+{
+    long bits;
+
+    memcpy(&bits, &value, sizeof(long));
+
+    jit_mov_imm(buffer, RAX, bits);
+
+    // movq xmm, rax
+    jit_rr(buffer, 0x66, 1, 0x0f6e, xmm, RAX);
+}
+
+/*
+ * Emits a jump (jcc when condition >= 0) to an entry of the program, or to
+ * a position in the buffer when target is negative (see JitFixup).
+ */
+void jit_jump(JitCompiler *compiler, int condition, long target)
+{
+    JitBuffer *buffer = &compiler->buffer;
+
+    if(condition >= 0)
+    {
+        jit_byte(buffer, 0x0f);
+        jit_byte(buffer, 0x80 + condition);
+    } else
+    {
+        jit_byte(buffer, 0xe9);
+    }
+
+    compiler->fixups[compiler->fixups_count].at = buffer->size;
+    compiler->fixups[compiler->fixups_count].target = target;
+    compiler->fixups_count++;
+
+    jit_int32(buffer, 0);
+}
+
+/*
+ * Returns 1 if an instruction setting the flags in written must store them,
+ * that is if they may be read before the next instructions overwrite them.
+ * Jumps and anything leaving the JIT read the flags.
+ */
+int jit_flags_live(JitCompiler *compiler, size_t index, int written)
+{
+    for(size_t i = index + 1; i < compiler->program->entries; ++i)
+    {
+        int opcode = compiler->instructions[i].opcode;
+
+        if(opcode >= CMP_RR && opcode <= CMP_DD)
+            return 0;
+
+        if((opcode >= MOV_RR && opcode <= DIVI_D) ||
+                (opcode >= LD_RR && opcode <= STR_DD) ||
+                (opcode >= LD16 && opcode <= STR64))
+        {
+            // set_flags() does not touch the overflow flag
+            if(written == 3)
+                continue;
+
+            return 0;
+        }
+
+        if(opcode == XOR || opcode == XORI || opcode == SHL ||
+                opcode == SHR || opcode == SHLI || opcode == SHRI ||
+                (opcode >= VLD && opcode <= VSHR))
+            continue;
+
+        return 1;
+    }
+
+    return 1;
+}
+
+/*
+ * Stores the zero and negative flags like set_flags() does for reg.
+ */
+void jit_set_flags(JitBuffer *buffer, int reg)
+{
+    jit_rr(buffer, 0, 0, 0x31, RAX, RAX);
+    jit_rr(buffer, 0, 0, 0x31, RCX, RCX);
+    jit_rr(buffer, 0, 1, 0x85, reg, reg);
+    jit_rr(buffer, 0, 0, 0x0f90 + CC_E, 0, RAX);
+    jit_rr(buffer, 0, 0, 0x0f90 + CC_S, 0, RCX);
+    jit_mem(buffer, 0x66, 0, 0x89, RAX, JIT_CPU, JIT_FLAG(zero));
+    jit_mem(buffer, 0x66, 0, 0x89, RCX, JIT_CPU, JIT_FLAG(negative));
+}
+
+void jit_set_dflags(JitBuffer *buffer, int xmm)
+{
+    // movq rdx, xmm
+    jit_rr(buffer, 0x66, 1, 0x0f7e, xmm, RDX);
+    jit_set_flags(buffer, RDX);
+}
+
+/*
+ * Flags of CMP: rax and rcx must have been cleared before the comparison,
+ * equal and greater are the conditions for the zero and overflow flags and
+ * unordered comparisons (NaN) leave both at 0.
+ */
+void jit_compare_flags(JitBuffer *buffer, int equal, int greater,
+        int unordered)
+{
+    jit_rr(buffer, 0, 0, 0x0f90 + equal, 0, RAX);
+    jit_rr(buffer, 0, 0, 0x0f90 + greater, 0, RCX);
+
+    if(unordered)
+    {
+        jit_rr(buffer, 0, 0, 0x0f90 + CC_NP, 0, RDX);
+        jit_rr(buffer, 0, 0, 0x21, RDX, RAX);
+    }
+
+    jit_mem(buffer, 0x66, 0, 0x89, RAX, JIT_CPU, JIT_FLAG(zero));
+    jit_mem(buffer, 0x66, 0, 0x89, RCX, JIT_CPU, JIT_FLAG(overflow));
+}
+
+void jit_clear_compare(JitBuffer *buffer)
+{
+    jit_rr(buffer, 0, 0, 0x31, RAX, RAX);
+    jit_rr(buffer, 0, 0, 0x31, RCX, RCX);
+    jit_rr(buffer, 0, 0, 0x31, RDX, RDX);
+
+    // mov word [negative], 0
+    jit_mem(buffer, 0x66, 0, 0xc7, 0, JIT_CPU, JIT_FLAG(negative));
+    jit_byte(buffer, 0);
+    jit_byte(buffer, 0);
+}
+
+/*
+ * Leaves the generated code: PC and bytecode are stored in the CPU like
+ * the engines in cpu.h do, status is returned to run_jit().
+ */
+void jit_exit(JitCompiler *compiler, long pc, int bytecode, int status)
+{
+    JitBuffer *buffer = &compiler->buffer;
+
+    jit_mov_imm(buffer, RCX, pc);
+
+    // mov edx, bytecode / mov eax, status
+    jit_byte(buffer, 0xba);
+    jit_int32(buffer, bytecode);
+    jit_byte(buffer, 0xb8);
+    jit_int32(buffer, status);
+
+    jit_jump(compiler, -1, -1 - (long)compiler->epilogue);
+}
+
+/*
+ * sse is one of the addsd/subsd/mulsd/divsd opcodes.
+ */
+void jit_operation(JitBuffer *buffer, DecodedInstruction *ip, int variant,
+        int integer, int sse)
+{
+    int dst = ip->dst;
+    int src = ip->src;
+
+    switch(variant)
+    {
+        case 0:
+            if(integer == 0xf7)
+            {
+                // cqo; idiv, like C's long division (and its traps)
+                jit_rr(buffer, 0, 1, 0x89, JIT_R(dst), RAX);
+                jit_byte(buffer, 0x48);
+                jit_byte(buffer, 0x99);
+                jit_rr(buffer, 0, 1, 0xf7, 7, JIT_R(src));
+                jit_rr(buffer, 0, 1, 0x89, RAX, JIT_R(dst));
+            } else if(integer == 0x0faf)
+            {
+                jit_rr(buffer, 0, 1, 0x0faf, JIT_R(dst), JIT_R(src));
+            } else
+            {
+                jit_rr(buffer, 0, 1, integer, JIT_R(src), JIT_R(dst));
+            }
+
+            jit_set_flags(buffer, JIT_R(dst));
+
+            return;
+
+        case 1:
+            // r = (double)r op d
+            jit_rr(buffer, 0xf2, 1, 0x0f2a, 0, JIT_R(dst));
+            jit_rr(buffer, 0xf2, 0, sse, 0, JIT_D(src));
+            jit_rr(buffer, 0xf2, 1, 0x0f2c, JIT_R(dst), 0);
+            jit_set_flags(buffer, JIT_R(dst));
+
+            return;
+
+        case 2:
+            jit_rr(buffer, 0xf2, 1, 0x0f2a, 0, JIT_R(src));
+            jit_rr(buffer, 0xf2, 0, sse, JIT_D(dst), 0);
+            jit_set_dflags(buffer, JIT_D(dst));
+
+            return;
+
+        case 3:
+            jit_rr(buffer, 0xf2, 0, sse, JIT_D(dst), JIT_D(src));
+            jit_set_dflags(buffer, JIT_D(dst));
+
+            return;
+    }
+}
+
+/*
+ * The exact ADDI/SUBI/MULI/DIVI on a R<n> register: converted to double
+ * and back.
+ */
+void jit_operationi_r(JitBuffer *buffer, DecodedInstruction *ip, int sse)
+{
+    jit_movq_imm(buffer, 1, ip->imm.d);
+    jit_rr(buffer, 0xf2, 1, 0x0f2a, 0, JIT_R(ip->dst));
+    jit_rr(buffer, 0xf2, 0, sse, 0, 1);
+    jit_rr(buffer, 0xf2, 1, 0x0f2c, JIT_R(ip->dst), 0);
+}
+
+/*
+ * ADDI/SUBI on a R<n> register with an integer immediate: when the
+ * register is within +/-2^52 going through a double is exact, so a plain
+ * add/sub does the job. Otherwise the slow path does the conversions.
+ */
+int jit_addi(JitCompiler *compiler, DecodedInstruction *ip, int digit)
+{
+    JitBuffer *buffer = &compiler->buffer;
+    double imm = ip->imm.d;
+
+    if(!(imm >= -0x7fffffff && imm <= 0x7fffffff) || imm != (long)imm)
+        return 0;
+
+    // mov rax, r; add rax, rbx; shr rax, 53; jnz slow
+    jit_rr(buffer, 0, 1, 0x89, JIT_R(ip->dst), RAX);
+    jit_rr(buffer, 0, 1, 0x01, JIT_BIAS, RAX);
+    jit_ri(buffer, 1, 0xc1, 5, RAX, 53);
+
+    JitSlowPath *slow = &compiler->slow_paths[compiler->slow_paths_count++];
+
+    jit_byte(buffer, 0x0f);
+    jit_byte(buffer, 0x80 + CC_NE);
+    slow->jump = buffer->size;
+    jit_int32(buffer, 0);
+    slow->instruction = ip;
+
+    jit_ri(buffer, 1, 0x81, digit, JIT_R(ip->dst), (long)imm);
+
+    slow->back = buffer->size;
+
+    return 1;
+}
+
+void jit_conditional_jump(JitCompiler *compiler, DecodedInstruction *ip,
+        int fused)
+{
+    JitBuffer *buffer = &compiler->buffer;
+    int opcode = ip->opcode;
+
+    if(fused)
+    {
+        int conditions[] = {
+            [JE] = CC_E, [JNE] = CC_NE, [JLT] = CC_L, [JGT] = CC_G
+        };
+
+        jit_jump(compiler, conditions[opcode], ip->imm.i);
+
+        return;
+    }
+
+    switch(opcode)
+    {
+        case JE:
+            // cmp word [zero], 1
+            jit_mem(buffer, 0x66, 0, 0x83, 7, JIT_CPU, JIT_FLAG(zero));
+            jit_byte(buffer, 1);
+            jit_jump(compiler, CC_E, ip->imm.i);
+
+            break;
+
+        case JNE:
+            jit_mem(buffer, 0x66, 0, 0x83, 7, JIT_CPU, JIT_FLAG(zero));
+            jit_byte(buffer, 0);
+            jit_jump(compiler, CC_E, ip->imm.i);
+
+            break;
+
+        case JLT:
+            // movzx eax, word [zero]; or ax, word [overflow]
+            jit_mem(buffer, 0, 0, 0x0fb7, RAX, JIT_CPU, JIT_FLAG(zero));
+            jit_mem(buffer, 0x66, 0, 0x0b, RAX, JIT_CPU, JIT_FLAG(overflow));
+            jit_jump(compiler, CC_E, ip->imm.i);
+
+            break;
+
+        case JGT:
+        {
+            jit_mem(buffer, 0x66, 0, 0x83, 7, JIT_CPU, JIT_FLAG(zero));
+            jit_byte(buffer, 0);
+
+            // jne over the second test and jump
+            jit_byte(buffer, 0x75);
+            jit_byte(buffer, 0);
+
+            size_t skip = buffer->size;
+
+            jit_mem(buffer, 0x66, 0, 0x83, 7, JIT_CPU, JIT_FLAG(overflow));
+            jit_byte(buffer, 1);
+            jit_jump(compiler, CC_E, ip->imm.i);
+
+            if(!buffer->failed)
+                buffer->bytes[skip - 1] = buffer->size - skip;
+
+            break;
+        }
+    }
+}
+
+/*
+ * VLD, VST, VXOR, VADD, VSHL and VSHR with SSE2, 16 bytes at a time
+ * through xmm0 and xmm1. rax gets the address of VLD and VST.
+ */
+void jit_vector(JitBuffer *buffer, DecodedInstruction *ip)
+{
+    int opcode = ip->opcode;
+
+    if(opcode == VLD || opcode == VST)
+    {
+        int address = opcode == VLD ? ip->src : ip->dst;
+
+        // lea rax, [rwmem + address]
+        jit_sib(buffer, 0, 1, 0x8d, RAX, JIT_RWMEM, JIT_R(address));
+    }
+
+    for(int half = 0; half < 2; ++half)
+    {
+        // movdqu xmm0, [...]
+        if(opcode == VLD)
+            jit_mem(buffer, 0xf3, 0, 0x0f6f, 0, RAX, half * 16);
+        else if(opcode == VST)
+            jit_mem(buffer, 0xf3, 0, 0x0f6f, 0, JIT_CPU, JIT_V(ip->src, half));
+        else
+            jit_mem(buffer, 0xf3, 0, 0x0f6f, 0, JIT_CPU, JIT_V(ip->dst, half));
+
+        if(opcode == VXOR || opcode == VADD)
+        {
+            // pxor or paddq xmm0, xmm1
+            jit_mem(buffer, 0xf3, 0, 0x0f6f, 1, JIT_CPU, JIT_V(ip->src, half));
+            jit_rr(buffer, 0x66, 0, opcode == VXOR ? 0x0fef : 0x0fd4, 0, 1);
+        } else if((opcode == VSHL || opcode == VSHR) &&
+                (ip->imm.i < 0 || ip->imm.i > 63))
+        {
+            jit_rr(buffer, 0x66, 0, 0x0fef, 0, 0);
+        } else if(opcode == VSHL || opcode == VSHR)
+        {
+            // psllq or psrlq xmm0, count
+            jit_rr(buffer, 0x66, 0, 0x0f73, opcode == VSHL ? 6 : 2, 0);
+            jit_byte(buffer, ip->imm.i);
+        }
+
+        // movdqu [...], xmm0
+        if(opcode == VST)
+            jit_mem(buffer, 0xf3, 0, 0x0f7f, 0, RAX, half * 16);
+        else
+            jit_mem(buffer, 0xf3, 0, 0x0f7f, 0, JIT_CPU, JIT_V(ip->dst, half));
+    }
+}
+
+/*
+ * Compiles a single decoded instruction, fused is set when the previous
+ * one was a CMP on R<n> registers whose result is still in the host flags.
+ */
+void jit_instruction(JitCompiler *compiler, size_t index, int fused)
+{
+    JitBuffer *buffer = &compiler->buffer;
+    DecodedInstruction *ip = &compiler->instructions[index];
+    int opcode = ip->opcode;
+    int dst = ip->dst;
+    int src = ip->src;
+    int flags = jit_flags_live(compiler, index, 2);
+
+    switch(opcode)
+    {
+        case MOV_RR:
+            jit_rr(buffer, 0, 1, 0x89, JIT_R(src), JIT_R(dst));
+
+            break;
+
+        case MOV_RD:
+            jit_rr(buffer, 0xf2, 1, 0x0f2c, JIT_R(dst), JIT_D(src));
+
+            break;
+
+        case MOV_DR:
+            jit_rr(buffer, 0xf2, 1, 0x0f2a, JIT_D(dst), JIT_R(src));
+
+            break;
+
+        case MOV_DD:
+            jit_rr(buffer, 0x66, 0, 0x0f28, JIT_D(dst), JIT_D(src));
+
+            break;
+
+        case MOVI_R:
+            jit_mov_imm(buffer, JIT_R(dst), ip->imm.i);
+
+            break;
+
+        case MOVI_D:
+            jit_movq_imm(buffer, JIT_D(dst), ip->imm.d);
+
+            break;
+
+        case ADD_RR: case ADD_RD: case ADD_DR: case ADD_DD:
+            jit_operation(buffer, ip, opcode - ADD_RR, 0x01, 0x0f58);
+
+            return;
+
+        case SUB_RR: case SUB_RD: case SUB_DR: case SUB_DD:
+            jit_operation(buffer, ip, opcode - SUB_RR, 0x29, 0x0f5c);
+
+            return;
+
+        case MUL_RR: case MUL_RD: case MUL_DR: case MUL_DD:
+            jit_operation(buffer, ip, opcode - MUL_RR, 0x0faf, 0x0f59);
+
+            return;
+
+        case DIV_RR: case DIV_RD: case DIV_DR: case DIV_DD:
+            jit_operation(buffer, ip, opcode - DIV_RR, 0xf7, 0x0f5e);
+
+            return;
+
+        case ADDI_R:
+            if(!jit_addi(compiler, ip, 0))
+                jit_operationi_r(buffer, ip, 0x0f58);
+
+            break;
+
+        case SUBI_R:
+            if(!jit_addi(compiler, ip, 5))
+                jit_operationi_r(buffer, ip, 0x0f5c);
+
+            break;
+
+        case MULI_R:
+            jit_operationi_r(buffer, ip, 0x0f59);
+
+            break;
+
+        case DIVI_R:
+            jit_operationi_r(buffer, ip, 0x0f5e);
+
+            break;
+
+        case ADDI_D: case SUBI_D: case MULI_D: case DIVI_D:
+        {
+            int sse[] = {0x0f58, 0x0f5c, 0x0f59, 0x0f5e};
+
+            jit_movq_imm(buffer, 0, ip->imm.d);
+            jit_rr(buffer, 0xf2, 0, sse[(opcode - ADDI_D) / 6], JIT_D(dst), 0);
+
+            break;
+        }
+
+        case CMP_RR:
+            if(!jit_flags_live(compiler, index, 3))
+                return;
+
+            jit_clear_compare(buffer);
+            jit_rr(buffer, 0, 1, 0x39, JIT_R(src), JIT_R(dst));
+            jit_compare_flags(buffer, CC_E, CC_G, 0);
+
+            return;
+
+        case CMP_RD: case CMP_DR: case CMP_DD:
+            if(!jit_flags_live(compiler, index, 3))
+                return;
+
+            jit_clear_compare(buffer);
+
+            if(opcode == CMP_RD)
+            {
+                jit_rr(buffer, 0xf2, 1, 0x0f2a, 0, JIT_R(dst));
+                jit_rr(buffer, 0x66, 0, 0x0f2e, 0, JIT_D(src));
+            } else if(opcode == CMP_DR)
+            {
+                jit_rr(buffer, 0xf2, 1, 0x0f2a, 0, JIT_R(src));
+                jit_rr(buffer, 0x66, 0, 0x0f2e, JIT_D(dst), 0);
+            } else
+            {
+                jit_rr(buffer, 0x66, 0, 0x0f2e, JIT_D(dst), JIT_D(src));
+            }
+
+            jit_compare_flags(buffer, CC_E, CC_A, 1);
+
+            return;
+
+        case JMP:
+            jit_jump(compiler, -1, ip->imm.i);
+
+            return;
+
+        case JE: case JNE: case JLT: case JGT:
+            jit_conditional_jump(compiler, ip, fused);
+
+            return;
+
+        case LD_RR:
+            jit_sib(buffer, 0, 1, 0x0fb6, JIT_R(dst), JIT_RWMEM, JIT_R(src));
+
+            break;
+
+        case LD_RD:
+            // rwmem[(int)d]: cvttsd2si eax; movsxd rax, eax
+            jit_rr(buffer, 0xf2, 0, 0x0f2c, RAX, JIT_D(src));
+            jit_rr(buffer, 0, 1, 0x63, RAX, RAX);
+            jit_sib(buffer, 0, 1, 0x0fb6, JIT_R(dst), JIT_RWMEM, RAX);
+
+            break;
+
+        case LD_DR:
+            jit_sib(buffer, 0, 1, 0x0fb6, RAX, JIT_RWMEM, JIT_R(src));
+            jit_rr(buffer, 0xf2, 1, 0x0f2a, JIT_D(dst), RAX);
+
+            break;
+
+        case LD_DD:
+            jit_rr(buffer, 0xf2, 0, 0x0f2c, RAX, JIT_D(src));
+            jit_rr(buffer, 0, 1, 0x63, RAX, RAX);
+            jit_sib(buffer, 0, 1, 0x0fb6, RAX, JIT_RWMEM, RAX);
+            jit_rr(buffer, 0xf2, 1, 0x0f2a, JIT_D(dst), RAX);
+
+            break;
+
+        case STR_RR:
+            jit_sib(buffer, 0, 0, 0x88, JIT_R(src), JIT_RWMEM, JIT_R(dst));
+
+            break;
+
+        // x86-64 is little-endian too: movzx r64, word, mov r32 (which
+        // clears the high half) and mov r64
+        case LD16:
+            jit_sib(buffer, 0, 1, 0x0fb7, JIT_R(dst), JIT_RWMEM, JIT_R(src));
+
+            break;
+
+        case LD32: case LD64:
+            jit_sib(buffer, 0, opcode == LD64, 0x8b, JIT_R(dst), JIT_RWMEM,
+                    JIT_R(src));
+
+            break;
+
+        case STR16:
+            jit_sib(buffer, 0x66, 0, 0x89, JIT_R(src), JIT_RWMEM, JIT_R(dst));
+
+            break;
+
+        case STR32: case STR64:
+            jit_sib(buffer, 0, opcode == STR64, 0x89, JIT_R(src), JIT_RWMEM,
+                    JIT_R(dst));
+
+            break;
+
+        case STR_RD:
+            // rwmem[(int)r] = d: the double goes through an int, like gcc
+            jit_rr(buffer, 0, 1, 0x63, RAX, JIT_R(dst));
+            jit_rr(buffer, 0xf2, 0, 0x0f2c, RCX, JIT_D(src));
+            jit_sib(buffer, 0, 0, 0x88, RCX, JIT_RWMEM, RAX);
+
+            break;
+
+        case STR_DR:
+            jit_rr(buffer, 0xf2, 0, 0x0f2c, RAX, JIT_D(dst));
+            jit_rr(buffer, 0, 1, 0x63, RAX, RAX);
+            jit_sib(buffer, 0, 0, 0x88, JIT_R(src), JIT_RWMEM, RAX);
+
+            break;
+
+        case STR_DD:
+            jit_rr(buffer, 0xf2, 0, 0x0f2c, RAX, JIT_D(dst));
+            jit_rr(buffer, 0, 1, 0x63, RAX, RAX);
+            jit_rr(buffer, 0xf2, 0, 0x0f2c, RCX, JIT_D(src));
+            jit_sib(buffer, 0, 0, 0x88, RCX, JIT_RWMEM, RAX);
+
+            break;
+
+        case XOR:
+            jit_rr(buffer, 0, 1, 0x31, JIT_R(src), JIT_R(dst));
+
+            return;
+
+        case XORI:
+            if(ip->imm.i >= -0x80000000L && ip->imm.i <= 0x7fffffffL)
+            {
+                jit_ri(buffer, 1, 0x81, 6, JIT_R(dst), ip->imm.i);
+            } else
+            {
+                jit_mov_imm(buffer, RAX, ip->imm.i);
+                jit_rr(buffer, 0, 1, 0x31, RAX, JIT_R(dst));
+            }
+
+            return;
+
+        case SHL: case SHR:
+            jit_rr(buffer, 0, 1, 0x89, JIT_R(src), RCX);
+            jit_rr(buffer, 0, 1, 0xd3, opcode == SHL ? 4 : 7, JIT_R(dst));
+
+            return;
+
+        case SHLI: case SHRI:
+            // the count is masked to 6 bits like the cl version does
+            jit_ri(buffer, 1, 0xc1, opcode == SHLI ? 4 : 7, JIT_R(dst),
+                    ip->imm.i & 63);
+
+            return;
+
+        case HLT:
+            jit_exit(compiler, ip->slot, HLT, 0);
+
+            return;
+
+        case VLD: case VST: case VXOR: case VADD: case VSHL: case VSHR:
+            jit_vector(buffer, ip);
+
+            return;
+
+        default:
+            // anything else goes on in interpret_code() from this instruction
+            jit_exit(compiler, ip->slot - 1, DECODED_FALLBACK, 1);
+
+            return;
+    }
+
+    // every instruction reaching here sets the flags on dst
+    if(!flags)
+        return;
+
+    if(opcode == MOV_DR || opcode == MOV_DD || opcode == MOVI_D ||
+            opcode == ADDI_D || opcode == SUBI_D || opcode == MULI_D ||
+            opcode == DIVI_D || opcode == LD_DR || opcode == LD_DD ||
+            opcode == STR_DR || opcode == STR_DD)
+        jit_set_dflags(buffer, JIT_D(dst));
+    else
+        jit_set_flags(buffer, JIT_R(dst));
+}
+
+/*
+ * Prologue: code(rwmem, cpu, entry) saves the callee saved registers, loads
+ * the VM registers and jumps to entry.
+ */
+void jit_prologue(JitBuffer *buffer)
+{
+    int saved[] = {RBX, R12, R13, R14, R15};
+
+    for(int i = 0; i < 5; ++i)
+        jit_opcode(buffer, 0, 0, 0, 0, saved[i], 0x50 + (saved[i] & 7));
+
+    jit_mov_imm(buffer, JIT_BIAS, 1L << 52);
+
+    for(int i = 0; i < 8; ++i)
+    {
+        jit_mem(buffer, 0, 1, 0x8b, JIT_R(i), JIT_CPU,
+                offsetof(CPU, registers) + i * sizeof(long));
+        jit_mem(buffer, 0xf2, 0, 0x0f10, JIT_D(i), JIT_CPU,
+                offsetof(CPU, dregisters) + i * sizeof(double));
+    }
+
+    // jmp rdx
+    jit_rr(buffer, 0, 0, 0xff, 4, RDX);
+}
+
+/*
+ * Epilogue: rcx is the new PC, edx the bytecode and eax the status.
+ */
+void jit_epilogue(JitBuffer *buffer)
+{
+    int saved[] = {R15, R14, R13, R12, RBX};
+
+    for(int i = 0; i < 8; ++i)
+    {
+        jit_mem(buffer, 0, 1, 0x89, JIT_R(i), JIT_CPU,
+                offsetof(CPU, registers) + i * sizeof(long));
+        jit_mem(buffer, 0xf2, 0, 0x0f11, JIT_D(i), JIT_CPU,
+                offsetof(CPU, dregisters) + i * sizeof(double));
+    }
+
+    jit_mem(buffer, 0, 1, 0x89, RCX, JIT_CPU, offsetof(CPU, PC));
+    jit_mem(buffer, 0, 0, 0x89, RDX, JIT_CPU,
+            offsetof(CPU, instruction.bytecode));
+
+    for(int i = 0; i < 5; ++i)
+        jit_opcode(buffer, 0, 0, 0, 0, saved[i], 0x58 + (saved[i] & 7));
+
+    jit_byte(buffer, 0xc3);
+}
+
+JitProgram *jit_compile(DecodedProgram *program)
+{
+    JitCompiler compiler;
+    JitBuffer *buffer = &compiler.buffer;
+    JitProgram *jit = NULL;
+    size_t entries = program->entries;
+    unsigned char *fused_entries = NULL;
+
+    memset(&compiler, 0, sizeof(compiler));
+
+    // at most a jump, an exit or slow path and a fused jcc entry each
+    compiler.program = program;
+    compiler.fixups = (JitFixup *)malloc(sizeof(JitFixup) * entries * 3);
+    compiler.slow_paths = (JitSlowPath *)malloc(sizeof(JitSlowPath) *
+            entries);
+    compiler.offsets = (size_t *)malloc(sizeof(size_t) * entries);
+    compiler.targets = (unsigned char *)calloc(entries, 1);
+    compiler.instructions = (DecodedInstruction *)malloc(
+            sizeof(DecodedInstruction) * entries);
+
+    if(compiler.fixups == NULL || compiler.slow_paths == NULL ||
+            compiler.offsets == NULL || compiler.targets == NULL ||
+            compiler.instructions == NULL)
+        goto done;
+
+    for(size_t i = 0; i < entries; ++i)
+    {
+        DecodedInstruction *ip = &compiler.instructions[i];
+
+        *ip = program->instructions[i];
+
+        if(unfused_opcode(ip->opcode) != ip->opcode)
+        {
+            ip->opcode = unfused_opcode(ip->opcode);
+            ip->src2 = 0;
+            ip->imm.i = 0;
+        }
+    }
+
+    for(size_t i = 0; i < entries; ++i)
+    {
+        int opcode = compiler.instructions[i].opcode;
+
+        if(opcode >= JMP && opcode <= JGT)
+            compiler.targets[compiler.instructions[i].imm.i] = 1;
+    }
+
+    jit_prologue(buffer);
+
+    // every exit jumps to the epilogue, which comes right after the
+    // prologue: jit_exit() finds its position in epilogue
+    compiler.epilogue = buffer->size;
+    jit_epilogue(buffer);
+
+    fused_entries = (unsigned char *)calloc(entries, 1);
+
+    if(fused_entries == NULL)
+        goto done;
+
+    for(size_t i = 0; i < entries; ++i)
+    {
+        DecodedInstruction *ip = &compiler.instructions[i];
+        int fused = i > 0 && compiler.instructions[i - 1].opcode == CMP_RR &&
+            ip->opcode >= JE && ip->opcode <= JGT && !compiler.targets[i];
+
+        compiler.offsets[i] = buffer->size;
+
+        jit_instruction(&compiler, i, fused);
+
+        // a jcc relying on the host flags can not be an entry point
+        fused_entries[i] = fused;
+    }
+
+    // the slow paths of ADDI/SUBI
+    for(size_t i = 0; i < compiler.slow_paths_count; ++i)
+    {
+        JitSlowPath *slow = &compiler.slow_paths[i];
+        int sse = slow->instruction->opcode == ADDI_R ? 0x0f58 : 0x0f5c;
+
+        jit_patch32(buffer, slow->jump, buffer->size - (slow->jump + 4));
+        jit_operationi_r(buffer, slow->instruction, sse);
+        jit_jump(&compiler, -1, -1 - (long)slow->back);
+    }
+
+    // entries for fused jcc: the same jump, reading the flags in the CPU
+    for(size_t i = 0; i < entries; ++i)
+    {
+        if(!fused_entries[i])
+            continue;
+
+        compiler.offsets[i] = buffer->size;
+
+        jit_conditional_jump(&compiler, &compiler.instructions[i], 0);
+        jit_jump(&compiler, -1, i + 1);
+    }
+
+    for(size_t i = 0; i < compiler.fixups_count; ++i)
+    {
+        JitFixup *fixup = &compiler.fixups[i];
+        size_t target = fixup->target >= 0 ?
+            compiler.offsets[fixup->target] : (size_t)(-1 - fixup->target);
+
+        jit_patch32(buffer, fixup->at, target - (fixup->at + 4));
+    }
+
+    if(buffer->failed)
+        goto done;
+
+    jit = (JitProgram *)malloc(sizeof(JitProgram));
+
+    if(jit == NULL)
+        goto done;
+
+    jit->size = buffer->size;
+    jit->code = (unsigned char *)mmap(NULL, jit->size,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(jit->code == MAP_FAILED)
+    {
+        free(jit);
+        jit = NULL;
+
+        goto done;
+    }
+
+    memcpy(jit->code, buffer->bytes, jit->size);
+
+    // W^X systems may refuse to make the pages executable
+    if(mprotect(jit->code, jit->size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(jit->code, jit->size);
+        free(jit);
+        jit = NULL;
+
+        goto done;
+    }
+
+    jit->offsets = compiler.offsets;
+    compiler.offsets = NULL;
+
+done:
+    free(fused_entries);
+    free(compiler.buffer.bytes);
+    free(compiler.fixups);
+    free(compiler.slow_paths);
+    free(compiler.offsets);
+    free(compiler.targets);
+    free(compiler.instructions);
+
+    return jit;
+}
+
+void free_jit_program(JitProgram *jit)
+{
+    if(jit == NULL)
+        return;
+
+    munmap(jit->code, jit->size);
+    free(jit->offsets);
+    free(jit);
+}
+
+/*
+ * Runs cpu->program natively, compiling it the first time. Instructions
+ * the JIT does not know are left to interpret_code().
+ */
+void run_jit(CPU *cpu)
+{
+    DecodedProgram *program = cpu->program;
+
+    // frozen programs are compiled by new_program() or not at all
+    if(program->jit == NULL && !program->frozen)
+        program->jit = jit_compile(program);
+
+    if(program->jit == NULL)
+    {
+        run_threaded(cpu);
+
+        return;
+    }
+
+    long entry = decoded_entry(cpu);
+
+    if(entry == -1)
+        return;
+
+    typedef int (*JitFunction)(unsigned char *, CPU *, void *);
+
+    JitProgram *jit = (JitProgram *)program->jit;
+    JitFunction function = (JitFunction)(void *)jit->code;
+
+    // like the DECODED_FALLBACK handler, PC is the slot before the
+    // instruction the JIT left to interpret_code()
+    if(function(cpu->memory->rwmem, cpu, jit->code + jit->offsets[entry]))
+        interpret_code(cpu);
+}
+
+#else
+
+JitProgram *jit_compile(DecodedProgram *program)
+{
+    (void)program;
+
+    return NULL;
+}
+
+void free_jit_program(JitProgram *jit)
+{
+    (void)jit;
+}
+
+void run_jit(CPU *cpu)
+{
+    run_threaded(cpu);
+}
+
+#endif
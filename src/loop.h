@@ -0,0 +1,498 @@
+#pragma once
+
+/**
+ * XORVM loop optimizer.
+ * Author: 0xb4db01
+ *
+ * optimize_loops() does what optimize_code() does (see optimize.h), then
+ * goes after the loops. Every jump back to an instruction closes a natural
+ * loop; the ones this works on are the innermost counted ones, a straight
+ * run of code (its body) closed by a CMP and a jump, like the README loop:
+ *
+ *     LD, R0, R1,
+ *     XOR, R0, R3,
+ *     STR, R1, R0,
+ *     ADDI, R1, 1,        // the induction register, the only write to it
+ *     CMP, R1, R2,        // R2, the limit, is not touched by the body
+ *     JNE, 5,             // or JLT counting up, JGT counting down
+ *
+ * Nothing else jumps into the body. Its ADDI/SUBI on the induction register
+ * add up to the step, and when the analysis knows both registers when the
+ * loop starts, the number of runs of the body (the trip count) as well.
+ *
+ *     - loop invariant code motion: the instructions writing a register
+ *       from immediates and registers the body does not write (a MOVI, or a
+ *       MOVI then arithmetic on the same register) move out in front of the
+ *       loop, as long as the body reads nothing they write before the last
+ *       of them
+ *     - unrolling: the body goes factor times in a row with a single CMP
+ *       and jump after them, which takes the loop as long as factor more
+ *       steps stay before the limit; the rest of the runs is left to the
+ *       loop as it was. A loop known to run factor times or less is
+ *       unrolled all the way, without a jump
+ *     - increment merging (see merge_increments()), which gets more to do
+ *       once the bodies are side by side: an induction register nothing but
+ *       the CMP reads gets one ADDI for all the unrolled bodies
+ *
+ *     OptimizeReport report;
+ *     size_t size;
+ *     double *optimized = optimize_loops(code, sizeof(code), 4, 1, &size,
+ *             &report);
+ *
+ * The unrolled loop compares against the limit minus factor steps, so the
+ * limit and the induction register must be within VERIFY_LIMIT whenever the
+ * loop starts: loops reading registers that were never written can only be
+ * unrolled when they start zeroed (zeroed, see Optimizer), which is what
+ * new_cpu() and init_run() do. A program run from other registers has to
+ * be optimized without.
+ *
+ * The output runs on any engine, with fewer CMPs and jumps per run of the
+ * body; what it takes apart is a loop the MAP_LOOP idiom (see idiom.h)
+ * would map 32 bytes at a time, which is best left rolled (factor 1) for
+ * FUSE_MAP_LOOP on the switch and threaded engines.
+ */
+
+#include "optimize.h"
+
+// instructions all the unrolled bodies of a loop may take together
+#define LOOP_MAX_BODY 256
+
+// largest step an unrolled loop may take
+#define LOOP_MAX_STEP (1L << 20)
+
+/*
+ * A counted loop: the body is header to latch - 2, latch - 1 the CMP of
+ * induction with limit and latch the jump back to header. trips is how
+ * many times the body runs, -1 when not known, bounded whether induction
+ * and limit are within VERIFY_LIMIT every time header is reached.
+ */
+typedef struct loop_t
+{
+    size_t header;
+    size_t latch;
+
+    int induction;
+    int limit;
+    long step;
+    long trips;
+    int bounded;
+} Loop;
+
+/*
+ * Loop optimizer functions prototypes
+ */
+
+double *optimize_loops(double *, size_t, int, int, size_t *,
+        OptimizeReport *);
+int find_loop(Optimizer *, size_t, Loop *);
+long count_trips(Optimizer *, Loop *, int);
+int replace_instructions(Optimizer *, size_t, size_t,
+        OptimizedInstruction *, size_t);
+size_t hoist_invariants(Optimizer *, Loop *);
+int unroll_loop(Optimizer *, Loop *, int);
+
+/*
+ * Fills loop if the jump at latch closes a counted loop, see the comment at
+ * the top. Needs an up to date analyze_program().
+ */
+int find_loop(Optimizer *optimizer, size_t latch, Loop *loop)
+{
+    OptimizedInstruction *instructions = optimizer->instructions;
+    OptimizedInstruction *jump = &instructions[latch];
+    int opcode = jump->code[0];
+
+    if(opcode < JE || opcode > JGT || jump->target < 0 ||
+            (size_t)jump->target + 2 > latch)
+        return 0;
+
+    OptimizedInstruction *compare = &instructions[latch - 1];
+    size_t header = jump->target;
+    int induction = compare->code[1];
+    int limit = compare->code[2];
+    long step = 0;
+
+    if(opcode == JE || compare->code[0] != CMP || induction > 7 ||
+            limit > 7 || induction == limit)
+        return 0;
+
+    for(size_t i = header + 1; i <= latch; ++i)
+    {
+        if(instructions[i].targeted)
+            return 0;
+    }
+
+    for(size_t i = header; i + 1 < latch; ++i)
+    {
+        OptimizedInstruction *instruction = &instructions[i];
+        int body_opcode = instruction->code[0];
+
+        // no way out of the body but the CMP, and nothing to wait for
+        if((body_opcode >= JMP && body_opcode <= JGT) || body_opcode == HLT ||
+                body_opcode == IN || body_opcode == OUT ||
+                body_opcode == YIELD)
+            return 0;
+
+        if((instruction->uses | instruction->defs) & (1u << limit))
+            return 0;
+
+        if(!(instruction->defs & (1u << induction)))
+            continue;
+
+        double imm = instruction->code[2];
+
+        if((body_opcode != ADDI && body_opcode != SUBI) ||
+                !integral_immediate(imm) || imm > LOOP_MAX_STEP ||
+                imm < -LOOP_MAX_STEP)
+            return 0;
+
+        step += body_opcode == ADDI ? imm : -imm;
+    }
+
+    if(step == 0 || step > LOOP_MAX_STEP || step < -LOOP_MAX_STEP ||
+            (opcode == JLT && step < 0) || (opcode == JGT && step > 0))
+        return 0;
+
+    VerifyState *state = &optimizer->states[header];
+
+    loop->header = header;
+    loop->latch = latch;
+    loop->induction = induction;
+    loop->limit = limit;
+    loop->step = step;
+    loop->bounded = state->reached && range_bounded(state->r[induction]) &&
+        range_bounded(state->r[limit]);
+    loop->trips = count_trips(optimizer, loop, opcode);
+
+    return 1;
+}
+
+/*
+ * How many times the body of loop, closed by a jump with opcode, runs when
+ * the loop is only ever started by the instruction before it, with both
+ * registers known. Returns -1 if that is not known, or the loop never ends.
+ */
+long count_trips(Optimizer *optimizer, Loop *loop, int opcode)
+{
+    OptimizedInstruction *instructions = optimizer->instructions;
+    size_t header = loop->header;
+
+    if(header == 0 || !loop->bounded ||
+            instructions[header - 1].code[0] == HLT ||
+            (instructions[header - 1].code[0] >= JMP &&
+             instructions[header - 1].code[0] <= JGT))
+        return -1;
+
+    for(size_t i = 0; i < optimizer->length; ++i)
+    {
+        if(instructions[i].target == (long)header && i != loop->latch)
+            return -1;
+    }
+
+    VerifyState entry = optimizer->states[header - 1];
+
+    if(!entry.reached)
+        return -1;
+
+    verify_instruction(&optimizer->decoded[header - 1], &entry);
+
+    Range start = entry.r[loop->induction];
+    Range limit = entry.r[loop->limit];
+
+    if(start.low != start.high || limit.low != limit.high ||
+            !range_bounded(start) || !range_bounded(limit))
+        return -1;
+
+    long distance = limit.low - start.low;
+    long step = loop->step;
+
+    if(opcode == JNE)
+        return distance % step == 0 && distance / step > 0 ?
+            distance / step : -1;
+
+    // counting down with JGT
+    if(step < 0)
+    {
+        distance = -distance;
+        step = -step;
+    }
+
+    // the body runs once before the first CMP
+    return distance <= step ? 1 : (distance + step - 1) / step;
+}
+
+/*
+ * Replaces instructions first to last with the count in block, whose
+ * targets are indexes in the program once they are in. Nothing outside may
+ * jump past first into what gets replaced. Returns 0 if there is no memory
+ * left, the program being as it was.
+ */
+int replace_instructions(Optimizer *optimizer, size_t first, size_t last,
+        OptimizedInstruction *block, size_t count)
+{
+    size_t replaced = last - first + 1;
+    size_t length = optimizer->length - replaced + count;
+
+    if(!grow_optimizer(optimizer, length))
+        return 0;
+
+    OptimizedInstruction *instructions = optimizer->instructions;
+
+    memmove(&instructions[first + count], &instructions[last + 1],
+            sizeof(OptimizedInstruction) * (optimizer->length - last - 1));
+    memcpy(&instructions[first], block, sizeof(OptimizedInstruction) * count);
+
+    for(size_t i = 0; i < length; ++i)
+    {
+        if(i >= first && i < first + count)
+            continue;
+
+        if(instructions[i].target > (long)last)
+            instructions[i].target += (long)count - (long)replaced;
+    }
+
+    optimizer->length = length;
+
+    return 1;
+}
+
+/*
+ * Loop invariant code motion, see the comment at the top. The instructions
+ * moving out set the flags before the loop instead of in it, so that only
+ * happens where nothing reads them. Returns how many moved.
+ */
+size_t hoist_invariants(Optimizer *optimizer, Loop *loop)
+{
+    OptimizedInstruction *instructions = optimizer->instructions;
+    OptimizedInstruction *header = &instructions[loop->header];
+    size_t end = loop->latch - 1;
+    unsigned int written = 0;
+    size_t count = 0;
+
+    // the flags coming into the loop
+    if((header->uses | (header->live & ~header->defs)) & LIVE_FLAGS)
+        return 0;
+
+    for(size_t i = loop->header; i < end; ++i)
+        written |= instructions[i].defs & ~LIVE_FLAGS & ~LIVE_OVERFLOW;
+
+    size_t length = loop->latch - loop->header + 1;
+    OptimizedInstruction *block = (OptimizedInstruction *)malloc(
+            sizeof(OptimizedInstruction) * length);
+    char *hoisted = (char *)calloc(length, 1);
+
+    if(block == NULL || hoisted == NULL)
+    {
+        free(block);
+        free(hoisted);
+
+        return 0;
+    }
+
+    // R0-R7 and D0-D7
+    for(unsigned int reg = 0; reg < 16; ++reg)
+    {
+        unsigned int bit = 1u << reg;
+        size_t last = end;
+        int invariant = 1;
+
+        if(!(written & bit))
+            continue;
+
+        for(size_t i = loop->header; invariant && i < end; ++i)
+        {
+            OptimizedInstruction *instruction = &instructions[i];
+            int opcode = instruction->code[0];
+
+            if(!(instruction->defs & bit))
+                continue;
+
+            // the first write starts from scratch, the others from it
+            invariant = ((opcode >= MOV && opcode <= DIVI) ||
+                    (opcode >= XOR && opcode <= SHRI)) &&
+                !(instruction->uses & written & ~bit) &&
+                !(last == end && (instruction->uses & bit)) &&
+                !(instruction->live & LIVE_FLAGS & instruction->defs);
+
+            last = i;
+        }
+
+        for(size_t i = loop->header; invariant && i < last; ++i)
+        {
+            if((instructions[i].uses & bit) && !(instructions[i].defs & bit))
+                invariant = 0;
+        }
+
+        for(size_t i = loop->header; invariant && i <= last; ++i)
+        {
+            if(instructions[i].defs & bit)
+                hoisted[i - loop->header] = 1;
+        }
+    }
+
+    for(size_t i = loop->header; i < end; ++i)
+    {
+        if(hoisted[i - loop->header])
+            block[count++] = instructions[i];
+    }
+
+    size_t moved = count;
+
+    if(moved > 0)
+    {
+        for(size_t i = loop->header; i <= loop->latch; ++i)
+        {
+            if(i == loop->latch || !hoisted[i - loop->header])
+                block[count++] = instructions[i];
+        }
+
+        block[count - 1].target = loop->header + moved;
+
+        if(replace_instructions(optimizer, loop->header, loop->latch, block,
+                    count))
+            optimizer->report->hoisted += moved;
+        else
+            moved = 0;
+    }
+
+    free(block);
+    free(hoisted);
+
+    return moved;
+}
+
+/*
+ * Unrolls loop factor times, see the comment at the top. The limit goes
+ * down by factor steps for the unrolled loop, which runs while the
+ * induction register is below that (above, counting down), and back up for
+ * the loop as it was, which takes the last runs and leaves the flags of its
+ * CMP. Returns 0 if loop can not be unrolled or there is no memory left.
+ */
+int unroll_loop(Optimizer *optimizer, Loop *loop, int factor)
+{
+    OptimizedInstruction *instructions = optimizer->instructions;
+    size_t header = loop->header;
+    size_t body = loop->latch - 1 - header;
+    int full = loop->trips > 0 && loop->trips <= factor;
+
+    if(full)
+        factor = loop->trips;
+
+    long step = loop->step * factor;
+
+    if(factor < 2 || !loop->bounded || body * factor > LOOP_MAX_BODY ||
+            step > LOOP_MAX_STEP || step < -LOOP_MAX_STEP)
+        return 0;
+
+    size_t length = body * factor + (full ? 1 : body + 7);
+    OptimizedInstruction *block = (OptimizedInstruction *)calloc(length,
+            sizeof(OptimizedInstruction));
+    OptimizedInstruction *compare = &instructions[loop->latch - 1];
+    size_t count = 0;
+
+    if(block == NULL)
+        return 0;
+
+    if(!full)
+    {
+        set_instruction(&block[count], step > 0 ? SUBI : ADDI, loop->limit,
+                labs(step));
+        block[count++].target = -1;
+        set_instruction(&block[count], JMP, 0, 0);
+        block[count++].target = header + 2 + body * factor;
+    }
+
+    for(int copy = 0; copy < factor; ++copy)
+    {
+        memcpy(&block[count], &instructions[header],
+                sizeof(OptimizedInstruction) * body);
+        count += body;
+    }
+
+    block[count++] = *compare;
+
+    if(!full)
+    {
+        set_instruction(&block[count], step > 0 ? JLT : JGT, 0, 0);
+        block[count++].target = header + 2;
+        set_instruction(&block[count], step > 0 ? ADDI : SUBI, loop->limit,
+                labs(step));
+        block[count++].target = -1;
+
+        // the loop as it was, from here
+        memcpy(&block[count], &instructions[header],
+                sizeof(OptimizedInstruction) * (body + 2));
+        block[count + body + 1].target = header + count;
+        count += body + 2;
+    }
+
+    int replaced = replace_instructions(optimizer, header, loop->latch, block,
+            count);
+
+    free(block);
+
+    if(replaced)
+        optimizer->report->unrolled++;
+
+    return replaced;
+}
+
+/*
+ * Optimizes code_size bytes of code like optimize_code(), then its loops,
+ * unrolling them factor times (not at all below 2). zeroed has the program
+ * start from R0-R7 zeroed, see the comment at the top. Returns the
+ * optimized code, which the caller frees, and its size in *optimized_size,
+ * or NULL if code can not be optimized or there is no memory left. report,
+ * which may be NULL, gets what was done.
+ */
+double *optimize_loops(double *code, size_t code_size, int factor,
+        int zeroed, size_t *optimized_size, OptimizeReport *report)
+{
+    Optimizer optimizer;
+    OptimizeReport unused;
+
+    if(report == NULL)
+        report = &unused;
+
+    memset(report, 0, sizeof(OptimizeReport));
+
+    if(!load_optimizer(&optimizer, code, code_size))
+        return NULL;
+
+    optimizer.report = report;
+    optimizer.zeroed = zeroed;
+    report->instructions_before = optimizer.length;
+    report->slots_before = code_size / sizeof(double);
+
+    run_passes(&optimizer);
+
+    // from the last loop back, so the ones before it keep their indexes
+    for(size_t latch = optimizer.length; latch-- > 0;)
+    {
+        Loop loop;
+
+        if(!analyze_program(&optimizer))
+            break;
+
+        if(!find_loop(&optimizer, latch, &loop))
+            continue;
+
+        report->loops++;
+
+        // hoisting keeps the latch where it is, moving the header down
+        while(hoist_invariants(&optimizer, &loop) > 0 &&
+                analyze_program(&optimizer) &&
+                find_loop(&optimizer, latch, &loop))
+            ;
+
+        if(analyze_program(&optimizer) &&
+                find_loop(&optimizer, latch, &loop))
+            unroll_loop(&optimizer, &loop, factor);
+
+        // what is past the header was just made from this loop
+        latch = loop.header;
+    }
+
+    run_passes(&optimizer);
+
+    return finish_optimizer(&optimizer, optimized_size);
+}
@@ -0,0 +1,1123 @@
+#pragma once
+
+/**
+ * XORVM bytecode optimizer.
+ * Author: 0xb4db01
+ *
+ * optimize_code() rewrites a code[] program into a shorter one doing the
+ * same: whatever the registers were when it starts, every run leaves the
+ * same rwmem, registers and flags at HLT (and at IN, OUT and YIELD, where
+ * the CPU may be looked at too). These passes run over and over until none
+ * of them finds anything left to do:
+ *
+ *     - constant propagation and folding: with the range analysis of
+ *       verify.h, an instruction always giving the same value becomes a
+ *       MOVI, a register operand always holding the same value becomes an
+ *       immediate and the jumps always (never) taken become a JMP (go away)
+ *     - increment merging: ADDI/SUBI on a register, then more of them on it
+ *       with nothing reading it in between, become one ADDI where the last
+ *       one was
+ *     - strength reduction: MULI and DIVI by a power of two become SHLI and
+ *       SHRI, ADDI 0, MULI 1, XORI 0 and the like go away
+ *     - jump threading: a jump to a JMP, or to a jump its own condition
+ *       decides, goes straight to where that one ends up, a JMP to HLT is a
+ *       HLT, a jump to the next instruction goes away and JE/JNE over a JMP
+ *       becomes a single jump
+ *     - dead code elimination: what no run reaches goes away, and so does
+ *       anything writing only registers and flags nothing reads afterwards
+ *
+ * The flags are the catch: XOR, SHL, SHR and their immediate versions leave
+ * them alone while everything else writing a register sets them, so one
+ * can become the other only where nothing reads the flags before they are
+ * set again. Immediates go through a double (see OPERATIONI), so only
+ * registers the range analysis keeps within VERIFY_LIMIT get folded.
+ *
+ *     OptimizeReport report;
+ *     size_t size;
+ *     double *optimized = optimize_code(code, sizeof(code), &size, &report);
+ *
+ *     print_optimize_report(&report);
+ *
+ * Jump targets are moved to the slots their instructions end up in. A
+ * program the decoder can not prove to run as it is written (see
+ * verify_code()) is left alone: optimize_code() returns NULL.
+ */
+
+#include "cpu.h"
+#include "verify.h"
+
+// times all the passes run before giving up on finding nothing left to do
+#define OPTIMIZE_ROUNDS 16
+
+/*
+ * Bits of what an instruction reads and writes, see live_uses(): the code of
+ * a R<n> or D<n> register is its own bit.
+ */
+#define LIVE_V(n) (1u << (16 + (n)))
+#define LIVE_ZERO (1u << 24)
+#define LIVE_NEGATIVE (1u << 25)
+#define LIVE_OVERFLOW (1u << 26)
+#define LIVE_ALL ((1u << 27) - 1)
+
+// what set_flags() writes
+#define LIVE_FLAGS (LIVE_ZERO | LIVE_NEGATIVE)
+
+/*
+ * An instruction as it is in code[], with the index of the instruction it
+ * jumps to in target. uses and defs are what it reads and writes, live what
+ * is read after it, see analyze_program().
+ */
+typedef struct optimized_instruction_t
+{
+    double code[5];
+    long target;
+
+    unsigned int uses;
+    unsigned int defs;
+    unsigned int live;
+    char removed;
+    char targeted;
+} OptimizedInstruction;
+
+/*
+ * Instructions and slots (doubles of code[]) before and after, and what
+ * each pass changed. loops, unrolled and hoisted are for optimize_loops(),
+ * see loop.h.
+ */
+typedef struct optimize_report_t
+{
+    size_t instructions_before;
+    size_t instructions_after;
+    size_t slots_before;
+    size_t slots_after;
+
+    size_t folded;
+    size_t reduced;
+    size_t threaded;
+    size_t removed;
+    size_t merged;
+    int rounds;
+
+    size_t loops;
+    size_t unrolled;
+    size_t hoisted;
+} OptimizeReport;
+
+/*
+ * decoded holds the specialized instructions (see specialize_instruction())
+ * the range analysis runs on, states what it found before each of them.
+ * Every array has room for capacity instructions. zeroed has the analysis
+ * start from R0-R7 zeroed, like verify_memory() does, instead of anything.
+ */
+typedef struct optimizer_t
+{
+    OptimizedInstruction *instructions;
+    size_t length;
+    size_t capacity;
+    int zeroed;
+
+    DecodedInstruction *decoded;
+    VerifyState *states;
+    long *thresholds;
+    long *map;
+
+    OptimizeReport *report;
+} Optimizer;
+
+/*
+ * Optimizer functions prototypes
+ */
+
+double *optimize_code(double *, size_t, size_t *, OptimizeReport *);
+void print_optimize_report(OptimizeReport *);
+int load_optimizer(Optimizer *, double *, size_t);
+int grow_optimizer(Optimizer *, size_t);
+void free_optimizer(Optimizer *);
+int decode_optimized(OptimizedInstruction *, DecodedInstruction *);
+unsigned int live_uses(DecodedInstruction *);
+unsigned int live_defs(DecodedInstruction *);
+int removable(int);
+int analyze_program(Optimizer *);
+void compact_program(Optimizer *);
+void set_instruction(OptimizedInstruction *, int, double, double);
+int power_of_two(double);
+int integral_immediate(double);
+size_t fold_constants(Optimizer *);
+size_t reduce_strength(Optimizer *);
+size_t merge_increments(Optimizer *);
+size_t thread_jumps(Optimizer *);
+size_t remove_dead(Optimizer *);
+void run_passes(Optimizer *);
+int check_program(Optimizer *);
+double *emit_program(Optimizer *, size_t *);
+double *finish_optimizer(Optimizer *, size_t *);
+
+/*
+ * Whether a jump is taken once the one before it (the rows, JE to JGT) was
+ * taken to it, the flags being the same: 1 always, 0 never, -1 it depends.
+ */
+const int jump_implies[4][4] = {
+    // JE  JNE  JLT  JGT
+    {  1,   0,   0,   0 },  // JE : zero
+    {  0,   1,  -1,  -1 },  // JNE: !zero
+    {  0,   1,   1,   0 },  // JLT: !zero, !overflow
+    {  0,   1,   0,   1 }   // JGT: !zero, overflow
+};
+
+/*
+ * Decodes instruction like decode_instruction() would, with the index of
+ * its target in imm.i for a jump. Returns 0 if it can not be decoded.
+ */
+int decode_optimized(OptimizedInstruction *instruction,
+        DecodedInstruction *out)
+{
+    memset(out, 0, sizeof(DecodedInstruction));
+    out->opcode = instruction->code[0];
+
+    if(out->opcode >= JMP && out->opcode <= JGT)
+    {
+        out->imm.i = instruction->target;
+
+        return 1;
+    }
+
+    return decode_instruction(instruction->code, 0, out);
+}
+
+/*
+ * The LIVE_* bits instruction (not specialized) reads. Block and I/O
+ * instructions, and HLT, count as reading everything.
+ */
+unsigned int live_uses(DecodedInstruction *instruction)
+{
+    unsigned int dst = 1u << instruction->dst;
+    unsigned int src = 1u << instruction->src;
+
+    switch(instruction->opcode)
+    {
+        case MOVI: case JMP:
+            return 0;
+
+        case MOV: case LD: case LD16: case LD32: case LD64: case VLD:
+            return src;
+
+        case ADD: case SUB: case MUL: case DIV: case CMP: case STR:
+        case XOR: case SHL: case SHR: case STR16: case STR32: case STR64:
+            return dst | src;
+
+        case ADDI: case SUBI: case MULI: case DIVI:
+        case XORI: case SHLI: case SHRI:
+            return dst;
+
+        case JE: case JNE:
+            return LIVE_ZERO;
+
+        case JLT: case JGT:
+            return LIVE_ZERO | LIVE_OVERFLOW;
+
+        case VST:
+            return dst | LIVE_V(instruction->src);
+
+        case VXOR: case VADD:
+            return LIVE_V(instruction->dst) | LIVE_V(instruction->src);
+
+        case VSHL: case VSHR:
+            return LIVE_V(instruction->dst);
+    }
+
+    return LIVE_ALL;
+}
+
+/*
+ * The LIVE_* bits instruction (not specialized) always writes.
+ */
+unsigned int live_defs(DecodedInstruction *instruction)
+{
+    unsigned int dst = 1u << instruction->dst;
+
+    switch(instruction->opcode)
+    {
+        case MOV: case MOVI: case ADD: case ADDI: case SUB: case SUBI:
+        case MUL: case MULI: case DIV: case DIVI:
+        case LD: case LD16: case LD32: case LD64:
+            return dst | LIVE_FLAGS;
+
+        case STR: case STR16: case STR32: case STR64:
+            return LIVE_FLAGS;
+
+        case XOR: case XORI: case SHL: case SHR: case SHLI: case SHRI:
+            return dst;
+
+        case CMP:
+            return LIVE_FLAGS | LIVE_OVERFLOW;
+
+        case VLD: case VXOR: case VADD: case VSHL: case VSHR:
+            return LIVE_V(instruction->dst);
+    }
+
+    return 0;
+}
+
+/*
+ * Returns 1 if an instruction with opcode does nothing but write what
+ * live_defs() says, so it can go when none of that is read.
+ */
+int removable(int opcode)
+{
+    switch(opcode)
+    {
+        case MOV: case MOVI: case ADD: case ADDI: case SUB: case SUBI:
+        case MUL: case MULI: case DIV: case DIVI: case CMP:
+        case LD: case LD16: case LD32: case LD64:
+        case XOR: case XORI: case SHL: case SHR: case SHLI: case SHRI:
+        case VLD: case VXOR: case VADD: case VSHL: case VSHR:
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns k if value is 2^k, -1 otherwise.
+ */
+int power_of_two(double value)
+{
+    for(int k = 0; k <= 52; ++k)
+    {
+        if(value == (double)(1L << k))
+            return k;
+    }
+
+    return -1;
+}
+
+/*
+ * Returns 1 if value is a whole number within VERIFY_LIMIT, which added to
+ * a register within VERIFY_LIMIT gives the exact sum.
+ */
+int integral_immediate(double value)
+{
+    return value >= -VERIFY_LIMIT && value <= VERIFY_LIMIT &&
+        value == (long)value;
+}
+
+void set_instruction(OptimizedInstruction *instruction, int opcode,
+        double dst, double src)
+{
+    instruction->code[0] = opcode;
+    instruction->code[1] = dst;
+    instruction->code[2] = src;
+    instruction->code[3] = 0;
+    instruction->code[4] = 0;
+}
+
+/*
+ * Decodes code and checks it like verify_code() into optimizer. Returns 0
+ * if it can not be optimized or there is no memory left.
+ */
+int load_optimizer(Optimizer *optimizer, double *code, size_t code_size)
+{
+    Memory memory;
+
+    memset(optimizer, 0, sizeof(Optimizer));
+
+    memory.code_size = code_size;
+    memory.code = code;
+    memory.rwmem_size = 0;
+    memory.rwmem = NULL;
+
+    DecodedProgram *program = decode_program(&memory);
+
+    if(program == NULL)
+        return 0;
+
+    size_t length = program->length;
+
+    if(!verify_code(program))
+    {
+        free_decoded_program(program);
+
+        return 0;
+    }
+
+    optimizer->instructions = (OptimizedInstruction *)calloc(length,
+            sizeof(OptimizedInstruction));
+    optimizer->decoded = (DecodedInstruction *)malloc(
+            sizeof(DecodedInstruction) * length);
+    optimizer->states = (VerifyState *)malloc(sizeof(VerifyState) * length);
+    optimizer->thresholds = (long *)malloc(sizeof(long) * (3 * length + 2));
+    optimizer->map = (long *)malloc(sizeof(long) * (length + 1));
+
+    if(optimizer->instructions == NULL || optimizer->decoded == NULL ||
+            optimizer->states == NULL || optimizer->thresholds == NULL ||
+            optimizer->map == NULL)
+    {
+        free_decoded_program(program);
+        free_optimizer(optimizer);
+
+        return 0;
+    }
+
+    for(size_t i = 0; i < length; ++i)
+    {
+        OptimizedInstruction *instruction = &optimizer->instructions[i];
+        int slot = program->instructions[i].slot;
+        int opcode = code[slot];
+
+        memcpy(instruction->code, code + slot,
+                sizeof(double) * instruction_slots[opcode]);
+
+        instruction->target = opcode >= JMP && opcode <= JGT ?
+            program->instructions[i].imm.i : -1;
+    }
+
+    optimizer->length = length;
+    optimizer->capacity = length;
+
+    free_decoded_program(program);
+
+    return 1;
+}
+
+/*
+ * Makes room in optimizer for length instructions. Returns 0 if there is no
+ * memory left, optimizer being as it was.
+ */
+int grow_optimizer(Optimizer *optimizer, size_t length)
+{
+    if(length <= optimizer->capacity)
+        return 1;
+
+    OptimizedInstruction *instructions = (OptimizedInstruction *)realloc(
+            optimizer->instructions, sizeof(OptimizedInstruction) * length);
+
+    if(instructions == NULL)
+        return 0;
+
+    optimizer->instructions = instructions;
+
+    DecodedInstruction *decoded = (DecodedInstruction *)malloc(
+            sizeof(DecodedInstruction) * length);
+    VerifyState *states = (VerifyState *)malloc(sizeof(VerifyState) * length);
+    long *thresholds = (long *)malloc(sizeof(long) * (3 * length + 2));
+    long *map = (long *)malloc(sizeof(long) * (length + 1));
+
+    if(decoded == NULL || states == NULL || thresholds == NULL ||
+            map == NULL)
+    {
+        free(decoded);
+        free(states);
+        free(thresholds);
+        free(map);
+
+        return 0;
+    }
+
+    // only the instructions outlive an analysis
+    free(optimizer->decoded);
+    free(optimizer->states);
+    free(optimizer->thresholds);
+    free(optimizer->map);
+
+    optimizer->decoded = decoded;
+    optimizer->states = states;
+    optimizer->thresholds = thresholds;
+    optimizer->map = map;
+    optimizer->capacity = length;
+
+    return 1;
+}
+
+void free_optimizer(Optimizer *optimizer)
+{
+    free(optimizer->instructions);
+    free(optimizer->decoded);
+    free(optimizer->states);
+    free(optimizer->thresholds);
+    free(optimizer->map);
+
+    memset(optimizer, 0, sizeof(Optimizer));
+}
+
+/*
+ * Runs the range analysis (see range_states()) from registers that may hold
+ * anything (zeroed ones, see Optimizer), and the liveness analysis, over the
+ * program. Returns 0 if there is no memory left.
+ */
+int analyze_program(Optimizer *optimizer)
+{
+    OptimizedInstruction *instructions = optimizer->instructions;
+    size_t length = optimizer->length;
+    size_t count = 0;
+    VerifyState entry;
+
+    optimizer->thresholds[count++] = 0;
+    optimizer->thresholds[count++] = 255;
+
+    for(size_t i = 0; i < length; ++i)
+    {
+        DecodedInstruction *decoded = &optimizer->decoded[i];
+
+        decode_optimized(&instructions[i], decoded);
+
+        instructions[i].uses = live_uses(decoded);
+        instructions[i].defs = live_defs(decoded);
+        instructions[i].live = 0;
+        instructions[i].targeted = 0;
+
+        if(decoded->opcode == MOVI && decoded->dst <= 7 &&
+                decoded->imm.i > -VERIFY_LIMIT &&
+                decoded->imm.i < VERIFY_LIMIT)
+        {
+            optimizer->thresholds[count++] = decoded->imm.i - 1;
+            optimizer->thresholds[count++] = decoded->imm.i;
+            optimizer->thresholds[count++] = decoded->imm.i + 1;
+        }
+
+        specialize_instruction(decoded);
+    }
+
+    for(size_t i = 0; i < length; ++i)
+    {
+        if(instructions[i].target != -1)
+            instructions[instructions[i].target].targeted = 1;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    memset(optimizer->states, 0, sizeof(VerifyState) * length);
+    entry.compare_dst = entry.compare_src = -1;
+
+    for(int i = 0; !optimizer->zeroed && i < 8; ++i)
+        entry.r[i] = range_any();
+
+    if(!range_states(optimizer->decoded, length, &entry, optimizer->states,
+                optimizer->thresholds, count))
+        return 0;
+
+    // backwards until nothing changes: live is what the successors read
+    // before writing it
+    for(int changed = 1; changed;)
+    {
+        changed = 0;
+
+        for(size_t i = length; i-- > 0;)
+        {
+            OptimizedInstruction *instruction = &instructions[i];
+            int opcode = instruction->code[0];
+            unsigned int live = 0;
+
+            if(opcode != JMP && opcode != HLT && i + 1 < length)
+                live |= instructions[i + 1].uses |
+                    (instructions[i + 1].live & ~instructions[i + 1].defs);
+
+            if(instruction->target != -1)
+            {
+                OptimizedInstruction *target =
+                    &instructions[instruction->target];
+
+                live |= target->uses | (target->live & ~target->defs);
+            }
+
+            if(live != instruction->live)
+            {
+                instruction->live = live;
+                changed = 1;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Drops the removed instructions, moving jumps to where their targets end
+ * up (the next instruction kept, for a target removed).
+ */
+void compact_program(Optimizer *optimizer)
+{
+    OptimizedInstruction *instructions = optimizer->instructions;
+    long *map = optimizer->map;
+    size_t count = 0;
+
+    for(size_t i = 0; i < optimizer->length; ++i)
+    {
+        map[i] = count;
+
+        if(!instructions[i].removed)
+            count++;
+    }
+
+    for(size_t i = 0; i < optimizer->length; ++i)
+    {
+        if(instructions[i].removed)
+            continue;
+
+        if(instructions[i].target != -1)
+            instructions[i].target = map[instructions[i].target];
+
+        instructions[map[i]] = instructions[i];
+    }
+
+    optimizer->length = count;
+}
+
+/*
+ * Constant propagation and folding, see the comment at the top. Also drops
+ * what the range analysis found no run reaching.
+ */
+size_t fold_constants(Optimizer *optimizer)
+{
+    OptimizedInstruction *instructions = optimizer->instructions;
+    OptimizeReport *report = optimizer->report;
+    size_t changes = 0;
+
+    for(size_t i = 0; i < optimizer->length; ++i)
+    {
+        OptimizedInstruction *instruction = &instructions[i];
+        VerifyState *state = &optimizer->states[i];
+        VerifyState after = *state;
+        DecodedInstruction plain;
+        int opcode = instruction->code[0];
+
+        if(!state->reached)
+        {
+            instruction->removed = 1;
+            report->removed++;
+            changes++;
+
+            continue;
+        }
+
+        verify_instruction(&optimizer->decoded[i], &after);
+        decode_optimized(instruction, &plain);
+
+        // a jump whose condition always (never) holds after the CMP
+        if(opcode >= JE && opcode <= JGT)
+        {
+            VerifyState taken = after;
+            VerifyState fallen = after;
+            int take = refine_compare(&taken, opcode);
+            int fall = refine_compare(&fallen, -opcode);
+
+            if(take == fall)
+                continue;
+
+            if(take)
+                instruction->code[0] = JMP;
+            else
+                instruction->removed = 1;
+
+            report->folded++;
+            changes++;
+
+            continue;
+        }
+
+        // what is left to fold is arithmetic and bitwise on R<n>
+        if(!((opcode >= MOV && opcode <= DIVI && opcode != MOVI) ||
+                    (opcode >= XOR && opcode <= SHRI)) || plain.dst > 7)
+            continue;
+
+        int sets_flags = !(opcode >= XOR && opcode <= SHRI);
+        Range *dst = &after.r[plain.dst];
+        Range src = state->r[plain.src & 7];
+
+        // always the same value
+        if(dst->low == dst->high && range_bounded(*dst) &&
+                (sets_flags || !(instruction->live & LIVE_FLAGS)))
+        {
+            set_instruction(instruction, MOVI, plain.dst, dst->low);
+            report->folded++;
+            changes++;
+
+            continue;
+        }
+
+        int immediate = -1;
+
+        // a R<n> operand always holding the same value
+        if(plain.src <= 7 && src.low == src.high && range_bounded(src))
+        {
+            switch(opcode)
+            {
+                case XOR: immediate = XORI; break;
+                case SHL: immediate = SHLI; break;
+                case SHR: immediate = SHRI; break;
+
+                // exact through a double as long as the result is bounded
+                case ADD: case SUB: case MUL:
+                    if(range_bounded(state->r[plain.dst]) &&
+                            range_bounded(*dst))
+                        immediate = opcode == ADD ? ADDI :
+                            opcode == SUB ? SUBI : MULI;
+
+                    break;
+            }
+        }
+
+        if(immediate == -1)
+            continue;
+
+        set_instruction(instruction, immediate, plain.dst, src.low);
+        report->folded++;
+        changes++;
+    }
+
+    return changes;
+}
+
+/*
+ * Strength reduction, see the comment at the top.
+ */
+size_t reduce_strength(Optimizer *optimizer)
+{
+    OptimizeReport *report = optimizer->report;
+    size_t changes = 0;
+
+    for(size_t i = 0; i < optimizer->length; ++i)
+    {
+        OptimizedInstruction *instruction = &optimizer->instructions[i];
+        VerifyState *state = &optimizer->states[i];
+        VerifyState after = *state;
+        DecodedInstruction plain;
+        int opcode = instruction->code[0];
+        double imm = instruction->code[2];
+
+        if(opcode != ADDI && opcode != SUBI && opcode != MULI &&
+                opcode != DIVI && opcode != XORI && opcode != SHLI &&
+                opcode != SHRI)
+            continue;
+
+        decode_optimized(instruction, &plain);
+        verify_instruction(&optimizer->decoded[i], &after);
+
+        if(plain.dst > 7)
+            continue;
+
+        Range value = state->r[plain.dst];
+        int flags = (instruction->live & LIVE_FLAGS) != 0;
+        int exact = range_bounded(value) && range_bounded(after.r[plain.dst]);
+        int shift = power_of_two(imm);
+
+        switch(opcode)
+        {
+            // (long)((double)r OP imm) is r when r is bounded
+            case ADDI: case SUBI: case MULI: case DIVI:
+                if(flags || !exact)
+                    break;
+
+                if(((opcode == ADDI || opcode == SUBI) && imm == 0) ||
+                        ((opcode == MULI || opcode == DIVI) && imm == 1))
+                {
+                    instruction->removed = 1;
+                } else if(opcode == MULI && shift > 0)
+                {
+                    set_instruction(instruction, SHLI, plain.dst, shift);
+                } else if(opcode == DIVI && shift > 0 && value.low >= 0)
+                {
+                    // truncating and shifting only differ below 0
+                    set_instruction(instruction, SHRI, plain.dst, shift);
+                } else
+                {
+                    break;
+                }
+
+                report->reduced++;
+                changes++;
+
+                break;
+
+            case XORI: case SHLI: case SHRI:
+                if(plain.imm.i != 0)
+                    break;
+
+                instruction->removed = 1;
+                report->reduced++;
+                changes++;
+
+                break;
+        }
+    }
+
+    return changes;
+}
+
+/*
+ * Increment merging, see the comment at the top. Whatever lies in between
+ * neither jumps nor is jumped to, and the flags of the ADDI/SUBI going away
+ * are not read: the one left sets them from the same sum.
+ */
+size_t merge_increments(Optimizer *optimizer)
+{
+    OptimizedInstruction *instructions = optimizer->instructions;
+    size_t length = optimizer->length;
+    size_t changes = 0;
+
+    for(size_t i = 0; i < length; ++i)
+    {
+        OptimizedInstruction *instruction = &instructions[i];
+        VerifyState *state = &optimizer->states[i];
+        VerifyState after = *state;
+        int opcode = instruction->code[0];
+        int dst = instruction->code[1];
+
+        if((opcode != ADDI && opcode != SUBI) || dst > 7 || !state->reached ||
+                (instruction->live & LIVE_FLAGS) ||
+                !integral_immediate(instruction->code[2]) ||
+                !range_bounded(state->r[dst]))
+            continue;
+
+        verify_instruction(&optimizer->decoded[i], &after);
+
+        if(!range_bounded(after.r[dst]))
+            continue;
+
+        size_t next = i + 1;
+
+        // the next instruction touching dst, or where the straight run ends
+        for(; next < length; ++next)
+        {
+            int next_opcode = instructions[next].code[0];
+
+            if(instructions[next].targeted || next_opcode == HLT ||
+                    (next_opcode >= JMP && next_opcode <= JGT) ||
+                    ((instructions[next].uses | instructions[next].defs) &
+                     (1u << dst)))
+                break;
+        }
+
+        if(next >= length)
+            continue;
+
+        OptimizedInstruction *last = &instructions[next];
+        int last_opcode = last->code[0];
+        VerifyState end = optimizer->states[next];
+
+        if((last_opcode != ADDI && last_opcode != SUBI) || last->targeted ||
+                last->code[1] != dst || !integral_immediate(last->code[2]))
+            continue;
+
+        verify_instruction(&optimizer->decoded[next], &end);
+
+        if(!range_bounded(end.r[dst]))
+            continue;
+
+        double sum = (opcode == ADDI ? 1 : -1) * instruction->code[2] +
+            (last_opcode == ADDI ? 1 : -1) * last->code[2];
+
+        set_instruction(last, ADDI, dst, sum);
+        instruction->removed = 1;
+        optimizer->report->merged++;
+        changes++;
+
+        // what the analysis found for the last one no longer holds
+        i = next;
+    }
+
+    return changes;
+}
+
+/*
+ * Jump threading, see the comment at the top.
+ */
+size_t thread_jumps(Optimizer *optimizer)
+{
+    OptimizedInstruction *instructions = optimizer->instructions;
+    OptimizeReport *report = optimizer->report;
+    size_t length = optimizer->length;
+    size_t changes = 0;
+
+    for(size_t i = 0; i < length; ++i)
+    {
+        OptimizedInstruction *instruction = &instructions[i];
+        int opcode = instruction->code[0];
+        long target = instruction->target;
+
+        if(target == -1)
+            continue;
+
+        // at most length steps, a loop of JMPs never ends
+        for(size_t steps = 0; steps < length; ++steps)
+        {
+            int next = instructions[target].code[0];
+            int taken = -1;
+
+            if(next == JMP)
+                taken = 1;
+            else if(next >= JE && next <= JGT && opcode != JMP)
+                taken = jump_implies[opcode - JE][next - JE];
+
+            if(taken == -1)
+                break;
+
+            target = taken ? instructions[target].target : target + 1;
+        }
+
+        if(target != instruction->target)
+        {
+            instruction->target = target;
+            report->threaded++;
+            changes++;
+        }
+
+        if(opcode == JMP && instructions[target].code[0] == HLT)
+        {
+            set_instruction(instruction, HLT, 0, 0);
+            instruction->target = -1;
+            report->threaded++;
+            changes++;
+        } else if((size_t)target == i + 1)
+        {
+            instruction->removed = 1;
+            report->threaded++;
+            changes++;
+        }
+    }
+
+    for(size_t i = 0; i < length; ++i)
+        instructions[i].targeted = 0;
+
+    for(size_t i = 0; i < length; ++i)
+    {
+        if(instructions[i].target != -1 && !instructions[i].removed)
+            instructions[instructions[i].target].targeted = 1;
+    }
+
+    // JE over a JMP is a JNE to where the JMP goes, and the other way round
+    for(size_t i = 0; i + 2 < length; ++i)
+    {
+        OptimizedInstruction *instruction = &instructions[i];
+        OptimizedInstruction *next = &instructions[i + 1];
+        int opcode = instruction->code[0];
+
+        if((opcode != JE && opcode != JNE) || instruction->removed ||
+                (size_t)instruction->target != i + 2 ||
+                next->code[0] != JMP || next->removed || next->targeted)
+            continue;
+
+        instruction->code[0] = opcode == JE ? JNE : JE;
+        instruction->target = next->target;
+        next->removed = 1;
+        report->threaded++;
+        changes++;
+    }
+
+    return changes;
+}
+
+/*
+ * Dead code elimination, see the comment at the top, until there is
+ * nothing left to remove (or no memory left for the analysis).
+ */
+size_t remove_dead(Optimizer *optimizer)
+{
+    size_t changes = 0;
+
+    for(;;)
+    {
+        size_t removed = 0;
+
+        if(!analyze_program(optimizer))
+            break;
+
+        for(size_t i = 0; i < optimizer->length; ++i)
+        {
+            OptimizedInstruction *instruction = &optimizer->instructions[i];
+
+            if(!removable(instruction->code[0]) ||
+                    (instruction->defs & instruction->live))
+                continue;
+
+            instruction->removed = 1;
+            removed++;
+        }
+
+        if(removed == 0)
+            break;
+
+        compact_program(optimizer);
+        optimizer->report->removed += removed;
+        changes += removed;
+    }
+
+    return changes;
+}
+
+/*
+ * Runs all the passes over and over, until none of them finds anything left
+ * to do or OPTIMIZE_ROUNDS times.
+ */
+void run_passes(Optimizer *optimizer)
+{
+    OptimizeReport *report = optimizer->report;
+
+    for(int round = 0; round < OPTIMIZE_ROUNDS; ++round)
+    {
+        size_t changes = 0;
+
+        report->rounds++;
+
+        if(!analyze_program(optimizer))
+            break;
+
+        changes += fold_constants(optimizer);
+        compact_program(optimizer);
+
+        if(!analyze_program(optimizer))
+            break;
+
+        changes += reduce_strength(optimizer);
+        compact_program(optimizer);
+
+        if(!analyze_program(optimizer))
+            break;
+
+        changes += merge_increments(optimizer);
+        compact_program(optimizer);
+
+        changes += thread_jumps(optimizer);
+        compact_program(optimizer);
+
+        changes += remove_dead(optimizer);
+
+        if(changes == 0)
+            break;
+    }
+}
+
+/*
+ * Checks what verify_code() checks on the optimized program, which holds
+ * as long as the passes are right.
+ */
+int check_program(Optimizer *optimizer)
+{
+    OptimizedInstruction *instructions = optimizer->instructions;
+    size_t length = optimizer->length;
+
+    if(length == 0)
+        return 0;
+
+    for(size_t i = 0; i < length; ++i)
+    {
+        if(instructions[i].target != -1 &&
+                (size_t)instructions[i].target >= length)
+            return 0;
+    }
+
+    int last = instructions[length - 1].code[0];
+
+    return last == HLT || last == JMP;
+}
+
+/*
+ * The optimized program as code[], in *code_size bytes. Returns NULL if
+ * there is no memory left.
+ */
+double *emit_program(Optimizer *optimizer, size_t *code_size)
+{
+    OptimizedInstruction *instructions = optimizer->instructions;
+    long *map = optimizer->map;
+    size_t slots = 0;
+
+    for(size_t i = 0; i < optimizer->length; ++i)
+    {
+        map[i] = slots;
+        slots += instruction_slots[(int)instructions[i].code[0]];
+    }
+
+    double *code = (double *)malloc(sizeof(double) * slots);
+
+    if(code == NULL)
+        return NULL;
+
+    for(size_t i = 0; i < optimizer->length; ++i)
+    {
+        OptimizedInstruction *instruction = &instructions[i];
+        int opcode = instruction->code[0];
+
+        memcpy(code + map[i], instruction->code,
+                sizeof(double) * instruction_slots[opcode]);
+
+        // the PC moves past the jump after it, see jmp()
+        if(instruction->target != -1)
+            code[map[i] + 1] = map[instruction->target] - 1;
+    }
+
+    *code_size = sizeof(double) * slots;
+
+    return code;
+}
+
+/*
+ * Emits the program in optimizer (see emit_program()), fills in the rest of
+ * its report and frees it.
+ */
+double *finish_optimizer(Optimizer *optimizer, size_t *optimized_size)
+{
+    OptimizeReport *report = optimizer->report;
+    double *optimized = check_program(optimizer) ?
+        emit_program(optimizer, optimized_size) : NULL;
+
+    if(optimized != NULL)
+    {
+        report->instructions_after = optimizer->length;
+        report->slots_after = *optimized_size / sizeof(double);
+    }
+
+    free_optimizer(optimizer);
+
+    return optimized;
+}
+
+/*
+ * Optimizes code_size bytes of code. Returns the optimized code, which the
+ * caller frees, and its size in *optimized_size, or NULL if code can not be
+ * optimized (see verify_code()) or there is no memory left. report, which
+ * may be NULL, gets what was done.
+ */
+double *optimize_code(double *code, size_t code_size, size_t *optimized_size,
+        OptimizeReport *report)
+{
+    Optimizer optimizer;
+    OptimizeReport unused;
+
+    if(report == NULL)
+        report = &unused;
+
+    memset(report, 0, sizeof(OptimizeReport));
+
+    if(!load_optimizer(&optimizer, code, code_size))
+        return NULL;
+
+    optimizer.report = report;
+    report->instructions_before = optimizer.length;
+    report->slots_before = code_size / sizeof(double);
+
+    run_passes(&optimizer);
+
+    return finish_optimizer(&optimizer, optimized_size);
+}
+
+void print_optimize_report(OptimizeReport *report)
+{
+    printf("[OPTIMIZER]\n");
+    printf("INSTRUCTIONS: %zu -> %zu\n", report->instructions_before,
+            report->instructions_after);
+    printf("SLOTS       : %zu -> %zu\n", report->slots_before,
+            report->slots_after);
+    printf("FOLDED      : %zu\n", report->folded);
+    printf("REDUCED     : %zu\n", report->reduced);
+    printf("THREADED    : %zu\n", report->threaded);
+    printf("REMOVED     : %zu\n", report->removed);
+    printf("MERGED      : %zu\n", report->merged);
+    printf("ROUNDS      : %d\n", report->rounds);
+
+    if(report->loops > 0)
+    {
+        printf("LOOPS       : %zu\n", report->loops);
+        printf("UNROLLED    : %zu\n", report->unrolled);
+        printf("HOISTED     : %zu\n", report->hoisted);
+    }
+
+    printf("\n");
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+/**
+ * XORVM hardware performance counters.
+ * Author: 0xb4db01
+ *
+ * Reads the Linux hardware counters of the calling thread around a run of
+ * the VM with perf_event_open(): cycles, native instructions, branch
+ * misses and L1 data and instruction cache read misses, in user space
+ * only. Every counter is opened on its own and scaled by the share of the
+ * time it was really counting, so the kernel may multiplex them.
+ *
+ * Counters that can not be opened (no PMU in a VM or a container, a
+ * perf_event_paranoid too high, not Linux...) are left out, and with none
+ * at all a PerfCounters only measures the time: callers don't have to
+ * care, perf_available() tells what there is.
+ *
+ *     PerfCounters counters;
+ *
+ *     open_perf(&counters);
+ *     run_cpu_counted(cpu, &counters);
+ *     print_perf(&counters, vm_instructions);
+ *     close_perf(&counters);
+ *
+ * Threads started by the run (run_batch(), run_stream()) are not counted.
+ */
+
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "cpu.h"
+
+enum PerfEvents
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_L1I_MISSES,
+    TOTAL_PERF_EVENTS
+};
+
+/*
+ * fds holds the counters, -1 for those that are not available. values and
+ * seconds are what the last start_perf()/stop_perf() measured.
+ */
+typedef struct perf_counters_t
+{
+    int fds[TOTAL_PERF_EVENTS];
+    double values[TOTAL_PERF_EVENTS];
+    double seconds;
+
+    struct timespec start;
+} PerfCounters;
+
+/*
+ * Perf functions prototypes
+ */
+
+int open_perf(PerfCounters *);
+void close_perf(PerfCounters *);
+int perf_available(PerfCounters *, int);
+void start_perf(PerfCounters *);
+void stop_perf(PerfCounters *);
+void run_cpu_counted(CPU *, PerfCounters *);
+const char *perf_event_name(int);
+void print_perf(PerfCounters *, double);
+
+/*
+ * Opens every counter that can be opened and returns how many could, 0
+ * meaning only the time is measured.
+ */
+int open_perf(PerfCounters *counters)
+{
+    int opened = 0;
+
+    memset(counters, 0, sizeof(PerfCounters));
+
+    for(int i = 0; i < TOTAL_PERF_EVENTS; ++i)
+        counters->fds[i] = -1;
+
+#ifdef __linux__
+    unsigned long long configs[] = {
+        [PERF_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+        [PERF_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+        [PERF_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+        [PERF_L1D_MISSES] = PERF_COUNT_HW_CACHE_L1D |
+            PERF_COUNT_HW_CACHE_OP_READ << 8 |
+            PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+        [PERF_L1I_MISSES] = PERF_COUNT_HW_CACHE_L1I |
+            PERF_COUNT_HW_CACHE_OP_READ << 8 |
+            PERF_COUNT_HW_CACHE_RESULT_MISS << 16
+    };
+
+    for(int i = 0; i < TOTAL_PERF_EVENTS; ++i)
+    {
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = i < PERF_L1D_MISSES ? PERF_TYPE_HARDWARE :
+            PERF_TYPE_HW_CACHE;
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+            PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // this thread, on any core
+        counters->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+        if(counters->fds[i] >= 0)
+            opened++;
+        else
+            counters->fds[i] = -1;
+    }
+#endif
+
+    return opened;
+}
+
+void close_perf(PerfCounters *counters)
+{
+    for(int i = 0; i < TOTAL_PERF_EVENTS; ++i)
+    {
+#ifdef __linux__
+        if(counters->fds[i] >= 0)
+            close(counters->fds[i]);
+#endif
+
+        counters->fds[i] = -1;
+    }
+}
+
+/*
+ * Returns 1 if event (one of enum PerfEvents) was counted by the last
+ * stop_perf().
+ */
+int perf_available(PerfCounters *counters, int event)
+{
+    return counters->fds[event] >= 0 && counters->values[event] >= 0;
+}
+
+void start_perf(PerfCounters *counters)
+{
+#ifdef __linux__
+    for(int i = 0; i < TOTAL_PERF_EVENTS; ++i)
+    {
+        if(counters->fds[i] < 0)
+            continue;
+
+        ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+
+    clock_gettime(CLOCK_MONOTONIC, &counters->start);
+}
+
+/*
+ * Stops the counters and fills values (-1 for a counter that did not count
+ * at all) and seconds.
+ */
+void stop_perf(PerfCounters *counters)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    counters->seconds = (end.tv_sec - counters->start.tv_sec) +
+        (end.tv_nsec - counters->start.tv_nsec) / 1e9;
+
+    for(int i = 0; i < TOTAL_PERF_EVENTS; ++i)
+    {
+        counters->values[i] = -1;
+
+#ifdef __linux__
+        // value, time enabled, time running
+        unsigned long long read_values[3];
+
+        if(counters->fds[i] < 0)
+            continue;
+
+        ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+        if(read(counters->fds[i], read_values, sizeof(read_values)) !=
+                sizeof(read_values) || read_values[2] == 0)
+            continue;
+
+        counters->values[i] = (double)read_values[0] * read_values[1] /
+            read_values[2];
+#endif
+    }
+}
+
+/*
+ * run_cpu() between start_perf() and stop_perf().
+ */
+void run_cpu_counted(CPU *cpu, PerfCounters *counters)
+{
+    start_perf(counters);
+    run_cpu(cpu);
+    stop_perf(counters);
+}
+
+const char *perf_event_name(int event)
+{
+    const char *names[] = {
+        [PERF_CYCLES] = "CYCLES",
+        [PERF_INSTRUCTIONS] = "INSTRUCTIONS",
+        [PERF_BRANCH_MISSES] = "BRANCH MISSES",
+        [PERF_L1D_MISSES] = "L1D MISSES",
+        [PERF_L1I_MISSES] = "L1I MISSES"
+    };
+
+    if(event < 0 || event >= TOTAL_PERF_EVENTS)
+        return "unknown";
+
+    return names[event];
+}
+
+/*
+ * Prints the last measure, per VM instruction too when vm_instructions
+ * (the VM instructions it ran, see stats.h) is not 0.
+ */
+void print_perf(PerfCounters *counters, double vm_instructions)
+{
+    printf("[PERF]\n");
+
+    printf("%-14s: %.6f s", "TIME", counters->seconds);
+
+    if(vm_instructions > 0)
+        printf(", %.3f ns per VM instruction",
+                counters->seconds * 1e9 / vm_instructions);
+
+    printf("\n");
+
+    for(int i = 0; i < TOTAL_PERF_EVENTS; ++i)
+    {
+        if(!perf_available(counters, i))
+            continue;
+
+        printf("%-14s: %.0f", perf_event_name(i), counters->values[i]);
+
+        if(vm_instructions > 0)
+            printf(", %.3f per VM instruction",
+                    counters->values[i] / vm_instructions);
+
+        printf("\n");
+    }
+
+    if(perf_available(counters, PERF_CYCLES) &&
+            perf_available(counters, PERF_INSTRUCTIONS) &&
+            counters->values[PERF_CYCLES] > 0)
+        printf("%-14s: %.2f\n", "IPC", counters->values[PERF_INSTRUCTIONS] /
+                counters->values[PERF_CYCLES]);
+    else
+        printf("no hardware counters, timing only\n");
+
+    printf("\n");
+}
@@ -0,0 +1,246 @@
+#pragma once
+
+/**
+ * XORVM multi-threaded batch runner.
+ * Author: 0xb4db01
+ *
+ * run_batch() runs the same DecodedProgram over n jobs (one Memory each,
+ * all with the code the program was decoded from) on a pool of threads.
+ *
+ * Every worker starts with a contiguous range of jobs and takes them from
+ * the front of it; a worker left without jobs steals the back half of the
+ * range of another one, so a few big jobs do not keep the other threads
+ * waiting. A range is a single 64-bit word (begin << 32 | end) changed with
+ * compare and swap, both by its owner and by thieves.
+ *
+ * Workers are pinned to the cores the process may run on and each one has
+ * its own CPU, on cache lines of its own, reset before every job: the only
+ * data the workers share is the read-only program and the ranges, each on
+ * its own cache line too. Pinning needs _GNU_SOURCE defined before the
+ * first #include (the Makefile does it), without it workers are not pinned.
+ */
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "cpu.h"
+
+#define POOL_CACHE_LINE 64
+
+typedef struct pool_worker_t
+{
+    _Alignas(POOL_CACHE_LINE) _Atomic unsigned long range;
+
+    _Alignas(POOL_CACHE_LINE) CPU cpu;
+
+    struct pool_t *pool;
+    pthread_t thread;
+    int index;
+    int core;
+} PoolWorker;
+
+typedef struct pool_t
+{
+    DecodedProgram *program;
+    Memory *jobs;
+
+    PoolWorker *workers;
+    int threads;
+} Pool;
+
+/*
+ * Pool functions prototypes
+ */
+
+int run_batch(DecodedProgram *, Memory *, size_t, int);
+long pop_job(PoolWorker *);
+long steal_job(PoolWorker *);
+void *pool_worker(void *);
+int pin_thread(int);
+
+#define POOL_RANGE(begin, end) (((unsigned long)(begin) << 32) | (end))
+#define POOL_BEGIN(range) ((long)((range) >> 32))
+#define POOL_END(range) ((long)((range) & 0xffffffff))
+
+/*
+ * Takes the first job of the range of worker, -1 if it is empty.
+ */
+long pop_job(PoolWorker *worker)
+{
+    unsigned long range = atomic_load(&worker->range);
+
+    while(POOL_BEGIN(range) < POOL_END(range))
+    {
+        unsigned long next = POOL_RANGE(POOL_BEGIN(range) + 1,
+                POOL_END(range));
+
+        if(atomic_compare_exchange_weak(&worker->range, &range, next))
+            return POOL_BEGIN(range);
+    }
+
+    return -1;
+}
+
+/*
+ * Steals the back half of the range of the first worker (after thief)
+ * having any job left, keeps all of it but the first job for later and
+ * returns that one, -1 when there is nothing left anywhere.
+ */
+long steal_job(PoolWorker *thief)
+{
+    Pool *pool = thief->pool;
+
+    for(int i = 1; i < pool->threads; ++i)
+    {
+        PoolWorker *victim = &pool->workers[(thief->index + i) %
+            pool->threads];
+        unsigned long range = atomic_load(&victim->range);
+
+        while(POOL_BEGIN(range) < POOL_END(range))
+        {
+            long begin = POOL_BEGIN(range);
+            long end = POOL_END(range);
+            long middle = begin + (end - begin) / 2;
+
+            if(!atomic_compare_exchange_weak(&victim->range, &range,
+                        POOL_RANGE(begin, middle)))
+                continue;
+
+            // nobody steals from an empty range, so this is safe
+            atomic_store(&thief->range, POOL_RANGE(middle + 1, end));
+
+            return middle;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Pins the calling thread to the index-th core the process may run on,
+ * returns 0 on success (or where pinning is not supported).
+ */
+int pin_thread(int index)
+{
+#if defined(__linux__) && defined(CPU_SETSIZE)
+    cpu_set_t allowed;
+    cpu_set_t pinned;
+    int count = 0;
+
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return -1;
+
+    index %= CPU_COUNT(&allowed);
+
+    for(int core = 0; core < CPU_SETSIZE; ++core)
+    {
+        if(!CPU_ISSET(core, &allowed) || count++ != index)
+            continue;
+
+        CPU_ZERO(&pinned);
+        CPU_SET(core, &pinned);
+
+        return pthread_setaffinity_np(pthread_self(), sizeof(pinned),
+                &pinned);
+    }
+
+    return -1;
+#else
+    (void)index;
+
+    return 0;
+#endif
+}
+
+void *pool_worker(void *argument)
+{
+    PoolWorker *worker = (PoolWorker *)argument;
+    Pool *pool = worker->pool;
+    CPU *cpu = &worker->cpu;
+
+    pin_thread(worker->core);
+
+    for(;;)
+    {
+        long job = pop_job(worker);
+
+        if(job == -1)
+            job = steal_job(worker);
+
+        if(job == -1)
+            return NULL;
+
+        // a new CPU for every job, without going through malloc
+        init_cpu(cpu, &pool->jobs[job]);
+
+        cpu->program = pool->program;
+        cpu->engine = ENGINE_THREADED;
+        cpu->fusions = pool->program->fusions;
+
+        run_cpu(cpu);
+    }
+}
+
+/*
+ * Runs program over the n jobs with threads workers (all the cores the
+ * process may run on if threads <= 0). Every job starts with zeroed
+ * registers and flags. The program is only read, so it must not be
+ * changed (nor compiled by run_jit()) while run_batch() runs.
+ *
+ * Returns 0, or -1 if the workers could not be started.
+ */
+int run_batch(DecodedProgram *program, Memory *jobs, size_t n, int threads)
+{
+    if(threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(threads <= 0)
+        threads = 1;
+
+    if(n > 0xffffffff)
+        return -1;
+
+    Pool pool;
+    pool.program = program;
+    pool.jobs = jobs;
+    pool.threads = threads;
+    pool.workers = (PoolWorker *)aligned_alloc(POOL_CACHE_LINE,
+            sizeof(PoolWorker) * threads);
+
+    if(pool.workers == NULL)
+        return -1;
+
+    int started = 0;
+
+    for(int i = 0; i < threads; ++i)
+    {
+        PoolWorker *worker = &pool.workers[i];
+
+        worker->pool = &pool;
+        worker->index = i;
+        worker->core = i;
+
+        atomic_init(&worker->range, POOL_RANGE(n * i / threads,
+                    n * (i + 1) / threads));
+    }
+
+    for(; started < threads; ++started)
+    {
+        if(pthread_create(&pool.workers[started].thread, NULL, pool_worker,
+                    &pool.workers[started]) != 0)
+            break;
+    }
+
+    // the workers started steal the jobs of the others
+    for(int i = 0; i < started; ++i)
+        pthread_join(pool.workers[i].thread, NULL);
+
+    free(pool.workers);
+
+    return started == 0 ? -1 : 0;
+}
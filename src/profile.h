@@ -0,0 +1,465 @@
+#pragma once
+
+/**
+ * XORVM sampling profiler.
+ * Author: 0xb4db01
+ *
+ * run_sampled() runs a CPU like run_cpu() does with ENGINE_SWITCH, taking
+ * a sample of the PC every period instructions and/or every interval
+ * microseconds of CPU time (with the ITIMER_PROF timer). A sample adds one
+ * to samples[slot], slot being the position in memory->code of the
+ * instruction about to run, so the histogram is in the same terms as
+ * cpu->PC.
+ *
+ * A superinstruction is a single dispatch: with period, the instructions
+ * it stands for are not sampled (a whole MAP_LOOP is one), use
+ * set_fusions(cpu, FUSE_NONE) or the timer to see them.
+ *
+ * Loops are found from their back-edges: a jump to a slot not after its
+ * own is a loop going from the target to the jump. write_profile() prints
+ * the hottest slots and loops, write_folded() the samples as folded stacks
+ * (one "frame;frame;... count" line per slot) for flamegraph.pl and the
+ * like, with the loops around a slot as its frames, outermost first.
+ *
+ * The timer is process-wide: only one run_sampled() with an interval may
+ * run at a time.
+ */
+
+#include <signal.h>
+#include <sys/time.h>
+
+#include "cpu.h"
+
+// the hottest slots and loops write_profile() prints
+#define PROFILE_TOP 20
+
+/*
+ * samples has one counter for each of the slots of memory->code, total is
+ * their sum.
+ */
+typedef struct profile_t
+{
+    unsigned long period;
+    long interval;
+
+    size_t slots;
+    unsigned long *samples;
+    unsigned long total;
+} Profile;
+
+/*
+ * A back-edge: the jump at end goes back to start.
+ */
+typedef struct profile_loop_t
+{
+    long start;
+    long end;
+    unsigned long samples;
+} ProfileLoop;
+
+/*
+ * Profile functions prototypes
+ */
+
+Profile *new_profile(Memory *, unsigned long, long);
+void free_profile(Profile *);
+void profile_sample(Profile *, long);
+void sampled_interpreter(CPU *, Profile *, unsigned long);
+void sampled_engine(CPU *, Profile *);
+void run_sampled(CPU *, Profile *);
+size_t find_loops(DecodedProgram *, ProfileLoop *, size_t);
+ProfileLoop *profile_loops(Profile *, CPU *, size_t *);
+void write_profile(FILE *, Profile *, CPU *);
+void write_folded(FILE *, Profile *, CPU *);
+
+// set by the ITIMER_PROF handler, the next dispatch takes a sample
+volatile sig_atomic_t profile_tick = 0;
+
+// counts countdown down to the next sample of the instruction at slot (0
+// wraps around: with no period only the timer takes samples)
+#define PROFILE_TICK(countdown, slot)\
+    if(--countdown == 0 || profile_tick)\
+    {\
+        profile_sample(profile, slot);\
+        countdown = profile->period;\
+    }\
+
+void profile_timer(int signal)
+{
+    (void)signal;
+
+    profile_tick = 1;
+}
+
+/*
+ * Returns a profile for memory->code sampling every period instructions
+ * (0 for never) and every interval microseconds (0 for never), NULL if
+ * there is no memory left for it.
+ */
+Profile *new_profile(Memory *memory, unsigned long period, long interval)
+{
+    Profile *profile = (Profile *)malloc(sizeof(Profile));
+
+    if(profile == NULL)
+        return NULL;
+
+    profile->period = period;
+    profile->interval = interval;
+    profile->slots = memory->code_size / sizeof(double);
+    profile->samples = (unsigned long *)calloc(profile->slots + 1,
+            sizeof(unsigned long));
+    profile->total = 0;
+
+    if(profile->samples == NULL)
+    {
+        free(profile);
+
+        return NULL;
+    }
+
+    return profile;
+}
+
+void free_profile(Profile *profile)
+{
+    free(profile->samples);
+    free(profile);
+}
+
+void profile_sample(Profile *profile, long slot)
+{
+    profile_tick = 0;
+
+    if(slot < 0 || (size_t)slot >= profile->slots)
+        return;
+
+    profile->samples[slot]++;
+    profile->total++;
+}
+
+/*
+ * interpret_code() taking samples, countdown dispatches away from the next
+ * one.
+ */
+void sampled_interpreter(CPU *cpu, Profile *profile, unsigned long countdown)
+{
+    while(cpu->instruction.bytecode != HLT)
+    {
+        PROFILE_TICK(countdown, cpu->PC + 1)
+
+        fetch_instruction(cpu);
+        execute_instruction(cpu);
+    }
+}
+
+/*
+ * run_decoded() with a sample every profile->period dispatches or when the
+ * timer ticks. A DECODED_FALLBACK goes on in sampled_interpreter() instead
+ * of interpret_code().
+ */
+void sampled_engine(CPU *cpu, Profile *profile)
+{
+    unsigned long countdown = profile->period;
+
+    if(cpu->program == NULL)
+    {
+        sampled_interpreter(cpu, profile, countdown);
+
+        return;
+    }
+
+    long entry = decoded_entry(cpu);
+
+    if(entry == -1)
+        return;
+
+    DecodedInstruction *code = cpu->program->instructions;
+    DecodedInstruction *ip = code + entry;
+    unsigned char *rwmem = cpu->memory->rwmem;
+    long r[8];
+    double d[8];
+    Flags flags;
+
+    memcpy(r, cpu->registers, sizeof(r));
+    memcpy(d, cpu->dregisters, sizeof(d));
+    flags = cpu->flags;
+
+#define TARGET(op) case op: STATS_DISPATCH(cpu, op)
+#define DISPATCH() ip++; break
+#define SKIP(n) ip += (n); break
+#define JUMP(condition) ip = (condition) ? code + ip->imm.i : ip + 1; break
+
+    for(;;)
+    {
+        if(ip->opcode == DECODED_FALLBACK)
+            break;
+
+        PROFILE_TICK(countdown, ip->slot)
+
+        switch(ip->opcode)
+        {
+#include "handlers.h"
+        }
+    }
+
+#undef TARGET
+#undef DISPATCH
+#undef SKIP
+#undef JUMP
+
+    // like the DECODED_FALLBACK handler
+    memcpy(cpu->registers, r, sizeof(r));
+    memcpy(cpu->dregisters, d, sizeof(d));
+    cpu->flags = flags;
+
+    cpu->PC = ip->slot - 1;
+    cpu->instruction.bytecode = DECODED_FALLBACK;
+
+    sampled_interpreter(cpu, profile, countdown);
+}
+
+/*
+ * Runs cpu taking samples in profile, which adds up over several runs.
+ * The program is decoded and fused like run_cpu() does, the engine of the
+ * CPU is not used.
+ */
+void run_sampled(CPU *cpu, Profile *profile)
+{
+    struct sigaction action;
+    struct sigaction old_action;
+    struct itimerval timer;
+    struct itimerval old_timer;
+
+    if(cpu->program == NULL)
+    {
+        cpu->program = decode_program(cpu->memory);
+        cpu->owns_program = 1;
+
+        if(cpu->program != NULL)
+            fuse_program(cpu->program, cpu->fusions);
+    }
+
+    if(profile->interval <= 0)
+    {
+        sampled_engine(cpu, profile);
+
+        return;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_timer;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &old_action);
+
+    timer.it_interval.tv_sec = profile->interval / 1000000;
+    timer.it_interval.tv_usec = profile->interval % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, &old_timer);
+
+    sampled_engine(cpu, profile);
+
+    setitimer(ITIMER_PROF, &old_timer, NULL);
+    sigaction(SIGPROF, &old_action, NULL);
+
+    profile_tick = 0;
+}
+
+/*
+ * Fills loops with up to max back-edges of program, in the order of the
+ * jumps, and returns how many there are.
+ */
+size_t find_loops(DecodedProgram *program, ProfileLoop *loops, size_t max)
+{
+    DecodedInstruction *code = program->instructions;
+    size_t found = 0;
+
+    // fused CMP_J* keep their jump right after them
+    for(size_t i = 0; i < program->length; ++i)
+    {
+        if(code[i].opcode < JMP || code[i].opcode > JGT)
+            continue;
+
+        if(code[code[i].imm.i].slot > code[i].slot)
+            continue;
+
+        if(found < max)
+        {
+            loops[found].start = code[code[i].imm.i].slot;
+            loops[found].end = code[i].slot;
+            loops[found].samples = 0;
+        }
+
+        found++;
+    }
+
+    return found;
+}
+
+/*
+ * The back-edges of cpu->program with the samples taken between their
+ * start and their end, NULL without memory (or a program). *count is set
+ * to the number of loops.
+ */
+ProfileLoop *profile_loops(Profile *profile, CPU *cpu, size_t *count)
+{
+    ProfileLoop *loops;
+
+    *count = 0;
+
+    if(cpu->program == NULL)
+        return NULL;
+
+    *count = find_loops(cpu->program, NULL, 0);
+    loops = (ProfileLoop *)malloc(sizeof(ProfileLoop) * (*count + 1));
+
+    if(loops == NULL)
+    {
+        *count = 0;
+
+        return NULL;
+    }
+
+    find_loops(cpu->program, loops, *count);
+
+    for(size_t i = 0; i < *count; ++i)
+    {
+        for(long slot = loops[i].start; slot <= loops[i].end; ++slot)
+            loops[i].samples += profile->samples[slot];
+    }
+
+    return loops;
+}
+
+/*
+ * Prints the PROFILE_TOP slots with the most samples, then the
+ * PROFILE_TOP hottest loops.
+ */
+void write_profile(FILE *out, Profile *profile, CPU *cpu)
+{
+    size_t count;
+    ProfileLoop *loops = profile_loops(profile, cpu, &count);
+    double total = profile->total ? profile->total : 1;
+    unsigned long last = (unsigned long)-1;
+
+    fprintf(out, "[PROFILE] %lu samples\n\n", profile->total);
+    fprintf(out, "    SLOT    SAMPLES       %%  INSTRUCTION\n");
+
+    // the next hottest slot is the hottest one below the last printed,
+    // those with as many samples as it in slot order
+    for(int printed = 0; printed < PROFILE_TOP;)
+    {
+        unsigned long hottest = 0;
+
+        for(size_t slot = 0; slot < profile->slots; ++slot)
+        {
+            if(profile->samples[slot] < last &&
+                    profile->samples[slot] > hottest)
+                hottest = profile->samples[slot];
+        }
+
+        if(hottest == 0)
+            break;
+
+        for(size_t slot = 0; slot < profile->slots &&
+                printed < PROFILE_TOP; ++slot)
+        {
+            if(profile->samples[slot] != hottest)
+                continue;
+
+            fprintf(out, "%8zu %10lu %6.2f%%  %s\n", slot, hottest,
+                    100 * hottest / total,
+                    instruction_name(cpu->memory->code[slot]));
+
+            printed++;
+        }
+
+        last = hottest;
+    }
+
+    fprintf(out, "\n[LOOPS] %zu back-edges\n\n", count);
+    fprintf(out, "   START      END    SAMPLES       %%  JUMP\n");
+
+    // selection of the hottest loop left, PROFILE_TOP times
+    for(int printed = 0; printed < PROFILE_TOP && loops != NULL; ++printed)
+    {
+        size_t hottest = count;
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            if(loops[i].end >= 0 && (hottest == count ||
+                        loops[i].samples > loops[hottest].samples))
+                hottest = i;
+        }
+
+        if(hottest == count)
+            break;
+
+        fprintf(out, "%8ld %8ld %10lu %6.2f%%  %s\n", loops[hottest].start,
+                loops[hottest].end, loops[hottest].samples,
+                100 * loops[hottest].samples / total,
+                instruction_name(cpu->memory->code[loops[hottest].end]));
+
+        loops[hottest].end = -1;
+    }
+
+    fprintf(out, "\n");
+
+    free(loops);
+}
+
+/*
+ * Writes a folded stack for every slot with samples:
+ *
+ *     xorvm;loop@9-24;XOR@12 120
+ *
+ * the loops being the ones around the slot, the largest first.
+ */
+void write_folded(FILE *out, Profile *profile, CPU *cpu)
+{
+    size_t count;
+    ProfileLoop *loops = profile_loops(profile, cpu, &count);
+
+    for(size_t slot = 0; slot < profile->slots; ++slot)
+    {
+        if(profile->samples[slot] == 0)
+            continue;
+
+        fprintf(out, "xorvm");
+
+        // the loops around slot from the largest, one size at a time
+        long last = -1;
+
+        for(;;)
+        {
+            long size = -1;
+
+            for(size_t i = 0; i < count; ++i)
+            {
+                long length = loops[i].end - loops[i].start;
+
+                if(loops[i].start <= (long)slot && loops[i].end >= (long)slot
+                        && (last == -1 || length < last) && length > size)
+                    size = length;
+            }
+
+            if(size == -1)
+                break;
+
+            for(size_t i = 0; i < count; ++i)
+            {
+                if(loops[i].start <= (long)slot && loops[i].end >= (long)slot
+                        && loops[i].end - loops[i].start == size)
+                    fprintf(out, ";loop@%ld-%ld", loops[i].start,
+                            loops[i].end);
+            }
+
+            last = size;
+        }
+
+        fprintf(out, ";%s@%zu %lu\n",
+                instruction_name(cpu->memory->code[slot]), slot,
+                profile->samples[slot]);
+    }
+
+    free(loops);
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+/**
+ * XORVM shared programs.
+ * Author: 0xb4db01
+ *
+ * A Memory holds both the code and the rwmem it works on, so whatever is
+ * made from it (a DecodedProgram, its superinstructions, its JIT code) is
+ * prepared for one buffer at a time. A Program is made once from the code
+ * alone, with all of that prepared up front, then never changed: any
+ * number of threads can run it at once without locks.
+ *
+ *     Program *program = new_program(code, sizeof(code), ENGINE_JIT,
+ *             FUSE_ALL);
+ *
+ *     // in every thread, for every buffer
+ *     RunContext run;
+ *
+ *     init_run(&run, program, buffer, size);
+ *     run_program(&run);
+ *     finish_run(&run);
+ *
+ *     release_program(program);
+ *
+ * A RunContext is what a run changes: a CPU (registers, flags, PC) and the
+ * buffer. It holds a reference to its Program, which is freed once the
+ * last reference is given back, so the thread making it does not have to
+ * wait for the others to be done with it.
+ */
+
+#include <stdatomic.h>
+
+#include "cpu.h"
+
+/*
+ * code is a copy of the code the Program was made from, and decoded its
+ * frozen DecodedProgram (see cpu.h), compiled already when engine is
+ * ENGINE_JIT: engine is ENGINE_THREADED when it could not be.
+ */
+typedef struct program_t
+{
+    double *code;
+    size_t code_size;
+
+    DecodedProgram *decoded;
+    int engine;
+
+    _Atomic unsigned long references;
+} Program;
+
+/*
+ * memory is the code of program with the buffer of the run. A RunContext
+ * must not be moved once init_run() made it, cpu points to its memory.
+ */
+typedef struct run_context_t
+{
+    CPU cpu;
+    Memory memory;
+    Program *program;
+} RunContext;
+
+/*
+ * Program functions prototypes
+ */
+
+Program *new_program(double *, size_t, int, int);
+Program *retain_program(Program *);
+void release_program(Program *);
+void init_run(RunContext *, Program *, unsigned char *, size_t);
+void reset_run(RunContext *, unsigned char *, size_t);
+void run_program(RunContext *);
+void finish_run(RunContext *);
+
+/*
+ * Makes a Program of code_size bytes of code, run with engine (see enum
+ * Engines) and the superinstructions in fusions (see enum Fusions).
+ * Returns it with one reference, NULL if the code can not be decoded.
+ */
+Program *new_program(double *code, size_t code_size, int engine,
+        int fusions)
+{
+    Program *program = (Program *)malloc(sizeof(Program));
+
+    if(program == NULL)
+        return NULL;
+
+    program->code = (double *)malloc(code_size);
+
+    if(program->code == NULL)
+    {
+        free(program);
+
+        return NULL;
+    }
+
+    memcpy(program->code, code, code_size);
+    program->code_size = code_size;
+
+    Memory memory;
+    memory.code_size = code_size;
+    memory.code = program->code;
+    memory.rwmem_size = 0;
+    memory.rwmem = NULL;
+
+    program->decoded = decode_program(&memory);
+
+    if(program->decoded == NULL)
+    {
+        free(program->code);
+        free(program);
+
+        return NULL;
+    }
+
+    fuse_program(program->decoded, fusions);
+
+    program->engine = engine;
+
+    if(engine == ENGINE_JIT)
+    {
+        program->decoded->jit = jit_compile(program->decoded);
+
+        if(program->decoded->jit == NULL)
+            program->engine = ENGINE_THREADED;
+    }
+
+    program->decoded->frozen = 1;
+
+    atomic_init(&program->references, 1);
+
+    return program;
+}
+
+/*
+ * Takes one more reference to program and returns it.
+ */
+Program *retain_program(Program *program)
+{
+    atomic_fetch_add_explicit(&program->references, 1, memory_order_relaxed);
+
+    return program;
+}
+
+/*
+ * Gives a reference to program back, freeing it with the last one.
+ */
+void release_program(Program *program)
+{
+    if(program == NULL)
+        return;
+
+    if(atomic_fetch_sub_explicit(&program->references, 1,
+                memory_order_acq_rel) != 1)
+        return;
+
+    free_decoded_program(program->decoded);
+    free(program->code);
+    free(program);
+}
+
+/*
+ * Makes run ready to run program over the size bytes of rwmem, with
+ * registers and flags zeroed, and takes a reference to program.
+ */
+void init_run(RunContext *run, Program *program, unsigned char *rwmem,
+        size_t size)
+{
+    run->program = retain_program(program);
+
+    run->memory.code_size = program->code_size;
+    run->memory.code = program->code;
+    run->memory.rwmem_size = size;
+    run->memory.rwmem = rwmem;
+
+    init_cpu(&run->cpu, &run->memory);
+    attach_program(&run->cpu, program->decoded);
+    set_engine(&run->cpu, program->engine);
+    run->cpu.fusions = program->decoded->fusions;
+}
+
+/*
+ * Gets run ready to run its program again over another buffer, see
+ * reset_cpu().
+ */
+void reset_run(RunContext *run, unsigned char *rwmem, size_t size)
+{
+    run->memory.rwmem_size = size;
+    run->memory.rwmem = rwmem;
+
+    reset_cpu(&run->cpu, &run->memory);
+}
+
+void run_program(RunContext *run)
+{
+    run_cpu(&run->cpu);
+}
+
+/*
+ * Gives back the reference of run to its program.
+ */
+void finish_run(RunContext *run)
+{
+    deinit_cpu(&run->cpu);
+    release_program(run->program);
+
+    run->program = NULL;
+}
@@ -0,0 +1,264 @@
+#pragma once
+
+/**
+ * XORVM scheduler.
+ * Author: 0xb4db01
+ *
+ * Runs any number of CPUs over a few threads, round robin: a worker takes
+ * the task at the front of the queue, runs it with run_cpu_for() for a
+ * slice of instructions and puts it back at the end unless it halted or
+ * failed. A program that runs for a long time only ever holds a worker for
+ * a slice, so short programs queued behind it still finish quickly.
+ *
+ *     Scheduler *scheduler = new_scheduler(4, SCHEDULER_SLICE);
+ *
+ *     for(size_t i = 0; i < n; ++i)
+ *         schedule(scheduler, &tasks[i], cpus[i]);
+ *
+ *     wait_scheduler(scheduler);
+ *     free_scheduler(scheduler);
+ *
+ * A task may also have a limit of instructions in total, after which it is
+ * stopped with VM_BUDGET, and a done callback called by the worker that
+ * ran its last slice. Tasks and CPUs belong to the caller and must stay
+ * where they are until the task is done.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "verify.h"
+
+// instructions a task runs before going back to the end of the queue
+#define SCHEDULER_SLICE 10000
+
+/*
+ * status is VM_BUDGET until the task is done, then what run_cpu_for()
+ * returned last (VM_BUDGET if it went over its limit). instructions and
+ * slices are what it ran so far.
+ */
+typedef struct scheduler_task_t
+{
+    CPU *cpu;
+
+    unsigned long limit;
+    void (*done)(struct scheduler_task_t *);
+    void *data;
+
+    int status;
+    unsigned long instructions;
+    unsigned long slices;
+
+    struct scheduler_task_t *next;
+} SchedulerTask;
+
+/*
+ * queued is the run queue, from head to tail. pending counts the tasks
+ * scheduled and not done yet.
+ */
+typedef struct scheduler_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t idle;
+
+    SchedulerTask *head;
+    SchedulerTask *tail;
+    size_t pending;
+    int stopping;
+
+    unsigned long slice;
+
+    pthread_t *threads;
+    int workers;
+} Scheduler;
+
+/*
+ * Scheduler functions prototypes
+ */
+
+Scheduler *new_scheduler(int, unsigned long);
+void free_scheduler(Scheduler *);
+void schedule(Scheduler *, SchedulerTask *, CPU *);
+void wait_scheduler(Scheduler *);
+void *scheduler_worker(void *);
+
+void *scheduler_worker(void *argument)
+{
+    Scheduler *scheduler = (Scheduler *)argument;
+
+    pthread_mutex_lock(&scheduler->lock);
+
+    for(;;)
+    {
+        while(scheduler->head == NULL && !scheduler->stopping)
+            pthread_cond_wait(&scheduler->queued, &scheduler->lock);
+
+        if(scheduler->head == NULL)
+            break;
+
+        SchedulerTask *task = scheduler->head;
+
+        scheduler->head = task->next;
+
+        if(scheduler->head == NULL)
+            scheduler->tail = NULL;
+
+        pthread_mutex_unlock(&scheduler->lock);
+
+        unsigned long slice = scheduler->slice;
+        unsigned long executed;
+
+        if(task->limit > 0 && task->limit - task->instructions < slice)
+            slice = task->limit - task->instructions;
+
+        task->status = run_cpu_for(task->cpu, slice, &executed);
+        task->instructions += executed;
+        task->slices++;
+
+        int done = task->status != VM_BUDGET ||
+            (task->limit > 0 && task->instructions >= task->limit);
+
+        if(done && task->done != NULL)
+            task->done(task);
+
+        pthread_mutex_lock(&scheduler->lock);
+
+        if(done)
+        {
+            if(--scheduler->pending == 0)
+                pthread_cond_broadcast(&scheduler->idle);
+
+            continue;
+        }
+
+        task->next = NULL;
+
+        if(scheduler->tail == NULL)
+            scheduler->head = task;
+        else
+            scheduler->tail->next = task;
+
+        scheduler->tail = task;
+    }
+
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return NULL;
+}
+
+/*
+ * Starts a scheduler with workers threads (the cores the process may run
+ * on if workers <= 0) running slices of slice instructions. Returns NULL
+ * if no thread could be started.
+ */
+Scheduler *new_scheduler(int workers, unsigned long slice)
+{
+    if(workers <= 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(workers <= 0)
+        workers = 1;
+
+    Scheduler *scheduler = (Scheduler *)malloc(sizeof(Scheduler));
+
+    if(scheduler == NULL)
+        return NULL;
+
+    scheduler->threads = (pthread_t *)malloc(sizeof(pthread_t) * workers);
+
+    if(scheduler->threads == NULL)
+    {
+        free(scheduler);
+
+        return NULL;
+    }
+
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->queued, NULL);
+    pthread_cond_init(&scheduler->idle, NULL);
+
+    scheduler->head = NULL;
+    scheduler->tail = NULL;
+    scheduler->pending = 0;
+    scheduler->stopping = 0;
+    scheduler->slice = slice > 0 ? slice : SCHEDULER_SLICE;
+    scheduler->workers = 0;
+
+    for(; scheduler->workers < workers; ++scheduler->workers)
+    {
+        if(pthread_create(&scheduler->threads[scheduler->workers], NULL,
+                    scheduler_worker, scheduler) != 0)
+            break;
+    }
+
+    if(scheduler->workers == 0)
+    {
+        free_scheduler(scheduler);
+
+        return NULL;
+    }
+
+    return scheduler;
+}
+
+/*
+ * Stops the workers once the queue is empty, then frees scheduler.
+ */
+void free_scheduler(Scheduler *scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->stopping = 1;
+    pthread_cond_broadcast(&scheduler->queued);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for(int i = 0; i < scheduler->workers; ++i)
+        pthread_join(scheduler->threads[i], NULL);
+
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->queued);
+    pthread_cond_destroy(&scheduler->idle);
+
+    free(scheduler->threads);
+    free(scheduler);
+}
+
+/*
+ * Queues task to run cpu. limit, done and data are left as the caller set
+ * them, everything else is reset.
+ */
+void schedule(Scheduler *scheduler, SchedulerTask *task, CPU *cpu)
+{
+    task->cpu = cpu;
+    task->status = VM_BUDGET;
+    task->instructions = 0;
+    task->slices = 0;
+    task->next = NULL;
+
+    pthread_mutex_lock(&scheduler->lock);
+
+    if(scheduler->tail == NULL)
+        scheduler->head = task;
+    else
+        scheduler->tail->next = task;
+
+    scheduler->tail = task;
+    scheduler->pending++;
+
+    pthread_cond_signal(&scheduler->queued);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/*
+ * Waits until every task scheduled so far is done.
+ */
+void wait_scheduler(Scheduler *scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+
+    while(scheduler->pending > 0)
+        pthread_cond_wait(&scheduler->idle, &scheduler->lock);
+
+    pthread_mutex_unlock(&scheduler->lock);
+}
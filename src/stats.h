@@ -0,0 +1,384 @@
+#pragma once
+
+/**
+ * XORVM statistics.
+ * Author: 0xb4db01
+ *
+ * Compiled with -DXORVM_STATS every CPU keeps a Stats (see cpu.h) counting
+ * the VM instructions it runs for every opcode, the jumps taken and not
+ * taken, and the bytes of rwmem read and written. -DXORVM_STATS_CYCLES
+ * (which implies XORVM_STATS) also splits the time stamp counter between
+ * the classes of instructions, from one dispatch to the next, which slows
+ * every dispatch down by a few dozen cycles.
+ *
+ * The counters are updated by interpret_code() and by the engines running
+ * a DecodedProgram, through the STATS_* hooks in cpu.h. ENGINE_JIT runs
+ * ENGINE_THREADED, since native code can not count anything, and the
+ * engines in batch.h, aot.h and bytecode.h are not counted at all. Without
+ * XORVM_STATS the hooks are empty and CPU has no stats: nothing is left of
+ * all this but get_stats() returning NULL.
+ *
+ * The counters add up until reset_stats(): run the CPU, then read them
+ * with get_stats() or print_stats().
+ */
+
+#include "cpu.h"
+
+#ifdef XORVM_STATS_CYCLES
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define STATS_TSC() __rdtsc()
+#else
+#define STATS_TSC() 0
+#endif
+
+#endif
+
+/*
+ * Stats functions prototypes
+ */
+
+const char *instruction_name(int);
+
+/*
+ * The opcode an instruction run by interpret_code() is counted as, which is
+ * DECODED_FALLBACK (nothing run) for the ones it does not know.
+ */
+int stats_instruction(int bytecode)
+{
+    if(bytecode < 0 || bytecode >= TOTAL_INSTRUCTIONS)
+        return DECODED_FALLBACK;
+
+    return bytecode;
+}
+
+/*
+ * Returns the enum Instructions opcode of an opcode of enum Instructions
+ * or enum DecodedOpcodes, -1 for superinstructions and DECODED_FALLBACK.
+ */
+int stats_opcode(int opcode)
+{
+    if(opcode >= 0 && opcode < TOTAL_INSTRUCTIONS)
+        return opcode;
+
+    // MOV to DIVI come in 4 variants (_RR to _DD) followed by the 2 of their
+    // immediate form (_R, _D), in the order of enum Instructions
+    if(opcode >= MOV_RR && opcode <= DIVI_D)
+        return MOV + (opcode - MOV_RR) / 6 * 2 + (opcode - MOV_RR) % 6 / 4;
+
+    if(opcode >= CMP_RR && opcode <= CMP_DD)
+        return CMP;
+
+    if(opcode >= LD_RR && opcode <= LD_DD)
+        return LD;
+
+    if(opcode >= STR_RR && opcode <= STR_DD)
+        return STR;
+
+    return -1;
+}
+
+/*
+ * Returns the enum InstructionClasses of an opcode of enum Instructions or
+ * enum DecodedOpcodes.
+ */
+int stats_class(int opcode)
+{
+    if(opcode >= CMP_JE_RR && opcode <= MAP_LOOP)
+        return CLASS_FUSED;
+
+    switch(stats_opcode(opcode))
+    {
+        case MOV: case MOVI:
+            return CLASS_MOVE;
+
+        case ADD: case ADDI: case SUB: case SUBI:
+        case MUL: case MULI: case DIV: case DIVI:
+            return CLASS_ARITHMETIC;
+
+        case CMP:
+            return CLASS_COMPARE;
+
+        case JMP: case JE: case JNE: case JLT: case JGT:
+            return CLASS_JUMP;
+
+        case LD: case STR:
+        case LD16: case LD32: case LD64: case STR16: case STR32: case STR64:
+        case VLD: case VST:
+            return CLASS_MEMORY;
+
+        case XOR: case XORI: case SHL: case SHR: case SHLI: case SHRI:
+            return CLASS_BITWISE;
+
+        case VXOR: case VADD: case VSHL: case VSHR:
+            return CLASS_VECTOR;
+
+        case MEMCPY: case MEMSET: case MEMXOR: case MEMXORK:
+            return CLASS_BLOCK;
+    }
+
+    return CLASS_OTHER;
+}
+
+/*
+ * Counts a dispatch of opcode (of enum Instructions or enum DecodedOpcodes)
+ * and the instructions it runs. The jumps, the block instructions and the
+ * rounds of a MAP_LOOP are counted by their own hooks.
+ */
+void stats_dispatch(Stats *stats, int opcode)
+{
+    int instruction = stats_opcode(opcode);
+
+#ifdef XORVM_STATS_CYCLES
+    unsigned long long now = STATS_TSC();
+
+    // only within run_cpu(), see stats_start()
+    if(stats->last_tsc != 0)
+    {
+        stats->cycles[stats->last_class] += now - stats->last_tsc;
+        stats->last_tsc = now;
+        stats->last_class = stats_class(opcode);
+    }
+#endif
+
+    stats->dispatches++;
+
+    if(opcode >= CMP_JE_RR && opcode <= CMP_JGT_RR)
+    {
+        stats->instructions[CMP]++;
+        stats->instructions[JE + opcode - CMP_JE_RR]++;
+        stats->retired += 2;
+
+        return;
+    }
+
+    if(opcode == LD_XOR_STR_INC)
+    {
+        stats->instructions[LD]++;
+        stats->instructions[XOR]++;
+        stats->instructions[STR]++;
+        stats->instructions[ADDI]++;
+        stats->retired += 4;
+        stats->loaded++;
+        stats->stored++;
+
+        return;
+    }
+
+    // the LD of the last round
+    if(opcode == MAP_LOOP)
+        instruction = LD;
+
+    // DECODED_FALLBACK, interpret_code() counts what it runs
+    if(instruction == -1)
+        return;
+
+    stats->instructions[instruction]++;
+    stats->retired++;
+
+    switch(instruction)
+    {
+        case LD:
+            stats->loaded++;
+
+            break;
+
+        case STR:
+            stats->stored++;
+
+            break;
+
+        case LD16: case LD32: case LD64:
+            stats->loaded += wide_size(instruction);
+
+            break;
+
+        case STR16: case STR32: case STR64:
+            stats->stored += wide_size(instruction);
+
+            break;
+
+        case VLD:
+            stats->loaded += VECTOR_SIZE;
+
+            break;
+
+        case VST:
+            stats->stored += VECTOR_SIZE;
+
+            break;
+    }
+}
+
+/*
+ * Counts a jump of opcode (JMP to JGT), taken or not.
+ */
+void stats_jump(Stats *stats, int opcode, int taken)
+{
+    if(taken)
+        stats->taken[opcode - JMP]++;
+    else
+        stats->not_taken[opcode - JMP]++;
+}
+
+/*
+ * Counts the bytes a block instruction reads and writes with the values of
+ * its length and key length registers, see block_operation().
+ */
+void stats_block(Stats *stats, int opcode, long length, long key_length)
+{
+    if(length <= 0 || (opcode == MEMXORK && key_length <= 0))
+        return;
+
+    if(opcode == MEMCPY)
+        stats->loaded += length;
+    else if(opcode != MEMSET)
+        stats->loaded += 2 * length;
+
+    stats->stored += length;
+}
+
+/*
+ * Counts the rounds map_loop() ran for the MAP_LOOP at ip: each one is the
+ * 6 instructions of the loop, with the jump back taken.
+ */
+void stats_map_loop(Stats *stats, DecodedInstruction *ip, size_t rounds)
+{
+    stats->instructions[LD] += rounds;
+    stats->instructions[stats_opcode(ip[1].opcode)] += rounds;
+    stats->instructions[STR] += rounds;
+    stats->instructions[ADDI] += rounds;
+    stats->instructions[CMP] += rounds;
+    stats->instructions[ip[5].opcode] += rounds;
+    stats->taken[ip[5].opcode - JMP] += rounds;
+    stats->retired += 6 * rounds;
+    stats->loaded += rounds;
+    stats->stored += rounds;
+}
+
+/*
+ * Called by run_cpu() before running and after: the cycles in between
+ * that are not spent in a class of instructions go to CLASS_OTHER.
+ */
+void stats_start(Stats *stats)
+{
+#ifdef XORVM_STATS_CYCLES
+    stats->last_tsc = STATS_TSC();
+    stats->last_class = CLASS_OTHER;
+#else
+    (void)stats;
+#endif
+}
+
+void stats_stop(Stats *stats)
+{
+#ifdef XORVM_STATS_CYCLES
+    stats->cycles[stats->last_class] += STATS_TSC() - stats->last_tsc;
+    stats->last_tsc = 0;
+#else
+    (void)stats;
+#endif
+}
+
+/*
+ * Returns the stats of cpu, NULL if XORVM was compiled without XORVM_STATS.
+ */
+Stats *get_stats(CPU *cpu)
+{
+#ifdef XORVM_STATS
+    return &cpu->stats;
+#else
+    (void)cpu;
+
+    return NULL;
+#endif
+}
+
+void reset_stats(CPU *cpu)
+{
+#ifdef XORVM_STATS
+    memset(&cpu->stats, 0, sizeof(cpu->stats));
+#else
+    (void)cpu;
+#endif
+}
+
+const char *instruction_name(int opcode)
+{
+    const char *names[] = {
+        [MOV] = "MOV", [MOVI] = "MOVI",
+        [ADD] = "ADD", [ADDI] = "ADDI", [SUB] = "SUB", [SUBI] = "SUBI",
+        [MUL] = "MUL", [MULI] = "MULI", [DIV] = "DIV", [DIVI] = "DIVI",
+        [CMP] = "CMP",
+        [JMP] = "JMP", [JE] = "JE", [JNE] = "JNE", [JLT] = "JLT",
+        [JGT] = "JGT",
+        [LD] = "LD", [STR] = "STR",
+        [XOR] = "XOR", [XORI] = "XORI", [SHL] = "SHL", [SHR] = "SHR",
+        [SHLI] = "SHLI", [SHRI] = "SHRI",
+        [HLT] = "HLT",
+        [LD16] = "LD16", [LD32] = "LD32", [LD64] = "LD64",
+        [STR16] = "STR16", [STR32] = "STR32", [STR64] = "STR64",
+        [VLD] = "VLD", [VST] = "VST", [VXOR] = "VXOR", [VADD] = "VADD",
+        [VSHL] = "VSHL", [VSHR] = "VSHR",
+        [MEMCPY] = "MEMCPY", [MEMSET] = "MEMSET", [MEMXOR] = "MEMXOR",
+        [MEMXORK] = "MEMXORK",
+        [IN] = "IN", [OUT] = "OUT", [YIELD] = "YIELD"
+    };
+
+    if(opcode < 0 || opcode >= TOTAL_INSTRUCTIONS)
+        return "unknown";
+
+    return names[opcode];
+}
+
+void print_stats(Stats *stats)
+{
+    const char *classes[] = {
+        [CLASS_MOVE] = "MOVE", [CLASS_ARITHMETIC] = "ARITHMETIC",
+        [CLASS_COMPARE] = "COMPARE", [CLASS_JUMP] = "JUMP",
+        [CLASS_MEMORY] = "MEMORY", [CLASS_BITWISE] = "BITWISE",
+        [CLASS_VECTOR] = "VECTOR", [CLASS_BLOCK] = "BLOCK",
+        [CLASS_FUSED] = "FUSED", [CLASS_OTHER] = "OTHER"
+    };
+
+    printf("[STATS]\n");
+
+    if(stats == NULL)
+    {
+        printf("compiled without XORVM_STATS\n\n");
+
+        return;
+    }
+
+    printf("RETIRED     : %lu\n", stats->retired);
+    printf("DISPATCHES  : %lu\n", stats->dispatches);
+    printf("LOADED      : %lu bytes\n", stats->loaded);
+    printf("STORED      : %lu bytes\n", stats->stored);
+
+    for(int i = 0; i < TOTAL_INSTRUCTIONS; ++i)
+    {
+        if(stats->instructions[i] == 0)
+            continue;
+
+        printf("%-12s: %lu", instruction_name(i), stats->instructions[i]);
+
+        if(i >= JMP && i <= JGT)
+            printf(" (%lu taken, %lu not taken)", stats->taken[i - JMP],
+                    stats->not_taken[i - JMP]);
+
+        printf("\n");
+    }
+
+#ifdef XORVM_STATS_CYCLES
+    for(int i = 0; i < TOTAL_CLASSES; ++i)
+    {
+        if(stats->cycles[i] != 0)
+            printf("%-12s: %llu cycles\n", classes[i], stats->cycles[i]);
+    }
+#else
+    (void)classes;
+#endif
+
+    printf("\n");
+}
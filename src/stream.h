@@ -0,0 +1,323 @@
+#pragma once
+
+/**
+ * XORVM streaming execution.
+ * Author: 0xb4db01
+ *
+ * run_stream() runs a program over an input of any size (a file, a pipe,
+ * a socket...) a window of bytes at a time: every window is read into
+ * rwmem, the program runs once on it from the beginning and the window,
+ * changed in place, is written to the output.
+ *
+ * Registers in StreamConfig.carry survive from one window to the next (a
+ * key, a counter of the bytes seen so far...), the others are zeroed before
+ * every window, and the size of the window is put in length_register so
+ * the program knows where to stop.
+ *
+ * Two buffers are used: an I/O thread writes the previous window and
+ * reads the next one into one while the program runs on the other, so
+ * memory use is 2 * window bytes whatever the size of the input.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+#define STREAM_WINDOW (1 << 20)
+
+// bits of StreamConfig.carry
+#define STREAM_CARRY_R(reg) (1 << (reg))
+#define STREAM_CARRY_D(reg) (1 << (8 + (reg)))
+#define STREAM_CARRY_FLAGS (1 << 16)
+
+/*
+ * window is the size of the windows (STREAM_WINDOW if 0), length_register
+ * the R<n> register getting the size of each window (-1 for none) and carry
+ * the registers (and flags) kept between windows, see STREAM_CARRY_R().
+ */
+typedef struct stream_config_t
+{
+    size_t window;
+    int length_register;
+    unsigned int carry;
+} StreamConfig;
+
+enum StreamStates
+{
+    STREAM_EMPTY,
+    STREAM_FULL,
+    STREAM_DONE
+};
+
+typedef struct stream_buffer_t
+{
+    unsigned char *bytes;
+    size_t length;
+    int state;
+} StreamBuffer;
+
+typedef struct stream_t
+{
+    StreamBuffer buffers[2];
+    size_t window;
+
+    int in;
+    int out;
+
+    // set by the I/O thread on end of input or errors
+    int eof;
+    int error;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Stream;
+
+/*
+ * Stream functions prototypes
+ */
+
+int run_stream(CPU *, int, int, StreamConfig *);
+ssize_t read_window(int, unsigned char *, size_t);
+int write_window(int, unsigned char *, size_t);
+void *stream_io(void *);
+void reset_window_registers(CPU *, StreamConfig *, size_t);
+
+/*
+ * Reads up to size bytes, fewer only at the end of the input.
+ */
+ssize_t read_window(int fd, unsigned char *bytes, size_t size)
+{
+    size_t done = 0;
+
+    while(done < size)
+    {
+        ssize_t count = read(fd, bytes + done, size - done);
+
+        if(count < 0 && errno == EINTR)
+            continue;
+
+        if(count < 0)
+            return -1;
+
+        if(count == 0)
+            break;
+
+        done += count;
+    }
+
+    return done;
+}
+
+int write_window(int fd, unsigned char *bytes, size_t size)
+{
+    size_t done = 0;
+
+    while(done < size)
+    {
+        ssize_t count = write(fd, bytes + done, size - done);
+
+        if(count < 0 && errno == EINTR)
+            continue;
+
+        if(count < 0)
+            return -1;
+
+        done += count;
+    }
+
+    return 0;
+}
+
+/*
+ * The I/O thread: writes out the buffers the program is done with and
+ * fills them again, one buffer after the other.
+ */
+void *stream_io(void *argument)
+{
+    Stream *stream = (Stream *)argument;
+
+    for(size_t next = 0;; ++next)
+    {
+        StreamBuffer *buffer = &stream->buffers[next % 2];
+
+        pthread_mutex_lock(&stream->lock);
+
+        while(buffer->state == STREAM_FULL)
+            pthread_cond_wait(&stream->changed, &stream->lock);
+
+        int state = buffer->state;
+        int eof = stream->eof;
+
+        pthread_mutex_unlock(&stream->lock);
+
+        if(state == STREAM_DONE &&
+                write_window(stream->out, buffer->bytes, buffer->length) != 0)
+        {
+            pthread_mutex_lock(&stream->lock);
+
+            stream->error = errno;
+            stream->eof = 1;
+
+            // the buffer the program may be running on is left alone, the
+            // other one tells it to stop
+            for(int i = 0; i < 2; ++i)
+            {
+                if(stream->buffers[i].state == STREAM_FULL)
+                    continue;
+
+                stream->buffers[i].state = STREAM_FULL;
+                stream->buffers[i].length = 0;
+            }
+
+            pthread_cond_broadcast(&stream->changed);
+            pthread_mutex_unlock(&stream->lock);
+
+            return NULL;
+        }
+
+        // the last buffer has been written out
+        if(eof)
+            return NULL;
+
+        ssize_t length = read_window(stream->in, buffer->bytes,
+                stream->window);
+
+        pthread_mutex_lock(&stream->lock);
+
+        if(length <= 0)
+        {
+            stream->error = length < 0 ? errno : 0;
+            stream->eof = 1;
+            length = 0;
+        }
+
+        buffer->length = length;
+        buffer->state = STREAM_FULL;
+
+        pthread_cond_broadcast(&stream->changed);
+        pthread_mutex_unlock(&stream->lock);
+    }
+}
+
+/*
+ * Gets cpu ready for the next window of length bytes.
+ */
+void reset_window_registers(CPU *cpu, StreamConfig *config, size_t length)
+{
+    for(int i = 0; i < 8; ++i)
+    {
+        if(!(config->carry & STREAM_CARRY_R(i)))
+            cpu->registers[i] = 0;
+
+        if(!(config->carry & STREAM_CARRY_D(i)))
+            cpu->dregisters[i] = 0;
+    }
+
+    if(!(config->carry & STREAM_CARRY_FLAGS))
+        memset(&cpu->flags, 0, sizeof(cpu->flags));
+
+    if(config->length_register >= 0 && config->length_register <= 7)
+        cpu->registers[config->length_register] = length;
+
+    cpu->PC = -1;
+    cpu->instruction.bytecode = 0;
+}
+
+/*
+ * Runs the code of cpu->memory (with cpu->program, if already decoded)
+ * over everything read from in, writing the result to out. The registers
+ * of cpu are the ones the first window starts with, and at the end they
+ * are the ones the last window left.
+ *
+ * Returns 0, or -1 with errno set on I/O errors.
+ */
+int run_stream(CPU *cpu, int in, int out, StreamConfig *config)
+{
+    Stream stream;
+    Memory *memory = cpu->memory;
+    Memory window;
+    pthread_t io;
+
+    stream.window = config->window ? config->window : STREAM_WINDOW;
+    stream.in = in;
+    stream.out = out;
+    stream.eof = 0;
+    stream.error = 0;
+
+    for(int i = 0; i < 2; ++i)
+    {
+        stream.buffers[i].bytes = (unsigned char *)malloc(stream.window);
+        stream.buffers[i].length = 0;
+        stream.buffers[i].state = STREAM_EMPTY;
+    }
+
+    if(stream.buffers[0].bytes == NULL || stream.buffers[1].bytes == NULL)
+    {
+        free(stream.buffers[0].bytes);
+        free(stream.buffers[1].bytes);
+
+        errno = ENOMEM;
+
+        return -1;
+    }
+
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.changed, NULL);
+
+    int started = pthread_create(&io, NULL, stream_io, &stream) == 0;
+
+    window.code = memory->code;
+    window.code_size = memory->code_size;
+    cpu->memory = &window;
+
+    for(size_t next = 0; started; ++next)
+    {
+        StreamBuffer *buffer = &stream.buffers[next % 2];
+
+        pthread_mutex_lock(&stream.lock);
+
+        while(buffer->state != STREAM_FULL)
+            pthread_cond_wait(&stream.changed, &stream.lock);
+
+        pthread_mutex_unlock(&stream.lock);
+
+        // an empty buffer is the end of the input
+        if(buffer->length == 0)
+            break;
+
+        window.rwmem = buffer->bytes;
+        window.rwmem_size = buffer->length;
+
+        reset_window_registers(cpu, config, buffer->length);
+        run_cpu(cpu);
+
+        pthread_mutex_lock(&stream.lock);
+
+        buffer->state = STREAM_DONE;
+
+        pthread_cond_broadcast(&stream.changed);
+        pthread_mutex_unlock(&stream.lock);
+    }
+
+    if(started)
+        pthread_join(io, NULL);
+
+    cpu->memory = memory;
+
+    pthread_mutex_destroy(&stream.lock);
+    pthread_cond_destroy(&stream.changed);
+
+    free(stream.buffers[0].bytes);
+    free(stream.buffers[1].bytes);
+
+    if(!started || stream.error)
+    {
+        errno = started ? stream.error : EAGAIN;
+
+        return -1;
+    }
+
+    return 0;
+}
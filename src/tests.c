@@ -1,8 +1,23 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
+#include <string.h>
 
 #include "cpu.h"
+#include "batch.h"
+#include "pool.h"
+#include "stream.h"
+#include "bytecode.h"
+#include "aot.h"
+#include "verify.h"
+#include "profile.h"
+#include "perf.h"
+#include "context.h"
+#include "program.h"
+#include "scheduler.h"
+#include "io.h"
+#include "optimize.h"
+#include "loop.h"
 
 void test_mov()
 {
@@ -669,6 +684,2635 @@ void test_jgt()
     printf("OK!\n");
 }
 
+/*
+ * Runs the same code with interpret_code() and with every engine, with and
+ * without superinstructions, and checks that all the CPUs end up in the
+ * same state.
+ */
+void assert_same_as_interpreter(double *code, size_t code_size,
+        unsigned char *payload, size_t payload_size)
+{
+    unsigned char expected_payload[64];
+    unsigned char engine_payload[64];
+
+    memcpy(expected_payload, payload, payload_size);
+
+    Memory reference;
+    reference.code_size = code_size;
+    reference.code = code;
+    reference.rwmem_size = payload_size;
+    reference.rwmem = expected_payload;
+
+    CPU *expected = new_cpu(&reference);
+
+    interpret_code(expected);
+
+    int engines[] = {ENGINE_SWITCH, ENGINE_THREADED, ENGINE_JIT};
+    int fusions[] = {FUSE_NONE, FUSE_ALL};
+
+    for(size_t i = 0; i < sizeof(engines) / sizeof(int) * 2; ++i)
+    {
+        memcpy(engine_payload, payload, payload_size);
+
+        Memory memory;
+        memory.code_size = code_size;
+        memory.code = code;
+        memory.rwmem_size = payload_size;
+        memory.rwmem = engine_payload;
+
+        CPU *cpu = new_cpu(&memory);
+
+        set_engine(cpu, engines[i / 2]);
+        set_fusions(cpu, fusions[i % 2]);
+        run_cpu(cpu);
+
+        assert(memcmp(cpu->registers, expected->registers,
+                    sizeof(cpu->registers)) == 0);
+        assert(memcmp(cpu->dregisters, expected->dregisters,
+                    sizeof(cpu->dregisters)) == 0);
+        assert(memcmp(cpu->vregisters, expected->vregisters,
+                    sizeof(cpu->vregisters)) == 0);
+        assert(cpu->flags.zero == expected->flags.zero);
+        assert(cpu->flags.negative == expected->flags.negative);
+        assert(cpu->flags.overflow == expected->flags.overflow);
+        assert(cpu->PC == expected->PC);
+        assert(memcmp(engine_payload, expected_payload, payload_size) == 0);
+
+        free_cpu(cpu);
+    }
+
+    free_cpu(expected);
+}
+
+void test_decoded()
+{
+    printf("[+] TESTING DECODED PROGRAM... ");
+
+    unsigned char payload[] = {'A', 'B', 'C', 'D', 0};
+
+    double code[] = {
+        MOVI, R2, 4,
+        MOVI, R3, 0x12,
+        MOVI, D0, -2.5,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        SHLI, R0, 1,
+        SHRI, R0, 1,
+        STR, R1, R0,
+        ADD, D0, R0,
+        MUL, R4, D0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JLT, 8,
+
+        CMP, D0, R2,
+        JGT, 48,
+        MOVI, R5, 1,
+        SUBI, D0, 0.5,
+
+        HLT
+    };
+
+    assert_same_as_interpreter(code, sizeof(code), payload, 5);
+
+    printf("OK!\n");
+}
+
+void test_specialized()
+{
+    printf("[+] TESTING R<n>/D<n> OPERAND COMBINATIONS... ");
+
+    unsigned char payload[] = {3, 5, 7, 11, 13};
+
+    double code[] = {
+        MOVI, R0, 2,
+        MOVI, D0, 1.5,
+        MOVI, R1, 1,
+        MOVI, D1, 3,
+
+        MOV, R2, R0, MOV, R3, D0, MOV, D2, R0, MOV, D3, D0,
+        ADD, R2, R0, ADD, R3, D0, ADD, D2, R0, ADD, D3, D0,
+        ADDI, R2, 2.5, ADDI, D2, 2.5,
+        SUB, R2, R1, SUB, R3, D1, SUB, D2, R1, SUB, D3, D1,
+        SUBI, R3, 0.5, SUBI, D3, 0.5,
+        MUL, R2, R0, MUL, R3, D0, MUL, D2, R0, MUL, D3, D0,
+        MULI, R2, -1, MULI, D2, -1,
+        DIV, R2, R0, DIV, R3, D0, DIV, D2, R0, DIV, D3, D0,
+        DIVI, R3, 2, DIVI, D3, 2,
+
+        LD, R4, R1, LD, R5, D1, LD, D4, R1, LD, D5, D1,
+        STR, R0, R4, STR, R1, D5, STR, D1, R4, STR, D1, D4,
+
+        CMP, R2, R3, CMP, R2, D3, CMP, D2, R3, CMP, D2, D3,
+
+        HLT
+    };
+
+    assert_same_as_interpreter(code, sizeof(code), payload, 5);
+
+    printf("OK!\n");
+}
+
+void test_decoded_fallback()
+{
+    printf("[+] TESTING DECODED PROGRAM FALLBACK... ");
+
+    unsigned char payload[] = {0};
+
+    double code[] = {
+        // jumps right in the middle of the MOVI, whose immediate is HLT
+        JMP, 3,
+        MOVI, R0, HLT,
+
+        HLT
+    };
+
+    assert_same_as_interpreter(code, sizeof(code), payload, 1);
+
+    double attached[] = {
+        MOVI, R0, 7,
+        HLT
+    };
+
+    Memory memory;
+    memory.code_size = sizeof(attached);
+    memory.code = attached;
+    memory.rwmem_size = 0;
+    memory.rwmem = NULL;
+
+    DecodedProgram *program = decode_program(&memory);
+
+    for(int i = 0; i < 2; ++i)
+    {
+        CPU *cpu = new_cpu(&memory);
+
+        attach_program(cpu, program);
+
+        run_cpu(cpu);
+
+        assert(cpu->registers[0] == 7);
+        assert(cpu->PC == 3);
+
+        free_cpu(cpu);
+    }
+
+    free_decoded_program(program);
+
+    printf("OK!\n");
+}
+
+void test_jit()
+{
+    printf("[+] TESTING JIT... ");
+
+    unsigned char payload[] = {0};
+
+    double code[] = {
+        MOVI, R0, 0,
+        MOVI, R1, 10,
+        // too big for the integer fast path of ADDI
+        MOVI, R5, 1152921504606846976.0,
+        MOVI, R6, -3,
+
+        ADDI, R0, 1,
+        ADDI, R5, 1,
+        SUBI, R6, 1,
+        XOR, R7, R0,
+        SHLI, R7, 65,
+        SHRI, R7, 1,
+        CMP, R0, R1,
+        JLT, 11,
+
+        MOVI, D0, 0.5,
+        MOVI, D1, 0,
+        ADD, D1, D0,
+        CMP, D1, R1,
+        JLT, 40,
+
+        MOV, R2, R0,
+        JE, 56,
+        XORI, R3, 0x123456789,
+        // jump target of the JE above
+        SHL, R3, R1,
+        CMP, R0, R1,
+        JE, 67,
+        MOVI, R4, 1,
+
+        // the first CMP is overwritten right away
+        CMP, R1, R0,
+        CMP, R0, R4,
+        JGT, 78,
+        MOVI, R4, 2,
+
+        HLT
+    };
+
+    assert_same_as_interpreter(code, sizeof(code), payload, 1);
+
+#ifdef XORVM_JIT
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = 1;
+    memory.rwmem = payload;
+
+    CPU *cpu = new_cpu(&memory);
+
+    set_engine(cpu, ENGINE_JIT);
+    run_cpu(cpu);
+
+    assert(cpu->program->jit != NULL);
+    assert(cpu->registers[4] == 0);
+    assert(cpu->PC == 79);
+
+    free_cpu(cpu);
+#endif
+
+    printf("OK!\n");
+}
+
+void test_fusion()
+{
+    printf("[+] TESTING SUPERINSTRUCTIONS... ");
+
+    unsigned char payload[] = {1, 2, 3, 4, 5};
+
+    double code[] = {
+        MOVI, R2, 5,
+        MOVI, R3, 0x21,
+
+        // starts the loop from the XOR, in the middle of LD_XOR_STR_INC
+        JMP, 10,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 7,
+
+        CMP, R1, R3,
+        JGT, 32,
+        MOVI, R4, 1,
+
+        // jumps to the JLT of CMP_JLT_RR, with the flags of this CMP
+        CMP, R4, R1,
+        JMP, 40,
+        CMP, R1, R4,
+        JLT, 45,
+        MOVI, R5, 7,
+
+        HLT
+    };
+
+    assert_same_as_interpreter(code, sizeof(code), payload, 5);
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = 5;
+    memory.rwmem = payload;
+
+    DecodedProgram *program = decode_program(&memory);
+    unsigned long counts[32] = {0};
+
+    assert(program->entries <= 32);
+
+    CPU *cpu = new_cpu(&memory);
+
+    attach_program(cpu, program);
+    run_profiled(cpu, counts);
+
+    assert(counts[3] == 4 && counts[4] == 5);
+    assert(choose_fusions(program, counts) == FUSE_ALL);
+
+    free_cpu(cpu);
+
+    fuse_program(program, FUSE_ALL);
+
+    assert(program->instructions[3].opcode == MAP_LOOP);
+    assert(program->instructions[4].opcode == XOR);
+
+    fuse_program(program, FUSE_CMP_JUMP | FUSE_LD_XOR_STR_INC);
+
+    assert(program->instructions[3].opcode == LD_XOR_STR_INC);
+    assert(program->instructions[4].opcode == XOR);
+    assert(program->instructions[7].opcode == CMP_JNE_RR);
+    assert(program->instructions[9].opcode == CMP_JGT_RR);
+    assert(program->instructions[12].opcode == CMP_RR);
+    assert(program->instructions[14].opcode == CMP_JLT_RR);
+
+    fuse_program(program, FUSE_CMP_JUMP);
+
+    assert(program->instructions[3].opcode == LD_RR);
+    assert(program->instructions[7].opcode == CMP_JNE_RR);
+
+    free_decoded_program(program);
+
+    printf("OK!\n");
+}
+
+void test_lanes()
+{
+    printf("[+] TESTING LOCK-STEP LANES... ");
+
+    double code[] = {
+        MOVI, R4, 100,
+        // the first byte of every payload is its length
+        LD, R2, R1,
+        MOVI, R1, 1,
+
+        LD, R0, R1,
+        CMP, R0, R4,
+        JGT, 19,
+        ADD, D0, R0,
+        XORI, R0, 0x5a,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JLT, 8,
+
+        // lanes whose sum is over 100 jump into the MOVI, whose
+        // immediate is HLT, and go on in interpret_code()
+        MOV, R5, D0,
+        CMP, R5, R4,
+        JGT, 43,
+        MOVI, R6, HLT,
+
+        // LD_XOR_STR_INC for the others
+        MOVI, R3, 0x33,
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+
+        HLT
+    };
+
+    unsigned char payloads[12][16];
+    unsigned char expected_payloads[12][16];
+    CPU *cpus[12];
+    Memory memories[12];
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = 16;
+    memory.rwmem = NULL;
+
+    DecodedProgram *program = decode_program(&memory);
+
+    fuse_program(program, FUSE_ALL);
+
+    for(int lane = 0; lane < 12; ++lane)
+    {
+        payloads[lane][0] = 3 + lane % 5 * 3;
+
+        for(int i = 1; i < 16; ++i)
+            payloads[lane][i] = (lane * 37 + i * 11) % 256;
+
+        memcpy(expected_payloads[lane], payloads[lane], 16);
+
+        memories[lane] = memory;
+        memories[lane].rwmem = payloads[lane];
+
+        cpus[lane] = new_cpu(&memories[lane]);
+    }
+
+    run_lanes(program, cpus, 12);
+
+    for(int lane = 0; lane < 12; ++lane)
+    {
+        Memory reference = memory;
+        reference.rwmem = expected_payloads[lane];
+
+        CPU *expected = new_cpu(&reference);
+
+        run_cpu(expected);
+
+        assert(memcmp(cpus[lane]->registers, expected->registers,
+                    sizeof(expected->registers)) == 0);
+        assert(memcmp(cpus[lane]->dregisters, expected->dregisters,
+                    sizeof(expected->dregisters)) == 0);
+        assert(cpus[lane]->flags.zero == expected->flags.zero);
+        assert(cpus[lane]->flags.negative == expected->flags.negative);
+        assert(cpus[lane]->flags.overflow == expected->flags.overflow);
+        assert(cpus[lane]->PC == expected->PC);
+        assert(memcmp(payloads[lane], expected_payloads[lane], 16) == 0);
+
+        free_cpu(expected);
+        free_cpu(cpus[lane]);
+    }
+
+    free_decoded_program(program);
+
+    printf("OK!\n");
+}
+
+void test_batch()
+{
+    printf("[+] TESTING BATCH RUNNER... ");
+
+    // xorfun with the payload length in R2 taken from the first byte
+    double code[] = {
+        LD, R2, R1,
+        MOVI, R1, 1,
+        MOVI, R3, 0x12,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JLT, 8,
+
+        HLT
+    };
+
+    static unsigned char payloads[100][256];
+    static unsigned char expected[100][256];
+    Memory jobs[100];
+
+    for(int job = 0; job < 100; ++job)
+    {
+        // a few big jobs and many small ones
+        payloads[job][0] = job % 10 == 0 ? 255 : 2 + job % 7;
+
+        for(int i = 1; i < 256; ++i)
+            payloads[job][i] = job + i;
+
+        for(int i = 0; i < 256; ++i)
+            expected[job][i] = i > 0 && i < payloads[job][0] ?
+                payloads[job][i] ^ 0x12 : payloads[job][i];
+
+        jobs[job].code_size = sizeof(code);
+        jobs[job].code = code;
+        jobs[job].rwmem_size = 256;
+        jobs[job].rwmem = payloads[job];
+    }
+
+    DecodedProgram *program = decode_program(&jobs[0]);
+
+    fuse_program(program, FUSE_ALL);
+
+    int threads[] = {1, 3, 8};
+
+    for(int i = 0; i < 3; ++i)
+    {
+        assert(run_batch(program, jobs, 100, threads[i]) == 0);
+
+        // every run xors the payloads again
+        for(int job = 0; job < 100; ++job)
+        {
+            for(int byte = 1; byte < payloads[job][0]; ++byte)
+                expected[job][byte] ^= i > 0 ? 0x12 : 0;
+        }
+
+        assert(memcmp(payloads, expected, sizeof(payloads)) == 0);
+    }
+
+    free_decoded_program(program);
+
+    printf("OK!\n");
+}
+
+void test_stream()
+{
+    printf("[+] TESTING STREAMING... ");
+
+    // R2 is the size of the window, R3 the key and R5 the position in the
+    // whole stream, carried from one window to the next
+    double code[] = {
+        LD, R0, R1,
+        XOR, R0, R3,
+        XOR, R0, R5,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        ADDI, R5, 1,
+        CMP, R1, R2,
+        JLT, -1,
+
+        HLT
+    };
+
+    static unsigned char input[10000];
+    static unsigned char output[10000];
+
+    for(int i = 0; i < 10000; ++i)
+        input[i] = i * 7;
+
+    FILE *in = tmpfile();
+    FILE *out = tmpfile();
+
+    assert(in != NULL && out != NULL);
+    assert(fwrite(input, 1, sizeof(input), in) == sizeof(input));
+
+    fflush(in);
+    rewind(in);
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = 0;
+    memory.rwmem = NULL;
+
+    CPU *cpu = new_cpu(&memory);
+
+    cpu->registers[3] = 0x12;
+
+    StreamConfig config;
+    config.window = 4096;
+    config.length_register = 2;
+    config.carry = STREAM_CARRY_R(3) | STREAM_CARRY_R(5);
+
+    assert(run_stream(cpu, fileno(in), fileno(out), &config) == 0);
+
+    // the last window has 10000 % 4096 bytes
+    assert(cpu->registers[1] == 10000 % 4096);
+    assert(cpu->registers[5] == 10000);
+    assert(cpu->memory == &memory);
+
+    rewind(out);
+
+    assert(fread(output, 1, sizeof(output), out) == sizeof(output));
+    assert(fgetc(out) == EOF);
+
+    for(int i = 0; i < 10000; ++i)
+        assert(output[i] == (unsigned char)(input[i] ^ 0x12 ^ i));
+
+    free_cpu(cpu);
+    fclose(in);
+    fclose(out);
+
+    printf("OK!\n");
+}
+
+void test_bytecode()
+{
+    printf("[+] TESTING BYTECODE... ");
+
+    unsigned char expected_payload[] = {3, 5, 7, 11, 13};
+    unsigned char payload[] = {3, 5, 7, 11, 13};
+
+    double code[] = {
+        MOVI, R2, 5,
+        MOVI, R3, 0x5a,
+        MOVI, D0, 0.1,
+        MOVI, D1, 2.5,
+        MOVI, R4, 1e15,
+        XORI, R4, 0x12345,
+        SHLI, R4, 3,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADD, D0, D1,
+        MULI, D0, -0.5,
+        MOV, D2, R0,
+        LD, D3, R1,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JLT, 20,
+
+        CMP, D0, R4,
+        SUBI, R5, 300,
+        DIVI, D1, 4,
+        SHRI, R4, 2,
+
+        HLT
+    };
+
+    Memory reference;
+    reference.code_size = sizeof(code);
+    reference.code = code;
+    reference.rwmem_size = sizeof(expected_payload);
+    reference.rwmem = expected_payload;
+
+    CPU *expected = new_cpu(&reference);
+
+    interpret_code(expected);
+
+    Bytecode *bytecode = convert_code(code, sizeof(code));
+
+    assert(bytecode != NULL);
+    assert(bytecode->header->count == 22);
+    assert(bytecode->code_size < sizeof(code) / 4);
+
+    char path[] = "/tmp/xorvm-bytecode-XXXXXX";
+    int fd = mkstemp(path);
+
+    assert(fd >= 0);
+    assert(save_bytecode(bytecode, path) == 0);
+
+    free_bytecode(bytecode);
+    bytecode = load_bytecode(path);
+
+    assert(bytecode != NULL && bytecode->mapping != NULL);
+
+    Memory memory;
+    memory.code_size = 0;
+    memory.code = NULL;
+    memory.rwmem_size = sizeof(payload);
+    memory.rwmem = payload;
+
+    CPU *cpu = new_cpu(&memory);
+
+    run_bytecode(cpu, bytecode);
+
+    assert(memcmp(cpu->registers, expected->registers,
+                sizeof(cpu->registers)) == 0);
+    assert(memcmp(cpu->dregisters, expected->dregisters,
+                sizeof(cpu->dregisters)) == 0);
+    assert(cpu->flags.zero == expected->flags.zero);
+    assert(cpu->flags.negative == expected->flags.negative);
+    assert(cpu->flags.overflow == expected->flags.overflow);
+    assert(memcmp(payload, expected_payload, sizeof(payload)) == 0);
+    assert(cpu->instruction.bytecode == HLT);
+    assert(cpu->PC == (long)bytecode->code_size - 1);
+
+    free_bytecode(bytecode);
+
+    // a flipped bit in the code fails the checksum
+    unsigned char byte;
+
+    assert(pread(fd, &byte, 1, sizeof(BytecodeHeader) + 3) == 1);
+    byte ^= 0x10;
+    assert(pwrite(fd, &byte, 1, sizeof(BytecodeHeader) + 3) == 1);
+
+    errno = 0;
+    assert(load_bytecode(path) == NULL && errno == EINVAL);
+
+    close(fd);
+    unlink(path);
+
+    // no interpret_code() to fall back to for jumps in the middle of an
+    // instruction or XOR on D<n> registers
+    double misaligned[] = {
+        JMP, 3,
+        MOVI, R0, HLT,
+
+        HLT
+    };
+
+    double dxor[] = {
+        XOR, D0, R1,
+        HLT
+    };
+
+    assert(convert_code(misaligned, sizeof(misaligned)) == NULL);
+    assert(convert_code(dxor, sizeof(dxor)) == NULL);
+
+    free_cpu(cpu);
+    free_cpu(expected);
+
+    printf("OK!\n");
+}
+
+/*
+ * Runs code with run_cpu() and compiled with compile_aot() into cache,
+ * checks both end up the same and removes the library from cache.
+ */
+void assert_aot_same_as_run_cpu(double *code, size_t code_size,
+        unsigned char *payload, size_t payload_size, const char *cache)
+{
+    unsigned char expected_payload[64];
+    unsigned char aot_payload[64];
+    CPU *cpus[2];
+    Memory memories[2];
+
+    memcpy(expected_payload, payload, payload_size);
+    memcpy(aot_payload, payload, payload_size);
+
+    for(int i = 0; i < 2; ++i)
+    {
+        memories[i].code_size = code_size;
+        memories[i].code = code;
+        memories[i].rwmem_size = payload_size;
+        memories[i].rwmem = i ? aot_payload : expected_payload;
+
+        cpus[i] = new_cpu(&memories[i]);
+    }
+
+    AotProgram *aot = compile_aot(&memories[1], cache);
+
+    assert(aot != NULL);
+
+    run_cpu(cpus[0]);
+    run_aot(cpus[1], aot);
+
+    assert(memcmp(cpus[1]->registers, cpus[0]->registers,
+                sizeof(cpus[0]->registers)) == 0);
+    assert(memcmp(cpus[1]->dregisters, cpus[0]->dregisters,
+                sizeof(cpus[0]->dregisters)) == 0);
+    assert(cpus[1]->flags.zero == cpus[0]->flags.zero);
+    assert(cpus[1]->flags.negative == cpus[0]->flags.negative);
+    assert(cpus[1]->flags.overflow == cpus[0]->flags.overflow);
+    assert(cpus[1]->PC == cpus[0]->PC);
+    assert(memcmp(aot_payload, expected_payload, payload_size) == 0);
+
+    // the second time the library comes from the cache
+    char path[4096];
+    struct stat before;
+    struct stat after;
+
+    snprintf(path, sizeof(path), "%s/%s.so", cache, aot->name);
+
+    assert(stat(path, &before) == 0);
+
+    free_aot_program(aot);
+    aot = compile_aot(&memories[1], cache);
+
+    assert(aot != NULL);
+    assert(stat(path, &after) == 0 && after.st_ino == before.st_ino);
+
+    free_aot_program(aot);
+    free_cpu(cpus[0]);
+    free_cpu(cpus[1]);
+
+    unlink(path);
+}
+
+void test_aot()
+{
+    printf("[+] TESTING AHEAD-OF-TIME COMPILATION... ");
+
+    char cache[] = "/tmp/xorvm-aot-XXXXXX";
+
+    assert(mkdtemp(cache) != NULL);
+
+    unsigned char payload[] = {3, 5, 7, 11, 13};
+
+    double specialized[] = {
+        MOVI, R0, 2,
+        MOVI, D0, 1.5,
+        MOVI, R1, 1,
+        MOVI, D1, 3,
+        MOVI, D6, 0.1,
+
+        MOV, R2, R0, MOV, R3, D0, MOV, D2, R0, MOV, D3, D0,
+        ADD, R2, R0, ADD, R3, D0, ADD, D2, R0, ADD, D3, D0,
+        ADDI, R2, 2.5, ADDI, D2, 2.5,
+        SUB, R2, R1, SUB, R3, D1, SUB, D2, R1, SUB, D3, D1,
+        SUBI, R3, 0.5, SUBI, D3, 0.5,
+        MUL, R2, R0, MUL, R3, D0, MUL, D2, R0, MUL, D3, D0,
+        MULI, R2, -1, MULI, D2, -1,
+        DIV, R2, R0, DIV, R3, D0, DIV, D2, R0, DIV, D3, D0,
+        DIVI, R3, 2, DIVI, D3, 2,
+
+        LD, R4, R1, LD, R5, D1, LD, D4, R1, LD, D5, D1,
+        STR, R0, R4, STR, R1, D5, STR, D1, R4, STR, D1, D4,
+
+        XORI, R4, 0x5a5a, SHLI, R4, 3, SHRI, R4, 1,
+        XOR, R5, R4, SHL, R5, R1, SHR, R5, R0,
+
+        CMP, R2, R3, CMP, R2, D3, CMP, D2, R3, CMP, D2, D3,
+
+        HLT
+    };
+
+    // the loop of xorfun(), then a jump in the middle of the MOVI which is
+    // left to interpret_code()
+    double loop[] = {
+        MOVI, R2, 5,
+        MOVI, R3, 0x12,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 5,
+
+        JMP, 26,
+        MOVI, R0, HLT,
+
+        HLT
+    };
+
+    assert_aot_same_as_run_cpu(specialized, sizeof(specialized), payload, 5,
+            cache);
+    assert_aot_same_as_run_cpu(loop, sizeof(loop), payload, 5, cache);
+
+    // a cache others could write a library into is refused
+    Memory memory;
+    char link[sizeof(cache) + 5];
+
+    memory.code_size = sizeof(loop);
+    memory.code = loop;
+    memory.rwmem_size = 5;
+    memory.rwmem = payload;
+
+    assert(chmod(cache, 0777) == 0);
+    assert(compile_aot(&memory, cache) == NULL);
+    assert(chmod(cache, 0700) == 0);
+
+    snprintf(link, sizeof(link), "%s.link", cache);
+
+    assert(symlink(cache, link) == 0);
+    assert(compile_aot(&memory, link) == NULL);
+    assert(unlink(link) == 0);
+
+    assert(rmdir(cache) == 0);
+
+    printf("OK!\n");
+}
+
+/*
+ * Runs code over payload with run_safe() from zeroed registers, returns
+ * its status and the CPU in cpu (to be freed by the caller).
+ */
+int run_safe_code(double *code, size_t code_size, unsigned char *payload,
+        size_t payload_size, Memory *memory, CPU **cpu)
+{
+    memory->code_size = code_size;
+    memory->code = code;
+    memory->rwmem_size = payload_size;
+    memory->rwmem = payload;
+
+    *cpu = new_cpu(memory);
+
+    return run_safe(*cpu);
+}
+
+void test_verify()
+{
+    printf("[+] TESTING VERIFIER... ");
+
+    unsigned char payload[] = {'A', 'B', 'C', 'D', 0};
+    Memory memory;
+    CPU *cpu;
+
+    // the loop of xorfun(), bounded by R2 through JNE, and a JLT loop
+    // reading the payload backwards two bytes at a time
+    double xorfun[] = {
+        MOVI, R2, 4,
+        MOVI, R3, 0x12,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 5,
+
+        MOVI, R4, 4,
+        MOVI, R5, 0,
+
+        LD, R6, R4,
+        ADD, R7, R6,
+        SUBI, R4, 2,
+        CMP, R5, R4,
+        JLT, 28,
+
+        HLT
+    };
+
+    assert(run_safe_code(xorfun, sizeof(xorfun), payload, 5, &memory,
+                &cpu) == VM_OK);
+    assert(cpu->program->verified == VERIFIED_ALL);
+    assert(memcmp(payload, "SPQV", 5) == 0);
+    assert(cpu->registers[7] == 'Q');
+
+    // R1 goes up to 3, which a rwmem of 3 bytes does not have
+    assert(verify_program(cpu->program, 3) == VERIFIED_CODE);
+    assert(verify_program(cpu->program, 4) == VERIFIED_CODE);
+    assert(verify_program(cpu->program, 5) == VERIFIED_ALL);
+
+    free_cpu(cpu);
+
+    // fused or not, the verifier sees the same program
+    DecodedProgram *program = decode_program(&memory);
+
+    fuse_program(program, FUSE_ALL);
+    assert(verify_program(program, 5) == VERIFIED_ALL);
+    free_decoded_program(program);
+
+    // errors the unchecked engines would crash (or exit) on
+    double out_of_bounds[] = {
+        MOVI, R1, 5,
+        LD, R0, R1,
+        HLT
+    };
+
+    double dxor[] = {
+        MOVI, D0, 1,
+        XOR, D0, R1,
+        HLT
+    };
+
+    double division[] = {
+        MOVI, R0, 1,
+        DIV, R0, R1,
+        HLT
+    };
+
+    double opcode[] = {
+        MOVI, R0, 1,
+        99,
+        HLT
+    };
+
+    double jump[] = {
+        JMP, 100,
+        HLT
+    };
+
+    double end[] = {
+        MOVI, R0, 1
+    };
+
+    struct
+    {
+        double *code;
+        size_t code_size;
+        int status;
+        long pc;
+    } broken[] = {
+        {out_of_bounds, sizeof(out_of_bounds), VM_ERR_MEMORY, 2},
+        {dxor, sizeof(dxor), VM_ERR_REGISTER, 2},
+        {division, sizeof(division), VM_ERR_DIVIDE, 2},
+        {opcode, sizeof(opcode), VM_ERR_OPCODE, 2},
+        {jump, sizeof(jump), VM_ERR_JUMP, -1},
+        {end, sizeof(end), VM_ERR_PC, 2}
+    };
+
+    for(size_t i = 0; i < sizeof(broken) / sizeof(broken[0]); ++i)
+    {
+        assert(run_safe_code(broken[i].code, broken[i].code_size, payload, 5,
+                    &memory, &cpu) == broken[i].status);
+        assert(cpu->PC == broken[i].pc);
+        assert(cpu->program == NULL ||
+                verify_program(cpu->program, 5) != VERIFIED_ALL);
+
+        free_cpu(cpu);
+    }
+
+    // a jump in the middle of an instruction is fine, but not verifiable
+    double misaligned[] = {
+        JMP, 3,
+        MOVI, R0, HLT,
+
+        HLT
+    };
+
+    assert(run_safe_code(misaligned, sizeof(misaligned), payload, 5, &memory,
+                &cpu) == VM_OK);
+    assert(cpu->program->verified == VERIFIED_NONE);
+    assert(cpu->PC == 4);
+
+    free_cpu(cpu);
+
+    printf("OK!\n");
+}
+
+void test_idiom()
+{
+    printf("[+] TESTING MAP LOOPS... ");
+
+    // 61 bytes: a block of 32 for map_bytes() and the rest one at a time
+    unsigned char payload[61];
+
+    for(size_t i = 0; i < sizeof(payload); ++i)
+        payload[i] = i * 37 + 11;
+
+    // the <op> of the loop, R3 holds 0x1234 (3 for the shifts)
+    double operations[][3] = {
+        {XOR, R0, R3},
+        {XORI, R0, 0x5a},
+        {ADD, R0, R3},
+        {SUB, R0, R3},
+        {ADDI, R0, 200},
+        {SUBI, R0, 7},
+        {SHL, R0, R3},
+        {SHR, R0, R3},
+        {SHLI, R0, 9},
+        {SHRI, R0, 2},
+        // not a byte addition, runs the slow way
+        {ADDI, R0, 0.5}
+    };
+
+    // R1 from, R2 to
+    long ranges[][2] = {{0, 61}, {7, 40}, {5, 6}, {60, 61}};
+
+    for(size_t op = 0; op < sizeof(operations) / sizeof(operations[0]); ++op)
+    {
+        for(size_t range = 0; range < 4; ++range)
+        {
+            double code[] = {
+                MOVI, R1, ranges[range][0],
+                MOVI, R2, ranges[range][1],
+                MOVI, R3, operations[op][0] == SHL ||
+                    operations[op][0] == SHR ? 3 : 0x1234,
+
+                LD, R0, R1,
+                operations[op][0], operations[op][1], operations[op][2],
+                STR, R1, R0,
+                ADDI, R1, 1,
+                CMP, R1, R2,
+                JNE, 8,
+
+                HLT
+            };
+
+            assert_same_as_interpreter(code, sizeof(code), payload,
+                    sizeof(payload));
+        }
+    }
+
+    double loops[] = {
+        MOVI, R3, 0x21,
+        MOVI, R2, 50,
+
+        // CMP Rn, Ri with JGT
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R2, R1,
+        JGT, 5,
+
+        // JLT from past the bound: a single round
+        MOVI, R1, 55,
+        LD, R4, R1,
+        ADDI, R4, -3,
+        STR, R1, R4,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JLT, 25,
+
+        HLT
+    };
+
+    assert_same_as_interpreter(loops, sizeof(loops), payload,
+            sizeof(payload));
+
+    Memory memory;
+    memory.code_size = sizeof(loops);
+    memory.code = loops;
+    memory.rwmem_size = sizeof(payload);
+    memory.rwmem = payload;
+
+    DecodedProgram *program = decode_program(&memory);
+
+    fuse_program(program, FUSE_ALL);
+
+    assert(program->instructions[2].opcode == MAP_LOOP);
+    assert(program->instructions[9].opcode == MAP_LOOP);
+
+    // a bound the loop can not reach within rwmem leaves it to the LD
+    long r[8] = {0, 0, 62, 0x21};
+
+    assert(map_loop(&program->instructions[2], r, payload,
+                sizeof(payload)) == 0);
+    assert(r[1] == 0);
+
+    r[2] = 61;
+
+    assert(map_loop(&program->instructions[2], r, payload,
+                sizeof(payload)) == 60);
+    assert(r[1] == 60);
+    assert(payload[59] == (unsigned char)((59 * 37 + 11) ^ 0x21));
+
+    free_decoded_program(program);
+
+    printf("OK!\n");
+}
+
+void test_wide()
+{
+    printf("[+] TESTING WIDE AND VECTOR INSTRUCTIONS... ");
+
+    unsigned char payload[64];
+
+    for(size_t i = 0; i < sizeof(payload); ++i)
+        payload[i] = i * 29 + 200;
+
+    double code[] = {
+        MOVI, R1, 3,
+        LD16, R0, R1,
+        LD32, R2, R1,
+        LD64, R3, R1,
+
+        MOVI, R4, 40,
+        STR64, R4, R3,
+        MOVI, R5, 50,
+        STR16, R5, R2,
+        ADDI, R5, 2,
+        STR32, R5, R3,
+
+        MOVI, R6, 32,
+        VLD, V0, R7,
+        VLD, V1, R6,
+        VLD, V2, R6,
+        VXOR, V0, V1,
+        VADD, V1, V0,
+        VSHL, V0, 3,
+        VSHR, V1, 61,
+        // too far, clears V2
+        VSHR, V2, 64,
+        VST, R7, V0,
+        MOVI, R7, 1,
+        VST, R7, V1,
+
+        HLT
+    };
+
+    unsigned char expected[64];
+
+    memcpy(expected, payload, sizeof(payload));
+    assert_same_as_interpreter(code, sizeof(code), payload, sizeof(payload));
+
+    Memory memory;
+    CPU *cpu;
+
+    assert(run_safe_code(code, sizeof(code), payload, sizeof(payload),
+                &memory, &cpu) == VM_OK);
+    assert(cpu->program->verified == VERIFIED_ALL);
+
+    // little-endian, whatever the host is
+    assert(cpu->registers[0] == (expected[3] | expected[4] << 8));
+    assert((unsigned long)cpu->registers[2] == (expected[3] |
+                expected[4] << 8 | expected[5] << 16 |
+                (unsigned long)expected[6] << 24));
+    assert((cpu->registers[3] & 0xffffffff) ==
+            (unsigned long)cpu->registers[2]);
+    assert(payload[50] == expected[3] && payload[51] == expected[4]);
+    assert(payload[52] == expected[3] && payload[55] == expected[6]);
+    assert(load_wide(payload + 40, 8) == (unsigned long)cpu->registers[3]);
+
+    unsigned long lanes[2] = {0, 0};
+
+    for(int i = 7; i >= 0; --i)
+    {
+        lanes[0] = lanes[0] << 8 | expected[i];
+        lanes[1] = lanes[1] << 8 | expected[32 + i];
+    }
+
+    assert(cpu->vregisters[0].lanes[0] == (lanes[0] ^ lanes[1]) << 3);
+    assert(cpu->vregisters[1].lanes[0] ==
+            (lanes[1] + (lanes[0] ^ lanes[1])) >> 61);
+    assert(cpu->vregisters[2].lanes[3] == 0);
+
+    free_cpu(cpu);
+
+    // an LD64 reaching past the end of rwmem
+    double past[] = {
+        MOVI, R1, 60,
+        LD64, R0, R1,
+
+        HLT
+    };
+
+    assert(run_safe_code(past, sizeof(past), payload, sizeof(payload),
+                &memory, &cpu) == VM_ERR_MEMORY);
+    assert(cpu->PC == 2);
+
+    free_cpu(cpu);
+
+    printf("OK!\n");
+}
+
+/*
+ * block_operation() one byte at a time, with a copy of the source read
+ * before anything is written.
+ */
+void reference_block(unsigned char *rwmem, int opcode, long dst, long src,
+        long length, long key_length)
+{
+    unsigned char *copy = (unsigned char *)malloc(length + key_length + 1);
+
+    memcpy(copy, rwmem + src, opcode == MEMXORK ? key_length : length);
+
+    for(long i = 0; i < length; ++i)
+    {
+        if(opcode == MEMCPY)
+            rwmem[dst + i] = copy[i];
+        else if(opcode == MEMXOR)
+            rwmem[dst + i] ^= copy[i];
+        else
+            rwmem[dst + i] ^= copy[i % key_length];
+    }
+
+    free(copy);
+}
+
+void test_block()
+{
+    printf("[+] TESTING BLOCK INSTRUCTIONS... ");
+
+    unsigned char payload[64];
+
+    for(size_t i = 0; i < sizeof(payload); ++i)
+        payload[i] = i * 53 + 7;
+
+    double code[] = {
+        MOVI, R1, 0,
+        MOVI, R2, 8,
+        MOVI, R3, 16,
+        // overlapping, like memmove()
+        MEMCPY, R2, R1, R3,
+
+        MOVI, R4, 40,
+        MOVI, R5, 0x1ab,
+        MOVI, R6, 5,
+        MEMSET, R4, R5, R6,
+
+        MOVI, R1, 20,
+        MOVI, R2, 24,
+        MOVI, R3, 37,
+        MEMXOR, R2, R1, R3,
+        MEMXOR, R1, R2, R6,
+
+        // a 7-byte key overlapping the 50 bytes it is xored with
+        MOVI, R0, 3,
+        MOVI, R1, 5,
+        MOVI, R3, 50,
+        MOVI, R7, 7,
+        MEMXORK, R1, R0, R3, R7,
+
+        // nothing to do
+        MOVI, R6, 0,
+        MEMXOR, R1, R2, R6,
+        MOVI, R6, -4,
+        MEMSET, R1, R5, R6,
+
+        HLT
+    };
+
+    unsigned char expected[64];
+
+    memcpy(expected, payload, sizeof(payload));
+
+    reference_block(expected, MEMCPY, 8, 0, 16, 0);
+    memset(expected + 40, 0xab, 5);
+    reference_block(expected, MEMXOR, 24, 20, 37, 0);
+    reference_block(expected, MEMXOR, 20, 24, 5, 0);
+    reference_block(expected, MEMXORK, 5, 3, 50, 7);
+
+    assert_same_as_interpreter(code, sizeof(code), payload, sizeof(payload));
+
+    Memory memory;
+    CPU *cpu;
+
+    assert(run_safe_code(code, sizeof(code), payload, sizeof(payload),
+                &memory, &cpu) == VM_OK);
+    assert(cpu->program->verified == VERIFIED_ALL);
+    assert(memcmp(payload, expected, sizeof(payload)) == 0);
+
+    free_cpu(cpu);
+
+    double past[] = {
+        MOVI, R1, 10,
+        MOVI, R2, 55,
+        MEMCPY, R0, R1, R2,
+
+        HLT
+    };
+
+    assert(run_safe_code(past, sizeof(past), payload, sizeof(payload),
+                &memory, &cpu) == VM_ERR_MEMORY);
+    assert(cpu->PC == 5);
+
+    free_cpu(cpu);
+
+    // a key too long for the stack, over many blocks of 32 bytes
+    unsigned char *big = (unsigned char *)malloc(5000);
+    unsigned char *big_expected = (unsigned char *)malloc(5000);
+
+    for(size_t i = 0; i < 5000; ++i)
+        big[i] = big_expected[i] = i * 31 + (i >> 8);
+
+    block_operation(big, MEMXORK, 301, 17, 4600, 300);
+    reference_block(big_expected, MEMXORK, 301, 17, 4600, 300);
+
+    // the pattern is the key copied over and over: lengths that are not a
+    // power of two, on the stack (up to 256) and not
+    long key_lengths[] = {1, 3, 7, 31, 33, 100, 255, 256, 257, 1000, 1023};
+
+    for(size_t i = 0; i < sizeof(key_lengths) / sizeof(long); ++i)
+    {
+        block_operation(big, MEMXORK, 1500 + i, 29 * i, 3000,
+                key_lengths[i]);
+        reference_block(big_expected, MEMXORK, 1500 + i, 29 * i, 3000,
+                key_lengths[i]);
+    }
+
+    block_operation(big, MEMXOR, 0, 1001, 3999, 0);
+    reference_block(big_expected, MEMXOR, 0, 1001, 3999, 0);
+
+    assert(memcmp(big, big_expected, 5000) == 0);
+
+    free(big);
+    free(big_expected);
+
+    printf("OK!\n");
+}
+
+void test_stats()
+{
+    printf("[+] TESTING STATS... ");
+
+    unsigned char payload[40];
+
+    double code[] = {
+        MOVI, R1, 0,
+        MOVI, R2, 40,
+        MOVI, R3, 0x21,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 8,
+
+        LD32, R4, R5,
+        MOVI, R6, 8,
+        MEMSET, R5, R3, R6,
+        // not taken, R6 is not 0
+        JE, 0,
+
+        HLT
+    };
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = sizeof(payload);
+    memory.rwmem = payload;
+
+    CPU *reference = new_cpu(&memory);
+
+    assert(reference != NULL);
+
+#ifndef XORVM_STATS
+    assert(get_stats(reference) == NULL);
+#else
+    memset(payload, 0, sizeof(payload));
+
+    interpret_code(reference);
+
+    Stats *expected = get_stats(reference);
+
+    assert(expected->instructions[MOVI] == 4);
+    assert(expected->instructions[LD] == 40);
+    assert(expected->instructions[XOR] == 40);
+    assert(expected->instructions[JNE] == 40);
+    assert(expected->taken[JNE - JMP] == 39);
+    assert(expected->not_taken[JNE - JMP] == 1);
+    assert(expected->instructions[LD32] == 1);
+    assert(expected->instructions[MEMSET] == 1);
+    assert(expected->not_taken[JE - JMP] == 1);
+    assert(expected->instructions[HLT] == 1);
+    assert(expected->retired == 248);
+    assert(expected->dispatches == 248);
+    assert(expected->loaded == 44);
+    assert(expected->stored == 48);
+
+    // every engine runs the same instructions, superinstructions or not
+    int engines[] = {ENGINE_SWITCH, ENGINE_THREADED, ENGINE_JIT};
+    int fusions[] = {FUSE_NONE, FUSE_ALL};
+    unsigned long dispatches[2];
+
+    for(size_t e = 0; e < 3; ++e)
+    {
+        for(size_t f = 0; f < 2; ++f)
+        {
+            CPU *cpu = new_cpu(&memory);
+
+            memset(payload, 0, sizeof(payload));
+
+            set_engine(cpu, engines[e]);
+            set_fusions(cpu, fusions[f]);
+            run_cpu(cpu);
+
+            Stats *stats = get_stats(cpu);
+
+            assert(memcmp(stats->instructions, expected->instructions,
+                        sizeof(stats->instructions)) == 0);
+            assert(memcmp(stats->taken, expected->taken,
+                        sizeof(stats->taken)) == 0);
+            assert(memcmp(stats->not_taken, expected->not_taken,
+                        sizeof(stats->not_taken)) == 0);
+            assert(stats->retired == expected->retired);
+            assert(stats->loaded == expected->loaded);
+            assert(stats->stored == expected->stored);
+
+#ifdef XORVM_STATS_CYCLES
+            unsigned long long cycles = 0;
+
+            for(int i = 0; i < TOTAL_CLASSES; ++i)
+                cycles += stats->cycles[i];
+
+            assert(cycles > 0);
+#endif
+
+            dispatches[f] = stats->dispatches;
+
+            reset_stats(cpu);
+
+            assert(stats->retired == 0);
+
+            free_cpu(cpu);
+        }
+
+        // the map loop runs 39 rounds in one dispatch
+        assert(dispatches[0] == 248);
+        assert(dispatches[1] < dispatches[0] - 39 * 6);
+    }
+#endif
+
+    free_cpu(reference);
+
+    printf("OK!\n");
+}
+
+void test_profile()
+{
+    printf("[+] TESTING PROFILER... ");
+
+    unsigned char payload[40] = {0};
+
+    double code[] = {
+        MOVI, R2, 40,
+        MOVI, R3, 0x21,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 5,
+
+        // lands in the middle of the MOVI, on a HLT run by the interpreter
+        JMP, 26,
+        MOVI, R4, HLT,
+
+        HLT
+    };
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = sizeof(payload);
+    memory.rwmem = payload;
+
+    // a sample for every instruction
+    Profile *profile = new_profile(&memory, 1, 0);
+    CPU *cpu = new_cpu(&memory);
+
+    set_fusions(cpu, FUSE_NONE);
+    run_sampled(cpu, profile);
+
+    assert(cpu->PC == 27);
+    assert(payload[39] == 0x21);
+    assert(profile->total == 244);
+    assert(profile->samples[0] == 1);
+    assert(profile->samples[9] == 40);
+    assert(profile->samples[21] == 40);
+    assert(profile->samples[23] == 1);
+    assert(profile->samples[25] == 0);
+    assert(profile->samples[27] == 1);
+
+    ProfileLoop loops[2];
+
+    assert(find_loops(cpu->program, loops, 2) == 1);
+    assert(loops[0].start == 6 && loops[0].end == 21);
+
+    char text[4096];
+    FILE *out = tmpfile();
+
+    write_folded(out, profile, cpu);
+    rewind(out);
+    text[fread(text, 1, sizeof(text) - 1, out)] = 0;
+    fclose(out);
+
+    assert(strstr(text, "xorvm;MOVI@0 1\n") != NULL);
+    assert(strstr(text, "xorvm;loop@6-21;XOR@9 40\n") != NULL);
+    assert(strstr(text, "xorvm;HLT@27 1\n") != NULL);
+
+    out = tmpfile();
+    write_profile(out, profile, cpu);
+    rewind(out);
+    text[fread(text, 1, sizeof(text) - 1, out)] = 0;
+    fclose(out);
+
+    assert(strstr(text, "[PROFILE] 244 samples") != NULL);
+    assert(strstr(text, "       6       21        240  98.36%  JNE") != NULL);
+
+    free_cpu(cpu);
+    free_profile(profile);
+
+    // only the timer, every millisecond of CPU time
+    double spin[] = {
+        MOVI, R2, 5000000,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 2,
+        HLT
+    };
+
+    memory.code_size = sizeof(spin);
+    memory.code = spin;
+
+    profile = new_profile(&memory, 0, 1000);
+    cpu = new_cpu(&memory);
+
+    run_sampled(cpu, profile);
+
+    assert(cpu->registers[1] == 5000000);
+    assert(profile->total > 0);
+    assert(profile->total == profile->samples[3] + profile->samples[6] +
+            profile->samples[8]);
+
+    free_cpu(cpu);
+    free_profile(profile);
+
+    printf("OK!\n");
+}
+
+void test_perf()
+{
+    printf("[+] TESTING PERFORMANCE COUNTERS... ");
+
+    double code[] = {
+        MOVI, R2, 100000,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 2,
+        HLT
+    };
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = 0;
+    memory.rwmem = NULL;
+
+    PerfCounters counters;
+    CPU *cpu = new_cpu(&memory);
+
+    // none at all without a PMU, only the time is measured then
+    int opened = open_perf(&counters);
+
+    run_cpu_counted(cpu, &counters);
+
+    assert(cpu->registers[1] == 100000);
+    assert(counters.seconds > 0);
+
+    for(int i = 0; i < TOTAL_PERF_EVENTS; ++i)
+    {
+        if(perf_available(&counters, i))
+            opened--;
+    }
+
+    assert(opened >= 0);
+
+    if(perf_available(&counters, PERF_INSTRUCTIONS))
+        assert(counters.values[PERF_INSTRUCTIONS] > 300000);
+
+    close_perf(&counters);
+
+    for(int i = 0; i < TOTAL_PERF_EVENTS; ++i)
+        assert(!perf_available(&counters, i));
+
+    free_cpu(cpu);
+
+    printf("OK!\n");
+}
+
+void test_context()
+{
+    printf("[+] TESTING CPU CONTEXTS... ");
+
+    unsigned char first[4] = {1, 2, 3, 4};
+    unsigned char second[4] = {5, 6, 7, 8};
+
+    // xors the 4 bytes of rwmem with 0x10
+    double code[] = {
+        MOVI, R2, 4,
+        MOVI, R3, 0x10,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 5,
+
+        HLT
+    };
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = sizeof(first);
+    memory.rwmem = first;
+
+    // nothing left of what was there before
+    CPU cpu;
+
+    memset(&cpu, 0xff, sizeof(cpu));
+    init_cpu(&cpu, &memory);
+
+    assert(cpu.PC == -1);
+    assert(cpu.program == NULL);
+    assert(cpu.flags.zero == 0 && cpu.flags.negative == 0);
+
+    for(int i = 0; i < 8; ++i)
+        assert(cpu.registers[i] == 0 && cpu.dregisters[i] == 0);
+
+    run_cpu(&cpu);
+
+    assert(first[0] == 0x11 && first[3] == 0x14);
+
+    DecodedProgram *decoded = cpu.program;
+
+    // same code over another rwmem, decoded once
+    Memory other = memory;
+    other.rwmem = second;
+
+    reset_cpu(&cpu, &other);
+
+    assert(cpu.PC == -1 && cpu.registers[1] == 0 && cpu.flags.zero == 0);
+    assert(cpu.program == decoded && cpu.owns_program);
+
+    run_cpu(&cpu);
+
+    assert(second[0] == 0x15 && second[3] == 0x18);
+    assert(cpu.program == decoded);
+
+    deinit_cpu(&cpu);
+
+    assert(cpu.program == NULL);
+
+    CPU *heap = new_cpu(&memory);
+
+    for(int i = 0; i < 8; ++i)
+        assert(heap->registers[i] == 0 && heap->dregisters[i] == 0);
+
+    free_cpu(heap);
+
+    // 2 CPUs in the pool, the third one comes from new_cpu()
+    ContextPool *pool = new_context_pool(2);
+    DecodedProgram *program = decode_program(&memory);
+    CPU *cpus[3];
+
+    for(int i = 0; i < 3; ++i)
+    {
+        cpus[i] = acquire_cpu(pool, &memory, program);
+
+        assert(cpus[i] != NULL);
+        assert(cpus[i]->program == program && !cpus[i]->owns_program);
+    }
+
+    assert(pool->available == 0);
+    assert(cpus[0] == &pool->contexts[0].cpu);
+    assert(cpus[1] == &pool->contexts[1].cpu);
+    assert((size_t)cpus[0] % CONTEXT_CACHE_LINE == 0);
+    assert((size_t)cpus[1] % CONTEXT_CACHE_LINE == 0);
+
+    run_cpu(cpus[1]);
+
+    assert(first[0] == 0x01 && first[3] == 0x04);
+
+    for(int i = 2; i >= 0; --i)
+        release_cpu(pool, cpus[i]);
+
+    assert(pool->available == 2);
+
+    // the last one given back comes first, a CPU reset by acquire_cpu()
+    CPU *again = acquire_cpu(pool, &other, NULL);
+
+    assert(again == cpus[0]);
+    assert(again->PC == -1 && again->registers[1] == 0);
+    assert(again->program == NULL);
+
+    run_cpu(again);
+
+    assert(second[0] == 0x05 && second[3] == 0x08);
+
+    release_cpu(pool, again);
+    free_context_pool(pool);
+    free_decoded_program(program);
+
+    pool = thread_context_pool();
+
+    assert(pool != NULL && pool == thread_context_pool());
+    assert(pool->size == CONTEXT_POOL_SIZE);
+
+    printf("OK!\n");
+}
+
+// 16 buffers of 64 bytes from run->memory.rwmem, then the last reference
+void *program_thread(void *argument)
+{
+    RunContext *run = (RunContext *)argument;
+    unsigned char *buffers = run->memory.rwmem;
+
+    for(int i = 0; i < 16; ++i)
+    {
+        reset_run(run, buffers + i * 64, 64);
+        run_program(run);
+    }
+
+    finish_run(run);
+
+    return NULL;
+}
+
+void test_program()
+{
+    printf("[+] TESTING SHARED PROGRAMS... ");
+
+    static unsigned char buffers[4][16 * 64];
+
+    double code[] = {
+        MOVI, R2, 64,
+        MOVI, R3, 0x21,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 5,
+
+        HLT
+    };
+
+    Program *program = new_program(code, sizeof(code), ENGINE_JIT, FUSE_ALL);
+
+    // the Program has a code of its own
+    memset(code, 0, sizeof(code));
+
+    assert(program != NULL);
+    assert(atomic_load(&program->references) == 1);
+    assert(program->decoded->frozen);
+    assert(program->decoded->fusions == FUSE_ALL);
+
+#ifdef XORVM_JIT
+    assert(program->engine == ENGINE_JIT && program->decoded->jit != NULL);
+#else
+    assert(program->engine == ENGINE_THREADED);
+#endif
+
+    // frozen: neither fused again nor changed by verification
+    fuse_program(program->decoded, FUSE_NONE);
+
+    assert(program->decoded->fusions == FUSE_ALL);
+
+    RunContext run;
+
+    init_run(&run, program, buffers[0], 64);
+
+    assert(atomic_load(&program->references) == 2);
+    assert(run_safe(&run.cpu) == VM_OK);
+    assert(program->decoded->verified == -1);
+    assert(buffers[0][0] == 0x21 && buffers[0][63] == 0x21);
+
+    finish_run(&run);
+    memset(buffers[0], 0, 64);
+
+    RunContext runs[4];
+    pthread_t threads[4];
+
+    for(int i = 0; i < 4; ++i)
+        init_run(&runs[i], program, buffers[i], sizeof(buffers[i]));
+
+    // the threads give the last references back
+    release_program(program);
+
+    for(int i = 0; i < 4; ++i)
+        assert(pthread_create(&threads[i], NULL, program_thread,
+                    &runs[i]) == 0);
+
+    for(int i = 0; i < 4; ++i)
+        pthread_join(threads[i], NULL);
+
+    for(int i = 0; i < 4; ++i)
+    {
+        for(size_t j = 0; j < sizeof(buffers[i]); ++j)
+            assert(buffers[i][j] == 0x21);
+    }
+
+    printf("OK!\n");
+}
+
+void test_budget()
+{
+    printf("[+] TESTING BUDGETED RUNS... ");
+
+    unsigned char payload[40] = {0};
+
+    double code[] = {
+        MOVI, R2, 40,
+        MOVI, R3, 0x21,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 5,
+
+        HLT
+    };
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem_size = sizeof(payload);
+    memory.rwmem = payload;
+
+    // verified, then not: a register that is not zeroed goes through
+    // run_checked_for()
+    for(int checked = 0; checked < 2; ++checked)
+    {
+        CPU *cpu = new_cpu(&memory);
+        unsigned long total = 0;
+        unsigned long executed;
+        int calls = 0;
+        int status;
+
+        set_fusions(cpu, FUSE_NONE);
+        cpu->registers[5] = checked;
+
+        do
+        {
+            status = run_cpu_for(cpu, 7, &executed);
+            total += executed;
+            calls++;
+
+            assert(status == VM_OK || executed == 7);
+        } while(status == VM_BUDGET);
+
+        assert(status == VM_OK);
+        assert(cpu->verified == !checked);
+        assert(total == 2 + 40 * 6 + 1);
+        assert(calls == 35);
+        assert(cpu->PC == 23 && cpu->registers[1] == 40);
+        assert(payload[0] == (checked ? 0 : 0x21));
+        assert(payload[39] == (checked ? 0 : 0x21));
+
+        // halted already
+        assert(run_cpu_for(cpu, 7, &executed) == VM_OK && executed == 0);
+
+        free_cpu(cpu);
+    }
+
+    // never halts
+    double forever[] = {
+        ADDI, R1, 1,
+        JMP, -1,
+        HLT
+    };
+
+    memory.code_size = sizeof(forever);
+    memory.code = forever;
+
+    CPU *cpu = new_cpu(&memory);
+    unsigned long executed;
+
+    assert(run_cpu_for(cpu, 1001, &executed) == VM_BUDGET);
+    assert(executed == 1001 && cpu->registers[1] == 501);
+    assert(run_cpu_for(cpu, 1, NULL) == VM_BUDGET);
+    assert(cpu->registers[1] == 501);
+
+    free_cpu(cpu);
+
+    // a STR past rwmem in the 3rd round
+    double broken[] = {
+        MOVI, R2, 2,
+        MOVI, R1, 38,
+
+        STR, R1, R2,
+        ADDI, R1, 1,
+        JMP, 5,
+
+        HLT
+    };
+
+    memory.code_size = sizeof(broken);
+    memory.code = broken;
+
+    cpu = new_cpu(&memory);
+
+    assert(run_cpu_for(cpu, 5, &executed) == VM_BUDGET && executed == 5);
+    assert(run_cpu_for(cpu, 100, &executed) == VM_ERR_MEMORY);
+    assert(executed == 3 && cpu->registers[1] == 40);
+    assert(run_cpu_for(cpu, 100, &executed) == VM_ERR_MEMORY);
+    assert(executed == 0);
+    assert(payload[38] == 2 && payload[39] == 2);
+    assert(strcmp(vm_status_name(VM_BUDGET), "VM_BUDGET") == 0);
+
+    free_cpu(cpu);
+
+    printf("OK!\n");
+}
+
+_Atomic int scheduler_done = 0;
+
+void count_done(SchedulerTask *task)
+{
+    (void)task;
+
+    scheduler_done++;
+}
+
+void test_scheduler()
+{
+    printf("[+] TESTING SCHEDULER... ");
+
+    static unsigned char payloads[64][40];
+
+    double code[] = {
+        MOVI, R2, 40,
+        MOVI, R3, 0x21,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 5,
+
+        HLT
+    };
+
+    double forever[] = {
+        ADDI, R1, 1,
+        JMP, -1,
+        HLT
+    };
+
+    Memory memories[64];
+    CPU cpus[64];
+    SchedulerTask tasks[64];
+
+    Scheduler *scheduler = new_scheduler(2, 100);
+
+    assert(scheduler != NULL);
+
+    // the first one never halts, stopped after 100000 instructions
+    for(int i = 0; i < 64; ++i)
+    {
+        memories[i].code_size = i == 0 ? sizeof(forever) : sizeof(code);
+        memories[i].code = i == 0 ? forever : code;
+        memories[i].rwmem_size = sizeof(payloads[i]);
+        memories[i].rwmem = payloads[i];
+
+        init_cpu(&cpus[i], &memories[i]);
+
+        tasks[i].limit = i == 0 ? 100000 : 0;
+        tasks[i].done = count_done;
+        tasks[i].data = NULL;
+
+        schedule(scheduler, &tasks[i], &cpus[i]);
+    }
+
+    wait_scheduler(scheduler);
+
+    assert(scheduler_done == 64);
+    assert(tasks[0].status == VM_BUDGET);
+    assert(tasks[0].instructions == 100000 && tasks[0].slices == 1000);
+
+    for(int i = 1; i < 64; ++i)
+    {
+        assert(tasks[i].status == VM_OK);
+        assert(tasks[i].slices == 1);
+        assert(payloads[i][0] == 0x21 && payloads[i][39] == 0x21);
+    }
+
+    // again, on the same workers
+    deinit_cpu(&cpus[1]);
+    init_cpu(&cpus[1], &memories[1]);
+    set_fusions(&cpus[1], FUSE_NONE);
+    tasks[1].limit = 0;
+    schedule(scheduler, &tasks[1], &cpus[1]);
+    wait_scheduler(scheduler);
+
+    assert(tasks[1].status == VM_OK && tasks[1].slices == 3);
+    assert(tasks[1].instructions == 243 && payloads[1][0] == 0);
+
+    for(int i = 0; i < 64; ++i)
+        deinit_cpu(&cpus[i]);
+
+    free_scheduler(scheduler);
+
+    printf("OK!\n");
+}
+
+// reads its input 16 bytes at a time and writes it back xored with 0x21
+double io_code[] = {
+    MOVI, R2, 16,
+    IN, R1, R2,
+    JE, 32,
+
+    MOVI, R3, 0,
+    LD, R0, R3,
+    XORI, R0, 0x21,
+    STR, R3, R0,
+    ADDI, R3, 1,
+    CMP, R3, R2,
+    JNE, 10,
+
+    OUT, R1, R2,
+    JMP, -1,
+
+    HLT
+};
+
+int io_done = 0;
+
+void count_io_done(IoStream *stream)
+{
+    (void)stream;
+
+    io_done++;
+}
+
+void *post_io_input(void *argument)
+{
+    IoLoop *loop = ((void **)argument)[0];
+    IoStream *stream = ((void **)argument)[1];
+    const char *input = "posted from another thread, a few bytes at a time";
+    size_t length = strlen(input);
+
+    for(size_t done = 0; done < length; done += 7)
+    {
+        usleep(1000);
+        post_io(loop, stream, (const unsigned char *)input + done,
+                length - done < 7 ? length - done : 7, 0);
+    }
+
+    post_io(loop, stream, NULL, 0, 1);
+
+    return NULL;
+}
+
+void test_io()
+{
+    printf("[+] TESTING I/O... ");
+
+    const char *input = "some input for the VM, fed to it 5 bytes at a time";
+    size_t length = strlen(input);
+    unsigned char payload[16];
+    unsigned char output[128];
+
+    Memory memory;
+    memory.code_size = sizeof(io_code);
+    memory.code = io_code;
+    memory.rwmem_size = sizeof(payload);
+    memory.rwmem = payload;
+
+    // the host feeds 5 bytes at a time and takes the output 20 at a time,
+    // out of an output of 20 bytes: both IN and OUT wait
+    for(int engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine)
+    {
+        CPU *cpu = new_cpu(&memory);
+        Io io;
+        size_t fed = 0;
+        size_t taken = 0;
+        int waits[IO_YIELDED + 1] = {0};
+        int wait;
+
+        assert(init_io(&io, 8, 20));
+        attach_io(cpu, &io);
+        set_engine(cpu, engine);
+
+        while((wait = run_io(cpu)) != IO_NONE)
+        {
+            waits[wait]++;
+
+            if(wait == IO_WAIT_IN && fed == length)
+                io.in.closed = 1;
+            else if(wait == IO_WAIT_IN)
+                fed += push_io(&io.in, (const unsigned char *)input + fed,
+                        length - fed < 5 ? length - fed : 5);
+            else if(wait == IO_WAIT_OUT)
+                taken += pull_io(&io.out, output + taken, 20);
+        }
+
+        taken += pull_io(&io.out, output + taken, sizeof(output) - taken);
+
+        assert(taken == length && cpu->registers[2] == 0);
+        assert(waits[IO_WAIT_IN] == (int)(length + 4) / 5 + 1);
+        assert(waits[IO_WAIT_OUT] == 2);
+
+        for(size_t i = 0; i < length; ++i)
+            assert(output[i] == (input[i] ^ 0x21));
+
+        deinit_io(&io);
+        free_cpu(cpu);
+    }
+
+    // without channels the input is over right away
+    CPU *cpu = new_cpu(&memory);
+
+    run_cpu(cpu);
+
+    assert(cpu->instruction.bytecode == HLT && cpu->io_wait == IO_NONE);
+    assert(cpu->registers[2] == 0 && cpu->flags.zero == 1);
+
+    free_cpu(cpu);
+
+    // YIELD goes on after itself, through run_cpu_for() too
+    double yield[] = {
+        ADDI, R1, 1,
+        YIELD,
+        ADDI, R1, 1,
+        HLT
+    };
+
+    Io io;
+    unsigned long executed;
+
+    memory.code_size = sizeof(yield);
+    memory.code = yield;
+
+    assert(init_io(&io, 1, 1));
+
+    for(int budgeted = 0; budgeted < 2; ++budgeted)
+    {
+        cpu = new_cpu(&memory);
+        attach_io(cpu, &io);
+
+        if(budgeted)
+        {
+            assert(run_cpu_for(cpu, 100, &executed) == VM_WAIT);
+            assert(cpu->io_wait == IO_YIELDED && cpu->registers[1] == 1);
+            assert(run_cpu_for(cpu, 100, &executed) == VM_OK);
+        } else
+        {
+            assert(run_io(cpu) == IO_YIELDED && cpu->registers[1] == 1);
+            assert(run_io(cpu) == IO_NONE);
+        }
+
+        assert(cpu->registers[1] == 2);
+
+        free_cpu(cpu);
+    }
+
+    deinit_io(&io);
+
+    // run_safe() waits on an empty input too, verified (from a fresh CPU)
+    // or checked, and goes on once it is fed
+    double take[] = {
+        MOVI, R2, 16,
+        IN, R1, R2,
+        HLT
+    };
+
+    memory.code_size = sizeof(take);
+    memory.code = take;
+
+    for(int checked = 0; checked < 2; ++checked)
+    {
+        cpu = new_cpu(&memory);
+
+        assert(init_io(&io, 16, 1));
+        attach_io(cpu, &io);
+
+        cpu->registers[5] = checked;
+
+        assert(run_safe(cpu) == VM_WAIT && cpu->io_wait == IO_WAIT_IN);
+        assert(checked || cpu->program->verified == VERIFIED_ALL);
+        assert(push_io(&io.in, (const unsigned char *)input, 16) == 16);
+        assert(run_safe(cpu) == VM_OK && cpu->io_wait == IO_NONE);
+        assert(cpu->registers[2] == 16 && memcmp(payload, input, 16) == 0);
+
+        deinit_io(&io);
+        free_cpu(cpu);
+    }
+
+    // one thread running three VMs: input from a pipe, from post_io() and
+    // from a pipe nobody writes to but closed, output to pipes
+    IoLoop *loop = new_io_loop();
+    IoStream streams[3];
+    unsigned char payloads[3][16];
+    Memory memories[3];
+    CPU cpus[3];
+    int in[3][2];
+    int out[3][2];
+
+    assert(loop != NULL);
+
+    for(int i = 0; i < 3; ++i)
+    {
+        memories[i].code_size = sizeof(io_code);
+        memories[i].code = io_code;
+        memories[i].rwmem_size = sizeof(payloads[i]);
+        memories[i].rwmem = payloads[i];
+
+        init_cpu(&cpus[i], &memories[i]);
+
+        assert(pipe(in[i]) == 0 && pipe(out[i]) == 0);
+
+        streams[i].done = count_io_done;
+        streams[i].data = NULL;
+
+        assert(add_io_stream(loop, &streams[i], &cpus[i],
+                    i == 1 ? -1 : in[i][0], out[i][1]));
+    }
+
+    assert(write(in[0][1], input, length) == (ssize_t)length);
+
+    close(in[0][1]);
+    close(in[2][1]);
+
+    pthread_t poster;
+    void *arguments[] = {loop, &streams[1]};
+
+    assert(pthread_create(&poster, NULL, post_io_input, arguments) == 0);
+    assert(run_io_loop(loop) == 0);
+
+    pthread_join(poster, NULL);
+
+    assert(io_done == 3 && loop->streams == 0);
+
+    const char *expected[] = {
+        input, "posted from another thread, a few bytes at a time", ""
+    };
+
+    for(int i = 0; i < 3; ++i)
+    {
+        size_t size = strlen(expected[i]);
+
+        close(out[i][1]);
+
+        assert(read(out[i][0], output, sizeof(output)) == (ssize_t)size);
+
+        for(size_t j = 0; j < size; ++j)
+            assert(output[j] == (expected[i][j] ^ 0x21));
+
+        assert(cpus[i].io == NULL);
+
+        close(in[i][0]);
+        close(out[i][0]);
+        deinit_cpu(&cpus[i]);
+    }
+
+    free_io_loop(loop);
+
+    printf("OK!\n");
+}
+
+void test_tiered()
+{
+    printf("[+] TESTING TIERED EXECUTION... ");
+
+    static unsigned char payload[100000];
+
+    double code[] = {
+        MOVI, R2, 0,
+        MOVI, R3, 0x21,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 5,
+
+        HLT
+    };
+
+    Memory memory;
+    memory.code_size = sizeof(code);
+    memory.code = code;
+    memory.rwmem = payload;
+
+    // the loop only gets hot with a long payload, MAP_LOOP or not
+    size_t sizes[] = {10, TIER_THRESHOLD, sizeof(payload) - 1};
+
+    for(int fusions = 0; fusions < 2; ++fusions)
+    {
+        for(size_t i = 0; i < sizeof(sizes) / sizeof(size_t); ++i)
+        {
+            code[2] = sizes[i];
+            memory.rwmem_size = sizes[i];
+            memset(payload, 0, sizeof(payload));
+
+            CPU *cpu = new_cpu(&memory);
+
+            set_engine(cpu, ENGINE_TIERED);
+            set_fusions(cpu, fusions ? FUSE_ALL : FUSE_NONE);
+            run_cpu(cpu);
+
+            assert(cpu->instruction.bytecode == HLT && cpu->PC == 23);
+            assert(cpu->registers[1] == (long)sizes[i]);
+            assert(payload[0] == 0x21 && payload[sizes[i] - 1] == 0x21);
+            assert(payload[sizes[i]] == 0);
+            assert((cpu->program != NULL) == (sizes[i] > TIER_THRESHOLD));
+
+            // the next run starts compiled
+            if(cpu->program != NULL)
+            {
+                reset_cpu(cpu, &memory);
+                run_cpu(cpu);
+
+                assert(cpu->registers[1] == (long)sizes[i]);
+                assert(payload[0] == 0 && payload[sizes[i] - 1] == 0);
+            }
+
+            free_cpu(cpu);
+        }
+    }
+
+    printf("OK!\n");
+}
+
+/*
+ * Runs code and its optimized version from the same registers, all set to
+ * start, and checks they leave the same rwmem, registers and flags.
+ */
+void assert_same_as_optimized(double *code, size_t code_size,
+        double *optimized, size_t optimized_size, unsigned char *payload,
+        size_t payload_size, long start)
+{
+    unsigned char expected_payload[64];
+    unsigned char optimized_payload[64];
+    Memory memory[2];
+    CPU *cpus[2];
+
+    memcpy(expected_payload, payload, payload_size);
+    memcpy(optimized_payload, payload, payload_size);
+
+    memory[0].code_size = code_size;
+    memory[0].code = code;
+    memory[0].rwmem = expected_payload;
+    memory[1].code_size = optimized_size;
+    memory[1].code = optimized;
+    memory[1].rwmem = optimized_payload;
+
+    for(int i = 0; i < 2; ++i)
+    {
+        memory[i].rwmem_size = payload_size;
+        cpus[i] = new_cpu(&memory[i]);
+
+        for(int r = 0; r < 8; ++r)
+        {
+            cpus[i]->registers[r] = start;
+            cpus[i]->dregisters[r] = start;
+        }
+
+        interpret_code(cpus[i]);
+    }
+
+    assert(memcmp(cpus[0]->registers, cpus[1]->registers,
+                sizeof(cpus[0]->registers)) == 0);
+    assert(memcmp(cpus[0]->dregisters, cpus[1]->dregisters,
+                sizeof(cpus[0]->dregisters)) == 0);
+    assert(cpus[0]->flags.zero == cpus[1]->flags.zero);
+    assert(cpus[0]->flags.negative == cpus[1]->flags.negative);
+    assert(cpus[0]->flags.overflow == cpus[1]->flags.overflow);
+    assert(memcmp(expected_payload, optimized_payload, payload_size) == 0);
+
+    free_cpu(cpus[0]);
+    free_cpu(cpus[1]);
+}
+
+void test_optimize()
+{
+    printf("[+] TESTING BYTECODE OPTIMIZER... ");
+
+    unsigned char payload[16];
+
+    for(size_t i = 0; i < sizeof(payload); ++i)
+        payload[i] = i * 7;
+
+    double code[] = {
+        // R4 only ever ends up 4, R5 0x21
+        MOVI, R4, 7,
+        MOVI, R4, 3,
+        ADDI, R4, 2,
+        SUBI, R4, 1,
+        MOVI, R5, 99,
+        MOVI, R5, 0x21,
+        MOV, R3, R5,
+        MOVI, R2, sizeof(payload),
+        MOVI, R1, 0,
+        MOVI, R6, 1,
+
+        // never taken, so the code at 69 is never reached
+        CMP, R6, R4,
+        JGT, 68,
+
+        // to the JMP to the loop
+        JMP, 36,
+        JMP, 38,
+
+        // the loop at 39, R0 is a byte so MULI is a shift
+        LD, R0, R1,
+        MULI, R0, 4,
+        SHRI, R0, 2,
+        XOR, R0, R3,
+        DIVI, R0, 1,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        ADDI, R1, 0,
+        CMP, R1, R2,
+        JNE, 38,
+
+        HLT,
+
+        MOVI, R7, 1234,
+        HLT
+    };
+
+    OptimizeReport report;
+    size_t size;
+    double *optimized = optimize_code(code, sizeof(code), &size, &report);
+
+    assert(optimized != NULL);
+    assert(report.instructions_before == 27);
+    assert(report.slots_before == sizeof(code) / sizeof(double));
+    assert(report.instructions_after < report.instructions_before);
+    assert(report.slots_after == size / sizeof(double));
+    assert(report.folded > 0 && report.reduced > 0);
+    assert(report.threaded > 0 && report.removed > 0);
+
+    // whatever the registers hold when it starts
+    assert_same_as_optimized(code, sizeof(code), optimized, size, payload,
+            sizeof(payload), 0);
+    assert_same_as_optimized(code, sizeof(code), optimized, size, payload,
+            sizeof(payload), -3);
+
+    // nothing but the loop and what it needs is left
+    for(size_t slot = 0; slot < size / sizeof(double);)
+    {
+        int opcode = optimized[slot];
+
+        assert(opcode != JGT && opcode != MULI && opcode != DIVI &&
+                opcode != XOR && opcode != MOV);
+
+        slot += instruction_slots[opcode];
+    }
+
+    free(optimized);
+
+    // the README loop counts on R1 being 0, the optimizer on nothing
+    double loop[] = {
+        MOVI, R2, sizeof(payload),
+        MOVI, R3, 0x21,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 5,
+
+        HLT
+    };
+
+    optimized = optimize_code(loop, sizeof(loop), &size, &report);
+
+    assert(optimized != NULL);
+    assert(report.instructions_after == report.instructions_before);
+
+    assert_same_as_optimized(loop, sizeof(loop), optimized, size, payload,
+            sizeof(payload), 0);
+
+    free(optimized);
+
+    // a jump in the middle of an instruction is left alone
+    double broken[] = {
+        MOVI, R0, 1,
+        JMP, 0,
+        HLT
+    };
+
+    assert(optimize_code(broken, sizeof(broken), &size, NULL) == NULL);
+
+    printf("OK!\n");
+}
+
+void test_loops()
+{
+    printf("[+] TESTING LOOP OPTIMIZER... ");
+
+    // not a multiple of the factor, the loop as it was takes the rest
+    unsigned char payload[13];
+
+    for(size_t i = 0; i < sizeof(payload); ++i)
+        payload[i] = i * 7;
+
+    double code[] = {
+        MOVI, R2, sizeof(payload),
+        MOVI, R3, 0x21,
+
+        LD, R0, R1,
+        XOR, R0, R3,
+        STR, R1, R0,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 5,
+
+        HLT
+    };
+
+    OptimizeReport report;
+    size_t size;
+    double *optimized = optimize_loops(code, sizeof(code), 4, 1, &size,
+            &report);
+
+    assert(optimized != NULL);
+    assert(report.loops == 1 && report.unrolled == 1);
+    assert(report.instructions_after > report.instructions_before);
+
+    assert_same_as_optimized(code, sizeof(code), optimized, size, payload,
+            sizeof(payload), 0);
+    assert_same_as_interpreter(optimized, size, payload, sizeof(payload));
+
+    free(optimized);
+
+    // R1 could be anything, and so could the limit of the unrolled loop
+    optimized = optimize_loops(code, sizeof(code), 4, 0, &size, &report);
+
+    assert(optimized != NULL);
+    assert(report.loops == 1 && report.unrolled == 0);
+
+    free(optimized);
+
+    // R5 is the same every time round, R1 only read by the CMP
+    double sum[] = {
+        MOVI, R2, 10,
+        LD, R4, R7,
+
+        MOV, R5, R4,
+        MULI, R5, 3,
+        ADD, R3, R5,
+        ADDI, R1, 1,
+        CMP, R1, R2,
+        JNE, 5,
+
+        HLT
+    };
+
+    optimized = optimize_loops(sum, sizeof(sum), 4, 1, &size, &report);
+
+    assert(optimized != NULL);
+    assert(report.unrolled == 1 && report.hoisted == 2);
+    assert(report.merged > 0);
+
+    assert_same_as_optimized(sum, sizeof(sum), optimized, size, payload,
+            sizeof(payload), 0);
+    assert_same_as_interpreter(optimized, size, payload, sizeof(payload));
+
+    free(optimized);
+
+    // 10 runs of the body unrolled all the way, no jump left
+    optimized = optimize_loops(sum, sizeof(sum), 16, 1, &size, &report);
+
+    assert(optimized != NULL);
+    assert(report.unrolled == 1);
+
+    for(size_t slot = 0; slot < size / sizeof(double);)
+    {
+        int opcode = optimized[slot];
+
+        assert(opcode < JMP || opcode > JGT);
+
+        slot += instruction_slots[opcode];
+    }
+
+    assert_same_as_optimized(sum, sizeof(sum), optimized, size, payload,
+            sizeof(payload), 0);
+
+    free(optimized);
+
+    // counting down, two steps at a time
+    double down[] = {
+        MOVI, R1, sizeof(payload) - 1,
+
+        LD, R0, R1,
+        XORI, R0, 0x21,
+        STR, R1, R0,
+        SUBI, R1, 1,
+        SUBI, R1, 1,
+        CMP, R1, R2,
+        JGT, 2,
+
+        HLT
+    };
+
+    optimized = optimize_loops(down, sizeof(down), 3, 1, &size, &report);
+
+    assert(optimized != NULL);
+    assert(report.unrolled == 1);
+
+    assert_same_as_optimized(down, sizeof(down), optimized, size, payload,
+            sizeof(payload), 0);
+    assert_same_as_interpreter(optimized, size, payload, sizeof(payload));
+
+    free(optimized);
+
+    printf("OK!\n");
+}
+
 void xorfun()
 {
     printf("\n[+] A MORE COMPLEX XOR ENCRYPTION FUNCTION...\n");
@@ -731,6 +3375,31 @@ int main()
     test_jne();
     test_jlt();
     test_jgt();
+    test_decoded();
+    test_specialized();
+    test_decoded_fallback();
+    test_jit();
+    test_fusion();
+    test_lanes();
+    test_batch();
+    test_stream();
+    test_bytecode();
+    test_aot();
+    test_verify();
+    test_idiom();
+    test_wide();
+    test_block();
+    test_stats();
+    test_profile();
+    test_perf();
+    test_context();
+    test_program();
+    test_budget();
+    test_scheduler();
+    test_io();
+    test_tiered();
+    test_optimize();
+    test_loops();
 
     printf("\n[+] ALL TESTS OK\n");
 
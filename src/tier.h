@@ -0,0 +1,215 @@
+#pragma once
+
+/**
+ * XORVM tiered execution.
+ * Author: 0xb4db01
+ *
+ * ENGINE_TIERED starts a program like interpret_code() does, straight from
+ * memory->code with nothing decoded, counting for every loop header the
+ * jumps taken back to it. A program that halts before any loop got hot
+ * never pays for decoding or compiling, which for a short program costs
+ * more than running it.
+ *
+ * Once a loop header has been jumped back to TIER_THRESHOLD times a thread
+ * of its own decodes the program, fuses it (see set_fusions()) and
+ * compiles it, while the CPU goes on being interpreted (on a single core
+ * the CPU waits for it instead). The first jump back to a loop header
+ * after that switches to the compiled program right there, registers and
+ * flags as they are, for the rest of the run:
+ *
+ *     - a loop starting with the MAP_LOOP idiom (see idiom.h) runs on the
+ *       threaded engine, which maps it 32 bytes at a time
+ *     - anything else runs on the JIT, or on the threaded engine when it
+ *       can not be compiled
+ *
+ * The compiled program stays with the CPU like the one run_cpu() decodes
+ * (see reset_cpu()), so the next runs start in it right away.
+ *
+ *     set_engine(cpu, ENGINE_TIERED);
+ *     run_cpu(cpu);
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+// jumps back to the same loop header before the program gets compiled
+#define TIER_THRESHOLD 1000
+
+// counters of loop headers, by slot modulo TIER_COUNTERS
+#define TIER_COUNTERS 64
+
+enum TierStates
+{
+    TIER_COUNTING,
+    TIER_COMPILING,
+    TIER_DONE
+};
+
+/*
+ * A program being compiled for a CPU: memory is a copy of its Memory
+ * without rwmem, header the slot of the loop that got hot. program is
+ * what compile_tier() made of it (NULL if the code can not be decoded),
+ * set before done.
+ */
+typedef struct tier_job_t
+{
+    Memory memory;
+    int fusions;
+    long header;
+
+    DecodedProgram *program;
+    _Atomic int done;
+
+    pthread_t thread;
+    int threaded;
+} TierJob;
+
+/*
+ * Tier functions prototypes
+ */
+
+void *compile_tier(void *);
+void start_tier(TierJob *, CPU *, long);
+int finish_tier(TierJob *, CPU *);
+void run_promoted(CPU *);
+void run_tiered(CPU *);
+
+void *compile_tier(void *argument)
+{
+    TierJob *job = (TierJob *)argument;
+    DecodedProgram *program = decode_program(&job->memory);
+
+    if(program != NULL)
+    {
+        fuse_program(program, job->fusions);
+
+        long entry = find_decoded_instruction(program, job->header);
+
+        // the JIT takes MAP_LOOP apart, the threaded engine keeps it
+        if(entry == -1 || program->instructions[entry].opcode != MAP_LOOP)
+            program->jit = jit_compile(program);
+    }
+
+    job->program = program;
+    atomic_store_explicit(&job->done, 1, memory_order_release);
+
+    return NULL;
+}
+
+/*
+ * Starts compiling the program of cpu, whose loop at header got hot, on a
+ * thread of its own. With a single core that thread could only take turns
+ * with the interpreter, so the program is compiled right away instead, as
+ * it is when there can not be a thread.
+ */
+void start_tier(TierJob *job, CPU *cpu, long header)
+{
+    job->memory = *cpu->memory;
+    job->memory.rwmem_size = 0;
+    job->memory.rwmem = NULL;
+    job->fusions = cpu->fusions;
+    job->header = header;
+    job->program = NULL;
+    atomic_init(&job->done, 0);
+
+    job->threaded = sysconf(_SC_NPROCESSORS_ONLN) > 1 &&
+        pthread_create(&job->thread, NULL, compile_tier, job) == 0;
+
+    if(!job->threaded)
+        compile_tier(job);
+}
+
+/*
+ * Waits for job and gives its program to cpu. Returns 0 if there is none.
+ */
+int finish_tier(TierJob *job, CPU *cpu)
+{
+    if(job->threaded)
+        pthread_join(job->thread, NULL);
+
+    job->threaded = 0;
+
+    if(job->program == NULL)
+        return 0;
+
+    cpu->program = job->program;
+    cpu->owns_program = 1;
+
+    return 1;
+}
+
+/*
+ * Runs the compiled program of cpu from where cpu is.
+ */
+void run_promoted(CPU *cpu)
+{
+    if(cpu->program->jit != NULL)
+        run_jit(cpu);
+    else
+        run_threaded(cpu);
+}
+
+void run_tiered(CPU *cpu)
+{
+    if(cpu->program != NULL)
+    {
+        run_promoted(cpu);
+
+        return;
+    }
+
+    unsigned int counters[TIER_COUNTERS] = {0};
+    int state = TIER_COUNTING;
+    TierJob job;
+
+    while(cpu->instruction.bytecode != HLT)
+    {
+        long slot = cpu->PC + 1;
+        int opcode;
+
+        fetch_instruction(cpu);
+        execute_instruction(cpu);
+
+        opcode = cpu->instruction.bytecode;
+
+        // only a jump taken backwards lands on a loop header, at PC + 1
+        if(opcode < JMP || opcode > JGT || cpu->PC >= slot ||
+                state == TIER_DONE)
+            continue;
+
+        if(state == TIER_COUNTING)
+        {
+            if(++counters[(cpu->PC + 1) % TIER_COUNTERS] >= TIER_THRESHOLD)
+            {
+                start_tier(&job, cpu, cpu->PC + 1);
+                state = TIER_COMPILING;
+            }
+
+            continue;
+        }
+
+        if(!atomic_load_explicit(&job.done, memory_order_acquire))
+            continue;
+
+        state = TIER_DONE;
+
+        if(!finish_tier(&job, cpu))
+            continue;
+
+        // the compiled program goes on from the loop header at PC + 1,
+        // like after a DECODED_FALLBACK
+        cpu->instruction.bytecode = DECODED_FALLBACK;
+
+        run_promoted(cpu);
+
+        return;
+    }
+
+    // halted (or waiting for its I/O, see io.h) while the program was
+    // being compiled: the next run starts with it
+    if(state == TIER_COMPILING)
+        finish_tier(&job, cpu);
+}
@@ -0,0 +1,1204 @@
+#pragma once
+
+/**
+ * XORVM program verifier.
+ * Author: 0xb4db01
+ *
+ * verify_program() runs once over a DecodedProgram and tries to prove that
+ * running it can not go wrong:
+ *
+ * VERIFIED_CODE  : every instruction has a valid opcode and registers, jumps
+ *                  land on the beginning of an instruction and the program
+ *                  can not run past its end, so the decoded engines never
+ *                  need interpret_code().
+ * VERIFIED_MEMORY: every LD/STR address is within rwmem and no R<n>/R<n>
+ *                  DIV divides by zero, for a CPU starting at the first
+ *                  instruction with all the R<n> registers zeroed.
+ *
+ * VERIFIED_MEMORY comes from a range analysis: every R<n> register gets an
+ * interval at every instruction, narrowed by the conditional jumps after a
+ * CMP (R1 < R2 on the taken edge of a JLT...) and widened at loop heads to
+ * the constants of the program, so counters like the one of xorfun() are
+ * bounded by the value they are compared with. D<n> registers are not
+ * tracked, an address in a D<n> register is never proven.
+ *
+ * run_safe() runs a program with the unchecked engines when both hold and
+ * with run_checked() otherwise, which checks every instruction before
+ * running it and returns one of enum VmStatus instead of exiting or
+ * reading out of rwmem.
+ *
+ * run_cpu_for() does the same within a budget of instructions, returning
+ * VM_BUDGET when it runs out: calling it again goes on exactly where it
+ * stopped.
+ */
+
+#include <limits.h>
+
+#include "cpu.h"
+
+enum Verified
+{
+    VERIFIED_NONE = 0,
+    VERIFIED_CODE = 1,
+    VERIFIED_MEMORY = 2,
+    VERIFIED_ALL = VERIFIED_CODE | VERIFIED_MEMORY
+};
+
+enum VmStatus
+{
+    VM_OK,
+    VM_ERR_PC,
+    VM_ERR_OPCODE,
+    VM_ERR_REGISTER,
+    VM_ERR_JUMP,
+    VM_ERR_MEMORY,
+    VM_ERR_DIVIDE,
+
+    // not errors, see run_cpu_for()
+    VM_BUDGET,
+    VM_WAIT
+};
+
+// beyond this a long does not go through a double exactly, so the range
+// analysis gives up on the register
+#define VERIFY_LIMIT (1L << 52)
+
+typedef struct range_t
+{
+    long low;
+    long high;
+} Range;
+
+/*
+ * What the range analysis knows before an instruction. compare_dst and
+ * compare_src are the R<n> registers of the CMP the flags come from, -1
+ * when they come from something else.
+ */
+typedef struct verify_state_t
+{
+    Range r[8];
+    int compare_dst;
+    int compare_src;
+    int reached;
+    int visits;
+} VerifyState;
+
+/*
+ * Verifier functions prototypes
+ */
+
+int verify_program(DecodedProgram *, size_t);
+int verify_code(DecodedProgram *);
+int verify_memory(DecodedProgram *, size_t);
+void verify_instruction(DecodedInstruction *, VerifyState *);
+int refine_compare(VerifyState *, int);
+int join_state(VerifyState *, VerifyState *, long *, size_t);
+int range_states(DecodedInstruction *, size_t, VerifyState *, VerifyState *,
+        long *, size_t);
+Range range_any();
+int range_bounded(Range);
+int range_within(Range, long, long);
+int range_block(Range, Range, size_t);
+long widen_low(long, long *, size_t);
+long widen_high(long, long *, size_t);
+int check_instruction(CPU *);
+int check_address(CPU *, int, size_t);
+int check_block(CPU *, long, long);
+int run_checked(CPU *);
+int run_safe(CPU *);
+void budgeted_engine(CPU *, unsigned long *);
+int run_checked_for(CPU *, unsigned long *);
+int run_cpu_for(CPU *, unsigned long, unsigned long *);
+const char *vm_status_name(int);
+
+Range range_any()
+{
+    Range range = {LONG_MIN, LONG_MAX};
+
+    return range;
+}
+
+int range_bounded(Range range)
+{
+    return range.low >= -VERIFY_LIMIT && range.high <= VERIFY_LIMIT;
+}
+
+int range_within(Range range, long low, long high)
+{
+    return range.low >= low && range.high <= high;
+}
+
+/*
+ * Returns 1 if length bytes from start are always within size bytes of
+ * rwmem, or length is never more than 0 (see block.h).
+ */
+int range_block(Range start, Range length, size_t size)
+{
+    if(length.high <= 0)
+        return 1;
+
+    return range_bounded(start) && range_bounded(length) && start.low >= 0 &&
+        start.high + length.high <= (long)size;
+}
+
+/*
+ * Checks the structure of program, see VERIFIED_CODE.
+ */
+int verify_code(DecodedProgram *program)
+{
+    if(program->length == 0 || program->entries != program->length + 1)
+        return 0;
+
+    for(size_t i = 0; i < program->length; ++i)
+    {
+        DecodedInstruction *instruction = &program->instructions[i];
+        int opcode = unfused_opcode(instruction->opcode);
+
+        if(opcode == DECODED_FALLBACK)
+            return 0;
+
+        // a fused CMP_J*_RR keeps the target of its jump in imm too
+        if(((opcode >= JMP && opcode <= JGT) ||
+                    (instruction->opcode >= CMP_JE_RR &&
+                     instruction->opcode <= CMP_JGT_RR)) &&
+                (instruction->imm.i < 0 ||
+                 (size_t)instruction->imm.i >= program->length))
+            return 0;
+    }
+
+    // the END entry after the last instruction hands over to
+    // interpret_code(), so it must not be reached
+    int last = program->instructions[program->length - 1].opcode;
+
+    return last == HLT || last == JMP;
+}
+
+/*
+ * Narrows the ranges of the last CMP for the given relation of its
+ * operands (JE, JNE, JLT, JGT for ==, !=, <, >, and -JE, -JNE... for their
+ * negations). Returns 0 if the relation can not hold.
+ */
+int refine_compare(VerifyState *state, int relation)
+{
+    int dst = state->compare_dst;
+    int src = state->compare_src;
+
+    if(dst == -1 || src == dst)
+        return 1;
+
+    Range *a = &state->r[dst];
+    Range *b = &state->r[src];
+
+    // a >= b is !(a < b), a <= b is !(a > b)
+    if(relation == -JE)
+        relation = JNE;
+    else if(relation == -JNE)
+        relation = JE;
+
+    switch(relation)
+    {
+        case JE:
+            a->low = b->low = a->low > b->low ? a->low : b->low;
+            a->high = b->high = a->high < b->high ? a->high : b->high;
+
+            break;
+
+        case JNE:
+            if(b->low == b->high && a->low == b->low && a->low < LONG_MAX)
+                a->low++;
+
+            if(b->low == b->high && a->high == b->low && a->high > LONG_MIN)
+                a->high--;
+
+            if(a->low == a->high && b->low == a->low && b->low < LONG_MAX)
+                b->low++;
+
+            if(a->low == a->high && b->high == a->low && b->high > LONG_MIN)
+                b->high--;
+
+            break;
+
+        case JLT:
+            if(b->high == LONG_MIN || a->low == LONG_MAX)
+                return 0;
+
+            if(a->high > b->high - 1)
+                a->high = b->high - 1;
+
+            if(b->low < a->low + 1)
+                b->low = a->low + 1;
+
+            break;
+
+        case JGT:
+            if(b->low == LONG_MAX || a->high == LONG_MIN)
+                return 0;
+
+            if(a->low < b->low + 1)
+                a->low = b->low + 1;
+
+            if(b->high > a->high - 1)
+                b->high = a->high - 1;
+
+            break;
+
+        case -JLT:
+            if(a->low < b->low)
+                a->low = b->low;
+
+            if(b->high > a->high)
+                b->high = a->high;
+
+            break;
+
+        case -JGT:
+            if(a->high > b->high)
+                a->high = b->high;
+
+            if(b->low < a->low)
+                b->low = a->low;
+
+            break;
+    }
+
+    return a->low <= a->high && b->low <= b->high;
+}
+
+/*
+ * The abstract counterpart of the handlers: updates state with the effect
+ * of instruction on the R<n> registers and on the flags.
+ */
+void verify_instruction(DecodedInstruction *instruction, VerifyState *state)
+{
+    int opcode = unfused_opcode(instruction->opcode);
+    Range *r = state->r;
+    Range *dst = &r[instruction->dst & 7];
+    Range src = r[instruction->src & 7];
+    Range result = range_any();
+    int writes = 1;
+    int sets_flags = 1;
+
+    switch(opcode)
+    {
+        case MOV_RR:
+            result = src;
+
+            break;
+
+        case MOVI_R:
+            result.low = result.high = instruction->imm.i;
+
+            break;
+
+        case ADD_RR: case SUB_RR:
+            if(range_bounded(*dst) && range_bounded(src))
+            {
+                result.low = opcode == ADD_RR ? dst->low + src.low :
+                    dst->low - src.high;
+                result.high = opcode == ADD_RR ? dst->high + src.high :
+                    dst->high - src.low;
+            }
+
+            break;
+
+        case MUL_RR:
+            if(range_within(*dst, -(1L << 26), 1L << 26) &&
+                    range_within(src, -(1L << 26), 1L << 26))
+            {
+                long corners[] = {
+                    dst->low * src.low, dst->low * src.high,
+                    dst->high * src.low, dst->high * src.high
+                };
+
+                result.low = result.high = corners[0];
+
+                for(int i = 1; i < 4; ++i)
+                {
+                    if(corners[i] < result.low)
+                        result.low = corners[i];
+
+                    if(corners[i] > result.high)
+                        result.high = corners[i];
+                }
+            }
+
+            break;
+
+        case DIV_RR:
+            // |a / b| <= |a| when b is not 0, which the caller checks
+            if(range_bounded(*dst))
+            {
+                long most = dst->high > -dst->low ? dst->high : -dst->low;
+
+                result.low = -most;
+                result.high = most;
+            }
+
+            break;
+
+        // (long)((double)r OP imm) is monotonic in r, so the bounds go to
+        // the bounds (swapped when multiplying or dividing by a negative)
+        case ADDI_R: case SUBI_R: case MULI_R: case DIVI_R:
+        {
+            double imm = instruction->imm.d;
+            double low = dst->low;
+            double high = dst->high;
+
+            switch(opcode)
+            {
+                case ADDI_R: low += imm; high += imm; break;
+                case SUBI_R: low -= imm; high -= imm; break;
+                case MULI_R: low *= imm; high *= imm; break;
+                case DIVI_R: low /= imm; high /= imm; break;
+            }
+
+            if(low > high)
+            {
+                double swap = low;
+                low = high;
+                high = swap;
+            }
+
+            if(range_bounded(*dst) && low >= -VERIFY_LIMIT &&
+                    high <= VERIFY_LIMIT)
+            {
+                result.low = low;
+                result.high = high;
+            }
+
+            break;
+        }
+
+        case LD_RR: case LD_RD:
+            result.low = 0;
+            result.high = 255;
+
+            break;
+
+        case LD16: case LD32:
+            result.low = 0;
+            result.high = (1L << 8 * wide_size(opcode)) - 1;
+
+            break;
+
+        // LD64 may load anything
+        case LD64:
+            break;
+
+        case XOR: case XORI:
+        {
+            Range other = src;
+
+            if(opcode == XORI)
+                other.low = other.high = instruction->imm.i;
+
+            // no bit above the highest one of either operand gets set
+            if(dst->low >= 0 && other.low >= 0)
+            {
+                long most = dst->high > other.high ? dst->high : other.high;
+
+                result.low = 0;
+                result.high = 0;
+
+                while(result.high < most)
+                    result.high = result.high * 2 + 1;
+            }
+
+            sets_flags = 0;
+
+            break;
+        }
+
+        case SHRI:
+            if(dst->low >= 0 && instruction->imm.i >= 0 &&
+                    instruction->imm.i <= 63)
+            {
+                result.low = dst->low >> instruction->imm.i;
+                result.high = dst->high >> instruction->imm.i;
+            }
+
+            sets_flags = 0;
+
+            break;
+
+        case SHR:
+            if(dst->low >= 0 && range_within(src, 0, 63))
+            {
+                result.low = 0;
+                result.high = dst->high;
+            }
+
+            sets_flags = 0;
+
+            break;
+
+        case SHL: case SHLI:
+            sets_flags = 0;
+
+            break;
+
+        case CMP_RR:
+            state->compare_dst = instruction->dst;
+            state->compare_src = instruction->src;
+            writes = 0;
+            sets_flags = 0;
+
+            break;
+
+        // IN writes the bytes it read to its length register, see io.h
+        case IN:
+            dst = &r[instruction->src & 7];
+            result.low = 0;
+            result.high = src.high > 0 ? src.high : 0;
+
+            break;
+
+        case JMP: case JE: case JNE: case JLT: case JGT: case HLT:
+        case VLD: case VST: case VXOR: case VADD: case VSHL: case VSHR:
+        case MEMCPY: case MEMSET: case MEMXOR: case MEMXORK:
+        case OUT: case YIELD:
+            writes = 0;
+            sets_flags = 0;
+
+            break;
+
+        // R<n> registers getting a double, and everything writing a D<n>
+        default:
+            writes = opcode == MOV_RD || opcode == ADD_RD ||
+                opcode == SUB_RD || opcode == MUL_RD || opcode == DIV_RD;
+
+            break;
+    }
+
+    if(writes)
+    {
+        *dst = result;
+
+        if(state->compare_dst == instruction->dst ||
+                state->compare_src == instruction->dst)
+            state->compare_dst = state->compare_src = -1;
+    }
+
+    if(sets_flags)
+        state->compare_dst = state->compare_src = -1;
+}
+
+// the largest threshold <= value, the smallest >= value
+long widen_low(long value, long *thresholds, size_t count)
+{
+    long low = LONG_MIN;
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(thresholds[i] <= value && thresholds[i] > low)
+            low = thresholds[i];
+    }
+
+    return low;
+}
+
+long widen_high(long value, long *thresholds, size_t count)
+{
+    long high = LONG_MAX;
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(thresholds[i] >= value && thresholds[i] < high)
+            high = thresholds[i];
+    }
+
+    return high;
+}
+
+/*
+ * Merges from into the state before an instruction, widening the ranges
+ * that keep growing to thresholds (never with NULL ones). Returns 1 if into
+ * changed.
+ */
+int join_state(VerifyState *into, VerifyState *from, long *thresholds,
+        size_t count)
+{
+    if(!into->reached)
+    {
+        *into = *from;
+        into->reached = 1;
+        into->visits = 1;
+
+        return 1;
+    }
+
+    int changed = 0;
+    int widen = thresholds != NULL && ++into->visits > 2;
+
+    for(int i = 0; i < 8; ++i)
+    {
+        Range *range = &into->r[i];
+
+        if(from->r[i].low < range->low)
+        {
+            range->low = widen ? widen_low(from->r[i].low, thresholds, count) :
+                from->r[i].low;
+            changed = 1;
+        }
+
+        if(from->r[i].high > range->high)
+        {
+            range->high = widen ?
+                widen_high(from->r[i].high, thresholds, count) :
+                from->r[i].high;
+            changed = 1;
+        }
+    }
+
+    if(into->compare_dst != from->compare_dst ||
+            into->compare_src != from->compare_src)
+    {
+        changed |= into->compare_dst != -1;
+        into->compare_dst = into->compare_src = -1;
+    }
+
+    return changed;
+}
+
+/*
+ * Runs the range analysis over the length instructions from the entry
+ * state, widening to thresholds, and fills states (zeroed by the caller)
+ * with what holds before every instruction. Jumps have the index of their
+ * target in imm.i. Returns 0 if there is no memory left.
+ *
+ * Every loop goes through an instruction a jump goes back to, so only
+ * those get widened: the others keep what the loop header narrowed down
+ * to, a counter one step past its limit included.
+ */
+int range_states(DecodedInstruction *instructions, size_t length,
+        VerifyState *entry, VerifyState *states, long *thresholds,
+        size_t count)
+{
+    size_t *worklist = (size_t *)malloc(sizeof(size_t) * length);
+    char *queued = (char *)calloc(length, 1);
+    char *headers = (char *)calloc(length, 1);
+    size_t pending = 0;
+
+    if(worklist == NULL || queued == NULL || headers == NULL)
+    {
+        free(worklist);
+        free(queued);
+        free(headers);
+
+        return 0;
+    }
+
+    for(size_t i = 0; i < length; ++i)
+    {
+        int opcode = instructions[i].opcode;
+
+        if(opcode >= JMP && opcode <= JGT && instructions[i].imm.i >= 0 &&
+                (size_t)instructions[i].imm.i <= i)
+            headers[instructions[i].imm.i] = 1;
+    }
+
+    join_state(&states[0], entry, thresholds, count);
+    worklist[pending++] = 0;
+    queued[0] = 1;
+
+    while(pending > 0)
+    {
+        size_t index = worklist[--pending];
+        DecodedInstruction *instruction = &instructions[index];
+        int opcode = instruction->opcode;
+        VerifyState state = states[index];
+        long target = -1;
+        int condition = 0;
+
+        queued[index] = 0;
+
+        // a fused CMP_J*_RR stands for its CMP, its jump comes next
+        verify_instruction(instruction, &state);
+
+        if(opcode >= JMP && opcode <= JGT)
+        {
+            target = instruction->imm.i;
+            condition = opcode;
+        }
+
+        for(int edge = 0; edge < 2; ++edge)
+        {
+            VerifyState next = state;
+            size_t successor = edge ? (size_t)target : index + 1;
+
+            // the fallthrough of JMP and HLT, and the jump of the others
+            if((edge == 0 && (opcode == JMP || opcode == HLT ||
+                            successor >= length)) ||
+                    (edge == 1 && target == -1))
+                continue;
+
+            if(condition != JMP && condition != 0 &&
+                    !refine_compare(&next, edge ? condition : -condition))
+                continue;
+
+            if(join_state(&states[successor], &next,
+                        headers[successor] ? thresholds : NULL, count) &&
+                    !queued[successor])
+            {
+                worklist[pending++] = successor;
+                queued[successor] = 1;
+            }
+        }
+    }
+
+    free(worklist);
+    free(queued);
+    free(headers);
+
+    return 1;
+}
+
+/*
+ * The range analysis of VERIFIED_MEMORY, for a program already proven
+ * VERIFIED_CODE and a rwmem of size bytes.
+ */
+int verify_memory(DecodedProgram *program, size_t size)
+{
+    size_t length = program->length;
+    VerifyState *states = (VerifyState *)calloc(length, sizeof(VerifyState));
+    long *thresholds = (long *)malloc(sizeof(long) * (3 * length + 4));
+    size_t count = 0;
+    int proven = 1;
+
+    if(states == NULL || thresholds == NULL || size == 0 ||
+            size > (size_t)VERIFY_LIMIT)
+    {
+        free(states);
+        free(thresholds);
+
+        return 0;
+    }
+
+    // loops are widened to the constants they are likely to be bounded by
+    thresholds[count++] = 0;
+    thresholds[count++] = 255;
+    thresholds[count++] = size - 1;
+    thresholds[count++] = size;
+
+    for(size_t i = 0; i < length; ++i)
+    {
+        DecodedInstruction *instruction = &program->instructions[i];
+        long value = instruction->imm.i;
+
+        if(instruction->opcode != MOVI_R || !(value > -VERIFY_LIMIT &&
+                    value < VERIFY_LIMIT))
+            continue;
+
+        thresholds[count++] = value - 1;
+        thresholds[count++] = value;
+        thresholds[count++] = value + 1;
+    }
+
+    VerifyState entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.compare_dst = entry.compare_src = -1;
+
+    if(!range_states(program->instructions, length, &entry, states,
+                thresholds, count))
+    {
+        free(states);
+        free(thresholds);
+
+        return 0;
+    }
+
+    // the ranges only grew, so they hold for every run
+    for(size_t i = 0; proven && i < length; ++i)
+    {
+        DecodedInstruction *instruction = &program->instructions[i];
+        int opcode = unfused_opcode(instruction->opcode);
+        Range *r = states[i].r;
+        Range valid = {0, size - 1};
+
+        if(!states[i].reached)
+            continue;
+
+        switch(opcode)
+        {
+            case LD_RR: case LD_DR:
+                proven = range_within(r[instruction->src], valid.low,
+                        valid.high);
+
+                break;
+
+            case STR_RR: case STR_RD:
+                proven = range_within(r[instruction->dst], valid.low,
+                        valid.high);
+
+                break;
+
+            case LD_RD: case LD_DD: case STR_DR: case STR_DD:
+                proven = 0;
+
+                break;
+
+            // the last byte has to be within rwmem too
+            case LD16: case LD32: case LD64:
+                proven = range_within(r[instruction->src], valid.low,
+                        valid.high - wide_size(opcode) + 1);
+
+                break;
+
+            case STR16: case STR32: case STR64:
+                proven = range_within(r[instruction->dst], valid.low,
+                        valid.high - wide_size(opcode) + 1);
+
+                break;
+
+            case VLD:
+                proven = range_within(r[instruction->src], valid.low,
+                        valid.high - VECTOR_SIZE + 1);
+
+                break;
+
+            case VST:
+                proven = range_within(r[instruction->dst], valid.low,
+                        valid.high - VECTOR_SIZE + 1);
+
+                break;
+
+            // the value of MEMSET is not an address
+            case MEMCPY: case MEMSET: case MEMXOR:
+                proven = range_block(r[instruction->dst],
+                        r[instruction->src2], size) && (opcode == MEMSET ||
+                        range_block(r[instruction->src],
+                            r[instruction->src2], size));
+
+                break;
+
+            case MEMXORK:
+                proven = range_block(r[instruction->dst],
+                        r[instruction->src2], size) &&
+                    range_block(r[instruction->src],
+                            r[instruction->imm.i], size);
+
+                break;
+
+            case IN: case OUT:
+                proven = range_block(r[instruction->dst],
+                        r[instruction->src], size);
+
+                break;
+
+            case DIV_RR:
+            {
+                Range divisor = r[instruction->src];
+
+                proven = (divisor.low > 0 || divisor.high < 0) &&
+                    (r[instruction->dst].low > LONG_MIN ||
+                     divisor.low > -1 || divisor.high < -1);
+
+                break;
+            }
+        }
+    }
+
+    free(states);
+    free(thresholds);
+
+    return proven;
+}
+
+/*
+ * Returns the enum Verified bits program has for a rwmem of size bytes,
+ * computing them the first time (every time for a frozen program, which
+ * is only read).
+ */
+int verify_program(DecodedProgram *program, size_t size)
+{
+    if(program->verified != -1 && program->verified_size == size)
+        return program->verified;
+
+    int verified = VERIFIED_NONE;
+
+    if(verify_code(program))
+    {
+        verified = VERIFIED_CODE;
+
+        if(verify_memory(program, size))
+            verified |= VERIFIED_MEMORY;
+    }
+
+    if(!program->frozen)
+    {
+        program->verified = verified;
+        program->verified_size = size;
+    }
+
+    return verified;
+}
+
+/*
+ * Returns VM_OK if the R<n> or D<n> register reg holds an address within
+ * rwmem, with room for size bytes from there.
+ */
+int check_address(CPU *cpu, int reg, size_t size)
+{
+    Memory *memory = cpu->memory;
+
+    if(memory->rwmem == NULL || size > memory->rwmem_size)
+        return VM_ERR_MEMORY;
+
+    size_t last = memory->rwmem_size - size;
+
+    if(reg <= 7)
+    {
+        long address = cpu->registers[reg];
+
+        return address >= 0 && (size_t)address <= last ? VM_OK :
+            VM_ERR_MEMORY;
+    }
+
+    // the interpreter truncates the double
+    double address = cpu->dregisters[reg - 8];
+
+    return address >= 0 && address < last + 1 ? VM_OK : VM_ERR_MEMORY;
+}
+
+/*
+ * Returns VM_OK if length bytes from start are within rwmem, or length is
+ * 0 or less.
+ */
+int check_block(CPU *cpu, long start, long length)
+{
+    Memory *memory = cpu->memory;
+
+    if(length <= 0)
+        return VM_OK;
+
+    if(memory->rwmem == NULL || start < 0 ||
+            (size_t)start > memory->rwmem_size ||
+            (size_t)length > memory->rwmem_size - start)
+        return VM_ERR_MEMORY;
+
+    return VM_OK;
+}
+
+/*
+ * Checks the instruction interpret_code() would run next (at PC + 1) with
+ * the registers as they are now, returns VM_OK if it can run.
+ */
+int check_instruction(CPU *cpu)
+{
+    double *code = cpu->memory->code;
+    long length = cpu->memory->code_size / sizeof(double);
+    long slot = cpu->PC + 1;
+    DecodedInstruction instruction;
+
+    if(slot < 0 || slot >= length)
+        return VM_ERR_PC;
+
+    double opcode = code[slot];
+
+    if(!(opcode >= MOV && opcode < TOTAL_INSTRUCTIONS) ||
+            opcode != (int)opcode)
+        return VM_ERR_OPCODE;
+
+    if(slot + instruction_slots[(int)opcode] > length)
+        return VM_ERR_PC;
+
+    memset(&instruction, 0, sizeof(instruction));
+    instruction.opcode = opcode;
+
+    if(opcode >= JMP && opcode <= JGT)
+    {
+        // the target is the slot before the next instruction
+        double target = code[slot + 1];
+
+        if(!(target >= -1 && target < length - 1) || target != (long)target)
+            return VM_ERR_JUMP;
+
+        return VM_OK;
+    }
+
+    if(!decode_instruction(code, slot, &instruction))
+        return VM_ERR_REGISTER;
+
+    switch(instruction.opcode)
+    {
+        case LD:
+            return check_address(cpu, instruction.src, 1);
+
+        case STR:
+            return check_address(cpu, instruction.dst, 1);
+
+        case LD16: case LD32: case LD64:
+            return check_address(cpu, instruction.src,
+                    wide_size(instruction.opcode));
+
+        case STR16: case STR32: case STR64:
+            return check_address(cpu, instruction.dst,
+                    wide_size(instruction.opcode));
+
+        case VLD:
+            return check_address(cpu, instruction.src, VECTOR_SIZE);
+
+        case VST:
+            return check_address(cpu, instruction.dst, VECTOR_SIZE);
+
+        case MEMCPY: case MEMSET: case MEMXOR: case MEMXORK:
+        {
+            long *r = cpu->registers;
+            long length = r[instruction.src2];
+            int status = check_block(cpu, r[instruction.dst], length);
+
+            if(status != VM_OK || instruction.opcode == MEMSET)
+                return status;
+
+            // the key is only read if there is something to xor
+            if(instruction.opcode == MEMXORK)
+                return length > 0 ? check_block(cpu, r[instruction.src],
+                        r[instruction.imm.i]) : VM_OK;
+
+            return check_block(cpu, r[instruction.src], length);
+        }
+
+        case IN: case OUT:
+            return check_block(cpu, cpu->registers[instruction.dst],
+                    cpu->registers[instruction.src]);
+
+        // only a division of two R<n> registers traps
+        case DIV:
+        {
+            if(instruction.dst > 7 || instruction.src > 7)
+                break;
+
+            long dividend = cpu->registers[instruction.dst];
+            long divisor = cpu->registers[instruction.src];
+
+            if(divisor == 0 || (divisor == -1 && dividend == LONG_MIN))
+                return VM_ERR_DIVIDE;
+
+            break;
+        }
+    }
+
+    return VM_OK;
+}
+
+/*
+ * interpret_code() checking every instruction before running it. Returns
+ * VM_OK once the CPU halts, VM_WAIT if it waits for its I/O (see io.h), or
+ * the error of the first instruction that can not run, with PC left on the
+ * slot before it.
+ */
+int run_checked(CPU *cpu)
+{
+    while(cpu->instruction.bytecode != HLT)
+    {
+        int status = check_instruction(cpu);
+
+        if(status != VM_OK)
+            return status;
+
+        fetch_instruction(cpu);
+        execute_instruction(cpu);
+    }
+
+    return cpu->io_wait != IO_NONE ? VM_WAIT : VM_OK;
+}
+
+/*
+ * run_cpu() for programs that may be broken: verified programs run with
+ * the engine of the CPU, the others with run_checked(). Returns one of
+ * enum VmStatus, VM_WAIT if the CPU waits for its I/O, in which case
+ * calling it again goes on from where it stopped.
+ */
+int run_safe(CPU *cpu)
+{
+    resume_io(cpu);
+
+    if(cpu->program == NULL)
+    {
+        cpu->program = decode_program(cpu->memory);
+        cpu->owns_program = 1;
+
+        if(cpu->program != NULL)
+            fuse_program(cpu->program, cpu->fusions);
+    }
+
+    if(cpu->program == NULL)
+        return run_checked(cpu);
+
+    int fresh = cpu->PC == -1 && cpu->instruction.bytecode != HLT;
+
+    for(int i = 0; i < 8; ++i)
+        fresh = fresh && cpu->registers[i] == 0;
+
+    if(fresh && verify_program(cpu->program, cpu->memory->rwmem_size) ==
+            VERIFIED_ALL && cpu->memory->rwmem != NULL)
+    {
+        run_cpu(cpu);
+
+        return cpu->io_wait != IO_NONE ? VM_WAIT : VM_OK;
+    }
+
+    return run_checked(cpu);
+}
+
+/*
+ * run_decoded() stopping once *budget dispatches have run, with the PC on
+ * the slot before the next instruction, the way a DECODED_FALLBACK does.
+ * *budget is left with the dispatches that were not used.
+ */
+void budgeted_engine(CPU *cpu, unsigned long *budget)
+{
+    long entry = decoded_entry(cpu);
+
+    if(entry == -1)
+        return;
+
+    DecodedInstruction *code = cpu->program->instructions;
+    DecodedInstruction *ip = code + entry;
+    unsigned char *rwmem = cpu->memory->rwmem;
+    long r[8];
+    double d[8];
+    Flags flags;
+
+    memcpy(r, cpu->registers, sizeof(r));
+    memcpy(d, cpu->dregisters, sizeof(d));
+    flags = cpu->flags;
+
+#define TARGET(op) case op: STATS_DISPATCH(cpu, op)
+#define DISPATCH() ip++; break
+#define SKIP(n) ip += (n); break
+#define JUMP(condition) ip = (condition) ? code + ip->imm.i : ip + 1; break
+
+    while(*budget > 0)
+    {
+        (*budget)--;
+
+        switch(ip->opcode)
+        {
+#include "handlers.h"
+        }
+    }
+
+#undef TARGET
+#undef DISPATCH
+#undef SKIP
+#undef JUMP
+
+    memcpy(cpu->registers, r, sizeof(r));
+    memcpy(cpu->dregisters, d, sizeof(d));
+    cpu->flags = flags;
+
+    cpu->PC = ip->slot - 1;
+    cpu->instruction.bytecode = DECODED_FALLBACK;
+}
+
+/*
+ * run_checked() stopping with VM_BUDGET once *budget instructions have
+ * run, *budget being left with the ones that were not used.
+ */
+int run_checked_for(CPU *cpu, unsigned long *budget)
+{
+    while(cpu->instruction.bytecode != HLT)
+    {
+        if(*budget == 0)
+            return VM_BUDGET;
+
+        int status = check_instruction(cpu);
+
+        if(status != VM_OK)
+            return status;
+
+        fetch_instruction(cpu);
+        execute_instruction(cpu);
+
+        (*budget)--;
+    }
+
+    return VM_OK;
+}
+
+/*
+ * run_safe() running at most max instructions: returns VM_OK once the CPU
+ * halts, VM_BUDGET if it has not halted yet, VM_WAIT if it waits for its
+ * I/O (see io.h), or the error of an instruction that can not run (calling
+ * it again returns it again). After VM_BUDGET and VM_WAIT the next call
+ * goes on from where this one stopped.
+ *
+ * A verified program (see run_safe(), the CPU must start fresh) runs with
+ * a switch engine counting dispatches, so a superinstruction is one
+ * instruction and MAP_LOOP maps all its bytes within one; the others run
+ * with run_checked_for(). executed, if not NULL, is set to the number of
+ * instructions that ran.
+ */
+int run_cpu_for(CPU *cpu, unsigned long max, unsigned long *executed)
+{
+    unsigned long budget = max;
+    int status;
+
+    resume_io(cpu);
+
+    if(cpu->program == NULL)
+    {
+        cpu->program = decode_program(cpu->memory);
+        cpu->owns_program = 1;
+
+        if(cpu->program != NULL)
+            fuse_program(cpu->program, cpu->fusions);
+    }
+
+    if(!cpu->verified && cpu->program != NULL && cpu->PC == -1 &&
+            cpu->instruction.bytecode != HLT && cpu->memory->rwmem != NULL)
+    {
+        int fresh = 1;
+
+        for(int i = 0; i < 8; ++i)
+            fresh = fresh && cpu->registers[i] == 0;
+
+        cpu->verified = fresh && verify_program(cpu->program,
+                cpu->memory->rwmem_size) == VERIFIED_ALL;
+    }
+
+    if(cpu->verified)
+    {
+        STATS_START(cpu)
+
+        budgeted_engine(cpu, &budget);
+
+        STATS_STOP(cpu)
+
+        status = cpu->instruction.bytecode == HLT ? VM_OK : VM_BUDGET;
+    } else
+    {
+        status = run_checked_for(cpu, &budget);
+    }
+
+    // IN, OUT and YIELD stop the CPU like HLT
+    if(status == VM_OK && cpu->io_wait != IO_NONE)
+        status = VM_WAIT;
+
+    if(executed != NULL)
+        *executed = max - budget;
+
+    return status;
+}
+
+const char *vm_status_name(int status)
+{
+    const char *names[] = {
+        [VM_OK] = "VM_OK",
+        [VM_ERR_PC] = "VM_ERR_PC",
+        [VM_ERR_OPCODE] = "VM_ERR_OPCODE",
+        [VM_ERR_REGISTER] = "VM_ERR_REGISTER",
+        [VM_ERR_JUMP] = "VM_ERR_JUMP",
+        [VM_ERR_MEMORY] = "VM_ERR_MEMORY",
+        [VM_ERR_DIVIDE] = "VM_ERR_DIVIDE",
+        [VM_BUDGET] = "VM_BUDGET",
+        [VM_WAIT] = "VM_WAIT"
+    };
+
+    if(status < VM_OK || status > VM_WAIT)
+        return "unknown";
+
+    return names[status];
+}